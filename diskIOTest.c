@@ -0,0 +1,336 @@
+/*
+ * diskIOTest.c
+ *
+ * Exercises the libDisk block cache, backends, submission queue,
+ * vectored I/O and journal: data written through a small cache, queued in
+ * batches, sent as vectored runs or logged in journal groups must survive
+ * eviction, flushing, reopening the disk and a crash, with every backend.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libDisk.h"
+
+#define TEST_DISK "diskIO.dsk"
+#define NUM_BLOCKS 64
+#define CACHE_BLOCKS 8
+#define JOURNAL_START 48 // journal tests log to the last 16 blocks
+
+static int failures = 0;
+
+static void check(int cond, const char *what){
+    if (cond) {
+        printf("] PASS %s\n", what);
+    } else {
+        printf("] FAIL %s\n", what);
+        failures++;
+    }
+}
+
+/* Fills a block with a pattern derived from its block number and a round */
+static void fillPattern(char *block, int bNum, int round){
+    int i;
+    for (i = 0; i < BLOCKSIZE; i++) block[i] = (char)(bNum * 7 + round + i);
+}
+
+static int verifyAll(int disk, int round){
+    char expected[BLOCKSIZE], actual[BLOCKSIZE];
+    int b;
+    for (b = 0; b < NUM_BLOCKS; b++) {
+        fillPattern(expected, b, round);
+        if (readBlock(disk, b, actual) < 0) return 0;
+        if (memcmp(expected, actual, BLOCKSIZE) != 0) return 0;
+    }
+    return 1;
+}
+
+static void testCache(int backend){
+    char block[BLOCKSIZE];
+    DiskCacheStats stats;
+    int b;
+
+    printf("] Backend %d\n", backend);
+    setDefaultDiskBackend(backend);
+    setDefaultCacheSize(CACHE_BLOCKS);
+    int disk = openDisk(TEST_DISK, NUM_BLOCKS * BLOCKSIZE);
+    check(disk >= 0, "open new disk");
+    if (disk < 0) return;
+    check(getDiskBackend(disk) == backend, "disk uses requested backend");
+
+    /* far more blocks than the cache holds, so dirty blocks get evicted */
+    for (b = 0; b < NUM_BLOCKS; b++) {
+        fillPattern(block, b, 1);
+        writeBlock(disk, b, block);
+    }
+    check(verifyAll(disk, 1), "read back after eviction");
+
+    getCacheStats(disk, &stats);
+    if (backend != DISK_BACKEND_MMAP)
+        check(stats.evictions > 0 && stats.writebacks > 0, "dirty blocks written back on eviction");
+
+    /* repeated access to one hot block should only miss once */
+    DiskCacheStats before = stats;
+    for (b = 0; b < 100; b++) readBlock(disk, 0, block);
+    getCacheStats(disk, &stats);
+    if (backend != DISK_BACKEND_MMAP)
+        check(stats.hits - before.hits >= 99, "hot block served from cache");
+
+    check(syncDisk(disk) == 0, "sync");
+    check(closeDisk(disk) == 0, "close");
+
+    disk = openDisk(TEST_DISK, 0);
+    check(disk >= 0 && verifyAll(disk, 1), "data persisted across reopen");
+    check(readBlock(disk, NUM_BLOCKS, block) == DISK_INVALID_ARG, "out of range block rejected");
+
+    if (backend == DISK_BACKEND_MMAP) {
+        /* stores through the mapping are visible to readBlock and vice versa */
+        char *mapped = mapBlock(disk, 3);
+        check(mapped != NULL, "mapBlock returns the mapping");
+        if (mapped) {
+            fillPattern(block, 3, 1);
+            check(memcmp(mapped, block, BLOCKSIZE) == 0, "mapped block holds written data");
+            memset(mapped, 'm', BLOCKSIZE);
+            readBlock(disk, 3, block);
+            check(block[0] == 'm' && block[BLOCKSIZE - 1] == 'm', "readBlock sees stores through mapping");
+        }
+    } else {
+        check(mapBlock(disk, 3) == NULL, "mapBlock only works on mapped disks");
+    }
+    closeDisk(disk);
+
+    setDefaultCacheSize(DEFAULT_CACHE_BLOCKS);
+    setDefaultDiskBackend(DEFAULT_DISK_BACKEND);
+}
+
+/* Writes and reads the whole disk through the submission queue */
+static void testQueue(int backend){
+    static char blocks[NUM_BLOCKS][BLOCKSIZE];
+    char expected[BLOCKSIZE];
+    int b, ok = 1;
+
+    setDefaultDiskBackend(backend);
+    setDefaultCacheSize(0); /* uncached, so every request reaches the backend */
+    int disk = openDisk(TEST_DISK, 0);
+    check(disk >= 0, "reopen disk for queued I/O");
+    if (disk < 0) return;
+
+    for (b = 0; b < NUM_BLOCKS; b++) {
+        fillPattern(blocks[b], b, 2);
+        if (queueWriteBlock(disk, b, blocks[b]) < 0) ok = 0;
+    }
+    check(ok && submitBlocks(disk) == 0, "queued writes submitted");
+
+    memset(blocks, 0, sizeof(blocks));
+    for (b = 0; b < NUM_BLOCKS; b++) {
+        if (queueReadBlock(disk, b, blocks[b]) < 0) ok = 0;
+    }
+    check(ok && submitBlocks(disk) == 0, "queued reads submitted");
+    for (b = 0; b < NUM_BLOCKS; b++) {
+        fillPattern(expected, b, 2);
+        if (memcmp(expected, blocks[b], BLOCKSIZE) != 0) ok = 0;
+    }
+    check(ok, "queued reads return queued writes");
+    check(verifyAll(disk, 2), "readBlock agrees with queued writes");
+    closeDisk(disk);
+
+    setDefaultCacheSize(DEFAULT_CACHE_BLOCKS);
+    setDefaultDiskBackend(DEFAULT_DISK_BACKEND);
+}
+
+/* Vectored runs and scatter lists, mixed with cached single-block writes */
+static void testVector(int backend){
+    static char blocks[NUM_BLOCKS][BLOCKSIZE];
+    char expected[BLOCKSIZE];
+    BlockVec list[NUM_BLOCKS];
+    int b, ok = 1;
+
+    setDefaultDiskBackend(backend);
+    int disk = openDisk(TEST_DISK, 0);
+    check(disk >= 0, "reopen disk for vectored I/O");
+    if (disk < 0) return;
+
+    for (b = 0; b < NUM_BLOCKS; b++) fillPattern(blocks[b], b, 3);
+    check(writeBlocks(disk, 0, NUM_BLOCKS, blocks) == 0, "writeBlocks of the whole disk");
+
+    /* a dirty cached block must win over what is on the file */
+    fillPattern(expected, 5, 4);
+    writeBlock(disk, 5, expected);
+
+    /* scatter list in reverse order, still two contiguous runs on disk */
+    memset(blocks, 0, sizeof(blocks));
+    for (b = 0; b < NUM_BLOCKS; b++) {
+        list[b].bNum = NUM_BLOCKS - 1 - b;
+        list[b].block = blocks[b];
+    }
+    check(readBlockList(disk, list, NUM_BLOCKS) == 0, "readBlockList");
+    for (b = 0; b < NUM_BLOCKS; b++) {
+        int bNum = NUM_BLOCKS - 1 - b;
+        fillPattern(expected, bNum, bNum == 5 ? 4 : 3);
+        if (memcmp(expected, blocks[b], BLOCKSIZE) != 0) ok = 0;
+    }
+    check(ok, "scatter read sees vectored and cached writes");
+
+    /* writing the same block twice in one list keeps the last entry */
+    fillPattern(blocks[0], 9, 5);
+    fillPattern(blocks[1], 9, 6);
+    list[0].bNum = 9;
+    list[0].block = blocks[0];
+    list[1].bNum = 9;
+    list[1].block = blocks[1];
+    check(writeBlockList(disk, list, 2) == 0, "writeBlockList with a repeated block");
+    readBlocks(disk, 9, 1, blocks[2]);
+    check(memcmp(blocks[1], blocks[2], BLOCKSIZE) == 0, "last entry for a block wins");
+
+    list[0].bNum = NUM_BLOCKS;
+    check(readBlockList(disk, list, 1) == DISK_INVALID_ARG, "out of range scatter entry rejected");
+    closeDisk(disk);
+    setDefaultDiskBackend(DEFAULT_DISK_BACKEND);
+}
+
+/* A write-through that fails must leave the cached copy dirty, so the
+ * next flush still gets the data to the file */
+static void testWriteFailure(void){
+    char block[BLOCKSIZE], expected[BLOCKSIZE];
+    struct stat disk1, disk2;
+
+    setDefaultDiskBackend(DISK_BACKEND_PIO);
+    int fd = open("/dev/null", O_RDONLY); // the lowest free descriptor, which openDisk takes next
+    close(fd);
+    int disk = openDisk(TEST_DISK, 0);
+    check(disk >= 0 && fstat(fd, &disk1) == 0 && stat(TEST_DISK, &disk2) == 0 &&
+          disk1.st_ino == disk2.st_ino, "reopen disk on a known descriptor");
+    if (disk < 0) return;
+
+    readBlock(disk, 7, block);
+    int saved = dup(fd), readOnly = open(TEST_DISK, O_RDONLY);
+    dup2(readOnly, fd);
+    close(readOnly);
+    fillPattern(expected, 7, 7);
+    check(writeBlocks(disk, 7, 1, expected) < 0, "write to a read-only file fails");
+    dup2(saved, fd);
+    close(saved);
+
+    check(flushDisk(disk) == 0, "flush after the failed write");
+    check(pread(fd, block, BLOCKSIZE, 7 * BLOCKSIZE) == BLOCKSIZE &&
+          memcmp(block, expected, BLOCKSIZE) == 0, "failed write reaches the file on the next flush");
+    closeDisk(disk);
+    setDefaultDiskBackend(DEFAULT_DISK_BACKEND);
+}
+
+/* Journal groups: reads see the pending group, full groups commit on
+ * their own, and a committed group whose home writes were lost to a crash
+ * is replayed when the journal is next opened */
+static void testJournal(int backend){
+    static char blocks[JOURNAL_START][BLOCKSIZE];
+    char block[BLOCKSIZE];
+    DiskJournalStats stats;
+    int b, ok = 1;
+
+    printf("] Journal, backend %d\n", backend);
+    setDefaultDiskBackend(backend);
+    int disk = openDisk(TEST_DISK, NUM_BLOCKS * BLOCKSIZE);
+    check(disk >= 0, "open new disk");
+    if (disk < 0) return;
+    memset(blocks, 0, sizeof(blocks));
+    writeBlocks(disk, 0, JOURNAL_START, blocks);
+    writeBlocks(disk, JOURNAL_START, NUM_BLOCKS - JOURNAL_START, blocks);
+    check(openJournal(disk, JOURNAL_START, NUM_BLOCKS - JOURNAL_START) == 0, "open empty journal");
+    check(openJournal(disk, JOURNAL_START, NUM_BLOCKS - JOURNAL_START) == DISK_INVALID_ARG,
+          "second journal rejected");
+    check(mapBlock(disk, 0) == NULL, "no mapped blocks while journaled");
+
+    for (b = 0; b < 10; b++) {
+        fillPattern(block, b, 8);
+        writeBlock(disk, b, block);
+    }
+    readBlock(disk, 3, block);
+    fillPattern(blocks[0], 3, 8);
+    check(memcmp(block, blocks[0], BLOCKSIZE) == 0, "read sees the uncommitted group");
+    int room = journalRoom(disk);
+    writeBlock(disk, 3, block);
+    check(room > 0 && journalRoom(disk) == room, "a rewrite takes no room in the group");
+    check(commitJournal(disk) == 0, "commit group");
+    check(journalRoom(disk) == room + 10, "an empty group has the whole log");
+    getJournalStats(disk, &stats);
+    check(stats.commits == 1 && stats.logged == 10, "one commit of ten blocks");
+
+    /* more blocks than the log holds: committed in several groups */
+    for (b = 0; b < JOURNAL_START; b++) fillPattern(blocks[b], b, 9);
+    check(writeBlocks(disk, 0, JOURNAL_START, blocks) == 0, "write more blocks than a group holds");
+    getJournalStats(disk, &stats);
+    check(stats.commits >= 3, "full groups commit on their own");
+    check(stats.overflows == stats.commits - 1, "commits forced by a full group are counted");
+    check(closeDisk(disk) == 0, "close journaled disk");
+
+    disk = openDisk(TEST_DISK, 0);
+    for (b = 0; b < JOURNAL_START && disk >= 0; b++) {
+        fillPattern(blocks[0], b, 9);
+        if (readBlock(disk, b, block) < 0 || memcmp(block, blocks[0], BLOCKSIZE) != 0) ok = 0;
+    }
+    check(ok, "every block home after close");
+    check(openJournal(disk, JOURNAL_START, NUM_BLOCKS - JOURNAL_START) == 0, "nothing to replay after close");
+    closeDisk(disk);
+
+    /* the child commits a group and crashes after its home writes were torn */
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        disk = openDisk(TEST_DISK, 0);
+        openJournal(disk, JOURNAL_START, NUM_BLOCKS - JOURNAL_START);
+        for (b = 0; b < 5; b++) {
+            fillPattern(block, b, 10);
+            writeBlock(disk, b, block);
+        }
+        commitJournal(disk);
+        FILE *raw = fopen(TEST_DISK, "r+b");
+        memset(block, 0, BLOCKSIZE);
+        for (b = 0; b < 5; b++) fwrite(block, 1, BLOCKSIZE, raw);
+        fclose(raw);
+        _exit(0);
+    }
+    waitpid(child, NULL, 0);
+    disk = openDisk(TEST_DISK, 0);
+    check(openJournal(disk, JOURNAL_START, NUM_BLOCKS - JOURNAL_START) == 5, "committed group replayed");
+    getJournalStats(disk, &stats);
+    check(stats.replayed == 5, "replay counted");
+    ok = 1;
+    for (b = 0; b < 10; b++) {
+        fillPattern(blocks[0], b, b < 5 ? 10 : 9);
+        if (readBlock(disk, b, block) < 0 || memcmp(block, blocks[0], BLOCKSIZE) != 0) ok = 0;
+    }
+    check(ok, "replayed blocks restored, others untouched");
+    closeDisk(disk);
+    setDefaultDiskBackend(DEFAULT_DISK_BACKEND);
+}
+
+int main(){
+    testCache(DISK_BACKEND_STDIO);
+    testCache(DISK_BACKEND_PIO);
+    testCache(DISK_BACKEND_MMAP);
+    testCache(DISK_BACKEND_URING);
+    testQueue(DISK_BACKEND_PIO);
+    testQueue(DISK_BACKEND_MMAP);
+    testQueue(DISK_BACKEND_URING);
+    testVector(DISK_BACKEND_STDIO);
+    testVector(DISK_BACKEND_PIO);
+    testVector(DISK_BACKEND_MMAP);
+    testWriteFailure();
+    testJournal(DISK_BACKEND_STDIO);
+    testJournal(DISK_BACKEND_PIO);
+    testJournal(DISK_BACKEND_MMAP);
+    testJournal(DISK_BACKEND_URING);
+    remove(TEST_DISK);
+
+    if (failures) {
+        printf("] %d check(s) failed.\n", failures);
+        return 1;
+    }
+    printf("] All disk I/O checks passed.\n");
+    return 0;
+}
@@ -1,32 +1,122 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 #include "libDisk.h"
 
-static Disk disks[MAX_DISKS] = {{NULL, 0, 0}};
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define DISK_HAVE_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
-int openDisk(char *filename, int nBytes){
-    int diskSize = 0;
+#define MAX_RUN_BLOCKS 256 // iovecs per vectored call, well below IOV_MAX
 
-    if (nBytes != 0){
-        if (nBytes < BLOCKSIZE){
-            return DISK_INVALID_ARG; // disk size too small for one block
-        }
-        // round down to largest multiple of BLOCKSIZE <= to nBytes
-        diskSize = (nBytes / BLOCKSIZE) * BLOCKSIZE;
+static Disk disks[MAX_DISKS] = {{NULL, -1, NULL, NULL, 0, 0, 0}};
+static int defaultCacheBlocks = DEFAULT_CACHE_BLOCKS;
+static int defaultBackend = DEFAULT_DISK_BACKEND;
+static int exitHookInstalled = 0;
+// Held only while a slot of disks[] is claimed or released, so threads can
+// open and close disks concurrently; calls on an open disk are serialized by
+// that disk's own lock instead.
+static pthread_mutex_t diskTableLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t diskLocksOnce = PTHREAD_ONCE_INIT;
+static void ringDestroy(struct DiskRing *r);
+static int journalLookup(struct DiskJournal *j, int bNum);
+static int journalPut(Disk *d, int bNum, const void *block);
+static const char *journalData(struct DiskJournal *j, int index);
+
+// Reads one block straight from the disk file, bypassing the cache
+static int rawReadBlock(Disk *d, int bNum, void *block){
+    off_t offset = (off_t)bNum * BLOCKSIZE;
+
+    if (d->backend == DISK_BACKEND_MMAP) {
+        memcpy(block, d->map + offset, BLOCKSIZE);
+        return 0;
+    }
+    if (d->backend != DISK_BACKEND_STDIO) {
+        ssize_t n;
+        do {
+            n = pread(d->fd, block, BLOCKSIZE, offset); // no shared file position to move
+        } while (n < 0 && errno == EINTR);
+        return n == BLOCKSIZE ? 0 : DISK_ERR;
     }
 
-    int diskIndex = -1;
-    int i;
-    //find next available disk
-    for (i = 0; i < MAX_DISKS; i++){
-        if(!disks[i].inUse){
-            diskIndex = i;
-            break;
-        }
+    FILE *fp = d->fp;
+    if (fseek(fp, offset, SEEK_SET) != 0) return DISK_ERR; //move fp to offset position
+
+    size_t numBytesRead = fread(block, 1, BLOCKSIZE, fp); //read 256B into block starting from offset
+    if (numBytesRead != BLOCKSIZE) return DISK_ERR;
+
+    return 0;
+}
+
+// Writes one block straight to the disk file, bypassing the cache. Flushing
+// is left to flushDisk/syncDisk.
+static int rawWriteBlock(Disk *d, int bNum, void *block){
+    off_t offset = (off_t)bNum * BLOCKSIZE;
+
+    if (d->backend == DISK_BACKEND_MMAP) {
+        memcpy(d->map + offset, block, BLOCKSIZE);
+        return 0;
+    }
+    if (d->backend != DISK_BACKEND_STDIO) {
+        ssize_t n;
+        do {
+            n = pwrite(d->fd, block, BLOCKSIZE, offset);
+        } while (n < 0 && errno == EINTR);
+        return n == BLOCKSIZE ? 0 : DISK_ERR;
     }
 
-    if (diskIndex == -1){
-        return DISK_ERR; //no available disk slots
+    FILE *fp = d->fp;
+    if (fseek(fp, offset, SEEK_SET) != 0) return DISK_ERR; //move fp to offset position
+
+    size_t numBytesWritten = fwrite(block, 1, BLOCKSIZE, fp);
+    if (numBytesWritten != BLOCKSIZE) return DISK_ERR;
+
+    return 0;
+}
+
+// Hands buffered writes to the OS, and to stable storage when durable is set
+static int rawFlush(Disk *d, int durable){
+    if (d->backend == DISK_BACKEND_MMAP) {
+        return msync(d->map, d->size, durable ? MS_SYNC : MS_ASYNC) < 0 ? DISK_ERR : 0;
     }
+    if (d->backend != DISK_BACKEND_STDIO) {
+        return (durable && fdatasync(d->fd) < 0) ? DISK_ERR : 0;
+    }
+    if (fflush(d->fp) != 0) return DISK_ERR;
+    if (durable && fsync(fileno(d->fp)) < 0) return DISK_ERR;
+    return 0;
+}
+
+static void rawClose(Disk *d){
+    if (d->backend == DISK_BACKEND_URING) {
+        ringDestroy(d->ring);
+        d->ring = NULL;
+    }
+    if (d->backend == DISK_BACKEND_MMAP) {
+        munmap(d->map, d->size);
+        d->map = NULL;
+    }
+    if (d->backend != DISK_BACKEND_STDIO) {
+        close(d->fd);
+        d->fd = -1;
+    } else {
+        fclose(d->fp);
+        d->fp = NULL;
+    }
+}
 
+// Opens filename with the stdio backend, see openDisk for the arguments
+static int stdioOpen(Disk *d, char *filename, int nBytes, int *diskSize){
     FILE *fp = NULL;
     //if nBytes is 0, open an existing disk, don't overwrite content
     if (nBytes == 0){
@@ -38,7 +128,7 @@ int openDisk(char *filename, int nBytes){
             return DISK_ERR;
         }
 
-        diskSize = ftell(fp); //get current file ptr position, gets total size of file
+        *diskSize = ftell(fp); //get current file ptr position, gets total size of file
         rewind(fp); //move file ptr back to beginning of file
     } else {
         //otherwise overwrite disk's content
@@ -47,7 +137,7 @@ int openDisk(char *filename, int nBytes){
 
         char zeros[BLOCKSIZE];
         memset(zeros, 0, BLOCKSIZE); //set zeros to 256bytes of 0's
-        int numBlocks = diskSize / BLOCKSIZE;
+        int numBlocks = *diskSize / BLOCKSIZE;
         int i;
         for(i = 0; i < numBlocks; i++){
             if (fwrite(zeros, 1, BLOCKSIZE, fp) != BLOCKSIZE){ //check to see if all 256 0's were written
@@ -57,50 +147,1352 @@ int openDisk(char *filename, int nBytes){
         }
         fflush(fp); //forces flush buffer, make sure all data in the buffer is actually written to the file
     }
+    d->fp = fp;
+    d->fd = -1;
+    d->map = NULL;
+    return 0;
+}
+
+// Opens filename with the pread/pwrite backend, see openDisk for the arguments
+static int pioOpen(Disk *d, char *filename, int nBytes, int *diskSize){
+    int fd;
+    if (nBytes == 0){
+        fd = open(filename, O_RDWR);
+        if (fd < 0) return DISK_ERR;
+
+        struct stat st;
+        if (fstat(fd, &st) < 0){
+            close(fd);
+            return DISK_ERR;
+        }
+        *diskSize = (int)st.st_size;
+    } else {
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) return DISK_ERR;
+
+        // a truncated file grows with zero bytes, same as writing zeros
+        if (ftruncate(fd, *diskSize) < 0){
+            close(fd);
+            return DISK_ERR;
+        }
+    }
+    d->fd = fd;
+    d->fp = NULL;
+    d->map = NULL;
+    return 0;
+}
+
+// Maps an opened PIO disk into memory. Leaves the disk untouched on failure
+// so the caller can keep using pread/pwrite.
+static int mmapAttach(Disk *d, int diskSize){
+    if (diskSize <= 0) return DISK_ERR; // nothing to map
+    void *map = mmap(NULL, diskSize, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
+    if (map == MAP_FAILED) return DISK_ERR;
+    d->map = map;
+    return 0;
+}
+
+//-------------------------------------------------------------
+/*                   io_uring Backend                        */
+//-------------------------------------------------------------
+
+#ifdef DISK_HAVE_URING
+
+struct DiskRing {
+    int fd;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqMap, *cqMap;
+    size_t sqMapLen, cqMapLen, sqesLen;
+};
+
+static void ringDestroy(struct DiskRing *r){
+    if (!r) return;
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqesLen);
+    if (r->cqMap && r->cqMap != MAP_FAILED && r->cqMap != r->sqMap) munmap(r->cqMap, r->cqMapLen);
+    if (r->sqMap && r->sqMap != MAP_FAILED) munmap(r->sqMap, r->sqMapLen);
+    if (r->fd >= 0) close(r->fd);
+    free(r);
+}
+
+// Sets up a ring with room for a full submission queue. Returns NULL when
+// the kernel does not offer io_uring (or forbids it).
+static struct DiskRing *ringCreate(void){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, DISK_QUEUE_DEPTH, &p);
+    if (fd < 0) return NULL;
+
+    struct DiskRing *r = calloc(1, sizeof(struct DiskRing));
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    r->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int singleMap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap) {
+        if (r->cqMapLen > r->sqMapLen) r->sqMapLen = r->cqMapLen;
+        r->cqMapLen = r->sqMapLen;
+    }
+
+    r->sqMap = mmap(NULL, r->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQ_RING);
+    if (r->sqMap == MAP_FAILED) {
+        ringDestroy(r);
+        return NULL;
+    }
+    r->cqMap = singleMap ? r->sqMap :
+               mmap(NULL, r->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_CQ_RING);
+    r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    if (r->cqMap == MAP_FAILED || r->sqes == MAP_FAILED) {
+        ringDestroy(r);
+        return NULL;
+    }
+
+    char *sq = r->sqMap;
+    char *cq = r->cqMap;
+    r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)(sq + p.sq_off.array);
+    r->cqHead = (unsigned *)(cq + p.cq_off.head);
+    r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+}
+
+// Pushes every queued request into the ring in one io_uring_enter call and
+// polls the completion ring until all of them are back. A request the
+// kernel fails (or only partly completes) is retried synchronously. If
+// io_uring_enter itself fails, the requests the kernel has not taken are
+// pulled back out of the ring, the ones it has are waited for (their
+// buffers stay in use until then), and the rest run synchronously.
+static int ringSubmit(Disk *d){
+    struct DiskRing *r = d->ring;
+    unsigned n = d->queued;
+    unsigned tail = *r->sqTail;
+    unsigned i;
+    char finished[DISK_QUEUE_DEPTH];
+    memset(finished, 0, sizeof(finished));
+    for (i = 0; i < n; i++){
+        unsigned idx = tail & *r->sqMask;
+        struct io_uring_sqe *sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = d->queue[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = d->fd;
+        sqe->addr = (unsigned long)d->queue[i].block;
+        sqe->len = BLOCKSIZE;
+        sqe->off = (unsigned long long)d->queue[i].bNum * BLOCKSIZE;
+        sqe->user_data = i;
+        r->sqArray[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(r->sqTail, tail, __ATOMIC_RELEASE);
+
+    int result = 0;
+    int broken = 0; // io_uring_enter failed, submit nothing more
+    unsigned toSubmit = n;
+    unsigned submitted = 0;
+    unsigned done = 0;
+    while (done < submitted || (!broken && toSubmit > 0)){
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, broken ? 0 : toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (!broken) {
+                // the kernel has not read these entries; take them back
+                broken = 1;
+                tail -= toSubmit;
+                __atomic_store_n(r->sqTail, tail, __ATOMIC_RELEASE);
+                continue;
+            }
+            sched_yield(); // cannot sleep in the kernel, poll the ring instead
+        } else if (!broken) {
+            toSubmit -= (unsigned)ret;
+            submitted += (unsigned)ret;
+        }
+
+        unsigned head = *r->cqHead;
+        unsigned cqTail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+        while (head != cqTail){
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+            DiskRequest *req = &d->queue[cqe->user_data];
+            if (cqe->res != BLOCKSIZE) {
+                int retry = req->write ? rawWriteBlock(d, req->bNum, req->block)
+                                       : rawReadBlock(d, req->bNum, req->block);
+                if (retry < 0) result = DISK_ERR;
+            }
+            finished[cqe->user_data] = 1;
+            head++;
+            done++;
+        }
+        __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // requests that never reached the kernel
+    for (i = 0; i < n; i++){
+        if (finished[i]) continue;
+        DiskRequest *req = &d->queue[i];
+        int retry = req->write ? rawWriteBlock(d, req->bNum, req->block)
+                               : rawReadBlock(d, req->bNum, req->block);
+        if (retry < 0) result = DISK_ERR;
+    }
+    d->queued = 0;
+    return result;
+}
+
+#else
+
+struct DiskRing {
+    int unused;
+};
+
+static void ringDestroy(struct DiskRing *r){
+    (void)r;
+}
+
+static struct DiskRing *ringCreate(void){
+    return NULL; // io_uring is not available on this platform
+}
+
+static int ringSubmit(Disk *d){
+    d->queued = 0;
+    return DISK_ERR;
+}
+
+#endif
+
+//-------------------------------------------------------------
+/*                   Block Cache                             */
+//-------------------------------------------------------------
+
+static int cacheHash(Disk *d, int bNum){
+    return (unsigned int)bNum * 2654435761u & (d->nBuckets - 1);
+}
+
+static CacheEntry *cacheLookup(Disk *d, int bNum){
+    CacheEntry *e = d->buckets[cacheHash(d, bNum)];
+    while (e && e->bNum != bNum) e = e->hashNext;
+    return e;
+}
+
+static void lruUnlink(Disk *d, CacheEntry *e){
+    if (e->prev) e->prev->next = e->next; else d->lruHead = e->next;
+    if (e->next) e->next->prev = e->prev; else d->lruTail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lruPushFront(Disk *d, CacheEntry *e){
+    e->prev = NULL;
+    e->next = d->lruHead;
+    if (d->lruHead) d->lruHead->prev = e; else d->lruTail = e;
+    d->lruHead = e;
+}
+
+static void lruPushBack(Disk *d, CacheEntry *e){
+    e->next = NULL;
+    e->prev = d->lruTail;
+    if (d->lruTail) d->lruTail->next = e; else d->lruHead = e;
+    d->lruTail = e;
+}
+
+static void hashRemove(Disk *d, CacheEntry *e){
+    CacheEntry **pp = &d->buckets[cacheHash(d, e->bNum)];
+    while (*pp && *pp != e) pp = &(*pp)->hashNext;
+    if (*pp) *pp = e->hashNext;
+    e->hashNext = NULL;
+}
+
+// Writes a dirty entry back to the disk file
+static int cacheWriteBack(Disk *d, CacheEntry *e){
+    if (!e->dirty) return 0;
+    if (rawWriteBlock(d, e->bNum, e->data) < 0) return DISK_ERR;
+    e->dirty = 0;
+    d->stats.writebacks++;
+    return 0;
+}
+
+// Returns an entry ready to hold bNum: an unused one from the pool, or the
+// least recently used one after writing it back. The entry is hashed under
+// bNum and placed at the head of the LRU list.
+static CacheEntry *cacheClaim(Disk *d, int bNum){
+    CacheEntry *e;
+    if (d->cacheUsed < d->cacheBlocks) {
+        e = &d->cache[d->cacheUsed++];
+    } else {
+        e = d->lruTail;
+        if (cacheWriteBack(d, e) < 0) return NULL;
+        lruUnlink(d, e);
+        hashRemove(d, e);
+        d->stats.evictions++;
+    }
+    e->bNum = bNum;
+    e->dirty = 0;
+    int h = cacheHash(d, bNum);
+    e->hashNext = d->buckets[h];
+    d->buckets[h] = e;
+    lruPushFront(d, e);
+    return e;
+}
+
+static int cacheInit(Disk *d, int nBlocks){
+    d->cache = NULL;
+    d->buckets = NULL;
+    d->nBuckets = 0;
+    d->cacheBlocks = 0;
+    d->cacheUsed = 0;
+    d->lruHead = d->lruTail = NULL;
+    if (nBlocks <= 0) return 0;
+
+    int nBuckets = 1;
+    while (nBuckets < nBlocks * 2) nBuckets <<= 1; // keep chains short
+
+    d->cache = calloc(nBlocks, sizeof(CacheEntry));
+    d->buckets = calloc(nBuckets, sizeof(CacheEntry *));
+    if (!d->cache || !d->buckets) {
+        free(d->cache);
+        free(d->buckets);
+        d->cache = NULL;
+        d->buckets = NULL;
+        return DISK_ERR;
+    }
+    d->nBuckets = nBuckets;
+    d->cacheBlocks = nBlocks;
+    return 0;
+}
+
+static void cacheFree(Disk *d){
+    free(d->cache);
+    free(d->buckets);
+    d->cache = NULL;
+    d->buckets = NULL;
+    d->cacheBlocks = 0;
+    d->cacheUsed = 0;
+    d->lruHead = d->lruTail = NULL;
+}
+
+static int validDisk(int disk){
+    return disk >= 0 && disk < MAX_DISKS && disks[disk].inUse;
+}
+
+// Programs that never call closeDisk still expect their writes in the file
+static void flushAllDisks(void){
+    int i;
+    for (i = 0; i < MAX_DISKS; i++){
+        if (disks[i].inUse && disks[i].journal) commitJournal(i);
+        if (disks[i].inUse) flushDisk(i);
+    }
+}
+
+//-------------------------------------------------------------
+/*                   Disk API                                */
+//-------------------------------------------------------------
+
+// Each disk has a recursive lock that its public calls take, so a disk can
+// be shared by threads; the calls still run one at a time per disk.
+static void initDiskLocks(void){
+    pthread_mutexattr_t attr;
+    int i;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    for (i = 0; i < MAX_DISKS; i++) pthread_mutex_init(&disks[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// openDisk with diskTableLock held
+static int openDiskSlot(char *filename, int nBytes){
+    int diskSize = 0;
+
+    if (nBytes != 0){
+        if (nBytes < BLOCKSIZE){
+            return DISK_INVALID_ARG; // disk size too small for one block
+        }
+        // round down to largest multiple of BLOCKSIZE <= to nBytes
+        diskSize = (nBytes / BLOCKSIZE) * BLOCKSIZE;
+    }
+
+    int diskIndex = -1;
+    int i;
+    //find next available disk
+    for (i = 0; i < MAX_DISKS; i++){
+        if(!disks[i].inUse){
+            diskIndex = i;
+            break;
+        }
+    }
+
+    if (diskIndex == -1){
+        return DISK_ERR; //no available disk slots
+    }
+
+    Disk *d = &disks[diskIndex];
+    int result = (defaultBackend == DISK_BACKEND_STDIO) ?
+                 stdioOpen(d, filename, nBytes, &diskSize) :
+                 pioOpen(d, filename, nBytes, &diskSize);
+    if (result < 0) return result;
+    d->backend = defaultBackend;
+    d->ring = NULL;
+    d->queued = 0;
+    d->journal = NULL;
+    if (d->backend == DISK_BACKEND_MMAP && mmapAttach(d, diskSize) < 0){
+        d->backend = DISK_BACKEND_PIO; // fall back to positional I/O
+    }
+    if (d->backend == DISK_BACKEND_URING && !(d->ring = ringCreate())){
+        d->backend = DISK_BACKEND_PIO; // no io_uring, stay synchronous
+    }
 
-    disks[diskIndex].fp = fp;
-    disks[diskIndex].size = diskSize;
-    disks[diskIndex].inUse = 1;
+    if (!exitHookInstalled){
+        atexit(flushAllDisks);
+        exitHookInstalled = 1;
+    }
+
+    d->size = diskSize;
+    // the mapping already is an in-memory copy, don't cache on top of it
+    if (cacheInit(d, d->backend == DISK_BACKEND_MMAP ? 0 : defaultCacheBlocks) < 0){
+        rawClose(d);
+        return DISK_ERR;
+    }
+    memset(&d->stats, 0, sizeof(d->stats));
+    d->inUse = 1;
 
     return diskIndex;
 }
 
-int closeDisk(int disk){
-    if (disk < 0 || disk >= MAX_DISKS || !disks[disk].inUse) return DISK_INVALID_NUM;
+int openDisk(char *filename, int nBytes){
+    pthread_once(&diskLocksOnce, initDiskLocks);
+    pthread_mutex_lock(&diskTableLock);
+    int result = openDiskSlot(filename, nBytes);
+    pthread_mutex_unlock(&diskTableLock);
+    return result;
+}
+
+static int closeDiskLocked(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
 
-    fclose(disks[disk].fp);
+    int result = submitBlocks(disk);
+    if (disks[disk].journal && closeJournal(disk) < 0) result = DISK_ERR;
+    if (flushDisk(disk) < 0) result = DISK_ERR; // don't lose dirty blocks
+    cacheFree(&disks[disk]);
+    rawClose(&disks[disk]);
+    pthread_mutex_lock(&diskTableLock);
     disks[disk].inUse = 0;
-    return 0;
+    pthread_mutex_unlock(&diskTableLock);
+    return result;
 }
 
-int readBlock(int disk, int bNum, void *block){
-    if(disk < 0 || disk >= MAX_DISKS || !disks[disk].inUse) return DISK_INVALID_NUM;
+static int readBlockLocked(int disk, int bNum, void *block){
+    if(!validDisk(disk)) return DISK_INVALID_NUM;
+    Disk *d = &disks[disk];
+    if (d->queued && submitBlocks(disk) < 0) return DISK_ERR;
 
     int offset = bNum * BLOCKSIZE; //translate bNum into logical block number
-    if (offset < 0 || offset + BLOCKSIZE > disks[disk].size) return DISK_INVALID_ARG;
+    if (offset < 0 || offset + BLOCKSIZE > d->size) return DISK_INVALID_ARG;
 
-    FILE *fp = disks[disk].fp;
-    if (fseek(fp, offset, SEEK_SET) != 0) return DISK_ERR; //move fp to offset position
+    if (d->journal) {
+        int index = journalLookup(d->journal, bNum);
+        if (index >= 0) {
+            memcpy(block, journalData(d->journal, index), BLOCKSIZE);
+            return 0;
+        }
+    }
+    if (d->cacheBlocks == 0) return rawReadBlock(d, bNum, block);
 
-    size_t numBytesRead = fread(block, 1, BLOCKSIZE, fp); //read 256B into block starting from offset
-    if (numBytesRead != BLOCKSIZE) return DISK_ERR;
-    
+    CacheEntry *e = cacheLookup(d, bNum);
+    if (e) {
+        d->stats.hits++;
+        lruUnlink(d, e);
+        lruPushFront(d, e);
+    } else {
+        d->stats.misses++;
+        e = cacheClaim(d, bNum);
+        if (!e) return DISK_ERR;
+        if (rawReadBlock(d, bNum, e->data) < 0) {
+            // don't leave a half-filled block in the cache, recycle it first
+            hashRemove(d, e);
+            e->bNum = -1;
+            lruUnlink(d, e);
+            lruPushBack(d, e);
+            return DISK_ERR;
+        }
+    }
+    memcpy(block, e->data, BLOCKSIZE);
     return 0;
 }
 
-int writeBlock(int disk, int bNum, void *block){
-    if(disk < 0 || disk >= MAX_DISKS || !disks[disk].inUse) return DISK_INVALID_NUM;
+static int writeBlockLocked(int disk, int bNum, void *block){
+    if(!validDisk(disk)) return DISK_INVALID_NUM;
+    Disk *d = &disks[disk];
+    if (d->queued && submitBlocks(disk) < 0) return DISK_ERR;
 
     int offset = bNum * BLOCKSIZE; //translate bNum into logical block number
-    if (offset < 0 || offset + BLOCKSIZE > disks[disk].size) return DISK_INVALID_ARG;
+    if (offset < 0 || offset + BLOCKSIZE > d->size) return DISK_INVALID_ARG;
 
-    FILE *fp = disks[disk].fp;
-    if (fseek(fp, offset, SEEK_SET) != 0) return DISK_ERR; //move fp to offset position
+    if (d->journal) return journalPut(d, bNum, block);
+    if (d->cacheBlocks == 0) return rawWriteBlock(d, bNum, block);
 
-    size_t numBytesWritten = fwrite(block, 1, BLOCKSIZE, fp);
-    if (numBytesWritten != BLOCKSIZE) return DISK_ERR;
+    CacheEntry *e = cacheLookup(d, bNum);
+    if (e) {
+        d->stats.hits++;
+        lruUnlink(d, e);
+        lruPushFront(d, e);
+    } else {
+        d->stats.misses++; // whole block is overwritten, no need to read it
+        e = cacheClaim(d, bNum);
+        if (!e) return DISK_ERR;
+    }
+    memcpy(e->data, block, BLOCKSIZE);
+    e->dirty = 1;
+    return 0;
+}
+
+// Transfers a run of consecutive blocks, bufs[i] holding block first + i,
+// with a single vectored call (a single seek on the stdio backend)
+static int rawRun(Disk *d, int first, void **bufs, int n, int write){
+    int i;
+    off_t offset = (off_t)first * BLOCKSIZE;
+
+    if (d->backend == DISK_BACKEND_MMAP) {
+        for (i = 0; i < n; i++){
+            if (write) memcpy(d->map + offset + i * BLOCKSIZE, bufs[i], BLOCKSIZE);
+            else memcpy(bufs[i], d->map + offset + i * BLOCKSIZE, BLOCKSIZE);
+        }
+        return 0;
+    }
+    if (d->backend == DISK_BACKEND_STDIO) {
+        if (fseek(d->fp, offset, SEEK_SET) != 0) return DISK_ERR;
+        for (i = 0; i < n; i++){
+            size_t moved = write ? fwrite(bufs[i], 1, BLOCKSIZE, d->fp)
+                                 : fread(bufs[i], 1, BLOCKSIZE, d->fp);
+            if (moved != BLOCKSIZE) return DISK_ERR;
+        }
+        return 0;
+    }
+
+    struct iovec iov[MAX_RUN_BLOCKS];
+    for (i = 0; i < n; i++){
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = BLOCKSIZE;
+    }
+    ssize_t moved;
+    do {
+        moved = write ? pwritev(d->fd, iov, n, offset) : preadv(d->fd, iov, n, offset);
+    } while (moved < 0 && errno == EINTR);
+    if (moved == (ssize_t)n * BLOCKSIZE) return 0;
+
+    // short transfer, finish block by block
+    for (i = 0; i < n; i++){
+        int result = write ? rawWriteBlock(d, first + i, bufs[i])
+                           : rawReadBlock(d, first + i, bufs[i]);
+        if (result < 0) return result;
+    }
+    return 0;
+}
+
+// rawRun for vectorIO. A written run's cached copies, cached[i] for
+// bufs[i] or NULL, only become clean once the run is in the file; on a
+// failure they stay dirty so the write-back retries them.
+static int moveRun(Disk *d, int first, void **bufs, CacheEntry **cached, int n, int write){
+    int i, result = rawRun(d, first, bufs, n, write);
+    if (result == 0 && write) {
+        for (i = 0; i < n; i++)
+            if (cached[i]) cached[i]->dirty = 0;
+    }
+    return result;
+}
+
+typedef struct VecOrder {
+    int bNum;
+    int index;      // position in the caller's list
+} VecOrder;
+
+static int compareVecOrder(const void *a, const void *b){
+    const VecOrder *x = a, *y = b;
+    if (x->bNum != y->bNum) return x->bNum < y->bNum ? -1 : 1;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+// Carries out a scatter list: sorts it by block number, serves reads from the
+// journal or the cache where possible, and moves every run of consecutive
+// blocks that has to touch the disk file with one rawRun call. Writes go
+// straight to the file and refresh cached copies, or into the journal's
+// current group on a journaled disk.
+static int vectorIO(Disk *d, BlockVec *list, int count, int write){
+    int k;
+    for (k = 0; k < count; k++){
+        int offset = list[k].bNum * BLOCKSIZE;
+        if (list[k].bNum < 0 || offset + BLOCKSIZE > d->size) return DISK_INVALID_ARG;
+    }
+    if (write && d->journal) {
+        for (k = 0; k < count; k++){
+            int result = journalPut(d, list[k].bNum, list[k].block);
+            if (result < 0) return result;
+        }
+        return 0;
+    }
+
+    VecOrder *order = malloc(count * sizeof(VecOrder));
+    if (!order) return DISK_ERR;
+    for (k = 0; k < count; k++){
+        order[k].bNum = list[k].bNum;
+        order[k].index = k;
+    }
+    qsort(order, count, sizeof(VecOrder), compareVecOrder);
+
+    void *bufs[MAX_RUN_BLOCKS];
+    CacheEntry *cached[MAX_RUN_BLOCKS];
+    int runStart = 0, runLen = 0;
+    int result = 0;
+    for (k = 0; k < count && result == 0; k++){
+        int bNum = order[k].bNum;
+        void *buffer = list[order[k].index].block;
+        if (write && k + 1 < count && order[k + 1].bNum == bNum) continue; // a later entry wins
+        if (!write && d->journal) {
+            int index = journalLookup(d->journal, bNum);
+            if (index >= 0) {
+                memcpy(buffer, journalData(d->journal, index), BLOCKSIZE);
+                continue;
+            }
+        }
+
+        CacheEntry *written = NULL;
+        if (d->cacheBlocks > 0) {
+            CacheEntry *e = cacheLookup(d, bNum);
+            if (write) {
+                if (e) {
+                    memcpy(e->data, buffer, BLOCKSIZE);
+                    e->dirty = 1; // until its run reaches the file
+                    written = e;
+                }
+            } else if (e) {
+                d->stats.hits++;
+                memcpy(buffer, e->data, BLOCKSIZE);
+                continue;
+            } else {
+                d->stats.misses++;
+            }
+        }
+
+        if (runLen > 0 && (bNum != runStart + runLen || runLen == MAX_RUN_BLOCKS)) {
+            result = moveRun(d, runStart, bufs, cached, runLen, write);
+            runLen = 0;
+        }
+        if (runLen == 0) runStart = bNum;
+        cached[runLen] = written;
+        bufs[runLen++] = buffer;
+    }
+    if (result == 0 && runLen > 0) result = moveRun(d, runStart, bufs, cached, runLen, write);
+
+    free(order);
+    return result;
+}
+
+// Builds the scatter list for a contiguous run and hands it to vectorIO
+static int runIO(int disk, int bNum, int nBlocks, void *blocks, int write){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    if (nBlocks < 0) return DISK_INVALID_ARG;
+    if (nBlocks == 0) return 0;
+    Disk *d = &disks[disk];
+    if (d->queued && submitBlocks(disk) < 0) return DISK_ERR;
+
+    BlockVec *list = malloc(nBlocks * sizeof(BlockVec));
+    if (!list) return DISK_ERR;
+    int i;
+    for (i = 0; i < nBlocks; i++){
+        list[i].bNum = bNum + i;
+        list[i].block = (char *)blocks + i * BLOCKSIZE;
+    }
+    int result = vectorIO(d, list, nBlocks, write);
+    free(list);
+    return result;
+}
+
+static int readBlocksLocked(int disk, int bNum, int nBlocks, void *blocks){
+    return runIO(disk, bNum, nBlocks, blocks, 0);
+}
+
+static int writeBlocksLocked(int disk, int bNum, int nBlocks, void *blocks){
+    return runIO(disk, bNum, nBlocks, blocks, 1);
+}
+
+int readBlocksShared(int disk, int bNum, int nBlocks, void *blocks){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    Disk *d = &disks[disk];
+    if (bNum < 0 || nBlocks < 0 || (off_t)(bNum + nBlocks) * BLOCKSIZE > d->size) return DISK_INVALID_ARG;
+
+    off_t offset = (off_t)bNum * BLOCKSIZE;
+    size_t left = (size_t)nBlocks * BLOCKSIZE;
+    if (d->backend == DISK_BACKEND_MMAP) {
+        memcpy(blocks, d->map + offset, left);
+        return 0;
+    }
+    // stdio buffers are flushed by flushDisk, so its descriptor is current
+    int fd = (d->backend == DISK_BACKEND_STDIO) ? fileno(d->fp) : d->fd;
+    char *dest = blocks;
+    while (left > 0){
+        ssize_t n = pread(fd, dest, left, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return DISK_ERR;
+        dest += n;
+        offset += n;
+        left -= n;
+    }
+    return 0;
+}
+
+static int readBlockListLocked(int disk, BlockVec *list, int count){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    if (count < 0) return DISK_INVALID_ARG;
+    if (count == 0) return 0;
+    if (disks[disk].queued && submitBlocks(disk) < 0) return DISK_ERR;
+    return vectorIO(&disks[disk], list, count, 0);
+}
+
+static int writeBlockListLocked(int disk, BlockVec *list, int count){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    if (count < 0) return DISK_INVALID_ARG;
+    if (count == 0) return 0;
+    if (disks[disk].queued && submitBlocks(disk) < 0) return DISK_ERR;
+    return vectorIO(&disks[disk], list, count, 1);
+}
+
+// Adds a request to the queue, submitting first if it would conflict with
+// a request already queued for the same block or the queue is full
+static int enqueue(int disk, int bNum, void *block, int write){
+    Disk *d = &disks[disk];
+    int i;
+    for (i = 0; i < d->queued; i++){
+        if (d->queue[i].bNum == bNum) break;
+    }
+    if ((i < d->queued || d->queued == DISK_QUEUE_DEPTH) && submitBlocks(disk) < 0)
+        return DISK_ERR;
+
+    DiskRequest *req = &d->queue[d->queued++];
+    req->bNum = bNum;
+    req->block = block;
+    req->write = write;
+    return 0;
+}
+
+static int queueReadBlockLocked(int disk, int bNum, void *block){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    Disk *d = &disks[disk];
+    if (d->backend != DISK_BACKEND_URING) return readBlock(disk, bNum, block);
+
+    int offset = bNum * BLOCKSIZE;
+    if (offset < 0 || offset + BLOCKSIZE > d->size) return DISK_INVALID_ARG;
+
+    if (d->journal) {
+        int index = journalLookup(d->journal, bNum);
+        if (index >= 0) {
+            memcpy(block, journalData(d->journal, index), BLOCKSIZE);
+            return 0;
+        }
+    }
+    if (d->cacheBlocks > 0) {
+        CacheEntry *e = cacheLookup(d, bNum);
+        if (e) {
+            d->stats.hits++;
+            memcpy(block, e->data, BLOCKSIZE);
+            return 0;
+        }
+        d->stats.misses++; // batched reads are mostly scans, keep them out of the cache
+    }
+    return enqueue(disk, bNum, block, 0);
+}
+
+static int queueWriteBlockLocked(int disk, int bNum, void *block){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    Disk *d = &disks[disk];
+    // a cached or journaled write only touches memory, nothing to batch;
+    // the flush or the commit writes it out with its neighbours later
+    if (d->backend != DISK_BACKEND_URING || d->cacheBlocks > 0 || d->journal)
+        return writeBlock(disk, bNum, block);
+
+    int offset = bNum * BLOCKSIZE;
+    if (offset < 0 || offset + BLOCKSIZE > d->size) return DISK_INVALID_ARG;
+    return enqueue(disk, bNum, block, 1);
+}
+
+static int submitBlocksLocked(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    Disk *d = &disks[disk];
+    if (d->queued == 0) return 0;
+    return ringSubmit(d);
+}
+
+static int compareEntryBlock(const void *a, const void *b){
+    return (*(CacheEntry * const *)a)->bNum - (*(CacheEntry * const *)b)->bNum;
+}
+
+static int flushDiskLocked(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    Disk *d = &disks[disk];
+    if (d->queued && submitBlocks(disk) < 0) return DISK_ERR;
+    if (d->cacheUsed == 0) return rawFlush(d, 0);
+
+    // write back in block order so the file is touched front to back
+    CacheEntry **dirty = malloc(d->cacheUsed * sizeof(CacheEntry *));
+    if (!dirty) return DISK_ERR;
+    int nDirty = 0;
+    int i;
+    for (i = 0; i < d->cacheUsed; i++){
+        if (d->cache[i].dirty) dirty[nDirty++] = &d->cache[i];
+    }
+    qsort(dirty, nDirty, sizeof(CacheEntry *), compareEntryBlock);
+
+    int result = 0;
+    if (d->backend == DISK_BACKEND_URING) {
+        // keep a whole queue of write-backs in flight at once
+        int start;
+        for (start = 0; start < nDirty; start += DISK_QUEUE_DEPTH){
+            int end = start + DISK_QUEUE_DEPTH < nDirty ? start + DISK_QUEUE_DEPTH : nDirty;
+            for (i = start; i < end; i++){
+                DiskRequest *req = &d->queue[d->queued++];
+                req->bNum = dirty[i]->bNum;
+                req->block = dirty[i]->data;
+                req->write = 1;
+            }
+            if (ringSubmit(d) < 0) {
+                result = DISK_ERR;
+                continue; // leave this batch dirty
+            }
+            for (i = start; i < end; i++){
+                dirty[i]->dirty = 0;
+                d->stats.writebacks++;
+            }
+        }
+    } else {
+        for (i = 0; i < nDirty; i++){
+            if (cacheWriteBack(d, dirty[i]) < 0) result = DISK_ERR;
+        }
+    }
+    free(dirty);
+
+    if (rawFlush(d, 0) < 0) result = DISK_ERR;
+    return result;
+}
+
+static int syncDiskLocked(int disk){
+    int result = flushDisk(disk);
+    if (result < 0) return result;
+    return rawFlush(&disks[disk], 1);
+}
+
+static int setCacheSizeLocked(int disk, int nBlocks){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    if (nBlocks < 0) return DISK_INVALID_ARG;
+    Disk *d = &disks[disk];
+    if (d->backend == DISK_BACKEND_MMAP && nBlocks > 0) return DISK_INVALID_ARG;
+    if (flushDisk(disk) < 0) return DISK_ERR;
+
+    cacheFree(d);
+    return cacheInit(d, nBlocks);
+}
+
+int setDefaultCacheSize(int nBlocks){
+    if (nBlocks < 0) return DISK_INVALID_ARG;
+    defaultCacheBlocks = nBlocks;
+    return 0;
+}
+
+static int getCacheStatsLocked(int disk, DiskCacheStats *stats){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    if (!stats) return DISK_INVALID_ARG;
+    *stats = disks[disk].stats;
+    return 0;
+}
+
+int setDefaultDiskBackend(int backend){
+    if (backend < DISK_BACKEND_STDIO || backend > DISK_BACKEND_URING) return DISK_INVALID_ARG;
+    defaultBackend = backend;
+    return 0;
+}
+
+int getDiskBackend(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    return disks[disk].backend;
+}
+
+void *mapBlock(int disk, int bNum){
+    if (!validDisk(disk)) return NULL;
+    Disk *d = &disks[disk];
+    if (d->backend != DISK_BACKEND_MMAP || d->journal) return NULL; // the map may be behind the journal
+
+    int offset = bNum * BLOCKSIZE;
+    if (offset < 0 || offset + BLOCKSIZE > d->size) return NULL;
+    return d->map + offset;
+}
+
+//-------------------------------------------------------------
+/*                   Write-ahead journal                     */
+//-------------------------------------------------------------
+
+#define JOURNAL_MAGIC 0x4A524E4C          // "JRNL", first word of a committed log
+#define JOURNAL_NUMS_PER_BLOCK (BLOCKSIZE / 4)
+
+// Log layout from the start of the region: a header block (magic, sequence
+// number, block count, checksum), the group's block numbers, 64 per block,
+// then the group's block images in the same order. An empty log has no
+// magic in its header.
+struct DiskJournal {
+    int start;          // log region
+    int length;
+    int maxBlocks;      // most blocks one group can hold
+    int *nums;          // block numbers of the current group, in first-write order
+    char (*data)[BLOCKSIZE]; // their latest contents
+    int count;
+    int *slots;         // hash of nums: index + 1, 0 for an empty slot
+    int nSlots;         // power of two, more than twice maxBlocks
+    unsigned int sequence;  // of the next commit
+    time_t groupStart;  // when the current group got its first block
+    int homeUnsynced;   // home writes of the last commit not yet forced out
+    DiskJournalStats stats;
+};
+
+static void putWord(char *dest, unsigned int value){
+    dest[0] = (char)(value >> 24);
+    dest[1] = (char)(value >> 16);
+    dest[2] = (char)(value >> 8);
+    dest[3] = (char)value;
+}
 
-    fflush(fp); //ensure bytes are actually written
+static unsigned int getWord(const char *src){
+    return ((unsigned int)(unsigned char)src[0] << 24) | ((unsigned int)(unsigned char)src[1] << 16) |
+           ((unsigned int)(unsigned char)src[2] << 8) | (unsigned int)(unsigned char)src[3];
+}
+
+// Blocks a group can hold in a log of length blocks: header, numbers, images
+static int journalCapacity(int length){
+    int n = length - 1;
+    while (n > 0 && n + (n + JOURNAL_NUMS_PER_BLOCK - 1) / JOURNAL_NUMS_PER_BLOCK > length - 1) n--;
+    return n;
+}
+
+static int journalSlot(struct DiskJournal *j, int bNum){
+    return (int)(((unsigned int)bNum * 2654435761u) & (unsigned int)(j->nSlots - 1));
+}
+
+// Index of bNum in the current group, or -1
+static int journalLookup(struct DiskJournal *j, int bNum){
+    int h = journalSlot(j, bNum);
+    while (j->slots[h] != 0){
+        if (j->nums[j->slots[h] - 1] == bNum) return j->slots[h] - 1;
+        h = (h + 1) & (j->nSlots - 1);
+    }
+    return -1;
+}
+
+static const char *journalData(struct DiskJournal *j, int index){
+    return j->data[index];
+}
+
+// FNV-1a over the sequence number, the block numbers and the images
+static unsigned int journalChecksum(unsigned int sequence, const char *nums, int numBytes,
+                                    char (*images)[BLOCKSIZE], int count){
+    unsigned int hash = 2166136261u;
+    char word[4];
+    int i, k;
+    putWord(word, sequence);
+    for (i = 0; i < 4; i++) hash = (hash ^ (unsigned char)word[i]) * 16777619u;
+    for (i = 0; i < numBytes; i++) hash = (hash ^ (unsigned char)nums[i]) * 16777619u;
+    for (k = 0; k < count; k++){
+        for (i = 0; i < BLOCKSIZE; i++) hash = (hash ^ (unsigned char)images[k][i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Writes a scatter list to the disk file itself, past the journal
+static int journalWriteThrough(Disk *d, BlockVec *list, int count){
+    struct DiskJournal *j = d->journal;
+    d->journal = NULL;
+    int result = vectorIO(d, list, count, 1);
+    d->journal = j;
+    return result;
+}
+
+// Writes the current group to the log, forces it to stable storage, and
+// then writes the blocks home. The previous group's home writes are forced
+// out first, since its log is about to be overwritten.
+static int journalCommit(Disk *d){
+    struct DiskJournal *j = d->journal;
+    if (j->count == 0) return 0;
+
+    int numBlocks = (j->count + JOURNAL_NUMS_PER_BLOCK - 1) / JOURNAL_NUMS_PER_BLOCK;
+    int total = 1 + numBlocks + j->count;
+    char (*meta)[BLOCKSIZE] = calloc(1 + numBlocks, BLOCKSIZE);
+    BlockVec *list = malloc(total * sizeof(BlockVec));
+    if (!meta || !list){
+        free(meta);
+        free(list);
+        return DISK_ERR;
+    }
+    int i;
+    for (i = 0; i < j->count; i++) putWord(meta[1] + i * 4, (unsigned int)j->nums[i]);
+    putWord(meta[0], JOURNAL_MAGIC);
+    putWord(meta[0] + 4, j->sequence);
+    putWord(meta[0] + 8, (unsigned int)j->count);
+    putWord(meta[0] + 12, journalChecksum(j->sequence, meta[1], j->count * 4, j->data, j->count));
+    for (i = 0; i < total; i++){
+        list[i].bNum = j->start + i;
+        list[i].block = (i <= numBlocks) ? meta[i] : j->data[i - 1 - numBlocks];
+    }
+
+    int result = 0;
+    if (j->homeUnsynced && rawFlush(d, 1) < 0) result = DISK_ERR;
+    if (result == 0) result = journalWriteThrough(d, list, total);
+    if (result == 0 && rawFlush(d, 1) < 0) result = DISK_ERR; // the commit point
+    if (result == 0){
+        for (i = 0; i < j->count; i++){
+            list[i].bNum = j->nums[i];
+            list[i].block = j->data[i];
+        }
+        // once the group is in the log a failed home write is repaired by replay
+        journalWriteThrough(d, list, j->count);
+        j->homeUnsynced = 1;
+        j->stats.commits++;
+        j->stats.logged += j->count;
+        j->sequence++;
+        j->count = 0;
+        memset(j->slots, 0, j->nSlots * sizeof(int));
+    }
+    free(meta);
+    free(list);
+    return result;
+}
+
+// Adds a block write to the current group, committing the group first if
+// it is full. A caller that checks journalRoom before each operation never
+// gets here with a full group; the commit is a last resort for one that
+// does not, and may end its group inside an operation.
+static int journalPut(Disk *d, int bNum, const void *block){
+    struct DiskJournal *j = d->journal;
+    int index = journalLookup(j, bNum);
+    if (index < 0){
+        if (j->count == j->maxBlocks){
+            if (journalCommit(d) < 0) return DISK_ERR;
+            j->stats.overflows++;
+        }
+        if (j->count == 0) j->groupStart = time(NULL);
+        index = j->count++;
+        j->nums[index] = bNum;
+        int h = journalSlot(j, bNum);
+        while (j->slots[h] != 0) h = (h + 1) & (j->nSlots - 1);
+        j->slots[h] = index + 1;
+    }
+    memcpy(j->data[index], block, BLOCKSIZE);
+    return 0;
+}
+
+// Copies a committed group left in the log home and empties the log.
+// Returns the number of blocks copied.
+static int journalReplay(Disk *d, struct DiskJournal *j){
+    char header[BLOCKSIZE];
+    if (readBlock(d - disks, j->start, header) < 0) return DISK_ERR;
+    int count = (int)getWord(header + 8);
+    if (getWord(header) != JOURNAL_MAGIC || count < 1 || count > j->maxBlocks) return 0;
+
+    int numBlocks = (count + JOURNAL_NUMS_PER_BLOCK - 1) / JOURNAL_NUMS_PER_BLOCK;
+    char (*meta)[BLOCKSIZE] = malloc(numBlocks * BLOCKSIZE);
+    char (*images)[BLOCKSIZE] = malloc(count * BLOCKSIZE);
+    BlockVec *list = malloc(count * sizeof(BlockVec));
+    int result = (meta && images && list) ? 0 : DISK_ERR;
+    if (result == 0 && readBlocks(d - disks, j->start + 1, numBlocks, meta) < 0) result = DISK_ERR;
+    if (result == 0 && readBlocks(d - disks, j->start + 1 + numBlocks, count, images) < 0) result = DISK_ERR;
+    int valid = (result == 0 &&
+                 journalChecksum(getWord(header + 4), meta[0], count * 4, images, count) == getWord(header + 12));
+    int i;
+    for (i = 0; valid && i < count; i++){
+        int bNum = (int)getWord(meta[0] + i * 4);
+        if (bNum < 0 || (bNum + 1) * BLOCKSIZE > d->size ||
+            (bNum >= j->start && bNum < j->start + j->length)) valid = 0;
+        list[i].bNum = bNum;
+        list[i].block = images[i];
+    }
+    // a torn log means the group never committed; its blocks were never written home
+    if (valid){
+        if (vectorIO(d, list, count, 1) < 0 || rawFlush(d, 1) < 0) result = DISK_ERR;
+        j->sequence = getWord(header + 4) + 1;
+        j->stats.replayed = count;
+    }
+    if (result == 0){
+        memset(header, 0, BLOCKSIZE);
+        list[0].bNum = j->start;
+        list[0].block = header;
+        if (vectorIO(d, list, 1, 1) < 0 || rawFlush(d, 1) < 0) result = DISK_ERR;
+    }
+    free(meta);
+    free(images);
+    free(list);
+    return result < 0 ? result : (valid ? count : 0);
+}
+
+static int openJournalLocked(int disk, int start, int nBlocks){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    Disk *d = &disks[disk];
+    if (d->journal || nBlocks < 3 || start < 0 || (start + nBlocks) * BLOCKSIZE > d->size)
+        return DISK_INVALID_ARG;
+    if (flushDisk(disk) < 0) return DISK_ERR; // earlier writes reach the file unjournaled
+
+    struct DiskJournal *j = calloc(1, sizeof(struct DiskJournal));
+    if (!j) return DISK_ERR;
+    j->start = start;
+    j->length = nBlocks;
+    j->maxBlocks = journalCapacity(nBlocks);
+    j->nSlots = 1;
+    while (j->nSlots <= 2 * j->maxBlocks) j->nSlots *= 2;
+    j->nums = malloc(j->maxBlocks * sizeof(int));
+    j->data = malloc(j->maxBlocks * BLOCKSIZE);
+    j->slots = calloc(j->nSlots, sizeof(int));
+    int result = (j->nums && j->data && j->slots) ? journalReplay(d, j) : DISK_ERR;
+    if (result < 0){
+        free(j->nums);
+        free(j->data);
+        free(j->slots);
+        free(j);
+        return result;
+    }
+    d->journal = j;
+    return result;
+}
+
+static int commitJournalLocked(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    if (!disks[disk].journal) return DISK_INVALID_ARG;
+    return journalCommit(&disks[disk]);
+}
+
+// Whether the current group is half as large as the log allows or old enough
+static int journalDue(struct DiskJournal *j){
+    if (!j || j->count == 0) return 0;
+    return j->count * 2 >= j->maxBlocks || time(NULL) - j->groupStart >= JOURNAL_COMMIT_SECONDS;
+}
+
+static int commitJournalIfDueLocked(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    if (!journalDue(disks[disk].journal)) return 0;
+    return journalCommit(&disks[disk]);
+}
+
+static int journalCommitDueLocked(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    return journalDue(disks[disk].journal);
+}
+
+static int journalRoomLocked(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    struct DiskJournal *j = disks[disk].journal;
+    if (!j) return DISK_INVALID_ARG;
+    return j->maxBlocks - j->count;
+}
+
+static int closeJournalLocked(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    Disk *d = &disks[disk];
+    struct DiskJournal *j = d->journal;
+    if (!j) return DISK_INVALID_ARG;
+
+    int result = journalCommit(d);
+    if (result == 0 && j->homeUnsynced){
+        // everything is home: empty the log so it is not replayed
+        char header[BLOCKSIZE];
+        BlockVec empty = {j->start, header};
+        memset(header, 0, BLOCKSIZE);
+        if (rawFlush(d, 1) < 0 || journalWriteThrough(d, &empty, 1) < 0 || rawFlush(d, 1) < 0)
+            result = DISK_ERR;
+    }
+    d->journal = NULL;
+    free(j->nums);
+    free(j->data);
+    free(j->slots);
+    free(j);
+    return result;
+}
+
+static int getJournalStatsLocked(int disk, DiskJournalStats *stats){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    if (!stats || !disks[disk].journal) return DISK_INVALID_ARG;
+    *stats = disks[disk].journal->stats;
     return 0;
+}
+
+//-------------------------------------------------------------
+/*                   Locked entry points                     */
+//-------------------------------------------------------------
+
+// Every per-disk call but readBlocksShared, mapBlock and getDiskBackend,
+// which only read what is fixed while the disk is open, runs its *Locked
+// body under the disk's lock.
+
+int closeDisk(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = closeDiskLocked(disk);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int readBlock(int disk, int bNum, void *block){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = readBlockLocked(disk, bNum, block);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int writeBlock(int disk, int bNum, void *block){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = writeBlockLocked(disk, bNum, block);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int readBlocks(int disk, int bNum, int nBlocks, void *blocks){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = readBlocksLocked(disk, bNum, nBlocks, blocks);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int writeBlocks(int disk, int bNum, int nBlocks, void *blocks){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = writeBlocksLocked(disk, bNum, nBlocks, blocks);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int readBlockList(int disk, BlockVec *list, int count){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = readBlockListLocked(disk, list, count);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int writeBlockList(int disk, BlockVec *list, int count){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = writeBlockListLocked(disk, list, count);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int queueReadBlock(int disk, int bNum, void *block){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = queueReadBlockLocked(disk, bNum, block);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
 
-}
\ No newline at end of file
+int queueWriteBlock(int disk, int bNum, void *block){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = queueWriteBlockLocked(disk, bNum, block);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int submitBlocks(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = submitBlocksLocked(disk);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int flushDisk(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = flushDiskLocked(disk);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int syncDisk(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = syncDiskLocked(disk);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int setCacheSize(int disk, int nBlocks){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = setCacheSizeLocked(disk, nBlocks);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int getCacheStats(int disk, DiskCacheStats *stats){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = getCacheStatsLocked(disk, stats);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int openJournal(int disk, int start, int nBlocks){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = openJournalLocked(disk, start, nBlocks);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int commitJournal(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = commitJournalLocked(disk);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int commitJournalIfDue(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = commitJournalIfDueLocked(disk);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int journalCommitDue(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = journalCommitDueLocked(disk);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int journalRoom(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = journalRoomLocked(disk);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int closeJournal(int disk){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = closeJournalLocked(disk);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
+
+int getJournalStats(int disk, DiskJournalStats *stats){
+    if (!validDisk(disk)) return DISK_INVALID_NUM;
+    pthread_mutex_lock(&disks[disk].lock);
+    int result = getJournalStatsLocked(disk, stats);
+    pthread_mutex_unlock(&disks[disk].lock);
+    return result;
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #define BLOCKSIZE 256
 #define DEFAULT_DISK_SIZE 10240
@@ -13,10 +14,86 @@
 #define DISK_INVALID_ARG -2
 #define DISK_INVALID_NUM -3
 
+#define DEFAULT_CACHE_BLOCKS 64 // blocks cached per disk unless changed
+#define JOURNAL_COMMIT_SECONDS 5 // oldest uncommitted write commitJournalIfDue lets wait
+
+// Disk backends: how a disk file is accessed underneath the block cache
+#define DISK_BACKEND_STDIO 0   // FILE * with fseek + fread/fwrite
+#define DISK_BACKEND_PIO   1   // file descriptor with positional pread/pwrite
+#define DISK_BACKEND_MMAP  2   // whole file mapped into memory, no block cache
+#define DISK_BACKEND_URING 3   // pread/pwrite plus an io_uring for queued batches (Linux)
+#define DEFAULT_DISK_BACKEND DISK_BACKEND_PIO
+
+// One cached block. Entries live on a per-disk LRU list (most recent at the
+// head) and are also chained into a hash bucket keyed by block number.
+typedef struct CacheEntry {
+    int bNum;                      // block number held, -1 if the entry is unused
+    int dirty;                     // 1 if data differs from the disk file
+    struct CacheEntry *prev;       // LRU neighbours
+    struct CacheEntry *next;
+    struct CacheEntry *hashNext;   // next entry in the same hash bucket
+    char data[BLOCKSIZE];
+} CacheEntry;
+
+#define DISK_QUEUE_DEPTH 64 // queued block requests submitted together
+
+// A block read or write waiting in a disk's submission queue
+typedef struct DiskRequest {
+    int bNum;
+    void *block;
+    int write;      // 1 for a write, 0 for a read
+} DiskRequest;
+
+struct DiskRing;    // io_uring state, private to libDisk.c
+struct DiskJournal; // write-ahead journal state, private to libDisk.c
+
+// One entry of a scatter list for readBlockList/writeBlockList
+typedef struct BlockVec {
+    int bNum;       // block number
+    void *block;    // BLOCKSIZE byte buffer for that block
+} BlockVec;
+
+typedef struct DiskCacheStats {
+    long hits;        // block accesses served from the cache
+    long misses;      // block accesses that had to go to the disk file
+    long writebacks;  // dirty blocks written to the disk file
+    long evictions;   // blocks dropped to make room for another block
+} DiskCacheStats;
+
+typedef struct DiskJournalStats {
+    long commits;     // groups written to the log
+    long logged;      // block images written to the log
+    long replayed;    // block images copied home from the log by openJournal
+    long overflows;   // groups committed because the next write did not fit
+} DiskJournalStats;
+
 typedef struct Disk {
-    FILE *fp;
+    FILE *fp;       // DISK_BACKEND_STDIO only
+    int fd;         // every backend but DISK_BACKEND_STDIO
+    char *map;      // DISK_BACKEND_MMAP only, size bytes long
+    struct DiskRing *ring;  // DISK_BACKEND_URING only
+    int backend;
     int size;
     int inUse;
+
+    // write-back LRU block cache (disabled when cacheBlocks is 0)
+    CacheEntry *cache;      // pool of cacheBlocks entries
+    CacheEntry **buckets;   // hash table, nBuckets is a power of two
+    int nBuckets;
+    int cacheBlocks;
+    int cacheUsed;
+    CacheEntry *lruHead;
+    CacheEntry *lruTail;
+    DiskCacheStats stats;
+
+    // requests queued by queueReadBlock/queueWriteBlock, not yet submitted
+    DiskRequest queue[DISK_QUEUE_DEPTH];
+    int queued;
+
+    // write-ahead journal, NULL unless openJournal was called
+    struct DiskJournal *journal;
+
+    pthread_mutex_t lock; // recursive, held by each call on the disk
 } Disk;
 
 /**
@@ -60,4 +137,281 @@ int readBlock(int disk, int bNum, void *block);
  */
 int writeBlock(int disk, int bNum, void *block);
 
+/**
+ * Reads a run of consecutive blocks into one buffer. Blocks not in the cache
+ * are fetched with a single vectored read.
+ * 
+ * @param disk    Disk index.
+ * @param bNum    First block number of the run.
+ * @param nBlocks Number of blocks in the run.
+ * @param blocks  Buffer of nBlocks * BLOCKSIZE bytes.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int readBlocks(int disk, int bNum, int nBlocks, void *blocks);
+
+/**
+ * Writes a run of consecutive blocks from one buffer with a single vectored
+ * write. The blocks go straight to the disk file; cached copies are updated.
+ * 
+ * @param disk    Disk index.
+ * @param bNum    First block number of the run.
+ * @param nBlocks Number of blocks in the run.
+ * @param blocks  Buffer of nBlocks * BLOCKSIZE bytes.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int writeBlocks(int disk, int bNum, int nBlocks, void *blocks);
+
+/**
+ * Reads a run of consecutive blocks straight from the disk file with
+ * positional reads, touching no state shared with other calls: not the
+ * cache, the queue, the journal or a file position. Several threads may
+ * call it at once on the same disk as long as nothing writes to the disk
+ * meanwhile. Dirty cached blocks and an uncommitted journal group are not
+ * seen, so call flushDisk (and commitJournal) first.
+ * 
+ * @param disk    Disk index.
+ * @param bNum    First block number of the run.
+ * @param nBlocks Number of blocks in the run.
+ * @param blocks  Buffer of nBlocks * BLOCKSIZE bytes.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int readBlocksShared(int disk, int bNum, int nBlocks, void *blocks);
+
+/**
+ * Reads a scatter list of blocks, each into its own buffer. Entries are
+ * served from the cache where possible; the rest are sorted by block number
+ * and every run of consecutive blocks is fetched with one vectored read.
+ * 
+ * @param disk  Disk index.
+ * @param list  Block numbers and buffers.
+ * @param count Number of entries in list.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int readBlockList(int disk, BlockVec *list, int count);
+
+/**
+ * Writes a scatter list of blocks, coalescing every run of consecutive block
+ * numbers into one vectored write. If a block appears more than once, the
+ * last entry wins.
+ * 
+ * @param disk  Disk index.
+ * @param list  Block numbers and buffers.
+ * @param count Number of entries in list.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int writeBlockList(int disk, BlockVec *list, int count);
+
+/**
+ * Queues a block read. The read is only guaranteed to have happened once
+ * submitBlocks returns, so the buffer must not be used before then. Blocks
+ * found in the cache are copied right away. Queued requests are submitted
+ * together, through io_uring on a DISK_BACKEND_URING disk; other backends
+ * carry them out synchronously.
+ * 
+ * @param disk  Disk index.
+ * @param bNum  Block number to read.
+ * @param block Buffer that receives the block.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int queueReadBlock(int disk, int bNum, void *block);
+
+/**
+ * Queues a block write. The buffer must stay unchanged until submitBlocks
+ * returns. Writes to a cached or journaled disk land in the cache or the
+ * journal group right away and are not batched here; they reach the disk
+ * file in batches when flushDisk writes the cache back (a full queue at a
+ * time on a DISK_BACKEND_URING disk) or the group commits, and one at a
+ * time when the cache evicts them.
+ * 
+ * @param disk  Disk index.
+ * @param bNum  Block number to write.
+ * @param block Data to write.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int queueWriteBlock(int disk, int bNum, void *block);
+
+/**
+ * Submits every queued request of a disk as one batch and polls for their
+ * completions. A full queue is submitted automatically, and readBlock /
+ * writeBlock submit pending requests before touching the disk.
+ * 
+ * @param disk Disk index.
+ * 
+ * @return 0 if every request succeeded, or an error code on failure.
+ */
+int submitBlocks(int disk);
+
+/**
+ * Writes every dirty cached block of a disk back to the disk file and hands
+ * buffered data to the operating system. Individual writeBlock calls never
+ * flush on their own.
+ * 
+ * @param disk Disk index.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int flushDisk(int disk);
+
+/**
+ * Flushes a disk and then forces its file contents to stable storage.
+ * 
+ * @param disk Disk index.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int syncDisk(int disk);
+
+/**
+ * Selects the backend used by disks opened after this call.
+ * 
+ * @param backend One of the DISK_BACKEND_* values.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int setDefaultDiskBackend(int backend);
+
+/**
+ * Returns a pointer straight into the mapping of a DISK_BACKEND_MMAP disk,
+ * so callers can read (or write) a block without copying it. Stores through
+ * the pointer update the disk just like writeBlock.
+ * 
+ * @param disk Disk index.
+ * @param bNum Block number.
+ * 
+ * @return Pointer to the block's BLOCKSIZE bytes, or NULL if the disk is not
+ *         memory mapped or bNum is out of range.
+ */
+void *mapBlock(int disk, int bNum);
+
+/**
+ * Reports which backend an open disk is using. A disk asked to use
+ * DISK_BACKEND_MMAP or DISK_BACKEND_URING reports DISK_BACKEND_PIO if the
+ * file could not be mapped or io_uring is unavailable.
+ * 
+ * @param disk Disk index.
+ * 
+ * @return The DISK_BACKEND_* value on success, or an error code on failure.
+ */
+int getDiskBackend(int disk);
+
+/**
+ * Resizes the block cache of an open disk. Dirty blocks are written back
+ * before the old cache is dropped.
+ * 
+ * @param disk    Disk index.
+ * @param nBlocks Number of blocks to cache (0 disables caching).
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int setCacheSize(int disk, int nBlocks);
+
+/**
+ * Sets the cache size given to disks opened after this call.
+ * 
+ * @param nBlocks Number of blocks to cache (0 disables caching).
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int setDefaultCacheSize(int nBlocks);
+
+/**
+ * Copies the cache counters of a disk.
+ * 
+ * @param disk  Disk index.
+ * @param stats Filled with the hit/miss/writeback/eviction counters.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int getCacheStats(int disk, DiskCacheStats *stats);
+
+/**
+ * Starts journaling a disk into the log region of nBlocks blocks at start.
+ * A group that was committed to the log but may not have reached its home
+ * blocks before a crash is first copied home. From then on every write is
+ * held in memory, and reads see it, until the group is committed: the
+ * blocks are written to the log with a checksummed header and forced to
+ * stable storage, and only then written to their home locations. A group
+ * is committed by commitJournal, by commitJournalIfDue between operations,
+ * or when it would no longer fit in the log. That last commit can end a
+ * group inside an operation, so a caller that needs whole operations in a
+ * group checks journalRoom first. mapBlock returns NULL while a disk is
+ * journaled.
+ * 
+ * @param disk    Disk index.
+ * @param start   First block of the log region.
+ * @param nBlocks Size of the log region (at least 3 blocks).
+ * 
+ * @return The number of blocks replayed, or an error code on failure.
+ */
+int openJournal(int disk, int start, int nBlocks);
+
+/**
+ * Commits the current group, if any, with one forced write to the log.
+ * 
+ * @param disk Disk index.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int commitJournal(int disk);
+
+/**
+ * Commits the current group if it holds half as many blocks as the log can
+ * take or its first write is JOURNAL_COMMIT_SECONDS old. Meant to be
+ * called between operations, so a group never ends inside one.
+ * 
+ * @param disk Disk index.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int commitJournalIfDue(int disk);
+
+/**
+ * Tells whether commitJournalIfDue would commit now, so a caller can wait
+ * for the end of concurrent operations first.
+ * 
+ * @param disk Disk index.
+ * 
+ * @return 1 if the group is due, 0 if not, or an error code on failure.
+ */
+int journalCommitDue(int disk);
+
+/**
+ * Tells how many more distinct blocks the current group can take before
+ * a write would commit it on its own. Rewriting a block already in the
+ * group takes no room.
+ * 
+ * @param disk Disk index.
+ * 
+ * @return The free room in blocks, or an error code if the disk is not
+ *         journaled.
+ */
+int journalRoom(int disk);
+
+/**
+ * Commits the current group, writes it home, empties the log and stops
+ * journaling. closeDisk does this for a journaled disk.
+ * 
+ * @param disk Disk index.
+ * 
+ * @return 0 on success, or an error code on failure.
+ */
+int closeJournal(int disk);
+
+/**
+ * Copies the journal counters of a disk.
+ * 
+ * @param disk  Disk index.
+ * @param stats Filled with the commit/logged/replayed/overflows counters.
+ * 
+ * @return 0 on success, or an error code if the disk is not journaled.
+ */
+int getJournalStats(int disk, DiskJournalStats *stats);
+
 #endif // LIBDISK_H
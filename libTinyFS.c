@@ -12,6 +12,12 @@
  * New functions added:
  *   - Timestamps:
  *       - tfs_readFileInfo
+ *   - In-place writes:
+ *       - tfs_writeAt
+ *       - tfs_append
+ *   - Bulk reads:
+ *       - tfs_read
+ *       - tfs_pread
  *   - Read-only and writeByte support:
  *       - tfs_makeRO
  *       - tfs_makeRW
@@ -22,8 +28,22 @@
  *   - Fragmentation:
  *      - tfs_displayFragments
  *      - tfs_defrag
+ *      - tfs_defragEx
+ *   - Online defragmentation:
+ *      - tfs_defragStep
+ *      - tfs_defragStart
+ *      - tfs_defragStop
+ *      - tfs_defragStatus
  *   - Consistency Checking:
  *      - tfs_checkConsistency
+ *      - tfs_check
+ *      - tfs_getCheckReport
+ *   - Background scrubbing:
+ *      - tfs_scrubStart
+ *      - tfs_scrubStop
+ *      - tfs_scrubStatus
+ *   - Volume handles:
+ *      - tfsv_mount, tfsv_unmount and a tfsv_* twin of every call above
  */
 
 #include <stdio.h>
@@ -33,11 +53,33 @@
 #include "libTinyFS.h"
 #include "TinyFS_errno.h"
 #include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 static int tfs_checkConsistency(void);
 
 
 #define MAX_OPEN_FILES 20
 #define MAX_INODES 1024
+#define SCAN_CHUNK DISK_QUEUE_DEPTH // blocks read per batch by full-volume scans
+#define BITMAP_BITS_PER_BLOCK ((BLOCKSIZE - 8) * 8) // blocks tracked by one bitmap block
+#define RELATIME_INTERVAL (24 * 60 * 60) // relatime refreshes an atime at most this often (seconds)
+#define FEATURE_DIRECTORY 0x02 // superblock feature bit: the volume has an on-disk directory
+#define DIR_ENTRY_SIZE 12      // 8 name bytes + 4 byte inode block number
+#define DIR_ENTRIES_PER_BLOCK ((BLOCKSIZE - 8) / DIR_ENTRY_SIZE)
+#define INODE_INDEXED 1        // inode byte 36: data reached through the block map
+#define DIRECT_POINTERS 52     // inode bytes 40-247
+#define POINTERS_PER_INDEX ((BLOCKSIZE - 4) / 4) // pointers in a type 7 index block
+#define INDEXED_PAYLOAD (BLOCKSIZE - 4)          // data bytes in a type 8 block
+#define MAX_INDEXED_BLOCKS (DIRECT_POINTERS + POINTERS_PER_INDEX + POINTERS_PER_INDEX * POINTERS_PER_INDEX)
+#define SUPER_CLEAN 0x01       // superblock byte 3: the volume was unmounted cleanly
+#define JOURNAL_MIN_BLOCKS 16  // journal region size bounds for TFS_MKFS_JOURNAL
+#define JOURNAL_MAX_BLOCKS 256
+#define INODE_LOCKS 256        // reader/writer locks per volume, picked by inode block
+#define MAGAZINES 16           // free-block magazines per volume, one per thread
+#define MAGAZINE_BATCH 32      // most blocks one request takes from a magazine
+#define MAGAZINE_SIZE (4 * MAGAZINE_BATCH)
 
 //-------------------------------------------------------------
 /*                   Core Features                           */
@@ -50,22 +92,288 @@ typedef struct {
     int r, g, b;        // Persistent color (stored in the inode as well)
 } InodeColor;
 
-static InodeColor inodeColors[MAX_INODES];
-static int inodeCount = 0;
-
-
 // Open file table entry
 typedef struct OpenFile {
     int inodeBlock;    // block number where the inode block is stored
     int filePointer;   // Current file pointer (in bytes).
     int used;          // 1 if used, 0 otherwise.
+    int cursorIndex;   // Logical index of the data block at the cursor, -1 if none.
+    int cursorBlock;   // Block number of that data block.
+    char cursorData[BLOCKSIZE]; // Cached copy of that data block.
+    int pendingAtime;  // Access time still to be written to the inode, 0 if none.
+    pthread_mutex_t lock; // held by the call using the descriptor, see lockFile
 } OpenFile;
 
-static OpenFile openFileTable[MAX_OPEN_FILES];
+// Name -> inode block hash entry, see nameIndex below
+typedef struct {
+    char name[8];   // zero padded, not terminated
+    int inodeBlock;
+    int dirSlot;    // directory entry naming the inode
+} NameEntry;
+
+// A thread's stock of free blocks, see takeFreeBlocks. Its blocks are off
+// the free list (or clear in the bitmap) and counted in reservedBlocks
+// instead of freeBlockCount until they are taken or drained back.
+typedef struct {
+    int busy;       // set while a thread uses it
+    int count;
+    int blocks[MAGAZINE_SIZE]; // taken from the top
+} Magazine;
+
+// Everything TinyFS knows about one mounted volume. tfsv_mount allocates
+// one per volume; the tfs_* calls share defaultVolume.
+struct TfsVolume {
+    // File operations share the volume lock; mount, unmount, sync, check,
+    // defrag and the scrubber's batches hold it alone. Under it, a file is
+    // guarded by inodeLocks[inode block % INODE_LOCKS]: readers share it and
+    // writers of the file take it alone. metaLock (recursive) covers the
+    // allocator, the superblock copy, bitmap, name index, directory, inode
+    // colours and open file table slots, only for as long as they change;
+    // it is taken after an inode lock, never before.
+    pthread_rwlock_t lock;
+    pthread_rwlock_t inodeLocks[INODE_LOCKS];
+    pthread_mutex_t metaLock;
+
+    InodeColor inodeColors[MAX_INODES];
+    int inodeCount;
+    OpenFile openFileTable[MAX_OPEN_FILES];
+
+    int mountedDisk;    // libDisk disk number, -1 while unmounted
+    int totalBlocks;
+    int isMounted;      // will be set to 1 when mounted
+    int mountFlags;     // TFS_MOUNT_* flags of the current mount
+    int uncheckedDirty; // mounted dirty without a check; unmount leaves it dirty
+    TfsMountStats mountStats;
+    TfsCheckReport lastCheck; // of the last consistency check
+
+    // In-memory copy of the mounted superblock and the number of blocks on
+    // the free list. Both are loaded at mount and kept current by the
+    // allocator; the superblock is only written back by syncSuperBlock().
+    char mountedSuper[BLOCKSIZE];
+    int freeBlockCount;
+    int superDirty;
+
+    // Free-space bitmap, used instead of the free list when the volume was
+    // made with TFS_MKFS_BITMAP. freeMap has one bit per block, set while
+    // the block is free; the on-disk copy is bitmapBlocks type-5 blocks
+    // from bitmapStart. Bitmap blocks flagged in mapDirty, all within
+    // [dirtyLo, dirtyHi], are written back by syncSuperBlock().
+    int useBitmap;
+    uint64_t *freeMap;
+    int mapWords;
+    int bitmapStart;
+    int bitmapBlocks;
+    unsigned char *mapDirty;
+    int dirtyLo, dirtyHi;
+    int allocHint;      // block where the next single-block search starts
+
+    // Free blocks set aside for the threads writing small files. A thread
+    // takes from and frees into its own magazine without the metadata
+    // lock; magazines refill from and drain to the free space above in
+    // batches under it, and are emptied before anything reads the free
+    // space as a whole (sync, check, defrag, unmount). A crash leaves
+    // their blocks for the next check to put back. Off (magazinesOn 0)
+    // where draining one could write more than a journal step may.
+    Magazine magazines[MAGAZINES];
+    int reservedBlocks; // blocks in magazines, updated atomically
+    int magazinesOn;
+
+    // Journal region of a volume made with TFS_MKFS_JOURNAL, journalBlocks
+    // blocks from journalStart (0 blocks otherwise). The disk layer owns
+    // its contents, so the scans leave it alone.
+    int journalStart;
+    int journalBlocks;
+
+    // Journal steps, see beginLog: a group only ends while logHandles is 0.
+    pthread_mutex_t logLock;
+    pthread_cond_t logIdle;  // a step ended or the group was committed
+    int logHandles;     // steps under way
+    int logCredits;     // log blocks they have reserved
+    int logWaiting;     // set while a step waits for the group to end
+    int logCapacity;    // blocks an empty group holds, 0 when not journaled
+    int stepBlocks;     // data blocks one step of a large write may cover
+
+    // Name -> inode block hash index, built at mount and kept current by
+    // every operation that creates, renames, moves or deletes an inode.
+    // Open addressing with linear probing; inodeBlock 0 marks an empty slot
+    // and -1 a deleted one.
+    NameEntry *nameIndex;
+    int nameSlots;      // capacity, a power of two
+    int nameUsed;       // live and deleted slots
+
+    // In-memory copy of the directory chain: dirBlocks[i] is the block
+    // number of the i-th directory block and dirData[i] its contents.
+    // Directory slot s is entry s % DIR_ENTRIES_PER_BLOCK of block
+    // s / DIR_ENTRIES_PER_BLOCK.
+    int *dirBlocks;
+    char (*dirData)[BLOCKSIZE];
+    int dirBlockCount;
+    int dirCapacity;
+    int dirFreeHint;    // no empty slot before this one
+
+    // Background scrubber, see tfs_scrubStart
+    pthread_t scrubThread;
+    pthread_mutex_t scrubLock; // guards scrubRunning, scrubStopping
+    pthread_cond_t scrubWake;
+    int scrubRunning;
+    int scrubStopping;
+    int scrubRate;
+    // Progress, under the volume lock
+    int scrubPosition;
+    long scrubPasses;
+    long scrubBlocksRead;
+    TfsCheckReport scrubPass;     // the pass in progress
+    TfsCheckReport scrubLastPass; // the last complete pass
+
+    // Online defragmentation, see tfs_defragStep and tfs_defragStart. The
+    // directory slot it resumes at is kept in the superblock.
+    pthread_t defragThread;
+    pthread_mutex_t defragLock; // guards defragRunning, defragStopping, defragFinished
+    pthread_cond_t defragWake;
+    int defragRunning;   // the thread has been started and not yet joined
+    int defragStopping;
+    int defragFinished;  // it ended on its own after a clean pass
+    int defragMicros;
+    // Progress, under the volume lock
+    int defragPassWhole; // the current pass started at slot 0 during this mount
+    long defragPassMoved;
+    long defragPasses;
+    long defragBlocksMoved;
+    long defragLongestMicros;
+};
+
+static tfs_volume defaultVolume;
+static pthread_once_t defaultVolumeOnce = PTHREAD_ONCE_INIT;
+
+// The volume the calling thread works on: set by enterVolume for the
+// length of an entry point, and for good in the threads a volume starts.
+static __thread tfs_volume *vol = NULL;
+
+static void initVolume(tfs_volume *v){
+    pthread_mutexattr_t attr;
+    pthread_rwlockattr_t rwAttr;
+    int i;
+    memset(v, 0, sizeof(*v));
+    pthread_rwlockattr_init(&rwAttr);
+#ifdef __GLIBC__
+    // no lock is read-locked twice by one thread, so writers can go first
+    pthread_rwlockattr_setkind_np(&rwAttr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&v->lock, &rwAttr);
+    for (i = 0; i < INODE_LOCKS; i++) pthread_rwlock_init(&v->inodeLocks[i], &rwAttr);
+    pthread_rwlockattr_destroy(&rwAttr);
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&v->metaLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    for (i = 0; i < MAX_OPEN_FILES; i++) pthread_mutex_init(&v->openFileTable[i].lock, NULL);
+    pthread_mutex_init(&v->scrubLock, NULL);
+    pthread_cond_init(&v->scrubWake, NULL);
+    pthread_mutex_init(&v->defragLock, NULL);
+    pthread_cond_init(&v->defragWake, NULL);
+    pthread_mutex_init(&v->logLock, NULL);
+    pthread_cond_init(&v->logIdle, NULL);
+    v->mountedDisk = -1;
+    v->isMounted = -1;
+    v->dirtyLo = v->dirtyHi = -1;
+}
+
+static void destroyVolume(tfs_volume *v){
+    int i;
+    pthread_cond_destroy(&v->logIdle);
+    pthread_mutex_destroy(&v->logLock);
+    pthread_cond_destroy(&v->defragWake);
+    pthread_mutex_destroy(&v->defragLock);
+    pthread_cond_destroy(&v->scrubWake);
+    pthread_mutex_destroy(&v->scrubLock);
+    pthread_mutex_destroy(&v->metaLock);
+    for (i = 0; i < MAX_OPEN_FILES; i++) pthread_mutex_destroy(&v->openFileTable[i].lock);
+    for (i = 0; i < INODE_LOCKS; i++) pthread_rwlock_destroy(&v->inodeLocks[i]);
+    pthread_rwlock_destroy(&v->lock);
+}
+
+static void initDefaultVolume(void){
+    initVolume(&defaultVolume);
+}
+
+static tfs_volume *getDefaultVolume(void){
+    pthread_once(&defaultVolumeOnce, initDefaultVolume);
+    return &defaultVolume;
+}
+
+// How an entry point holds the volume lock
+#define VOLUME_READ 0      // shared
+#define VOLUME_UPDATE 1    // shared, by a call that writes in journal steps (see beginLog)
+#define VOLUME_EXCLUSIVE 2 // alone
+
+// Takes the lock of v as mode says and makes v the calling thread's
+// volume. Returns the volume that was current before, for leaveVolume.
+static tfs_volume *enterVolume(tfs_volume *v, int mode){
+    tfs_volume *previous = vol;
+    if (mode == VOLUME_EXCLUSIVE)
+        pthread_rwlock_wrlock(&v->lock);
+    else
+        pthread_rwlock_rdlock(&v->lock);
+    vol = v;
+    return previous;
+}
+
+static void leaveVolume(tfs_volume *previous){
+    tfs_volume *v = vol;
+    vol = previous;
+    pthread_rwlock_unlock(&v->lock);
+}
+
+static void lockMeta(void){
+    pthread_mutex_lock(&vol->metaLock);
+}
+
+static void unlockMeta(void){
+    pthread_mutex_unlock(&vol->metaLock);
+}
+
+static void lockInode(int inodeBlock, int write){
+    pthread_rwlock_t *lock = &vol->inodeLocks[inodeBlock % INODE_LOCKS];
+    if (write) pthread_rwlock_wrlock(lock);
+    else pthread_rwlock_rdlock(lock);
+}
+
+static void unlockInode(int inodeBlock){
+    pthread_rwlock_unlock(&vol->inodeLocks[inodeBlock % INODE_LOCKS]);
+}
+
+// Locks the inode of the file open as FD for reading or writing, then the
+// descriptor itself: its file pointer, cursor and pending access time
+// belong to one call at a time, while calls on other descriptors of the
+// file share a read lock. The descriptor is looked up again once both are
+// held, in case it was closed and reopened on another file meanwhile; it
+// cannot be closed while its lock is held. Returns the inode block for
+// unlockFile, or -1 (and locks nothing) if FD is not open; the operation
+// then reports the bad descriptor itself.
+static int lockFile(fileDescriptor FD, int write){
+    if (FD < 0 || FD >= MAX_OPEN_FILES) return -1;
+    OpenFile *file = &vol->openFileTable[FD];
+    while (1) {
+        lockMeta();
+        int inodeBlock = file->used ? file->inodeBlock : -1;
+        unlockMeta();
+        if (inodeBlock <= 0) return -1;
+        lockInode(inodeBlock, write);
+        pthread_mutex_lock(&file->lock);
+        lockMeta();
+        int same = file->used && file->inodeBlock == inodeBlock;
+        unlockMeta();
+        if (same) return inodeBlock;
+        pthread_mutex_unlock(&file->lock);
+        unlockInode(inodeBlock);
+    }
+}
 
-static int mountedDisk = -1;
-static int totalBlocks = 0;
-static int isMounted = -1;  // will be set to 1 when mounted
+static void unlockFile(fileDescriptor FD, int inodeBlock){
+    if (inodeBlock <= 0) return;
+    pthread_mutex_unlock(&vol->openFileTable[FD].lock);
+    unlockInode(inodeBlock);
+}
 
 unsigned int get_seed() {
     struct timespec ts;
@@ -89,972 +397,4562 @@ static int bytesToInt(const char *src) {
            ((unsigned char)src[3]);
 }
 
+// Returns a read-only view of a block: a pointer into the disk mapping when
+// the disk is memory mapped, otherwise scratch filled by readBlock.
+// Returns NULL if the block cannot be read.
+static const char *peekBlock(int bNum, char *scratch){
+    const char *mapped = mapBlock(vol->mountedDisk, bNum);
+    if (mapped) return mapped;
+    if (readBlock(vol->mountedDisk, bNum, scratch) < 0) return NULL;
+    return scratch;
+}
+
+// Returns a read-only view of up to SCAN_CHUNK consecutive blocks starting
+// at first (count is clipped to SCAN_CHUNK): the disk mapping itself when the
+// disk is memory mapped, otherwise scratch filled by one vectored read.
+// Returns NULL if the blocks cannot be read.
+static const char *peekBlocks(int first, int count, char *scratch){
+    if (count > SCAN_CHUNK) count = SCAN_CHUNK;
+    const char *mapped = mapBlock(vol->mountedDisk, first);
+    if (mapped && mapBlock(vol->mountedDisk, first + count - 1)) return mapped;
+    if (readBlocks(vol->mountedDisk, first, count, scratch) < 0) return NULL;
+    return scratch;
+}
+
 static void clearOpenFileTable() {
     int i;
     for(i = 0; i < MAX_OPEN_FILES; i++){
-        openFileTable[i].used = 0;
+        vol->openFileTable[i].used = 0;
+        vol->openFileTable[i].cursorIndex = -1;
+        vol->openFileTable[i].pendingAtime = 0;
     }
 }
 
-// Returns location of next free block and updates the superblock's free block pointer 
-static int getFreeBlock(){
-    char superBlock[BLOCKSIZE];
-    char freeBlock[BLOCKSIZE];
+// Drops the cursor of every descriptor open on inodeBlock (every
+// descriptor if inodeBlock is -1), after its data chain has changed.
+static void invalidateCursors(int inodeBlock){
+    int i;
+    lockMeta();
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (inodeBlock < 0 || vol->openFileTable[i].inodeBlock == inodeBlock)
+            vol->openFileTable[i].cursorIndex = -1;
+    }
+    unlockMeta();
+}
 
-    if (readBlock(mountedDisk, 0, superBlock) < 0) return -1; // read superblock
-    
-    int nextFreeBlockLocation = bytesToInt(superBlock+4); // location of next free block
-    if (nextFreeBlockLocation == 0) return -1; // no free blocks available
+static int syncSuperBlock();
+
+// Journal steps. On a journaled volume every change is made in steps that
+// each leave the volume consistent, and a journal group only ends between
+// steps, so a crash loses whole steps. An operation that fits the log is
+// one step; a larger write or delete is cut into several (see
+// writeRangeLogged and truncateLogged), each of which it could have
+// stopped after. A step reserves log room for every block it may write
+// before it writes any: beginLog waits, if the group lacks that room or is
+// due, until the running steps end and commits it. A step starts with its
+// inode locks held and the metadata lock free, and takes no inode lock
+// after. Steps of one thread do not nest; an inner beginLog is covered by
+// the outer one. Data blocks go through the log with the metadata: a
+// chained data block holds the next pointer, and a block one step frees
+// may take another file's data in the next, so writing data home ahead of
+// its group could overwrite a block the committed state still uses.
+static __thread int logDepth = 0; // steps the calling thread is in
+static __thread int logHeld = 0;  // credits its outermost step reserved
+
+static void beginLog(int credits){
+    if (vol->logCapacity == 0 || logDepth++ > 0) return;
+    if (credits > vol->logCapacity) credits = vol->logCapacity;
+    pthread_mutex_lock(&vol->logLock);
+    while (1) {
+        int room = journalRoom(vol->mountedDisk);
+        if (room < 0) break; // the journal is suspended, see defragExLocked
+        int wanted = vol->logWaiting || room - vol->logCredits < credits ||
+                     journalCommitDue(vol->mountedDisk) > 0;
+        if (!wanted) break;
+        if (vol->logHandles == 0) {
+            lockMeta();
+            syncSuperBlock();
+            unlockMeta();
+            commitJournal(vol->mountedDisk);
+            vol->logWaiting = 0;
+            pthread_cond_broadcast(&vol->logIdle);
+            break;
+        }
+        vol->logWaiting = 1;
+        pthread_cond_wait(&vol->logIdle, &vol->logLock);
+    }
+    vol->logHandles++;
+    vol->logCredits += credits;
+    logHeld = credits;
+    pthread_mutex_unlock(&vol->logLock);
+}
 
-    if(readBlock(mountedDisk, nextFreeBlockLocation, freeBlock) < 0) return -1; // read the free block
+// Ends the calling thread's step, with the superblock and bitmap blocks
+// it changed written into the group first.
+static void endLog(void){
+    if (vol->logCapacity == 0 || --logDepth > 0) return;
+    lockMeta();
+    syncSuperBlock();
+    unlockMeta();
+    pthread_mutex_lock(&vol->logLock);
+    vol->logHandles--;
+    vol->logCredits -= logHeld;
+    logHeld = 0;
+    if (vol->logHandles == 0) pthread_cond_broadcast(&vol->logIdle);
+    pthread_mutex_unlock(&vol->logLock);
+}
 
-    int freeBlockLocation = nextFreeBlockLocation; // store current free block location
-    nextFreeBlockLocation = bytesToInt(freeBlock+4); // get next free block from free block's pointer
-    intToBytes(nextFreeBlockLocation, superBlock+4); // update superblock
+// Log credits of a step that writes `writes` blocks of its own (data,
+// index, inode, directory and freed blocks) and takes or frees `changes`
+// blocks: those, the superblock, and the bitmap blocks the changes may
+// dirty. With magazines on, a step may drain any of them, so every bitmap
+// block counts.
+static int logCredits(int writes, int changes){
+    int bitmap = 0;
+    if (vol->useBitmap && changes > 0)
+        bitmap = (vol->magazinesOn || changes > vol->bitmapBlocks) ? vol->bitmapBlocks : changes;
+    return writes + 1 + bitmap;
+}
 
-    if (writeBlock(mountedDisk, 0, superBlock) < 0) return -1; // write back superblock
+// Log credits of one step of a large write, truncation or delete covering
+// blocks data blocks: those, the index blocks over them and the blocks
+// freed with them, and a few inode, chain and index block rewrites.
+static int stepCredits(int blocks){
+    int index = blocks / POINTERS_PER_INDEX + 2;
+    return logCredits(blocks + index + 6, blocks + index);
+}
 
-    return freeBlockLocation;
+// Raises the access time stored in the inode at inodeBlock to atime. The
+// inode is read again and written under metaLock, so readers of the file,
+// who share its inode lock, never write back each other's older copies.
+static void storeAtime(int inodeBlock, int atime){
+    char inode[BLOCKSIZE];
+    lockMeta();
+    if (readBlock(vol->mountedDisk, inodeBlock, inode) == 0 && bytesToInt(inode+28) < atime) {
+        intToBytes(atime, inode+28);
+        writeBlock(vol->mountedDisk, inodeBlock, inode);
+    }
+    unlockMeta();
 }
 
-// Marks the block at blockNum as free and sets the superblock's free block pointer to it
-static int addFreeBlock(int blockNum){
-    char superBlock[BLOCKSIZE];
-    char freeBlock[BLOCKSIZE];
+// Records a read through FD of the file whose inode has been read into
+// inodeBlock, according to the mount's access time mode:
+// - default: the access time is written to the inode right away;
+// - TFS_MOUNT_RELATIME: only when the stored one is older than the
+//   modification time or than RELATIME_INTERVAL, and then it is kept on
+//   the descriptor and written by flushAtime() at close or unmount;
+// - TFS_MOUNT_NOATIME: never.
+static void touchAtime(fileDescriptor FD, char *inodeBlock){
+    if (vol->mountFlags & TFS_MOUNT_NOATIME) return;
 
-    if(readBlock(mountedDisk, 0, superBlock) < 0) return -1;
+    int now = (int)time(NULL);
+    if (vol->mountFlags & TFS_MOUNT_RELATIME) {
+        int accessTime = bytesToInt(inodeBlock+28);
+        if (accessTime < bytesToInt(inodeBlock+24) || now - accessTime >= RELATIME_INTERVAL)
+            vol->openFileTable[FD].pendingAtime = now;
+        return;
+    }
+    intToBytes(now, inodeBlock+28);
+    beginLog(logCredits(1, 0));
+    storeAtime(vol->openFileTable[FD].inodeBlock, now);
+    endLog();
+}
 
-    int currentNextFreeLocation = bytesToInt(superBlock+4);
-    memset(freeBlock, 0, BLOCKSIZE);
-    freeBlock[0] = 4; // free block type
-    freeBlock[1] = 0x44;
-    intToBytes(currentNextFreeLocation, freeBlock+4);
+// Writes FD's deferred access time to its inode.
+static void flushAtime(fileDescriptor FD){
+    OpenFile *file = &vol->openFileTable[FD];
+    if (file->pendingAtime == 0) return;
 
-    if (writeBlock(mountedDisk, blockNum, freeBlock) < 0 ) return -1;
-    
-    intToBytes(blockNum, superBlock+4);
-    if (writeBlock(mountedDisk, 0, superBlock) < 0) return -1;
+    storeAtime(file->inodeBlock, file->pendingAtime);
+    file->pendingAtime = 0;
+}
 
-    return 0; 
+static int isIndexed(const char *inode){
+    return inode[36] == INODE_INDEXED;
 }
 
-static int getFreeBlockCount(){
-    if (mountedDisk < 0) return -1;
+// Where file data starts in the data blocks of inode, and how much fits.
+static int payloadOffset(const char *inode){
+    return isIndexed(inode) ? 4 : 8;
+}
 
-    int freeBlockCount = 0;
-    char block[BLOCKSIZE];
-    int i;
-    for(i = 0; i < totalBlocks; i++){
-        if(readBlock(mountedDisk, i, block) < 0) return -1;
-        if(block[0] == 4) freeBlockCount++;
+static int payloadSize(const char *inode){
+    return BLOCKSIZE - payloadOffset(inode);
+}
+
+// Number of index blocks an indexed file with dataBlocks data blocks needs:
+// the single indirect block, then the double indirect block and its children.
+static int indexBlocksFor(int dataBlocks){
+    if (dataBlocks <= DIRECT_POINTERS) return 0;
+    dataBlocks -= DIRECT_POINTERS;
+    if (dataBlocks <= POINTERS_PER_INDEX) return 1;
+    dataBlocks -= POINTERS_PER_INDEX;
+    return 2 + (dataBlocks + POINTERS_PER_INDEX - 1) / POINTERS_PER_INDEX;
+}
+
+// Data and index blocks a file of size bytes takes in inode's layout.
+static int fileBlocksFor(const char *inode, int size){
+    int dataBlocks = (size + payloadSize(inode) - 1) / payloadSize(inode);
+    return isIndexed(inode) ? dataBlocks + indexBlocksFor(dataBlocks) : dataBlocks;
+}
+
+// Block number of data block blockIndex of an indexed file, read through at
+// most two index blocks. Returns 0 past the end of the map and -1 on error.
+static int indexedBlockAt(const char *inode, int blockIndex){
+    char scratch[BLOCKSIZE];
+    const char *index;
+    if (blockIndex < 0) return -1;
+    if (blockIndex < DIRECT_POINTERS) return bytesToInt(inode + 40 + blockIndex * 4);
+    blockIndex -= DIRECT_POINTERS;
+
+    int indirect;
+    if (blockIndex < POINTERS_PER_INDEX) {
+        indirect = bytesToInt(inode + 248);
+    } else {
+        blockIndex -= POINTERS_PER_INDEX;
+        if (blockIndex >= POINTERS_PER_INDEX * POINTERS_PER_INDEX) return 0;
+        int twoLevel = bytesToInt(inode + 252);
+        if (twoLevel == 0) return 0;
+        if (!(index = peekBlock(twoLevel, scratch))) return -1;
+        indirect = bytesToInt(index + 4 + (blockIndex / POINTERS_PER_INDEX) * 4);
+        blockIndex %= POINTERS_PER_INDEX;
     }
-    return freeBlockCount;
+    if (indirect == 0) return 0;
+    if (!(index = peekBlock(indirect, scratch))) return -1;
+    return bytesToInt(index + 4 + blockIndex * 4);
 }
 
-// Generate random RGB colors
-void generateRandomColor(int *r, int *g, int *b) {
-    srand(get_seed());
-    *r = rand() % 256;
-    *g = rand() % 256;
-    *b = rand() % 256;
+// Writes an index block holding pointers[0..count) to blockNum.
+static int writeIndexBlock(int blockNum, const int *pointers, int count){
+    char block[BLOCKSIZE];
+    int i;
+    memset(block, 0, BLOCKSIZE);
+    block[0] = 7; // index block type
+    block[1] = 0x44;
+    for (i = 0; i < count; i++) intToBytes(pointers[i], block + 4 + i * 4);
+    return writeBlock(vol->mountedDisk, blockNum, block);
 }
 
-// Add a mapping entry if one for this inode does not already exist.
-void addMapping(int inodeBlock, char *name, int firstDataBlock, int r, int g, int b) {
-    // Check if already exists.
+// Points inode's block map at the data blocks data[0..dataCount) and writes
+// the index blocks that takes to the indexBlocksFor(dataCount) blocks in
+// indexBlocks[]. Entries before from are as the index blocks already hold
+// them, so only those holding later entries (and the double indirect
+// block) are written. The inode itself is left for the caller to write.
+static int writeBlockMap(char *inode, const int *data, int dataCount, const int *indexBlocks, int from){
     int i;
-    for (i = 0; i < inodeCount; i++) {
-        if (inodeColors[i].inodeIndex == inodeBlock) {
-            return; // already exists, do nothing.
-        }
+    memset(inode + 40, 0, BLOCKSIZE - 40);
+    for (i = 0; i < dataCount && i < DIRECT_POINTERS; i++)
+        intToBytes(data[i], inode + 40 + i * 4);
+    if (dataCount <= DIRECT_POINTERS) return 0;
+    data += DIRECT_POINTERS;
+    dataCount -= DIRECT_POINTERS;
+    from -= DIRECT_POINTERS;
+
+    int count = dataCount < POINTERS_PER_INDEX ? dataCount : POINTERS_PER_INDEX;
+    if (from < POINTERS_PER_INDEX && writeIndexBlock(indexBlocks[0], data, count) < 0) return -1;
+    intToBytes(indexBlocks[0], inode + 248);
+    if (dataCount <= POINTERS_PER_INDEX) return 0;
+    data += POINTERS_PER_INDEX;
+    dataCount -= POINTERS_PER_INDEX;
+    from -= POINTERS_PER_INDEX;
+
+    // children first, so no index block points at one not yet written
+    int children = (dataCount + POINTERS_PER_INDEX - 1) / POINTERS_PER_INDEX;
+    for (i = 0; i < children; i++) {
+        if (from >= (i + 1) * POINTERS_PER_INDEX) continue;
+        count = dataCount - i * POINTERS_PER_INDEX;
+        if (count > POINTERS_PER_INDEX) count = POINTERS_PER_INDEX;
+        if (writeIndexBlock(indexBlocks[2 + i], data + i * POINTERS_PER_INDEX, count) < 0) return -1;
     }
-    if (inodeCount < MAX_INODES) {
-        strncpy(inodeColors[inodeCount].name, name, 8);
-        inodeColors[inodeCount].name[8] = '\0';
-        inodeColors[inodeCount].inodeIndex = inodeBlock;
-        inodeColors[inodeCount].firstDataBlock = firstDataBlock;
-        inodeColors[inodeCount].r = r;
-        inodeColors[inodeCount].g = g;
-        inodeColors[inodeCount].b = b;
-        inodeCount++;
+    if (writeIndexBlock(indexBlocks[1], indexBlocks + 2, children) < 0) return -1;
+    intToBytes(indexBlocks[1], inode + 252);
+    return 0;
+}
+
+// A growable list of block numbers.
+typedef struct {
+    int *blocks;
+    int count;
+    int capacity;
+} BlockList;
+
+static int appendBlock(BlockList *list, int blockNum){
+    if (list->count == list->capacity) {
+        int grown = list->capacity ? list->capacity * 2 : 16;
+        int *blocks = realloc(list->blocks, grown * sizeof(int));
+        if (!blocks) return -1;
+        list->blocks = blocks;
+        list->capacity = grown;
     }
+    list->blocks[list->count++] = blockNum;
+    return 0;
 }
 
-// Remove a mapping entry by inode block number.
-void removeMapping(int inodeBlock) {
+// Appends the pointers of index block blockNum to data and, for the double
+// indirect block, appends each child to index followed by its pointers.
+static int collectIndexBlock(int blockNum, int nested, BlockList *data, BlockList *index){
+    char scratch[BLOCKSIZE];
+    const char *block = peekBlock(blockNum, scratch);
+    int pointers[POINTERS_PER_INDEX];
     int i;
-    for (i = 0; i < inodeCount; i++) {
-        if (inodeColors[i].inodeIndex == inodeBlock) {
-            int j;
-            for (j = i; j < inodeCount - 1; j++) {
-                inodeColors[j] = inodeColors[j + 1];
-            }
-            inodeCount--;
-            return;
-        }
+    if (!block) return -1;
+    for (i = 0; i < POINTERS_PER_INDEX; i++) pointers[i] = bytesToInt(block + 4 + i * 4);
+    for (i = 0; i < POINTERS_PER_INDEX; i++) {
+        if (pointers[i] == 0) continue;
+        if (appendBlock(nested ? index : data, pointers[i]) < 0) return -1;
+        if (nested && collectIndexBlock(pointers[i], 0, data, index) < 0) return -1;
     }
+    return 0;
 }
 
-// Given a data block number, determine the owning file by checking each mapping's chain.
-InodeColor *getOwnerForDataBlock(int dataBlock) {
-    if (dataBlock == 0) return NULL;
+// Lists the blocks of the file whose inode is given: its data blocks in
+// file order go to data, and the index blocks of an indexed file to index
+// in the order writeBlockMap takes them (single indirect, double indirect,
+// then its children). index may be data itself, in which case each index
+// block comes just before the blocks it points at. On failure the lists
+// are freed.
+static int collectFileBlocks(const char *inode, BlockList *data, BlockList *index){
+    int result = 0;
     int i;
-    char tempBlock[BLOCKSIZE];
-    for (i = 0; i < inodeCount; i++) {
-        int current = inodeColors[i].firstDataBlock;
-        while (current != 0) {
-            if (current == dataBlock) return &inodeColors[i];
-            if (readBlock(mountedDisk, current, tempBlock) < 0) break;
-            current = bytesToInt(tempBlock + 4);
+    if (isIndexed(inode)) {
+        for (i = 0; i < DIRECT_POINTERS && result == 0; i++) {
+            int blockNum = bytesToInt(inode + 40 + i * 4);
+            if (blockNum != 0) result = appendBlock(data, blockNum);
+        }
+        for (i = 0; i < 2 && result == 0; i++) {
+            int blockNum = bytesToInt(inode + 248 + i * 4);
+            if (blockNum == 0) continue;
+            result = appendBlock(index, blockNum);
+            if (result == 0) result = collectIndexBlock(blockNum, i, data, index);
+        }
+    } else {
+        char scratch[BLOCKSIZE];
+        int current = bytesToInt(inode + 16);
+        while (current != 0 && result == 0) {
+            const char *dataBlock = peekBlock(current, scratch);
+            if (!dataBlock) break;
+            result = appendBlock(data, current);
+            current = bytesToInt(dataBlock + 4);
         }
     }
-    return NULL;
+    if (result < 0) {
+        free(data->blocks);
+        if (index != data) free(index->blocks);
+        return -1;
+    }
+    return 0;
 }
 
-/* tfs_mkfs:
-   - Checks that nBytes is > 0 and a multiple of BLOCKSIZE.
-   - Initializes the superblock and free blocks.
-   Returns TFS_SUCCESS on success or TFS_ERR_MKFS on failure.
-*/
-int tfs_mkfs(char *filename, int nBytes){
-    if(nBytes <= 0 || nBytes % BLOCKSIZE != 0)
-         return TFS_ERR_MKFS;
+// Moves FD's cursor to the data block with logical index blockIndex of the
+// file whose inode is given and returns the cached copy of it, or NULL.
+// An indexed file goes straight to the block through its map, reading at
+// most two index blocks. A chain is walked from the cursor when it is at or
+// before blockIndex, so sequential access and forward seeks cost one block
+// read per block crossed; going backwards restarts from the first block.
+static const char *seekCursor(fileDescriptor FD, const char *inode, int blockIndex){
+    OpenFile *file = &vol->openFileTable[FD];
+    if (isIndexed(inode)) {
+        if (file->cursorIndex == blockIndex) return file->cursorData;
+        file->cursorIndex = -1;
+        int blockNum = indexedBlockAt(inode, blockIndex);
+        if (blockNum <= 0 || readBlock(vol->mountedDisk, blockNum, file->cursorData) < 0)
+            return NULL;
+        file->cursorBlock = blockNum;
+        file->cursorIndex = blockIndex;
+        return file->cursorData;
+    }
+    int firstDataBlock = bytesToInt(inode + 16);
+    if (file->cursorIndex < 0 || file->cursorIndex > blockIndex) {
+        file->cursorIndex = -1;
+        if (firstDataBlock == 0 || readBlock(vol->mountedDisk, firstDataBlock, file->cursorData) < 0)
+            return NULL;
+        file->cursorBlock = firstDataBlock;
+        file->cursorIndex = 0;
+    }
+    while (file->cursorIndex < blockIndex) {
+        int next = bytesToInt(file->cursorData + 4);
+        if (next == 0 || readBlock(vol->mountedDisk, next, file->cursorData) < 0) {
+            file->cursorIndex = -1;
+            return NULL;
+        }
+        file->cursorBlock = next;
+        file->cursorIndex++;
+    }
+    return file->cursorData;
+}
 
-    int disk = openDisk(filename, nBytes);
-    if (disk < 0) return TFS_ERR_MKFS;
+// Reads ahead in a chain: when the block after FD's cursor is also the
+// next block on the disk, reads up to count blocks from there with one
+// vectored read into run and moves the cursor over those that continue the
+// chain. Returns how many did, 0 if the chain jumps.
+static int readChainRun(fileDescriptor FD, int count, char (*run)[BLOCKSIZE]){
+    OpenFile *file = &vol->openFileTable[FD];
+    int next = bytesToInt(file->cursorData + 4);
+    if (file->cursorIndex < 0 || next != file->cursorBlock + 1) return 0;
+    if (count > SCAN_CHUNK) count = SCAN_CHUNK;
+    if (count > vol->totalBlocks - next) count = vol->totalBlocks - next;
+    if (count <= 0 || readBlocks(vol->mountedDisk, next, count, run) < 0) return 0;
+    int n = 1; // the cursor's pointer vouches for the first
+    while (n < count && bytesToInt(run[n - 1] + 4) == next + n) n++;
+    memcpy(file->cursorData, run[n - 1], BLOCKSIZE);
+    file->cursorBlock = next + n - 1;
+    file->cursorIndex += n;
+    return n;
+}
 
-    mountedDisk = disk;
-    totalBlocks = nBytes / BLOCKSIZE;
+static int drainMagazines(void);
 
-    char superBlock[BLOCKSIZE];
-    memset(superBlock, 0, BLOCKSIZE);
-    superBlock[0] = 1;       // superblock type
-    superBlock[1] = 0x44;    // magic number
-    
-    int firstFreeBlockLocation = 1;
-    intToBytes(firstFreeBlockLocation, superBlock+4);
-    intToBytes(totalBlocks, superBlock+8);
+// Whether blockNum lies in the journal region.
+static int inJournal(int blockNum){
+    return blockNum >= vol->journalStart && blockNum < vol->journalStart + vol->journalBlocks;
+}
 
-    if (writeBlock(mountedDisk, 0, superBlock) < 0) return TFS_ERR_MKFS;
+// Number of bitmap blocks needed to track numBlocks blocks.
+static int bitmapBlocksFor(int numBlocks){
+    return (numBlocks + BITMAP_BITS_PER_BLOCK - 1) / BITMAP_BITS_PER_BLOCK;
+}
 
-    char freeBlock[BLOCKSIZE];
-    int i;
-    for(i = 1; i < totalBlocks; i++){
-        memset(freeBlock, 0, BLOCKSIZE);
-        freeBlock[0] = 4;
-        freeBlock[1] = 0x44;
-        int nextFreeBlockLocation = (i == totalBlocks - 1) ? 0 : i + 1;
-        intToBytes(nextFreeBlockLocation, freeBlock+4);
-        if (writeBlock(mountedDisk, i, freeBlock) < 0) return TFS_ERR_MKFS;
+// Fills block with bitmap block number index of map (words long). Byte j of
+// the payload holds the free bits of 8 consecutive blocks, lowest block in
+// the lowest bit.
+static void encodeBitmapBlock(const uint64_t *map, int words, int index, char *block){
+    int j;
+    memset(block, 0, BLOCKSIZE);
+    block[0] = 5; // bitmap block type
+    block[1] = 0x44;
+    for (j = 0; j < BLOCKSIZE - 8; j++) {
+        int bit = index * BITMAP_BITS_PER_BLOCK + j * 8;
+        if (bit >= words * 64) break;
+        block[8 + j] = (char)(map[bit / 64] >> (bit % 64));
     }
-
-    clearOpenFileTable();
-    return TFS_SUCCESS;
 }
 
-/* tfs_mount:
-   - Mounts an existing filesystem.
-   - Returns TFS_SUCCESS if successful, TFS_ERR_MOUNT otherwise.
-*/
-int tfs_mount(char *diskname){
-    if (isMounted >= 0) return TFS_ERR_MOUNT;
-    
-    int disk = openDisk(diskname, 0);
-    if (disk < 0) return TFS_ERR_MOUNT;
-    mountedDisk = disk;
-
-    char superBlock[BLOCKSIZE];
-    if (readBlock(mountedDisk, 0, superBlock) < 0) return TFS_ERR_MOUNT;
-    if(superBlock[0] != 1 || superBlock[1] != 0x44) return TFS_ERR_MOUNT;
-
-    totalBlocks = bytesToInt(superBlock+8);
-    // Invoke consistency checks.
-    if(tfs_checkConsistency() != 0) {
-        closeDisk(mountedDisk);
-        mountedDisk = -1;
-        printf("Mount failed: File system inconsistency detected.\n");
-        return TFS_ERR_MOUNT;
+// Inverse of encodeBitmapBlock: ORs the bits held by block into map.
+static void decodeBitmapBlock(uint64_t *map, int words, int index, const char *block){
+    int j;
+    for (j = 0; j < BLOCKSIZE - 8; j++) {
+        int bit = index * BITMAP_BITS_PER_BLOCK + j * 8;
+        if (bit >= words * 64) break;
+        map[bit / 64] |= (uint64_t)(unsigned char)block[8 + j] << (bit % 64);
     }
-    clearOpenFileTable();
-    isMounted = 1;
-    return TFS_SUCCESS;
 }
 
-/* tfs_unmount:
-   - Unmounts the filesystem.
-   - Returns TFS_SUCCESS on success or TFS_ERR_UNMOUNT if no filesystem is mounted.
-*/
-int tfs_unmount(void){
-    if (mountedDisk < 0) return TFS_ERR_UNMOUNT;
-    if (closeDisk(mountedDisk) < 0) return TFS_ERR_UNMOUNT;
-
-    mountedDisk = -1;
-    isMounted = -1;
-    clearOpenFileTable();
-    return TFS_SUCCESS;
+static int isBlockFree(int blockNum){
+    return (vol->freeMap[blockNum / 64] >> (blockNum % 64)) & 1;
 }
 
-/* tfs_openFile:
-   - Opens a file. If the file does not exist, a new inode is created.
-   - Initializes timestamps and sets file mode to read-write.
-   - Returns a file descriptor on success or TFS_ERR_OPEN if an error occurs.
-   - Fails if the filename is longer than 8 characters.
-*/
-fileDescriptor tfs_openFile(char *name) {
-    if (mountedDisk < 0) return TFS_ERR_OPEN;
-    if (strlen(name) > 8) return TFS_ERR_OPEN;
+// Sets or clears the free bit of blockNum and schedules its bitmap block
+// for write-back.
+static void setBlockFree(int blockNum, int isFree){
+    uint64_t bit = (uint64_t)1 << (blockNum % 64);
+    if (isFree)
+        vol->freeMap[blockNum / 64] |= bit;
+    else
+        vol->freeMap[blockNum / 64] &= ~bit;
 
-    int nameLength = strlen(name);
-    char inodeName[9];
-    memset(inodeName, 0, 9);
-    strncpy(inodeName, name, nameLength);
+    int index = blockNum / BITMAP_BITS_PER_BLOCK;
+    vol->mapDirty[index] = 1;
+    if (vol->dirtyLo < 0 || index < vol->dirtyLo) vol->dirtyLo = index;
+    if (index > vol->dirtyHi) vol->dirtyHi = index;
+}
 
-    char block[BLOCKSIZE];
-    int inodeBlockLocation = -1;
+// Takes the first free block at or after allocHint, wrapping around once.
+// Words with no free block are skipped with a single test.
+static int bitmapAlloc(){
     int i;
-    // Search disk for an inode with matching name.
-    for (i = 0; i < totalBlocks; i++){
-        if (readBlock(mountedDisk, i, block) < 0) continue;
-        if (block[0] == 2 && block[1] == 0x44) {
-            if (strncmp(block + 4, inodeName, 8) == 0) {
-                inodeBlockLocation = i;
-                break;
-            }
+    for (i = 0; i <= vol->mapWords; i++) {
+        int w = (vol->allocHint / 64 + i) % vol->mapWords;
+        uint64_t word = vol->freeMap[w];
+        if (i == 0) word &= ~(uint64_t)0 << (vol->allocHint % 64); // bits before the hint come last
+        if (word != 0) {
+            int blockNum = w * 64 + __builtin_ctzll(word);
+            setBlockFree(blockNum, 0);
+            vol->allocHint = (blockNum + 1 < vol->totalBlocks) ? blockNum + 1 : 0;
+            return blockNum;
         }
     }
-    if (inodeBlockLocation < 0) {
-        // File doesn't exist, create a new inode.
-        inodeBlockLocation = getFreeBlock();
-        if (inodeBlockLocation < 0) return TFS_ERR_OPEN;
+    return -1;
+}
 
-        memset(block, 0, BLOCKSIZE);
-        block[0] = 2;        // inode block type
-        block[1] = 0x44;     // magic number
-        memcpy(block + 4, inodeName, 8);
-        intToBytes(0, block + 12); // file size = 0
-        intToBytes(0, block + 16); // no data block yet
+// Finds the first run of free blocks at or after block from. Returns its
+// first block and stores its length in *len, or returns -1 if there is none.
+// Words are skipped whole while they hold no free block (for the start) or
+// no used block (for the end); ctz finds the boundary inside a word.
+static int bitmapNextRun(int from, int *len){
+    if (from >= vol->totalBlocks) return -1;
+    int w = from / 64;
+    uint64_t word = vol->freeMap[w] & (~(uint64_t)0 << (from % 64));
+    while (word == 0) {
+        if (++w >= vol->mapWords) return -1;
+        word = vol->freeMap[w];
+    }
+    int start = w * 64 + __builtin_ctzll(word);
 
-        // Set timestamps (creation, modification, access)
-        int timestamp = (int)time(NULL);
-        intToBytes(timestamp, block + 20);
-        intToBytes(timestamp, block + 24);
-        intToBytes(timestamp, block + 28);
-        block[32] = 0;       // read-write flag
+    word = ~vol->freeMap[w] & (~(uint64_t)0 << (start % 64));
+    while (word == 0) {
+        if (++w >= vol->mapWords) break;
+        word = ~vol->freeMap[w];
+    }
+    int end = (w < vol->mapWords) ? w * 64 + __builtin_ctzll(word) : vol->totalBlocks;
+    if (end > vol->totalBlocks) end = vol->totalBlocks;
+    *len = end - start;
+    return start;
+}
 
-        // Generate a random color and store it in bytes 33-35.
-        int r, g, b;
-        generateRandomColor(&r, &g, &b);
-        block[33] = (char)r;
-        block[34] = (char)g;
-        block[35] = (char)b;
+// Returns the first block of the lowest run of n contiguous free blocks, or
+// -1 if there is none.
+static int bitmapFindRun(int n){
+    int len = 0;
+    int start = bitmapNextRun(0, &len);
+    while (start >= 0 && len < n)
+        start = bitmapNextRun(start + len, &len);
+    return start;
+}
 
-        if (writeBlock(mountedDisk, inodeBlockLocation, block) < 0)
-            return TFS_ERR_OPEN;
+// Reads the bitmap blocks named by the mounted superblock into freeMap.
+static int loadBitmap(){
+    vol->bitmapStart = bytesToInt(vol->mountedSuper+16);
+    vol->bitmapBlocks = bytesToInt(vol->mountedSuper+20);
+    if (vol->bitmapStart != 1 || vol->bitmapBlocks != bitmapBlocksFor(vol->totalBlocks)) return -1;
 
-        // Add one mapping entry.
-        addMapping(inodeBlockLocation, inodeName, 0, r, g, b);
-    }
+    vol->mapWords = (vol->totalBlocks + 63) / 64;
+    vol->freeMap = calloc(vol->mapWords, sizeof(uint64_t));
+    vol->mapDirty = calloc(vol->bitmapBlocks, 1);
+    if (!vol->freeMap || !vol->mapDirty) return -1;
 
-    // Insert into open file table.
-    int fd = -1;
-    for (i = 0; i < MAX_OPEN_FILES; i++) {
-        if (!openFileTable[i].used) {
-            fd = i;
-            openFileTable[i].used = 1;
-            openFileTable[i].inodeBlock = inodeBlockLocation;
-            openFileTable[i].filePointer = 0;
-            break;
+    char chunk[SCAN_CHUNK * BLOCKSIZE];
+    const char *view = NULL;
+    int i;
+    for (i = 0; i < vol->bitmapBlocks; i++) {
+        if (i % SCAN_CHUNK == 0 && !(view = peekBlocks(vol->bitmapStart + i, vol->bitmapBlocks - i, chunk)))
+            return -1;
+        const char *block = view + (i % SCAN_CHUNK) * BLOCKSIZE;
+        if (block[0] != 5 || block[1] != 0x44) {
+            printf("Block %d is not a valid bitmap block.\n", vol->bitmapStart + i);
+            return -1;
         }
+        decodeBitmapBlock(vol->freeMap, vol->mapWords, i, block);
     }
-    if (fd < 0) return TFS_ERR_OPEN;
-    return fd;
+    // bits past the end of the volume never describe a block
+    if (vol->totalBlocks % 64) vol->freeMap[vol->mapWords - 1] &= ((uint64_t)1 << (vol->totalBlocks % 64)) - 1;
+    vol->dirtyLo = vol->dirtyHi = -1;
+    vol->allocHint = 0;
+    return 0;
 }
 
-int tfs_closeFile(fileDescriptor FD){
-    if (FD < 0 || FD >= MAX_OPEN_FILES || !openFileTable[FD].used) return TFS_ERR_CLOSE;
-
-    openFileTable[FD].used = 0;
-    openFileTable[FD].inodeBlock = -1;
-    openFileTable[FD].filePointer = -1;
-    return TFS_SUCCESS;
+static void releaseBitmap(){
+    free(vol->freeMap);
+    free(vol->mapDirty);
+    vol->freeMap = NULL;
+    vol->mapDirty = NULL;
+    vol->mapWords = 0;
+    vol->useBitmap = 0;
+    vol->dirtyLo = vol->dirtyHi = -1;
 }
 
-void freeAllocatedBlocks(int allocatedBlocks[], int length){
-    int i;
-    for(i = 0; i < length; i++){
-        addFreeBlock(allocatedBlocks[i]);
+// Writes the in-memory superblock (free list head and free count) back to
+// block 0 if the allocator has changed it since the last sync, preceded by
+// the bitmap blocks that changed, each run of them with one write.
+static int syncSuperBlock(){
+    if (vol->useBitmap && vol->dirtyLo >= 0) {
+        char chunk[SCAN_CHUNK * BLOCKSIZE];
+        int first = vol->dirtyLo, i;
+        while (first <= vol->dirtyHi) {
+            if (!vol->mapDirty[first]) {
+                first++;
+                continue;
+            }
+            int count = 0;
+            while (first + count <= vol->dirtyHi && vol->mapDirty[first + count] && count < SCAN_CHUNK) {
+                encodeBitmapBlock(vol->freeMap, vol->mapWords, first + count, chunk + count * BLOCKSIZE);
+                count++;
+            }
+            if (writeBlocks(vol->mountedDisk, vol->bitmapStart + first, count, chunk) < 0) return -1;
+            for (i = 0; i < count; i++) vol->mapDirty[first + i] = 0;
+            first += count;
+        }
+        vol->dirtyLo = vol->dirtyHi = -1;
     }
+    if (!vol->superDirty) return 0;
+    intToBytes(vol->freeBlockCount + __atomic_load_n(&vol->reservedBlocks, __ATOMIC_RELAXED), vol->mountedSuper+12);
+    if (writeBlock(vol->mountedDisk, 0, vol->mountedSuper) < 0) return -1;
+    vol->superDirty = 0;
+    return 0;
 }
 
-/* tfs_writeFile:
-   - Writes a buffer to a file.
-   - Checks the read-only flag and updates the modification timestamp.
-   - Returns TFS_SUCCESS on success or TFS_ERR_WRITE on failure.
-*/
-int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
-    if (FD < 0 || FD >= MAX_OPEN_FILES || !openFileTable[FD].used)
-         return TFS_ERR_WRITE;
+static void reclaimMagazines(void);
 
-    int inodeBlockLocation = openFileTable[FD].inodeBlock;
-    char inodeBlock[BLOCKSIZE];
-    if (readBlock(mountedDisk, inodeBlockLocation, inodeBlock) < 0)
-         return TFS_ERR_WRITE;
+// Returns location of next free block and updates the superblock's free block pointer 
+static int getFreeBlock(){
+    char scratch[BLOCKSIZE];
 
-    if (inodeBlock[32] == 1) return TFS_ERR_WRITE;  // read-only
+    if (vol->freeBlockCount == 0) reclaimMagazines();
 
-    // Free old data blocks.
-    int dataBlockLocation = bytesToInt(inodeBlock + 16);
-    char dataBlock[BLOCKSIZE];
-    while (dataBlockLocation != 0) {
-         if (readBlock(mountedDisk, dataBlockLocation, dataBlock) < 0)
-             break;
-         int next = bytesToInt(dataBlock + 4);
-         addFreeBlock(dataBlockLocation);
-         dataBlockLocation = next;
+    if (vol->useBitmap) {
+        int blockNum = bitmapAlloc();
+        if (blockNum < 0) return -1;
+        vol->freeBlockCount--;
+        vol->superDirty = 1;
+        return blockNum;
     }
 
-    if (size == 0) {
-        intToBytes(0, inodeBlock + 12);
-        intToBytes(0, inodeBlock + 16);
-        intToBytes((int)time(NULL), inodeBlock + 24);
-        writeBlock(mountedDisk, inodeBlockLocation, inodeBlock);
-        openFileTable[FD].filePointer = 0;
-        int i;
-        for (i = 0; i < inodeCount; i++) {
-            if (inodeColors[i].inodeIndex == inodeBlockLocation) {
-                inodeColors[i].firstDataBlock = 0;
-                break;
-            }
-        }
-        return TFS_SUCCESS;
-    }
+    int freeBlockLocation = bytesToInt(vol->mountedSuper+4); // location of next free block
+    if (freeBlockLocation == 0) return -1; // no free blocks available
 
-    int bytesPerBlock = BLOCKSIZE - 8;
-    int blocksNeeded = (size + bytesPerBlock - 1) / bytesPerBlock;
-    int availableFreeBlocks = getFreeBlockCount();
-    if (blocksNeeded > availableFreeBlocks) return TFS_ERR_WRITE;
-
-    int firstDataBlockLocation = 0;
-    int prevBlock = 0;
-    int allocatedBlocks[blocksNeeded];
-    int allocatedCount = 0;
-    int i;
-    for (i = 0; i < blocksNeeded; i++) {
-        int currentBlock = getFreeBlock();
-        if (currentBlock < 0) {
-            freeAllocatedBlocks(allocatedBlocks, allocatedCount);
-            return TFS_ERR_WRITE;
-        }
-        allocatedBlocks[allocatedCount++] = currentBlock;
+    const char *freeBlock = peekBlock(freeBlockLocation, scratch); // read the free block
+    if (!freeBlock) return -1;
 
-        memset(dataBlock, 0, BLOCKSIZE);
-        dataBlock[0] = 3;      // data block type
-        dataBlock[1] = 0x44;   // magic number
-        intToBytes(0, dataBlock + 4); // next pointer initially 0
+    intToBytes(bytesToInt(freeBlock+4), vol->mountedSuper+4); // next free block becomes the head
+    vol->freeBlockCount--;
+    vol->superDirty = 1;
+    return freeBlockLocation;
+}
 
-        int bufferPos = i * bytesPerBlock;
-        int numBytesToWrite = (size - bufferPos < bytesPerBlock) ? (size - bufferPos) : bytesPerBlock;
-        memcpy(dataBlock + 8, buffer + bufferPos, numBytesToWrite);
+// Marks the block at blockNum as free and sets the superblock's free block pointer to it
+static int addFreeBlock(int blockNum){
+    char freeBlock[BLOCKSIZE];
 
-        if (writeBlock(mountedDisk, currentBlock, dataBlock) < 0) {
-            freeAllocatedBlocks(allocatedBlocks, allocatedCount);
-            return TFS_ERR_WRITE;
-        }
+    memset(freeBlock, 0, BLOCKSIZE);
+    freeBlock[0] = 4; // free block type
+    freeBlock[1] = 0x44;
+    if (!vol->useBitmap) intToBytes(bytesToInt(vol->mountedSuper+4), freeBlock+4);
 
-        if (firstDataBlockLocation == 0)
-            firstDataBlockLocation = currentBlock;
+    if (writeBlock(vol->mountedDisk, blockNum, freeBlock) < 0 ) return -1;
+    
+    if (vol->useBitmap)
+        setBlockFree(blockNum, 1);
+    else
+        intToBytes(blockNum, vol->mountedSuper+4);
+    vol->freeBlockCount++;
+    vol->superDirty = 1;
+    return 0; 
+}
 
-        if (prevBlock != 0) {
-            if (readBlock(mountedDisk, prevBlock, dataBlock) < 0)
-                return TFS_ERR_WRITE;
-            intToBytes(currentBlock, dataBlock + 4);
-            if (writeBlock(mountedDisk, prevBlock, dataBlock) < 0)
-                return TFS_ERR_WRITE;
-        }
-        prevBlock = currentBlock;
+// FNV-1a over the 8 name bytes.
+static unsigned int hashName(const char *name){
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < 8; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    intToBytes(size, inodeBlock + 12);
-    intToBytes(firstDataBlockLocation, inodeBlock + 16);
-    intToBytes((int)time(NULL), inodeBlock + 24);
-    if (writeBlock(mountedDisk, inodeBlockLocation, inodeBlock) < 0)
-         return TFS_ERR_WRITE;
+// Returns the slot holding name, or -1 if it is not in the index.
+static int nameSlot(const char *name){
+    if (!vol->nameIndex) return -1;
+    unsigned int slot = hashName(name) & (vol->nameSlots - 1);
+    while (vol->nameIndex[slot].inodeBlock != 0) {
+        if (vol->nameIndex[slot].inodeBlock > 0 && memcmp(vol->nameIndex[slot].name, name, 8) == 0)
+            return slot;
+        slot = (slot + 1) & (vol->nameSlots - 1);
+    }
+    return -1;
+}
 
-    openFileTable[FD].filePointer = 0;
+static int nameIndexInsert(const char *name, int inodeBlock, int dirSlot);
 
-    for (i = 0; i < inodeCount; i++) {
-        if (inodeColors[i].inodeIndex == inodeBlockLocation) {
-            inodeColors[i].firstDataBlock = firstDataBlockLocation;
-            break;
-        }
+// Rehashes the live entries into a table of the given number of slots.
+static int nameIndexResize(int slots){
+    NameEntry *old = vol->nameIndex;
+    int oldSlots = vol->nameSlots;
+    NameEntry *table = calloc(slots, sizeof(NameEntry));
+    if (!table) return -1;
+    vol->nameIndex = table;
+    vol->nameSlots = slots;
+    vol->nameUsed = 0;
+    int i;
+    for (i = 0; i < oldSlots; i++) {
+        if (old[i].inodeBlock > 0) nameIndexInsert(old[i].name, old[i].inodeBlock, old[i].dirSlot);
     }
-
-    return TFS_SUCCESS;
+    free(old);
+    return 0;
 }
 
-void removeInodeColorByIndex(int inodeIndex) {
-    int i;
-    for (i = 0; i < inodeCount; i++) {
-        if (inodeColors[i].inodeIndex == inodeIndex) {
-            int j;
-            for (j = i; j < inodeCount - 1; j++) {
-                inodeColors[j] = inodeColors[j + 1];
-            }
-            inodeCount--;
-            return;
+// Adds name -> inodeBlock, named by directory slot dirSlot. A name already
+// in the index keeps its inode. The table is rebuilt once half its slots
+// are used: at twice the size if a quarter or more hold live entries,
+// otherwise just to drop deleted ones.
+static int nameIndexInsert(const char *name, int inodeBlock, int dirSlot){
+    if ((vol->nameUsed + 1) * 2 > vol->nameSlots) {
+        int live = 0, i;
+        for (i = 0; i < vol->nameSlots; i++) {
+            if (vol->nameIndex[i].inodeBlock > 0) live++;
         }
+        int slots = ((live + 1) * 4 > vol->nameSlots) ? vol->nameSlots * 2 : vol->nameSlots;
+        if (nameIndexResize(slots ? slots : 64) < 0) return -1;
     }
+    if (nameSlot(name) >= 0) return 0;
+    unsigned int slot = hashName(name) & (vol->nameSlots - 1);
+    while (vol->nameIndex[slot].inodeBlock > 0) slot = (slot + 1) & (vol->nameSlots - 1);
+    if (vol->nameIndex[slot].inodeBlock == 0) vol->nameUsed++;
+    memcpy(vol->nameIndex[slot].name, name, 8);
+    vol->nameIndex[slot].inodeBlock = inodeBlock;
+    vol->nameIndex[slot].dirSlot = dirSlot;
+    return 0;
 }
-/* tfs_deleteFile:
-   - Deletes a file (failing if it is read-only).
-*/
-int tfs_deleteFile(fileDescriptor FD) {
-    if (FD < 0 || FD >= MAX_OPEN_FILES) return TFS_ERR_DELETE;
 
-    int inodeBlockLocation = openFileTable[FD].inodeBlock;
-    char inodeBlock[BLOCKSIZE];
-    if (readBlock(mountedDisk, inodeBlockLocation, inodeBlock) < 0)
-        return TFS_ERR_DELETE;
+// Drops name from the index if it refers to inodeBlock.
+static void nameIndexRemove(const char *name, int inodeBlock){
+    int slot = nameSlot(name);
+    if (slot >= 0 && vol->nameIndex[slot].inodeBlock == inodeBlock) vol->nameIndex[slot].inodeBlock = -1;
+}
 
-    if (inodeBlock[32] == 1) return TFS_ERR_DELETE;
+static void releaseNameIndex(){
+    free(vol->nameIndex);
+    vol->nameIndex = NULL;
+    vol->nameSlots = vol->nameUsed = 0;
+}
 
-    removeInodeColorByIndex(inodeBlockLocation);
+// Looks up the inode named inodeName (8 bytes, zero padded).
+// Returns its block number, or -1 if there is no such file.
+static int findInode(const char *inodeName){
+    int slot = nameSlot(inodeName);
+    return slot >= 0 ? vol->nameIndex[slot].inodeBlock : -1;
+}
 
-    int dataBlockLocation = bytesToInt(inodeBlock+16);
-    char dataBlock[BLOCKSIZE];
-    while (dataBlockLocation != 0){
-        if (readBlock(mountedDisk, dataBlockLocation, dataBlock) < 0) break;
-        int next = bytesToInt(dataBlock+4);
-        addFreeBlock(dataBlockLocation);
-        dataBlockLocation = next;
-    }
-    addFreeBlock(inodeBlockLocation);
+// Returns the name (8 bytes) and inode block number (4 bytes) of slot s.
+static char *dirEntry(int slot){
+    return vol->dirData[slot / DIR_ENTRIES_PER_BLOCK] + 8 + (slot % DIR_ENTRIES_PER_BLOCK) * DIR_ENTRY_SIZE;
+}
 
-    openFileTable[FD].used = 0;
-    openFileTable[FD].inodeBlock = -1;
-    openFileTable[FD].filePointer = -1;
-    return TFS_SUCCESS;
+static int writeDirBlockOf(int slot){
+    int i = slot / DIR_ENTRIES_PER_BLOCK;
+    return writeBlock(vol->mountedDisk, vol->dirBlocks[i], vol->dirData[i]);
 }
 
-/* tfs_readByte:
-   - Reads a single byte from a file and updates the access timestamp.
-*/
-int tfs_readByte(fileDescriptor FD, char *buffer) {
-    if (FD < 0 || FD >= MAX_OPEN_FILES || !openFileTable[FD].used) return TFS_ERR_READ;
-    
-    int inodeBlockLocation = openFileTable[FD].inodeBlock;
-    char inodeBlock[BLOCKSIZE];
-    if (readBlock(mountedDisk, inodeBlockLocation, inodeBlock) < 0) return TFS_ERR_READ;
-    
-    int fileSize = bytesToInt(inodeBlock+12);
-    int fpPosition = openFileTable[FD].filePointer;
-    if (fpPosition >= fileSize) return TFS_ERR_READ;
+// Makes room for count directory blocks in memory.
+static int dirReserve(int count){
+    if (count <= vol->dirCapacity) return 0;
+    int capacity = vol->dirCapacity ? vol->dirCapacity * 2 : 8;
+    while (capacity < count) capacity *= 2;
+    int *blocks = realloc(vol->dirBlocks, capacity * sizeof(int));
+    if (!blocks) return -1;
+    vol->dirBlocks = blocks;
+    char (*data)[BLOCKSIZE] = realloc(vol->dirData, capacity * BLOCKSIZE);
+    if (!data) return -1;
+    vol->dirData = data;
+    vol->dirCapacity = capacity;
+    return 0;
+}
 
-    int bytesPerBlock = BLOCKSIZE - 8;
-    int blockIndex = fpPosition / bytesPerBlock;
-    int offsetWithinBlock = fpPosition % bytesPerBlock;
-    int dataBlockLocation = bytesToInt(inodeBlock+16);
-    char dataBlock[BLOCKSIZE];
-    int i;
-    for(i = 0; i < blockIndex; i++){
-        if (readBlock(mountedDisk, dataBlockLocation, dataBlock) < 0) return TFS_ERR_READ;
-        dataBlockLocation = bytesToInt(dataBlock+4);
+static void releaseDirectory(){
+    free(vol->dirBlocks);
+    free(vol->dirData);
+    vol->dirBlocks = NULL;
+    vol->dirData = NULL;
+    vol->dirBlockCount = vol->dirCapacity = vol->dirFreeHint = 0;
+}
+
+// Stores name -> inodeBlock in the first empty directory slot. When every
+// directory block is full a new one is allocated, written, and then linked
+// to the end of the chain. Returns the slot, or -1.
+static int dirAddEntry(const char *name, int inodeBlock){
+    int total = vol->dirBlockCount * DIR_ENTRIES_PER_BLOCK;
+    int slot;
+    for (slot = vol->dirFreeHint; slot < total; slot++) {
+        if (bytesToInt(dirEntry(slot) + 8) == 0) break;
+    }
+    int newBlock = 0;
+    if (slot == total) {
+        if (dirReserve(vol->dirBlockCount + 1) < 0) return -1;
+        newBlock = getFreeBlock();
+        if (newBlock < 0) return -1;
+        char *block = vol->dirData[vol->dirBlockCount];
+        memset(block, 0, BLOCKSIZE);
+        block[0] = 6; // directory block type
+        block[1] = 0x44;
+        vol->dirBlocks[vol->dirBlockCount++] = newBlock;
     }
-    if (readBlock(mountedDisk, dataBlockLocation, dataBlock) < 0) return TFS_ERR_READ;
 
-    *buffer = dataBlock[8 + offsetWithinBlock];
-    openFileTable[FD].filePointer++;
+    char *entry = dirEntry(slot);
+    memcpy(entry, name, 8);
+    intToBytes(inodeBlock, entry + 8);
+    vol->dirFreeHint = slot + 1;
+    if (writeDirBlockOf(slot) < 0) return -1;
 
-    intToBytes((int)time(NULL), inodeBlock+28);
-    writeBlock(mountedDisk, inodeBlockLocation, inodeBlock);
-    
-    return TFS_SUCCESS;
+    if (newBlock != 0) {
+        if (vol->dirBlockCount == 1) {
+            intToBytes(newBlock, vol->mountedSuper+24);
+            vol->superDirty = 1;
+        } else {
+            intToBytes(newBlock, vol->dirData[vol->dirBlockCount - 2] + 4);
+            if (writeBlock(vol->mountedDisk, vol->dirBlocks[vol->dirBlockCount - 2], vol->dirData[vol->dirBlockCount - 2]) < 0)
+                return -1;
+        }
+    }
+    return slot;
 }
 
-int tfs_seek(fileDescriptor FD, int offset){
-    if (FD < 0 || FD >= MAX_OPEN_FILES || !openFileTable[FD].used) return TFS_ERR_SEEK;
+static int dirRemoveEntry(int slot){
+    memset(dirEntry(slot), 0, DIR_ENTRY_SIZE);
+    if (slot < vol->dirFreeHint) vol->dirFreeHint = slot;
+    return writeDirBlockOf(slot);
+}
 
-    int inodeBlockLocation = openFileTable[FD].inodeBlock;
-    char inodeBlock[BLOCKSIZE];
-    if (readBlock(mountedDisk, inodeBlockLocation, inodeBlock) < 0) return TFS_ERR_READ;
-    
-    int fileSize = bytesToInt(inodeBlock+12);
-    if (offset < 0 || offset > fileSize) return TFS_ERR_SEEK;
+static int dirRenameEntry(int slot, const char *name){
+    memcpy(dirEntry(slot), name, 8);
+    return writeDirBlockOf(slot);
+}
 
-    openFileTable[FD].filePointer = offset;
-    return TFS_SUCCESS;
+// Returns the directory slot naming inodeBlock, or -1. Inodes sharing a
+// name on an old image are not all in the name index; those are found in
+// the in-memory directory instead.
+static int dirFindSlot(const char *name, int inodeBlock){
+    int slot = nameSlot(name);
+    if (slot >= 0 && vol->nameIndex[slot].inodeBlock == inodeBlock) return vol->nameIndex[slot].dirSlot;
+    for (slot = 0; slot < vol->dirBlockCount * DIR_ENTRIES_PER_BLOCK; slot++) {
+        if (bytesToInt(dirEntry(slot) + 8) == inodeBlock) return slot;
+    }
+    return -1;
 }
 
-//-------------------------------------------------------------
-/*                Additional Features                      */
-//-------------------------------------------------------------
+// Reads the directory chain named by the superblock into memory and
+// indexes every entry by name; where two entries share a name the first
+// one wins.
+static int loadDirectory(){
+    releaseDirectory();
+    releaseNameIndex();
+    if (nameIndexResize(64) < 0) return -1;
 
-/* tfs_readFileInfo:
-   - Prints file info (name, size, timestamps, read-only status).
-*/
-int tfs_readFileInfo(fileDescriptor FD) {
-    if (FD < 0 || FD >= MAX_OPEN_FILES || !openFileTable[FD].used)
-        return TFS_ERR_READINFO;
+    int current = bytesToInt(vol->mountedSuper+24);
+    while (current != 0) {
+        if (current < 1 || current >= vol->totalBlocks || vol->dirBlockCount >= vol->totalBlocks) return -1;
+        if (dirReserve(vol->dirBlockCount + 1) < 0) return -1;
+        char *block = vol->dirData[vol->dirBlockCount];
+        if (readBlock(vol->mountedDisk, current, block) < 0) return -1;
+        if (block[0] != 6 || block[1] != 0x44) return -1;
+        vol->dirBlocks[vol->dirBlockCount++] = current;
+        current = bytesToInt(block + 4);
+    }
 
-    int inodeBlockLocation = openFileTable[FD].inodeBlock;
-    char inodeBlock[BLOCKSIZE];
-    if (readBlock(mountedDisk, inodeBlockLocation, inodeBlock) < 0)
-        return TFS_ERR_READINFO;
+    int slot;
+    for (slot = 0; slot < vol->dirBlockCount * DIR_ENTRIES_PER_BLOCK; slot++) {
+        const char *entry = dirEntry(slot);
+        int inodeBlock = bytesToInt(entry + 8);
+        if (inodeBlock != 0 && nameIndexInsert(entry, inodeBlock, slot) < 0) return -1;
+    }
+    return 0;
+}
 
-    char filename[9];
-    memcpy(filename, inodeBlock+4, 8);
-    filename[8] = '\0';
-    int fileSize = bytesToInt(inodeBlock+12);
-    int creationTime = bytesToInt(inodeBlock+20);
-    int modificationTime = bytesToInt(inodeBlock+24);
-    int accessTime = bytesToInt(inodeBlock+28);
-    int readOnly = inodeBlock[32];
+// Gives a volume made before directories existed one: scans for its
+// inodes once, enters each into a new directory and the name index, and
+// marks the superblock.
+static int upgradeDirectory(){
+    char chunk[SCAN_CHUNK * BLOCKSIZE];
+    const char *view = NULL;
+    int *inodes = malloc(vol->totalBlocks * sizeof(int));
+    int count = 0, i;
+    if (!inodes) return -1;
+    for (i = 0; i < vol->totalBlocks; i++){
+        if (i % SCAN_CHUNK == 0 && !(view = peekBlocks(i, vol->totalBlocks - i, chunk))) {
+            free(inodes);
+            return -1;
+        }
+        if (view[(i % SCAN_CHUNK) * BLOCKSIZE] == 2 && !inJournal(i)) inodes[count++] = i;
+    }
 
-    time_t t_creation = (time_t) creationTime;
-    time_t t_mod = (time_t) modificationTime;
-    time_t t_access = (time_t) accessTime;
+    if ((count + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK > vol->freeBlockCount) {
+        printf("No free blocks left to add a directory.\n");
+        free(inodes);
+        return -1;
+    }
+    releaseDirectory();
+    releaseNameIndex();
+    if (nameIndexResize(64) < 0) {
+        free(inodes);
+        return -1;
+    }
+    char name[BLOCKSIZE];
+    for (i = 0; i < count; i++) {
+        if (readBlock(vol->mountedDisk, inodes[i], name) < 0) break;
+        int slot = dirAddEntry(name + 4, inodes[i]);
+        if (slot < 0 || nameIndexInsert(name + 4, inodes[i], slot) < 0) break;
+    }
+    free(inodes);
+    if (i < count) return -1;
 
-    printf("File Info:\n");
-    printf("  Name: %s\n", filename);
-    printf("  Size: %d bytes\n", fileSize);
-    printf("  Created: %s", ctime(&t_creation));
-    printf("  Modified: %s", ctime(&t_mod));
-    printf("  Last Accessed: %s", ctime(&t_access));
-    printf("  Read-Only: %s\n", readOnly ? "Yes" : "No");
-    return TFS_SUCCESS;
+    vol->mountedSuper[2] |= FEATURE_DIRECTORY;
+    vol->superDirty = 1;
+    return syncSuperBlock();
 }
 
-/* tfs_makeRO:
-   - Sets a file's flag to read-only by name.
-*/
-int tfs_makeRO(char *name) {
-    char inodeName[9];
-    memset(inodeName, 0, 9);
-    strncpy(inodeName, name, 8);
+// Writes the count blocks of chain as free blocks. With toPool they are
+// linked onto the front of the free list in that order (or marked free in
+// the bitmap) and counted free, with the writes queued as batches and the
+// in-memory superblock updated once; the disk's queue is shared, so this
+// needs the metadata lock. Otherwise they are only written, unlinked, for a
+// magazine.
+static int writeFreeBlocks(const int *chain, int count, int toPool){
+    if (count == 0) return 0;
+    int oldHead = toPool ? bytesToInt(vol->mountedSuper + 4) : 0;
 
-    char block[BLOCKSIZE];
-    int inodeBlockLocation = -1;
+    char (*batch)[BLOCKSIZE] = malloc(SCAN_CHUNK * BLOCKSIZE);
+    BlockVec list[SCAN_CHUNK];
+    if (!batch) return -1;
+    int result = 0;
     int i;
-    for(i = 0; i < totalBlocks; i++){
-        if (readBlock(mountedDisk, i, block) < 0) continue;
-        if (block[0] == 2 && block[1] == 0x44){
-            if (strncmp(block+4, inodeName, 8) == 0) {
-                inodeBlockLocation = i;
-                break;
-            }
+    for (i = 0; i < count; i++) {
+        char *freeBlock = batch[i % SCAN_CHUNK];
+        memset(freeBlock, 0, BLOCKSIZE);
+        freeBlock[0] = 4; // free block type
+        freeBlock[1] = 0x44;
+        if (toPool && !vol->useBitmap) intToBytes(i + 1 < count ? chain[i + 1] : oldHead, freeBlock + 4);
+        list[i % SCAN_CHUNK].bNum = chain[i];
+        list[i % SCAN_CHUNK].block = freeBlock;
+        if (toPool && queueWriteBlock(vol->mountedDisk, chain[i], freeBlock) < 0) result = -1;
+        if ((i + 1) % SCAN_CHUNK == 0 || i + 1 == count) {
+            if ((toPool ? submitBlocks(vol->mountedDisk) : writeBlockList(vol->mountedDisk, list, i % SCAN_CHUNK + 1)) < 0)
+                result = -1;
         }
     }
-    if (inodeBlockLocation < 0) return TFS_ERR_MAKE_RO;
+    free(batch);
 
-    block[32] = 1; // set read-only
-    if (writeBlock(mountedDisk, inodeBlockLocation, block) < 0)
-        return TFS_ERR_MAKE_RO;
-    return TFS_SUCCESS;
+    if (toPool && result == 0) {
+        if (vol->useBitmap) {
+            for (i = 0; i < count; i++) setBlockFree(chain[i], 1);
+        } else {
+            intToBytes(chain[0], vol->mountedSuper + 4);
+        }
+        vol->freeBlockCount += count;
+        vol->superDirty = 1;
+    }
+    return result;
 }
 
-/* tfs_makeRW:
-   - Resets a file's flag to read-write by name.
-*/
-int tfs_makeRW(char *name) {
-    char inodeName[9];
-    memset(inodeName, 0, 9);
-    strncpy(inodeName, name, 8);
+// Number of free blocks, counted at mount and maintained by the allocator
+// since: the free space plus what the magazines hold.
+static int getFreeBlockCount(){
+    if (vol->mountedDisk < 0) return -1;
+    lockMeta();
+    int count = vol->freeBlockCount + __atomic_load_n(&vol->reservedBlocks, __ATOMIC_RELAXED);
+    unlockMeta();
+    return count;
+}
 
-    char block[BLOCKSIZE];
-    int inodeBlockLocation = -1;
+// Generate random RGB colors
+void generateRandomColor(int *r, int *g, int *b) {
+    srand(get_seed());
+    *r = rand() % 256;
+    *g = rand() % 256;
+    *b = rand() % 256;
+}
+
+// Add a mapping entry if one for this inode does not already exist.
+void addMapping(int inodeBlock, char *name, int firstDataBlock, int r, int g, int b) {
+    // Check if already exists.
     int i;
-    for(i = 0; i < totalBlocks; i++){
-        if (readBlock(mountedDisk, i, block) < 0) continue;
-        if (block[0] == 2 && block[1] == 0x44){
-            if (strncmp(block+4, inodeName, 8) == 0) {
-                inodeBlockLocation = i;
-                break;
+    for (i = 0; i < vol->inodeCount; i++) {
+        if (vol->inodeColors[i].inodeIndex == inodeBlock) {
+            return; // already exists, do nothing.
+        }
+    }
+    if (vol->inodeCount < MAX_INODES) {
+        strncpy(vol->inodeColors[vol->inodeCount].name, name, 8);
+        vol->inodeColors[vol->inodeCount].name[8] = '\0';
+        vol->inodeColors[vol->inodeCount].inodeIndex = inodeBlock;
+        vol->inodeColors[vol->inodeCount].firstDataBlock = firstDataBlock;
+        vol->inodeColors[vol->inodeCount].r = r;
+        vol->inodeColors[vol->inodeCount].g = g;
+        vol->inodeColors[vol->inodeCount].b = b;
+        vol->inodeCount++;
+    }
+}
+
+// Remove a mapping entry by inode block number.
+void removeMapping(int inodeBlock) {
+    int i;
+    for (i = 0; i < vol->inodeCount; i++) {
+        if (vol->inodeColors[i].inodeIndex == inodeBlock) {
+            int j;
+            for (j = i; j < vol->inodeCount - 1; j++) {
+                vol->inodeColors[j] = vol->inodeColors[j + 1];
             }
+            vol->inodeCount--;
+            return;
         }
     }
-    if (inodeBlockLocation < 0) return TFS_ERR_MAKE_RW;
+}
 
-    block[32] = 0; // set to read-write
-    if (writeBlock(mountedDisk, inodeBlockLocation, block) < 0)
-        return TFS_ERR_MAKE_RW;
-    return TFS_SUCCESS;
+// Given a data or index block number, determine the owning file by listing
+// each mapping's blocks.
+InodeColor *getOwnerForDataBlock(int dataBlock) {
+    if (dataBlock == 0) return NULL;
+    int i, j;
+    char scratch[BLOCKSIZE];
+    for (i = 0; i < vol->inodeCount; i++) {
+        if (vol->inodeColors[i].firstDataBlock == 0) continue;
+        const char *inode = peekBlock(vol->inodeColors[i].inodeIndex, scratch);
+        BlockList list = {NULL, 0, 0};
+        if (!inode || collectFileBlocks(inode, &list, &list) < 0) continue;
+        for (j = 0; j < list.count && list.blocks[j] != dataBlock; j++);
+        free(list.blocks);
+        if (j < list.count) return &vol->inodeColors[i];
+    }
+    return NULL;
 }
 
-/* tfs_writeByte:
-   - Writes a single byte at a given offset.
-   - Fails if the file is read-only or if the offset is invalid.
+// Free blocks of a volume mounted without the consistency check: counted
+// from the bitmap, or by walking the free list. Returns -1 if the list is
+// broken or longer than the volume.
+static int countFreeBlocks(){
+    int count = 0, i;
+    if (vol->useBitmap) {
+        for (i = 0; i < vol->mapWords; i++) count += __builtin_popcountll(vol->freeMap[i]);
+        return count;
+    }
+    char scratch[BLOCKSIZE];
+    int freePtr = bytesToInt(vol->mountedSuper+4);
+    while (freePtr != 0) {
+        const char *block = (freePtr > 0 && freePtr < vol->totalBlocks && count < vol->totalBlocks)
+                            ? peekBlock(freePtr, scratch) : NULL;
+        if (!block || block[0] != 4) return -1;
+        count++;
+        freePtr = bytesToInt(block+4);
+    }
+    return count;
+}
+
+// Records in the superblock whether the volume is unmounted cleanly and
+// forces everything written so far, the flag included, to the disk.
+static int markVolume(int clean){
+    if (clean) vol->mountedSuper[3] |= SUPER_CLEAN;
+    else vol->mountedSuper[3] &= ~SUPER_CLEAN;
+    vol->superDirty = 1;
+    if (syncSuperBlock() < 0) return -1;
+    return (vol->journalBlocks > 0) ? commitJournal(vol->mountedDisk) : syncDisk(vol->mountedDisk);
+}
+
+/* tfs_mkfs:
+   - Makes a filesystem with the default (free list) layout.
 */
-int tfs_writeByte(fileDescriptor FD, int offset, unsigned int data) {
-    if (FD < 0 || FD >= MAX_OPEN_FILES || !openFileTable[FD].used)
-        return TFS_ERR_WRITE;
+int tfs_mkfs(char *filename, int nBytes){
+    return tfs_mkfsEx(filename, nBytes, 0);
+}
 
-    int inodeBlockLocation = openFileTable[FD].inodeBlock;
-    char inodeBlock[BLOCKSIZE];
-    if (readBlock(mountedDisk, inodeBlockLocation, inodeBlock) < 0)
-        return TFS_ERR_WRITE;
+/* tfs_mkfsEx:
+   - Checks that nBytes is > 0 and a multiple of BLOCKSIZE.
+   - Initializes the superblock and free blocks.
+   - With TFS_MKFS_BITMAP, free space is tracked by bitmap blocks placed
+     right after the superblock instead of a linked free list.
+   - With TFS_MKFS_INDEXED, files created on the volume keep a block map
+     of direct and indirect pointers in the inode instead of a data chain.
+   - With TFS_MKFS_JOURNAL, an eighth of the volume (16 to 256 blocks) after
+     the superblock and bitmap is reserved as a write-ahead log; it needs a
+     volume of at least 32 blocks.
+   - Closes the new disk again so its cached blocks reach the file before
+     tfs_mount opens it.
+   Returns TFS_SUCCESS on success or TFS_ERR_MKFS on failure.
+*/
+int tfs_mkfsEx(char *filename, int nBytes, int flags){
+    if(nBytes <= 0 || nBytes % BLOCKSIZE != 0)
+         return TFS_ERR_MKFS;
+    if (flags & ~(TFS_MKFS_BITMAP | TFS_MKFS_INDEXED | TFS_MKFS_JOURNAL)) return TFS_ERR_MKFS;
 
-    if (inodeBlock[32] == 1) return TFS_ERR_WRITE;
+    int numBlocks = nBytes / BLOCKSIZE;
+    int bitmap = (flags & TFS_MKFS_BITMAP) != 0;
+    int mapBlocks = bitmap ? bitmapBlocksFor(numBlocks) : 0;
+    int logBlocks = 0;
+    if (flags & TFS_MKFS_JOURNAL) {
+        logBlocks = numBlocks / 8;
+        if (logBlocks < JOURNAL_MIN_BLOCKS) logBlocks = JOURNAL_MIN_BLOCKS;
+        if (logBlocks > JOURNAL_MAX_BLOCKS) logBlocks = JOURNAL_MAX_BLOCKS;
+        if (numBlocks < 2 * JOURNAL_MIN_BLOCKS) return TFS_ERR_MKFS;
+    }
+    int reserved = mapBlocks + logBlocks; // blocks after the superblock
+    int firstFreeBlockLocation = 1 + reserved;
+    if (firstFreeBlockLocation > numBlocks) return TFS_ERR_MKFS;
 
-    int fileSize = bytesToInt(inodeBlock+12);
-    if (offset < 0 || offset >= fileSize) return TFS_ERR_WRITE;
+    int disk = openDisk(filename, nBytes);
+    if (disk < 0) return TFS_ERR_MKFS;
 
-    int bytesPerBlock = BLOCKSIZE - 8;
-    int blockIndex = offset / bytesPerBlock;
-    int offsetWithinBlock = offset % bytesPerBlock;
+    char superBlock[BLOCKSIZE];
+    memset(superBlock, 0, BLOCKSIZE);
+    superBlock[0] = 1;       // superblock type
+    superBlock[1] = 0x44;    // magic number
+    superBlock[2] = (char)(flags | FEATURE_DIRECTORY); // empty directory, head at 24-27 is 0
+    superBlock[3] = SUPER_CLEAN;
+    
+    if (!bitmap && firstFreeBlockLocation < numBlocks)
+        intToBytes(firstFreeBlockLocation, superBlock+4);
+    intToBytes(numBlocks, superBlock+8);
+    intToBytes(numBlocks - firstFreeBlockLocation, superBlock+12); // free blocks
+    if (bitmap) {
+        intToBytes(1, superBlock+16);
+        intToBytes(mapBlocks, superBlock+20);
+    }
+    if (logBlocks > 0) {
+        intToBytes(1 + mapBlocks, superBlock+28);
+        intToBytes(logBlocks, superBlock+32);
+    }
 
-    int dataBlockLocation = bytesToInt(inodeBlock+16);
-    char dataBlock[BLOCKSIZE];
-    int i;
-    for(i = 0; i < blockIndex; i++){
-        if (readBlock(mountedDisk, dataBlockLocation, dataBlock) < 0)
-            return TFS_ERR_WRITE;
-        dataBlockLocation = bytesToInt(dataBlock+4);
-        if (dataBlockLocation == 0) return TFS_ERR_WRITE;
+    if (writeBlock(disk, 0, superBlock) < 0) {
+        closeDisk(disk);
+        return TFS_ERR_MKFS;
     }
-    if (readBlock(mountedDisk, dataBlockLocation, dataBlock) < 0)
-        return TFS_ERR_WRITE;
 
-    dataBlock[8 + offsetWithinBlock] = (char)data;
-    if (writeBlock(mountedDisk, dataBlockLocation, dataBlock) < 0)
-        return TFS_ERR_WRITE;
+    // Bitmap and free blocks are written SCAN_CHUNK at a time with one
+    // vectored write each.
+    char chunk[SCAN_CHUNK * BLOCKSIZE];
+    int first, i;
+    if (bitmap) {
+        int words = (numBlocks + 63) / 64;
+        uint64_t *map = calloc(words, sizeof(uint64_t));
+        if (!map) {
+            closeDisk(disk);
+            return TFS_ERR_MKFS;
+        }
+        for (i = firstFreeBlockLocation; i < numBlocks; i++)
+            map[i / 64] |= (uint64_t)1 << (i % 64);
+        for (first = 0; first < mapBlocks; first += SCAN_CHUNK) {
+            int count = (mapBlocks - first < SCAN_CHUNK) ? mapBlocks - first : SCAN_CHUNK;
+            for (i = 0; i < count; i++)
+                encodeBitmapBlock(map, words, first + i, chunk + i * BLOCKSIZE);
+            if (writeBlocks(disk, 1 + first, count, chunk) < 0) {
+                free(map);
+                closeDisk(disk);
+                return TFS_ERR_MKFS;
+            }
+        }
+        free(map);
+    }
 
-    intToBytes((int)time(NULL), inodeBlock+24);
-    if (writeBlock(mountedDisk, inodeBlockLocation, inodeBlock) < 0)
-        return TFS_ERR_WRITE;
+    // An empty log: its header carries no commit.
+    for (first = 1 + mapBlocks; first < firstFreeBlockLocation; first += SCAN_CHUNK) {
+        int count = (firstFreeBlockLocation - first < SCAN_CHUNK) ? firstFreeBlockLocation - first : SCAN_CHUNK;
+        memset(chunk, 0, count * BLOCKSIZE);
+        for (i = 0; i < count; i++) {
+            chunk[i * BLOCKSIZE] = 9;
+            chunk[i * BLOCKSIZE + 1] = 0x44;
+        }
+        if (writeBlocks(disk, first, count, chunk) < 0) {
+            closeDisk(disk);
+            return TFS_ERR_MKFS;
+        }
+    }
+
+    for(first = firstFreeBlockLocation; first < numBlocks; first += SCAN_CHUNK){
+        int count = (numBlocks - first < SCAN_CHUNK) ? numBlocks - first : SCAN_CHUNK;
+        for(i = 0; i < count; i++){
+            char *freeBlock = chunk + i * BLOCKSIZE;
+            memset(freeBlock, 0, BLOCKSIZE);
+            freeBlock[0] = 4;
+            freeBlock[1] = 0x44;
+            int nextFreeBlockLocation = (bitmap || first + i == numBlocks - 1) ? 0 : first + i + 1;
+            intToBytes(nextFreeBlockLocation, freeBlock+4);
+        }
+        if (writeBlocks(disk, first, count, chunk) < 0) {
+            closeDisk(disk);
+            return TFS_ERR_MKFS;
+        }
+    }
+
+    if (closeDisk(disk) < 0) return TFS_ERR_MKFS;
     return TFS_SUCCESS;
 }
 
-/* tfs_rename:
-   - Renames an open file by updating its inode's filename field and modification timestamp.
+// Sets up journal steps for the volume just mounted, whose group is
+// empty: the log's capacity, the blocks a step of a large write covers
+// (the most whose credits fit it), and whether magazines stay on. On a
+// free-list volume draining a magazine rewrites its blocks, and on a
+// large bitmap one every bitmap block counts against each step that
+// takes from one, so journaled volumes keep them only with a bitmap of at
+// most a quarter of the log.
+static void startJournalSteps(void){
+    vol->logCapacity = (vol->journalBlocks > 0) ? journalRoom(vol->mountedDisk) : 0;
+    if (vol->logCapacity < 0) vol->logCapacity = 0;
+    vol->magazinesOn = vol->logCapacity == 0 ||
+                       (vol->useBitmap && 4 * vol->bitmapBlocks <= vol->logCapacity);
+    vol->stepBlocks = SCAN_CHUNK;
+    while (vol->logCapacity > 0 && vol->stepBlocks > 1 && stepCredits(vol->stepBlocks) > vol->logCapacity) vol->stepBlocks--;
+    vol->logHandles = vol->logCredits = vol->logWaiting = 0;
+}
+
+/* tfs_mount:
+   - Mounts an existing filesystem with default options.
 */
-int tfs_rename(fileDescriptor FD, char *newName) {
-    if (FD < 0 || FD >= MAX_OPEN_FILES || !openFileTable[FD].used)
-        return TFS_ERR_RENAME;
+int tfs_mount(char *diskname){
+    return tfs_mountEx(diskname, 0);
+}
 
-    int nameLength = strlen(newName);
-    if (nameLength > 8) nameLength = 8;
-    char newNameBuffer[9];
-    memset(newNameBuffer, 0, 9);
-    strncpy(newNameBuffer, newName, nameLength);
+/* tfs_mountEx:
+   - Mounts an existing filesystem.
+   - flags selects how reads update access times: TFS_MOUNT_NOATIME never
+     writes them, TFS_MOUNT_RELATIME defers them to close or unmount and
+     only refreshes stale ones. The default writes one on every read.
+   - On a journaled volume, first replays a group the log holds from a
+     crash, then batches the writes of following operations into groups.
+   - Loads the superblock into memory. A volume that was unmounted
+     cleanly mounts without the consistency check and takes its free count
+     from the superblock; one that was not is checked first, unless flags
+     has TFS_MOUNT_NOCHECK, which leaves the check to tfs_check().
+     TFS_MOUNT_CHECK checks even a clean volume. The free count is then
+     maintained in memory until unmount.
+   - Marks the volume as in use on the disk before returning, so a crash
+     leaves it to be checked at the next mount.
+   - tfs_getMountStats() reports how long the mount took and what it did.
+   - Returns TFS_SUCCESS if successful, TFS_ERR_MOUNT otherwise.
+*/
+static int mountExLocked(char *diskname, int flags){
+    if (vol->isMounted >= 0) return TFS_ERR_MOUNT;
+    if (flags & ~(TFS_MOUNT_NOATIME | TFS_MOUNT_RELATIME | TFS_MOUNT_CHECK | TFS_MOUNT_NOCHECK))
+        return TFS_ERR_MOUNT;
+    if ((flags & TFS_MOUNT_CHECK) && (flags & TFS_MOUNT_NOCHECK)) return TFS_ERR_MOUNT;
 
-    int inodeBlockLocation = openFileTable[FD].inodeBlock;
-    char inodeBlock[BLOCKSIZE];
-    if (readBlock(mountedDisk, inodeBlockLocation, inodeBlock) < 0)
-        return TFS_ERR_RENAME;
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    memset(&vol->mountStats, 0, sizeof(vol->mountStats));
+    int disk = openDisk(diskname, 0);
+    if (disk < 0) return TFS_ERR_MOUNT;
 
-    memset(inodeBlock+4, 0, 8);
-    memcpy(inodeBlock+4, newNameBuffer, 8);
-    intToBytes((int)time(NULL), inodeBlock+24);
-    if (writeBlock(mountedDisk, inodeBlockLocation, inodeBlock) < 0)
-        return TFS_ERR_RENAME;
+    if (readBlock(disk, 0, vol->mountedSuper) < 0 ||
+        vol->mountedSuper[0] != 1 || vol->mountedSuper[1] != 0x44) {
+        closeDisk(disk);
+        return TFS_ERR_MOUNT;
+    }
+    if (vol->mountedSuper[2] & ~(TFS_MKFS_BITMAP | FEATURE_DIRECTORY | TFS_MKFS_INDEXED | TFS_MKFS_JOURNAL)) {
+        printf("Mount failed: unsupported filesystem features 0x%x.\n", vol->mountedSuper[2] & 0xFF);
+        closeDisk(disk);
+        return TFS_ERR_MOUNT;
+    }
+    vol->journalStart = vol->journalBlocks = 0;
+    if (vol->mountedSuper[2] & TFS_MKFS_JOURNAL) {
+        vol->journalStart = bytesToInt(vol->mountedSuper+28);
+        vol->journalBlocks = bytesToInt(vol->mountedSuper+32);
+        // the replay may rewrite the superblock itself
+        if (vol->journalStart < 1 || (vol->mountStats.replayed = openJournal(disk, vol->journalStart, vol->journalBlocks)) < 0 ||
+            readBlock(disk, 0, vol->mountedSuper) < 0) {
+            printf("Mount failed: journal is unreadable.\n");
+            vol->journalStart = vol->journalBlocks = 0;
+            closeDisk(disk);
+            return TFS_ERR_MOUNT;
+        }
+    }
+    vol->mountedDisk = disk;
+    vol->superDirty = 0;
+
+    vol->totalBlocks = bytesToInt(vol->mountedSuper+8);
+    vol->useBitmap = (vol->mountedSuper[2] & TFS_MKFS_BITMAP) != 0;
+    if (vol->useBitmap && loadBitmap() < 0) {
+        releaseBitmap();
+        closeDisk(vol->mountedDisk);
+        vol->mountedDisk = -1;
+        printf("Mount failed: free-space bitmap is unreadable.\n");
+        return TFS_ERR_MOUNT;
+    }
+    vol->mountStats.wasClean = (vol->mountedSuper[3] & SUPER_CLEAN) != 0;
+    vol->mountStats.checked = (flags & TFS_MOUNT_CHECK) || (!vol->mountStats.wasClean && !(flags & TFS_MOUNT_NOCHECK));
+    if (vol->mountStats.checked) {
+        // Invoke consistency checks.
+        if(tfs_checkConsistency() != 0) {
+            releaseBitmap();
+            closeDisk(vol->mountedDisk);
+            vol->mountedDisk = -1;
+            printf("Block %d: %s.\n", vol->lastCheck.problems[0].block, tfs_checkProblemText(vol->lastCheck.problems[0].code));
+            printf("Mount failed: File system inconsistency detected.\n");
+            return TFS_ERR_MOUNT;
+        }
+    } else {
+        vol->freeBlockCount = vol->mountStats.wasClean ? bytesToInt(vol->mountedSuper+12) : countFreeBlocks();
+        if (vol->freeBlockCount < 0 || vol->freeBlockCount > vol->totalBlocks) {
+            releaseBitmap();
+            closeDisk(vol->mountedDisk);
+            vol->mountedDisk = -1;
+            printf("Mount failed: free space is unreadable.\n");
+            return TFS_ERR_MOUNT;
+        }
+    }
+    int loaded = (vol->mountedSuper[2] & FEATURE_DIRECTORY) ? loadDirectory() : upgradeDirectory();
+    if (loaded < 0) {
+        releaseDirectory();
+        releaseNameIndex();
+        releaseBitmap();
+        closeDisk(vol->mountedDisk);
+        vol->mountedDisk = -1;
+        printf("Mount failed: directory is unreadable.\n");
+        return TFS_ERR_MOUNT;
+    }
+    if (markVolume(0) < 0) {
+        releaseDirectory();
+        releaseNameIndex();
+        releaseBitmap();
+        closeDisk(vol->mountedDisk);
+        vol->mountedDisk = -1;
+        return TFS_ERR_MOUNT;
+    }
+    clearOpenFileTable();
+    startJournalSteps();
+    vol->mountFlags = flags;
+    vol->defragPassWhole = bytesToInt(vol->mountedSuper+36) == 0;
+    vol->defragPassMoved = vol->defragPasses = vol->defragBlocksMoved = vol->defragLongestMicros = 0;
+    vol->uncheckedDirty = !vol->mountStats.wasClean && !vol->mountStats.checked;
+    vol->isMounted = 1;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    vol->mountStats.micros = (finished.tv_sec - started.tv_sec) * 1000000L +
+                        (finished.tv_nsec - started.tv_nsec) / 1000;
     return TFS_SUCCESS;
 }
 
-/* tfs_readdir:
-   - Scans the disk for inode blocks and prints each file's info.
+/* tfs_getMountStats:
+   - Copies the statistics of the last mount into stats: its duration in
+     microseconds (0 if it failed), whether the volume had been unmounted
+     cleanly, whether the consistency check ran, and how many blocks the
+     journal replayed.
+   - Returns TFS_SUCCESS, or TFS_ERR if stats is NULL.
+*/
+static int getMountStatsLocked(TfsMountStats *stats){
+    if (!stats) return TFS_ERR;
+    *stats = vol->mountStats;
+    return TFS_SUCCESS;
+}
+
+/* tfs_check:
+   - Runs the consistency check on the mounted volume, for a volume mounted
+     with TFS_MOUNT_NOCHECK or whenever the caller wants one.
+   - A volume mounted dirty without a check is only marked clean again at
+     unmount once a tfs_check() has passed.
+   - What the check found is available from tfs_getCheckReport().
+   - Returns TFS_SUCCESS if the volume is consistent, TFS_ERR if it is not
+     or nothing is mounted.
+*/
+static int checkLocked(void){
+    if (vol->mountedDisk < 0) return TFS_ERR;
+    if (drainMagazines() < 0 || syncSuperBlock() < 0 || tfs_checkConsistency() != 0) return TFS_ERR;
+    vol->uncheckedDirty = 0;
+    return TFS_SUCCESS;
+}
+
+/* tfs_unmount:
+   - Writes back deferred access times and the in-memory superblock and
+     unmounts the filesystem, committing the journal's last group.
+   - Once everything else is on the disk, marks the volume clean so the
+     next mount can skip the consistency check; a volume mounted dirty
+     without a check stays dirty until tfs_check() passes.
+   - Returns TFS_SUCCESS on success or TFS_ERR_UNMOUNT if no filesystem is mounted.
+*/
+static int unmountLocked(void){
+    if (vol->mountedDisk < 0) return TFS_ERR_UNMOUNT;
+    int i;
+    beginLog(logCredits(MAX_OPEN_FILES, 0));
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (vol->openFileTable[i].used) flushAtime(i);
+    }
+    endLog();
+    if (drainMagazines() < 0 || syncSuperBlock() < 0) return TFS_ERR_UNMOUNT;
+    if (!vol->uncheckedDirty) {
+        // the flag must not reach the disk before the writes it vouches for
+        if ((vol->journalBlocks > 0 ? commitJournal(vol->mountedDisk) : syncDisk(vol->mountedDisk)) < 0)
+            return TFS_ERR_UNMOUNT;
+        vol->mountedSuper[3] |= SUPER_CLEAN;
+        vol->superDirty = 1;
+        if (syncSuperBlock() < 0) return TFS_ERR_UNMOUNT;
+    }
+    if (closeDisk(vol->mountedDisk) < 0) return TFS_ERR_UNMOUNT;
+
+    releaseBitmap();
+    releaseNameIndex();
+    releaseDirectory();
+    vol->mountedDisk = -1;
+    vol->isMounted = -1;
+    vol->journalStart = vol->journalBlocks = 0;
+    vol->logCapacity = 0;
+    clearOpenFileTable();
+    return TFS_SUCCESS;
+}
+
+/* tfs_sync:
+   - Makes every completed operation durable. On a journaled volume this
+     commits the current group: all operations since the last commit reach
+     the disk with one forced log write, and after a crash they are
+     replayed together at the next mount.
+   - Otherwise writes back the superblock and forces the disk file to
+     stable storage.
+   - Returns TFS_SUCCESS, or TFS_ERR_UNMOUNT if nothing is mounted or the
+     disk fails.
+*/
+static int syncLocked(void){
+    if (vol->mountedDisk < 0) return TFS_ERR_UNMOUNT;
+    if (drainMagazines() < 0 || syncSuperBlock() < 0) return TFS_ERR_UNMOUNT;
+    if (vol->journalBlocks > 0) return commitJournal(vol->mountedDisk) < 0 ? TFS_ERR_UNMOUNT : TFS_SUCCESS;
+    return syncDisk(vol->mountedDisk) < 0 ? TFS_ERR_UNMOUNT : TFS_SUCCESS;
+}
+
+/* tfs_openFile:
+   - Opens a file. If the file does not exist, a new inode is created.
+   - Initializes timestamps and sets file mode to read-write.
+   - Returns a file descriptor on success or TFS_ERR_OPEN if an error occurs.
+   - Fails if the filename is longer than 8 characters.
 */
-int tfs_readdir(void) {
-    if (mountedDisk < 0) return TFS_ERR_READDIR;
+static fileDescriptor openFileLocked(char *name) {
+    if (vol->mountedDisk < 0) return TFS_ERR_OPEN;
+    if (strlen(name) > 8) return TFS_ERR_OPEN;
+
+    int nameLength = strlen(name);
+    char inodeName[9];
+    memset(inodeName, 0, 9);
+    strncpy(inodeName, name, nameLength);
 
     char block[BLOCKSIZE];
-    int i, found = 0;
-    printf("Directory Listing:\n");
-    for (i = 0; i < totalBlocks; i++){
-        if (readBlock(mountedDisk, i, block) < 0)
-            continue;
-        if (block[0] == 2 && block[1] == 0x44) {
-            found = 1;
-            char filename[9];
-            memcpy(filename, block+4, 8);
-            filename[8] = '\0';
-            int fileSize = bytesToInt(block+12);
-            int readOnly = block[32];
-            printf("  Name: %s, Size: %d bytes, Read-Only: %s\n",
-                   filename, fileSize, readOnly ? "Yes" : "No");
+    int i;
+    // Search disk for an inode with matching name.
+    int inodeBlockLocation = findInode(inodeName);
+    if (inodeBlockLocation < 0) {
+        // File doesn't exist, create a new inode.
+        inodeBlockLocation = getFreeBlock();
+        if (inodeBlockLocation < 0) return TFS_ERR_OPEN;
+
+        memset(block, 0, BLOCKSIZE);
+        block[0] = 2;        // inode block type
+        block[1] = 0x44;     // magic number
+        memcpy(block + 4, inodeName, 8);
+        intToBytes(0, block + 12); // file size = 0
+        intToBytes(0, block + 16); // no data block yet
+
+        // Set timestamps (creation, modification, access)
+        int timestamp = (int)time(NULL);
+        intToBytes(timestamp, block + 20);
+        intToBytes(timestamp, block + 24);
+        intToBytes(timestamp, block + 28);
+        block[32] = 0;       // read-write flag
+
+        // Generate a random color and store it in bytes 33-35.
+        int r, g, b;
+        generateRandomColor(&r, &g, &b);
+        block[33] = (char)r;
+        block[34] = (char)g;
+        block[35] = (char)b;
+        if (vol->mountedSuper[2] & TFS_MKFS_INDEXED) block[36] = INODE_INDEXED;
+
+        if (writeBlock(vol->mountedDisk, inodeBlockLocation, block) < 0)
+            return TFS_ERR_OPEN;
+        int dirSlot = dirAddEntry(inodeName, inodeBlockLocation);
+        if (dirSlot < 0) {
+            addFreeBlock(inodeBlockLocation);
+            syncSuperBlock();
+            return TFS_ERR_OPEN;
         }
+        syncSuperBlock();
+        nameIndexInsert(inodeName, inodeBlockLocation, dirSlot);
+
+        // Add one mapping entry.
+        addMapping(inodeBlockLocation, inodeName, 0, r, g, b);
     }
-    if (!found)
-        printf("  (No files found)\n");
+
+    // Insert into open file table.
+    int fd = -1;
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (!vol->openFileTable[i].used) {
+            fd = i;
+            vol->openFileTable[i].used = 1;
+            vol->openFileTable[i].inodeBlock = inodeBlockLocation;
+            vol->openFileTable[i].filePointer = 0;
+            vol->openFileTable[i].cursorIndex = -1;
+            vol->openFileTable[i].pendingAtime = 0;
+            break;
+        }
+    }
+    if (fd < 0) return TFS_ERR_OPEN;
+    return fd;
+}
+
+static int closeFileLocked(fileDescriptor FD){
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used) return TFS_ERR_CLOSE;
+
+    flushAtime(FD);
+    vol->openFileTable[FD].used = 0;
+    vol->openFileTable[FD].inodeBlock = -1;
+    vol->openFileTable[FD].filePointer = -1;
+    vol->openFileTable[FD].cursorIndex = -1;
     return TFS_SUCCESS;
 }
 
-void tfs_displayFragments() {
-    if (mountedDisk < 0) {
-        printf("No filesystem mounted.\n");
-        return;
+void freeAllocatedBlocks(int allocatedBlocks[], int length){
+    int i;
+    for(i = 0; i < length; i++){
+        addFreeBlock(allocatedBlocks[i]);
     }
+}
 
-    char block[BLOCKSIZE];
+typedef struct {
+    int start;  // first block of a run of free blocks
+    int length; // number of blocks in the run
+} Extent;
+
+static int compareBlockNums(const void *a, const void *b){
+    return *(const int *)a - *(const int *)b;
+}
+
+static int compareExtentStart(const void *a, const void *b){
+    return ((const Extent *)a)->start - ((const Extent *)b)->start;
+}
+
+// Longest runs first; equal runs keep disk order.
+static int compareExtentLength(const void *a, const void *b){
+    const Extent *x = a, *y = b;
+    if (x->length != y->length) return y->length - x->length;
+    return x->start - y->start;
+}
+
+// Takes count blocks of each bitmap run in extents[0..n) in disk order.
+static void takeExtents(Extent *extents, int n, int count, int *blocks){
+    int i, j, taken = 0;
+    for (i = 0; i < n && taken < count; i++) {
+        for (j = 0; j < extents[i].length && taken < count; j++) {
+            blocks[taken++] = extents[i].start + j;
+            setBlockFree(extents[i].start + j, 0);
+        }
+    }
+}
+
+// Allocates the count blocks of one file into blocks[], all or nothing, in
+// ascending order so the file's chain runs forward on disk.
+// - Bitmap volumes: one contiguous run when there is one, otherwise the
+//   fewest runs that add up to count (the longest runs).
+// - Free-list volumes: only the head of the list is reachable, so the first
+//   count blocks are taken off the list and sorted; blocks freed together
+//   come back adjacent.
+static int allocBlocks(int count, int *blocks){
+    if (count > vol->freeBlockCount) reclaimMagazines();
+    if (count > vol->freeBlockCount) return -1;
     int i;
-    printf("--- File Color Mapping ---\n");
-    for (i = 0; i < inodeCount; i++) {
-        printf("  \033[1;38;2;%d;%d;%dm%s\033[0m\n", 
-               inodeColors[i].r, inodeColors[i].g, inodeColors[i].b, inodeColors[i].name);
+    if (!vol->useBitmap) {
+        for (i = 0; i < count; i++) {
+            blocks[i] = getFreeBlock();
+            if (blocks[i] < 0) {
+                freeAllocatedBlocks(blocks, i);
+                return -1;
+            }
+        }
+        qsort(blocks, count, sizeof(int), compareBlockNums);
+        return 0;
     }
 
-    printf("\n--- Disk Fragmentation Map ---\n");
-    for (i = 0; i < totalBlocks; i++) {
-        if (readBlock(mountedDisk, i, block) < 0) continue;
-        if (i == 0) {
-            printf("\033[1m[SUPERBLOCK]\033[0m ");
-        } else if (block[0] == 2) {  // Inode block
-            InodeColor *color = NULL;
-            int j;
-            for (j = 0; j < inodeCount; j++) {
-                if (inodeColors[j].inodeIndex == i) {
-                    color = &inodeColors[j];
-                    break;
+    Extent extent;
+    extent.start = bitmapFindRun(count);
+    if (extent.start >= 0) {
+        extent.length = count;
+        takeExtents(&extent, 1, count, blocks);
+    } else {
+        // No single run is long enough: gather every run, keep the longest
+        // ones that cover count, and take them in disk order.
+        int capacity = 64, n = 0, len;
+        Extent *extents = malloc(capacity * sizeof(Extent));
+        if (!extents) return -1;
+        int start = bitmapNextRun(0, &len);
+        while (start >= 0) {
+            if (n == capacity) {
+                capacity *= 2;
+                Extent *grown = realloc(extents, capacity * sizeof(Extent));
+                if (!grown) {
+                    free(extents);
+                    return -1;
                 }
+                extents = grown;
             }
-            if (color) {
-                printf("\033[3;38;2;%d;%d;%dm[INODE]\033[0m ", 
-                       color->r, color->g, color->b);
-            } else {
-                printf("\033[3m[UNKNOWN INODE]\033[0m ");
-            }
-        } else if (block[0] == 3) {  // Data block
-            InodeColor *owner = getOwnerForDataBlock(i);
-            if (owner) {
-                printf("\033[1;38;2;%d;%d;%dm[DATA]\033[0m ", 
-                       owner->r, owner->g, owner->b);
-            } else {
-                printf("\033[1;36m[DATA]\033[0m ");
-            }
-        } else if (block[0] == 4) {
-            printf("\033[1;31m[FREE]\033[0m ");
-        } else {
-            printf("\033[1;33m[UNKNOWN]\033[0m ");
+            extents[n].start = start;
+            extents[n].length = len;
+            n++;
+            start = bitmapNextRun(start + len, &len);
         }
-        if ((i + 1) % 10 == 0) printf("\n");
+        qsort(extents, n, sizeof(Extent), compareExtentLength);
+        int used = 0, covered = 0;
+        while (used < n && covered < count) covered += extents[used++].length;
+        if (covered < count) {
+            free(extents);
+            return -1;
+        }
+        extents[used - 1].length -= covered - count; // only part of the shortest one
+        qsort(extents, used, sizeof(Extent), compareExtentStart);
+        takeExtents(extents, used, count, blocks);
+        free(extents);
     }
-    printf("\n");
+    vol->allocHint = (blocks[count - 1] + 1 < vol->totalBlocks) ? blocks[count - 1] + 1 : 0;
+    vol->freeBlockCount -= count;
+    vol->superDirty = 1;
+    return 0;
 }
 
-void tfs_defrag() {
-    if (mountedDisk < 0) {
-        printf("No filesystem mounted.\n");
-        return;
+// Claims the calling thread's magazine, without waiting: returns NULL if a
+// thread sharing its slot is using it or the volume has magazines off.
+static int nextMagazine = 0;
+static __thread int magazineSlot = -1;
+
+static Magazine *grabMagazine(void){
+    if (!vol->magazinesOn) return NULL;
+    if (magazineSlot < 0) magazineSlot = __atomic_fetch_add(&nextMagazine, 1, __ATOMIC_RELAXED) % MAGAZINES;
+    Magazine *m = &vol->magazines[magazineSlot];
+    if (__atomic_exchange_n(&m->busy, 1, __ATOMIC_ACQUIRE)) return NULL;
+    return m;
+}
+
+static void releaseMagazine(Magazine *m){
+    __atomic_store_n(&m->busy, 0, __ATOMIC_RELEASE);
+}
+
+// Returns all but the top keep blocks of m to the free space. Metadata
+// lock held.
+static int drainMagazine(Magazine *m, int keep){
+    int count = m->count - keep;
+    int i;
+    if (count <= 0) return 0;
+    if (vol->useBitmap) {
+        // they already are free blocks on disk
+        for (i = 0; i < count; i++) setBlockFree(m->blocks[i], 1);
+        vol->freeBlockCount += count;
+        vol->superDirty = 1;
+    } else {
+        qsort(m->blocks, count, sizeof(int), compareBlockNums); // the list runs forward
+        if (writeFreeBlocks(m->blocks, count, 1) < 0) return -1;
     }
+    memmove(m->blocks, m->blocks + count, keep * sizeof(int));
+    m->count = keep;
+    __atomic_sub_fetch(&vol->reservedBlocks, count, __ATOMIC_RELAXED);
+    return 0;
+}
 
-    char block[BLOCKSIZE];
-    int *mapping = malloc(totalBlocks * sizeof(int));
-    if (!mapping) return;
+// Empties every magazine, with the volume held alone, as one journal step.
+static int drainMagazines(void){
+    int result = 0, i;
+    beginLog(logCredits(vol->useBitmap ? 0 : vol->reservedBlocks, vol->reservedBlocks));
+    lockMeta();
+    for (i = 0; i < MAGAZINES; i++) {
+        if (drainMagazine(&vol->magazines[i], 0) < 0) result = -1;
+    }
+    unlockMeta();
+    endLog();
+    return result;
+}
+
+// Called with the metadata lock when the free space runs short: drains the
+// magazines no thread is using.
+static void reclaimMagazines(void){
     int i;
-    // Initialize mapping so that mapping[i] = i initially.
-    for (i = 0; i < totalBlocks; i++) {
-        mapping[i] = i;
+    for (i = 0; i < MAGAZINES; i++) {
+        Magazine *m = &vol->magazines[i];
+        if (__atomic_exchange_n(&m->busy, 1, __ATOMIC_ACQUIRE)) continue;
+        drainMagazine(m, 0);
+        releaseMagazine(m);
     }
-    int nextFreeIndex = 1;
-    // Move allocated blocks to the beginning (after superblock).
-    for (i = 1; i < totalBlocks; i++) {
-        if (readBlock(mountedDisk, i, block) < 0) continue;
-        if (block[0] != 4) {  // if block is not free
-            if (i != nextFreeIndex) {
-                // Move block from i to nextFreeIndex.
-                writeBlock(mountedDisk, nextFreeIndex, block);
-                // Mark block i as free.
-                memset(block, 0, BLOCKSIZE);
-                block[0] = 4;
-                block[1] = 0x44;
-                int nextFree = (i == totalBlocks - 1) ? 0 : i + 1;
-                intToBytes(nextFree, block+4);
-                writeBlock(mountedDisk, i, block);
-                // Update mapping: block originally at i now resides at nextFreeIndex.
-                mapping[i] = nextFreeIndex;
+}
+
+// Makes the held magazine m hold at least need blocks and leave room for
+// room more (both at most MAGAZINE_BATCH), refilling it from the free space
+// or draining it there when it does not. A refill takes a batch beyond
+// need, but no more than a fair share of the free space; on bitmap volumes
+// the magazine is emptied first and refilled with one run when there is
+// one, so a file allocated from it stays one extent. Returns -1 if the
+// free space cannot cover need.
+static int stockMagazine(Magazine *m, int need, int room){
+    if (m->count >= need && m->count + room <= MAGAZINE_SIZE) return 0;
+    int result = 0;
+    lockMeta();
+    if (m->count + room > MAGAZINE_SIZE) result = drainMagazine(m, MAGAZINE_SIZE - room - MAGAZINE_BATCH);
+    if (result == 0 && m->count < need && vol->useBitmap) drainMagazine(m, 0);
+    if (result == 0 && m->count < need) {
+        int want = need - m->count;
+        if (vol->freeBlockCount < want) reclaimMagazines();
+        if (vol->freeBlockCount < want) {
+            result = -1;
+        } else {
+            int extra = vol->freeBlockCount / (2 * MAGAZINES);
+            want += extra < MAGAZINE_BATCH ? extra : MAGAZINE_BATCH;
+            if (want > MAGAZINE_SIZE - room - m->count) want = MAGAZINE_SIZE - room - m->count;
+            // pushed in reverse, so the lowest block is taken first
+            int *top = m->blocks + m->count;
+            int run = vol->useBitmap ? bitmapFindRun(want) : -1;
+            int taken = 0, i;
+            while (taken < want) {
+                int blockNum;
+                if (run >= 0) {
+                    blockNum = run + taken;
+                    setBlockFree(blockNum, 0);
+                    vol->freeBlockCount--;
+                    vol->superDirty = 1;
+                } else if ((blockNum = getFreeBlock()) < 0) {
+                    break;
+                }
+                for (i = taken; i > 0; i--) top[i] = top[i - 1];
+                top[0] = blockNum;
+                taken++;
             }
-            nextFreeIndex++;
-        }
-    }
-    // Update chain pointers inside inode and data blocks.
-    for (i = 1; i < nextFreeIndex; i++) {
-        if (readBlock(mountedDisk, i, block) < 0) continue;
-        if (block[0] == 2) { // inode block
-            int oldFirstData = bytesToInt(block+16);
-            int newFirstData = (oldFirstData == 0) ? 0 : mapping[oldFirstData];
-            intToBytes(newFirstData, block+16);
-            writeBlock(mountedDisk, i, block);
-        } else if (block[0] == 3) { // data block
-            int oldNext = bytesToInt(block+4);
-            int newNext = (oldNext == 0) ? 0 : mapping[oldNext];
-            intToBytes(newNext, block+4);
-            writeBlock(mountedDisk, i, block);
-        }
-    }
-    // Update global inodeColors table with new inode and first data block numbers.
-    for (i = 0; i < inodeCount; i++) {
-        int oldInode = inodeColors[i].inodeIndex;
-        inodeColors[i].inodeIndex = mapping[oldInode];
-        int oldData = inodeColors[i].firstDataBlock;
-        if (oldData != 0)
-            inodeColors[i].firstDataBlock = mapping[oldData];
+            m->count += taken;
+            __atomic_add_fetch(&vol->reservedBlocks, taken, __ATOMIC_RELAXED);
+            if (m->count < need) result = -1;
+        }
     }
-    free(mapping);
-    printf("Defragmentation complete.\n");
+    unlockMeta();
+    return result;
 }
-/* tfs_checkConsistency()
- * Returns 0 if the file system is consistent, or a negative error code otherwise.
- */
-static int tfs_checkConsistency(void) {
-    int i;  // Declare the loop variable once for use in all loops.
-    
-    // Allocate arrays to track block status and inode references.
-    int *status = calloc(totalBlocks, sizeof(int));
-    int *referenced = calloc(totalBlocks, sizeof(int));
-    if (!status || !referenced) {
-        free(status);
-        free(referenced);
-        return -1;
+
+// Takes the top count blocks of the held magazine m into blocks[], in
+// ascending order.
+static void popMagazine(Magazine *m, int count, int *blocks){
+    m->count -= count;
+    memcpy(blocks, m->blocks + m->count, count * sizeof(int));
+    qsort(blocks, count, sizeof(int), compareBlockNums);
+    __atomic_sub_fetch(&vol->reservedBlocks, count, __ATOMIC_RELAXED);
+}
+
+// Frees every data and index block of the file whose inode is given. The
+// blocks are listed once and go to the held magazine m when it has room,
+// written as free blocks but left unlinked; otherwise they are linked
+// onto the free space under the metadata lock, see writeFreeBlocks.
+static int freeFileBlocks(const char *inode, Magazine *m){
+    BlockList list = {NULL, 0, 0};
+    if (collectFileBlocks(inode, &list, &list) < 0) return -1;
+    int count = list.count;
+    int result;
+    if (m && m->count + count <= MAGAZINE_SIZE) {
+        result = writeFreeBlocks(list.blocks, count, 0);
+        if (result == 0) {
+            memcpy(m->blocks + m->count, list.blocks, count * sizeof(int));
+            m->count += count;
+            __atomic_add_fetch(&vol->reservedBlocks, count, __ATOMIC_RELAXED);
+        }
+    } else {
+        lockMeta();
+        result = writeFreeBlocks(list.blocks, count, 1);
+        unlockMeta();
     }
+    free(list.blocks);
+    return result;
+}
 
-    char block[BLOCKSIZE];
+// Allocates count blocks into blocks[] like allocBlocks. Requests of up to
+// MAGAZINE_BATCH blocks come from the calling thread's magazine and only
+// take the metadata lock when it needs a refill.
+static int takeFreeBlocks(int count, int *blocks){
+    Magazine *m = count <= MAGAZINE_BATCH ? grabMagazine() : NULL;
+    int result;
+    if (m) {
+        result = stockMagazine(m, count, 0);
+        if (result == 0) popMagazine(m, count, blocks);
+        releaseMagazine(m);
+        return result;
+    }
+    lockMeta();
+    result = allocBlocks(count, blocks);
+    unlockMeta();
+    return result;
+}
 
-    // --- Check Superblock ---
-    if (readBlock(mountedDisk, 0, block) < 0) {
-        free(status); 
-        free(referenced);
-        return -1;
+// Writes size bytes of buffer at offset of the file open as FD, whose inode
+// is given, and sets the file size to newSize. offset is within the file,
+// newSize is at least offset + size, and the file keeps or grows its block
+// count: blocks it already has are rewritten in place and only the missing
+// data and index blocks are allocated. Blocks the write covers are built in
+// memory; one it only partly covers is read first. Returns -1, leaving the
+// file unchanged, if the new blocks do not fit.
+static int writeFileRange(fileDescriptor FD, char *inode, int offset, const char *buffer, int size, int newSize){
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    int indexed = isIndexed(inode);
+    int bytesPerBlock = payloadSize(inode);
+    int oldData = (bytesToInt(inode + 12) + bytesPerBlock - 1) / bytesPerBlock;
+    int newData = (newSize + bytesPerBlock - 1) / bytesPerBlock;
+    if (newData < oldData || (indexed && newData > MAX_INDEXED_BLOCKS)) return -1;
+    int oldIndex = indexed ? indexBlocksFor(oldData) : 0;
+    int newIndex = indexed ? indexBlocksFor(newData) : 0;
+    if (newData - oldData + newIndex - oldIndex > getFreeBlockCount()) return -1;
+
+    BlockList data = {NULL, 0, 0}, index = {NULL, 0, 0};
+    if (collectFileBlocks(inode, &data, &index) < 0) return -1;
+    int result = (data.count == oldData && index.count == oldIndex) ? 0 : -1;
+    int i;
+    for (i = oldData; i < newData && result == 0; i++) result = appendBlock(&data, 0);
+    for (i = oldIndex; i < newIndex && result == 0; i++) result = appendBlock(&index, 0);
+    if (result == 0 && newData > oldData && takeFreeBlocks(newData - oldData, data.blocks + oldData) < 0)
+        result = -1;
+    else if (result == 0 && newIndex > oldIndex && takeFreeBlocks(newIndex - oldIndex, index.blocks + oldIndex) < 0) {
+        lockMeta();
+        freeAllocatedBlocks(data.blocks + oldData, newData - oldData);
+        unlockMeta();
+        result = -1;
     }
-    if (block[0] != 1 || block[1] != 0x44) {
-        printf("Superblock corrupted.\n");
-        free(status); 
-        free(referenced);
+    if (result < 0) {
+        free(data.blocks);
+        free(index.blocks);
+        lockMeta();
+        syncSuperBlock();
+        unlockMeta();
         return -1;
     }
-    status[0] = 1; // Superblock is allocated.
 
-    // --- Traverse the Free List ---
-    int freePtr = bytesToInt(block + 4); // starting free block pointer from superblock.
-    while (freePtr != 0) {
-        if (freePtr < 1 || freePtr >= totalBlocks) {
-            printf("Free list pointer out of range: %d\n", freePtr);
-            free(status); 
-            free(referenced);
-            return -1;
-        }
-        if (status[freePtr] != 0) {  // already marked allocated/free?
-            printf("Block %d appears multiple times in free list or conflicts with allocation.\n", freePtr);
-            free(status); 
-            free(referenced);
-            return -1;
-        }
-        if (readBlock(mountedDisk, freePtr, block) < 0) {
-            free(status); 
-            free(referenced);
-            return -1;
-        }
-        if (block[0] != 4 || block[1] != 0x44) {
-            printf("Block %d in free list is not a valid free block.\n", freePtr);
-            free(status); 
-            free(referenced);
-            return -1;
-        }
-        status[freePtr] = 2; // mark as free.
-        freePtr = bytesToInt(block + 4);
+    // Blocks the write touches, plus every new block and, when a chain
+    // grows, its old last block, which gets linked to the first new one.
+    int first = offset / bytesPerBlock;
+    int last = size > 0 ? (offset + size - 1) / bytesPerBlock : first - 1;
+    if (newData > oldData) {
+        last = newData - 1;
+        if (!indexed && oldData > 0 && first > oldData - 1) first = oldData - 1;
     }
-
-    // --- Scan All Blocks ---
-    for (i = 1; i < totalBlocks; i++) {
-        if (readBlock(mountedDisk, i, block) < 0) {
-            free(status); 
-            free(referenced);
-            return -1;
-        }
-        // Check the magic number for all blocks.
-        if (block[1] != 0x44) {
-            printf("Block %d has an invalid magic number.\n", i);
-            free(status); 
-            free(referenced);
-            return -1;
-        }
-        // If block type indicates a free block, then it should have been marked free by the free list.
-        if (block[0] == 4) {
-            if (status[i] != 2) {
-                printf("Block %d is free on disk but not found in the free list.\n", i);
-                free(status); 
-                free(referenced);
-                return -1;
-            }
-        } else if (block[0] == 2 || block[0] == 3) {
-            // For inode (2) and data (3) blocks, ensure they are not marked free.
-            if (status[i] == 2) {
-                printf("Block %d is allocated but also appears in the free list.\n", i);
-                free(status); 
-                free(referenced);
-                return -1;
+    // Blocks are built in a fixed buffer and written SCAN_CHUNK at a time.
+    char (*chunk)[BLOCKSIZE] = malloc(SCAN_CHUNK * BLOCKSIZE);
+    BlockVec list[SCAN_CHUNK];
+    int queued = 0;
+    if (!chunk) result = -1;
+    for (i = first; i <= last && result == 0; i++) {
+        char *block = chunk[queued];
+        int start = i * bytesPerBlock; // file offset of the block's first byte
+        int end = (start + bytesPerBlock < newSize) ? start + bytesPerBlock : newSize;
+        int from = (offset > start) ? offset : start;
+        int to = (offset + size < end) ? offset + size : end;
+        if (i < oldData && (from > start || to < end)) {
+            if (readBlock(vol->mountedDisk, data.blocks[i], block) < 0) {
+                result = -1;
+                break;
             }
-            status[i] = 1; // mark as allocated.
         } else {
-            printf("Block %d has an unknown type: %d\n", i, block[0]);
-            free(status); 
-            free(referenced);
-            return -1;
+            memset(block, 0, BLOCKSIZE);
+            block[0] = indexed ? 8 : 3; // indexed or chained data block type
+            block[1] = 0x44;
+        }
+        if (!indexed) intToBytes(i + 1 < newData ? data.blocks[i + 1] : 0, block + 4);
+        if (to > from) memcpy(block + payloadOffset(inode) + from - start, buffer + from - offset, to - from);
+        list[queued].bNum = data.blocks[i];
+        list[queued].block = block;
+        if (++queued == SCAN_CHUNK || i == last) {
+            if (writeBlockList(vol->mountedDisk, list, queued) < 0) result = -1;
+            queued = 0;
         }
     }
+    free(chunk);
+    if (result == 0 && indexed && newData > oldData)
+        result = writeBlockMap(inode, data.blocks, newData, index.blocks, oldData);
+    invalidateCursors(inodeBlockLocation);
 
-    // --- Check Inode Chains ---
-    for (i = 0; i < totalBlocks; i++) {
-        if (readBlock(mountedDisk, i, block) < 0) {
-            free(status); 
-            free(referenced);
-            return -1;
-        }
-        if (block[0] == 2) {  // inode block
-            int dataPtr = bytesToInt(block + 16);
-            while (dataPtr != 0) {
-                if (dataPtr < 1 || dataPtr >= totalBlocks) {
-                    printf("Inode at block %d references an invalid data block %d.\n", i, dataPtr);
-                    free(status); 
-                    free(referenced);
-                    return -1;
-                }
-                char dataBlock[BLOCKSIZE];
-                if (readBlock(mountedDisk, dataPtr, dataBlock) < 0) {
-                    free(status); 
-                    free(referenced);
-                    return -1;
-                }
-                if (dataBlock[0] != 3 || dataBlock[1] != 0x44) {
-                    printf("Inode at block %d references a corrupted data block %d.\n", i, dataPtr);
-                    free(status); 
-                    free(referenced);
-                    return -1;
-                }
-                if (referenced[dataPtr] != 0) {
-                    printf("Data block %d is referenced by multiple inodes.\n", dataPtr);
-                    free(status); 
-                    free(referenced);
-                    return -1;
-                }
-                referenced[dataPtr] = 1;
-                if (status[dataPtr] == 2) {
-                    printf("Data block %d is allocated in an inode but marked free.\n", dataPtr);
-                    free(status); 
-                    free(referenced);
-                    return -1;
-                }
-                dataPtr = bytesToInt(dataBlock + 4);
+    if (result == 0) {
+        if (!indexed && oldData == 0 && newData > 0) intToBytes(data.blocks[0], inode + 16);
+        intToBytes(newSize, inode + 12);
+        intToBytes((int)time(NULL), inode + 24);
+        result = writeBlock(vol->mountedDisk, inodeBlockLocation, inode);
+    }
+    lockMeta();
+    syncSuperBlock();
+    if (result == 0 && oldData == 0 && newData > 0) {
+        for (i = 0; i < vol->inodeCount; i++) {
+            if (vol->inodeColors[i].inodeIndex == inodeBlockLocation) {
+                vol->inodeColors[i].firstDataBlock = data.blocks[0];
+                break;
             }
         }
     }
+    unlockMeta();
+    free(data.blocks);
+    free(index.blocks);
+    return result < 0 ? -1 : 0;
+}
 
-    // --- Check for Orphan Data Blocks ---
-    for (i = 1; i < totalBlocks; i++) {
-        if (readBlock(mountedDisk, i, block) < 0) {
-            free(status); 
-            free(referenced);
-            return -1;
-        }
-        if (block[0] == 3) {  // data block
-            if (referenced[i] == 0) {
-                printf("Data block %d is allocated but not referenced by any inode.\n", i);
-                free(status); 
-                free(referenced);
-                return -1;
-            }
-        }
+// writeFileRange as journal steps: in one if it fits the log, otherwise cut
+// at block boundaries into pieces of stepBlocks blocks, each written (and
+// the file grown to cover it) as a step of its own. The space for all of
+// them is checked first; a failure after that leaves the pieces before it
+// written.
+static int writeRangeLogged(fileDescriptor FD, char *inode, int offset, const char *buffer, int size, int newSize){
+    int bytesPerBlock = payloadSize(inode);
+    int first = offset / bytesPerBlock;
+    int last = (newSize > offset + size ? offset + size : newSize) / bytesPerBlock;
+    if (vol->logCapacity == 0 || stepCredits(last - first + 1) <= vol->logCapacity) {
+        beginLog(stepCredits(last - first + 1));
+        int result = writeFileRange(FD, inode, offset, buffer, size, newSize);
+        endLog();
+        return result;
+    }
+    int oldData = (bytesToInt(inode + 12) + bytesPerBlock - 1) / bytesPerBlock;
+    int newData = (newSize + bytesPerBlock - 1) / bytesPerBlock;
+    int growth = newData - oldData;
+    if (isIndexed(inode)) {
+        if (newData > MAX_INDEXED_BLOCKS) return -1;
+        growth += indexBlocksFor(newData) - indexBlocksFor(oldData);
     }
+    if (growth > getFreeBlockCount()) return -1;
+    int result = 0;
+    while (result == 0 && size > 0) {
+        int end = (offset / bytesPerBlock + vol->stepBlocks) * bytesPerBlock;
+        int piece = (offset + size < end) ? size : end - offset;
+        int fileSize = bytesToInt(inode + 12);
+        int pieceSize = (piece == size) ? newSize : (offset + piece > fileSize ? offset + piece : fileSize);
+        beginLog(stepCredits(vol->stepBlocks));
+        result = writeFileRange(FD, inode, offset, buffer, piece, pieceSize);
+        endLog();
+        offset += piece;
+        buffer += piece;
+        size -= piece;
+    }
+    return result;
+}
 
-    free(status);
-    free(referenced);
+// Cuts the file open as FD, whose inode is given, to newSize bytes, at most
+// its size: a chain ends at its new last block or the map drops the
+// entries past it, the inode is written, and the data and index blocks
+// past it are freed.
+static int truncateFile(fileDescriptor FD, char *inode, int newSize){
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    int indexed = isIndexed(inode);
+    int bytesPerBlock = payloadSize(inode);
+    int keep = (newSize + bytesPerBlock - 1) / bytesPerBlock;
+    int keepIndex = indexed ? indexBlocksFor(keep) : 0;
+    BlockList data = {NULL, 0, 0}, index = {NULL, 0, 0};
+    if (collectFileBlocks(inode, &data, &index) < 0) return -1;
+
+    int result = 0;
+    if (keep < data.count) {
+        if (indexed) {
+            result = writeBlockMap(inode, data.blocks, keep, index.blocks, keep);
+        } else if (keep == 0) {
+            intToBytes(0, inode + 16);
+        } else {
+            char block[BLOCKSIZE];
+            result = readBlock(vol->mountedDisk, data.blocks[keep - 1], block);
+            intToBytes(0, block + 4);
+            if (result == 0) result = writeBlock(vol->mountedDisk, data.blocks[keep - 1], block);
+        }
+    }
+    invalidateCursors(inodeBlockLocation);
+    if (result == 0) {
+        intToBytes(newSize, inode + 12);
+        intToBytes((int)time(NULL), inode + 24);
+        result = writeBlock(vol->mountedDisk, inodeBlockLocation, inode);
+    }
+    lockMeta();
+    if (result == 0 && keep < data.count) {
+        result = writeFreeBlocks(data.blocks + keep, data.count - keep, 1);
+        if (result == 0) result = writeFreeBlocks(index.blocks + keepIndex, index.count - keepIndex, 1);
+    }
+    if (result == 0 && keep == 0) {
+        int i;
+        for (i = 0; i < vol->inodeCount; i++) {
+            if (vol->inodeColors[i].inodeIndex == inodeBlockLocation) vol->inodeColors[i].firstDataBlock = 0;
+        }
+    }
+    syncSuperBlock();
+    unlockMeta();
+    free(data.blocks);
+    free(index.blocks);
+    return result < 0 ? -1 : 0;
+}
+
+// truncateFile as journal steps, each freeing at most stepBlocks data
+// blocks from the end of the file.
+static int truncateLogged(fileDescriptor FD, char *inode, int newSize){
+    int bytesPerBlock = payloadSize(inode);
+    int keep = (newSize + bytesPerBlock - 1) / bytesPerBlock;
+    int blocks = (bytesToInt(inode + 12) + bytesPerBlock - 1) / bytesPerBlock;
+    int result = 0;
+    while (result == 0) {
+        int cut = (vol->logCapacity > 0 && blocks - keep > vol->stepBlocks) ? blocks - vol->stepBlocks : keep;
+        beginLog(stepCredits(blocks - cut));
+        result = truncateFile(FD, inode, cut == keep ? newSize : cut * bytesPerBlock);
+        endLog();
+        if (cut == keep) break;
+        blocks = cut;
+    }
+    return result;
+}
+
+// The rest of tfs_writeFile when the file changes its block count, as one
+// journal step: frees the file's blocks and writes size bytes of buffer to
+// blocksNeeded data and indexNeeded index blocks allocated afresh.
+static int replaceFile(fileDescriptor FD, char *inodeBlock, char *buffer, int size, int blocksNeeded, int indexNeeded){
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    int bytesPerBlock = payloadSize(inodeBlock);
+    int indexed = isIndexed(inodeBlock);
+
+    // Free old data blocks. A small file is freed into the thread's
+    // magazine and allocated from it, stocked first so that nothing fails
+    // once the old blocks are gone. Otherwise other writers may have taken
+    // space since tfs_writeFile's check, so it is repeated with the
+    // allocator held until the new blocks are taken.
+    int total = blocksNeeded + indexNeeded;
+    int oldBlocks = fileBlocksFor(inodeBlock, bytesToInt(inodeBlock + 12));
+    Magazine *m = (total <= MAGAZINE_BATCH && oldBlocks <= MAGAZINE_BATCH) ? grabMagazine() : NULL;
+    if (m) {
+        if (stockMagazine(m, total > oldBlocks ? total - oldBlocks : 0, oldBlocks) < 0) {
+            releaseMagazine(m);
+            return TFS_ERR_WRITE;
+        }
+    } else {
+        lockMeta();
+        if (total > getFreeBlockCount() + oldBlocks) {
+            unlockMeta();
+            return TFS_ERR_WRITE;
+        }
+    }
+    invalidateCursors(inodeBlockLocation);
+    if (freeFileBlocks(inodeBlock, m) < 0) {
+        if (m) releaseMagazine(m);
+        else unlockMeta();
+        return TFS_ERR_WRITE;
+    }
+
+    if (size == 0) {
+        if (m) {
+            releaseMagazine(m);
+            lockMeta();
+        }
+        intToBytes(0, inodeBlock + 12);
+        intToBytes(0, inodeBlock + 16);
+        if (indexed) memset(inodeBlock + 40, 0, BLOCKSIZE - 40);
+        intToBytes((int)time(NULL), inodeBlock + 24);
+        writeBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock);
+        syncSuperBlock();
+        vol->openFileTable[FD].filePointer = 0;
+        int i;
+        for (i = 0; i < vol->inodeCount; i++) {
+            if (vol->inodeColors[i].inodeIndex == inodeBlockLocation) {
+                vol->inodeColors[i].firstDataBlock = 0;
+                break;
+            }
+        }
+        unlockMeta();
+        return TFS_SUCCESS;
+    }
+
+    // Allocate the whole file at once, as few extents as possible. Index
+    // blocks are allocated after the data so they do not split its run.
+    // Each data block is then built once in memory, next pointer included,
+    // and the blocks go out SCAN_CHUNK at a time as one scatter-list write,
+    // so a write of any size needs one block number per block and a fixed
+    // amount of buffer space.
+    int *allocatedBlocks = malloc(total * sizeof(int));
+    char (*chunk)[BLOCKSIZE] = malloc(SCAN_CHUNK * BLOCKSIZE);
+    BlockVec list[SCAN_CHUNK];
+    int *indexBlocks = allocatedBlocks + blocksNeeded;
+    int i;
+    int result = (allocatedBlocks && chunk) ? 0 : -1;
+    if (m) {
+        // lowest blocks for the data, the rest for its index
+        if (result == 0 && m->count >= total) popMagazine(m, total, allocatedBlocks);
+        else result = -1;
+        releaseMagazine(m);
+    } else {
+        if (result == 0) result = allocBlocks(blocksNeeded, allocatedBlocks);
+        if (result == 0 && indexNeeded > 0 && allocBlocks(indexNeeded, indexBlocks) < 0) {
+            freeAllocatedBlocks(allocatedBlocks, blocksNeeded);
+            result = -1;
+        }
+        if (result < 0) syncSuperBlock();
+        unlockMeta();
+    }
+    if (result < 0) {
+        free(allocatedBlocks);
+        free(chunk);
+        return TFS_ERR_WRITE;
+    }
+    for (i = 0; i < blocksNeeded && result == 0; i++) {
+        char *dataBlock = chunk[i % SCAN_CHUNK];
+        memset(dataBlock, 0, BLOCKSIZE);
+        dataBlock[0] = indexed ? 8 : 3; // indexed or chained data block type
+        dataBlock[1] = 0x44;   // magic number
+        if (!indexed) intToBytes(i + 1 < blocksNeeded ? allocatedBlocks[i + 1] : 0, dataBlock + 4);
+
+        int bufferPos = i * bytesPerBlock;
+        int numBytesToWrite = (size - bufferPos < bytesPerBlock) ? (size - bufferPos) : bytesPerBlock;
+        memcpy(dataBlock + payloadOffset(inodeBlock), buffer + bufferPos, numBytesToWrite);
+
+        list[i % SCAN_CHUNK].bNum = allocatedBlocks[i];
+        list[i % SCAN_CHUNK].block = dataBlock;
+        if ((i + 1) % SCAN_CHUNK == 0 || i + 1 == blocksNeeded) {
+            if (writeBlockList(vol->mountedDisk, list, i % SCAN_CHUNK + 1) < 0) result = -1;
+        }
+    }
+    if (result == 0 && indexed)
+        result = writeBlockMap(inodeBlock, allocatedBlocks, blocksNeeded, indexBlocks, 0);
+    int firstDataBlockLocation = allocatedBlocks[0];
+    free(chunk);
+    if (result < 0) {
+        lockMeta();
+        freeAllocatedBlocks(allocatedBlocks, total);
+        syncSuperBlock();
+        unlockMeta();
+        free(allocatedBlocks);
+        return TFS_ERR_WRITE;
+    }
+    free(allocatedBlocks);
+
+    intToBytes(size, inodeBlock + 12);
+    intToBytes(indexed ? 0 : firstDataBlockLocation, inodeBlock + 16);
+    intToBytes((int)time(NULL), inodeBlock + 24);
+    if (writeBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0)
+         return TFS_ERR_WRITE;
+    vol->openFileTable[FD].filePointer = 0;
+
+    lockMeta();
+    syncSuperBlock();
+    for (i = 0; i < vol->inodeCount; i++) {
+        if (vol->inodeColors[i].inodeIndex == inodeBlockLocation) {
+            vol->inodeColors[i].firstDataBlock = firstDataBlockLocation;
+            break;
+        }
+    }
+    unlockMeta();
+
+    return TFS_SUCCESS;
+}
+
+/* tfs_writeFile:
+   - Writes a buffer to a file.
+   - Checks the read-only flag and updates the modification timestamp.
+   - When the new contents take as many blocks as the old ones, the blocks
+     are overwritten in place; otherwise they are freed and the file is
+     allocated afresh.
+   - On a journaled volume, a write too large for one journal group is
+     made in steps instead: the file is cut to the new size, then written
+     over in pieces. A crash part way leaves it as some step left it.
+   - Returns TFS_SUCCESS on success or TFS_ERR_WRITE on failure.
+*/
+static int writeFileLocked(fileDescriptor FD, char *buffer, int size) {
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used)
+         return TFS_ERR_WRITE;
+
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    char inodeBlock[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0)
+         return TFS_ERR_WRITE;
+
+    if (inodeBlock[32] == 1) return TFS_ERR_WRITE;  // read-only
+
+    // The old data blocks are reused, so the write only fails for lack of
+    // space if it does not fit in them plus the free blocks. Checked before
+    // anything is freed so a failed write leaves the file as it was.
+    int bytesPerBlock = payloadSize(inodeBlock);
+    int indexed = isIndexed(inodeBlock);
+    int blocksNeeded = (size + bytesPerBlock - 1) / bytesPerBlock;
+    if (indexed && blocksNeeded > MAX_INDEXED_BLOCKS) return TFS_ERR_WRITE;
+    int indexNeeded = indexed ? indexBlocksFor(blocksNeeded) : 0;
+    int oldBlocks = fileBlocksFor(inodeBlock, bytesToInt(inodeBlock + 12));
+    if (blocksNeeded + indexNeeded > getFreeBlockCount() + oldBlocks) return TFS_ERR_WRITE;
+
+    // Same number of blocks: overwrite them where they are.
+    if (size > 0 && blocksNeeded + indexNeeded == oldBlocks) {
+        if (writeRangeLogged(FD, inodeBlock, 0, buffer, size, size) < 0) return TFS_ERR_WRITE;
+        vol->openFileTable[FD].filePointer = 0;
+        return TFS_SUCCESS;
+    }
+
+    // Too large for one journal group: cut the file to the new size in
+    // steps, then write over it in steps, reusing the blocks it keeps.
+    int total = blocksNeeded + indexNeeded;
+    int credits = logCredits(oldBlocks + total + 1, oldBlocks + total);
+    if (vol->logCapacity > 0 && credits > vol->logCapacity) {
+        int result = 0;
+        if (size < bytesToInt(inodeBlock + 12)) result = truncateLogged(FD, inodeBlock, size);
+        if (result == 0 && size > 0) result = writeRangeLogged(FD, inodeBlock, 0, buffer, size, size);
+        if (result < 0) return TFS_ERR_WRITE;
+        vol->openFileTable[FD].filePointer = 0;
+        return TFS_SUCCESS;
+    }
+    beginLog(credits);
+    int result = replaceFile(FD, inodeBlock, buffer, size, blocksNeeded, indexNeeded);
+    endLog();
+    return result;
+}
+
+/* tfs_writeAt:
+   - Writes size bytes of buffer at offset, anywhere from the start to the
+     end of the file; a write running past the end grows the file.
+   - Blocks the file already has are rewritten in place and only the
+     blocks for the growth are allocated.
+   - On a journaled volume, a write too large for one journal group is
+     made in pieces of whole blocks, each a step a crash may end after.
+   - Leaves the file pointer where it was.
+   - Returns TFS_SUCCESS, or TFS_ERR_WRITE for a read-only file, an offset
+     past the end or a lack of space (the file is then unchanged).
+*/
+static int writeAtLocked(fileDescriptor FD, int offset, char *buffer, int size) {
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used)
+        return TFS_ERR_WRITE;
+    if (size < 0 || (!buffer && size > 0)) return TFS_ERR_WRITE;
+
+    char inodeBlock[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, vol->openFileTable[FD].inodeBlock, inodeBlock) < 0)
+        return TFS_ERR_WRITE;
+    if (inodeBlock[32] == 1) return TFS_ERR_WRITE;  // read-only
+
+    int fileSize = bytesToInt(inodeBlock + 12);
+    if (offset < 0 || offset > fileSize) return TFS_ERR_WRITE;
+    int newSize = (offset + size > fileSize) ? offset + size : fileSize;
+    if (writeRangeLogged(FD, inodeBlock, offset, buffer, size, newSize) < 0) return TFS_ERR_WRITE;
+    return TFS_SUCCESS;
+}
+
+/* tfs_append:
+   - Writes size bytes of buffer after the end of the file, allocating
+     only the blocks the growth needs.
+   - Leaves the file pointer where it was.
+   - Returns TFS_SUCCESS or TFS_ERR_WRITE.
+*/
+static int appendLocked(fileDescriptor FD, char *buffer, int size) {
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used)
+        return TFS_ERR_WRITE;
+
+    char inodeBlock[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, vol->openFileTable[FD].inodeBlock, inodeBlock) < 0)
+        return TFS_ERR_WRITE;
+    return writeAtLocked(FD, bytesToInt(inodeBlock + 12), buffer, size);
+}
+
+void removeInodeColorByIndex(int inodeIndex) {
+    int i;
+    for (i = 0; i < vol->inodeCount; i++) {
+        if (vol->inodeColors[i].inodeIndex == inodeIndex) {
+            int j;
+            for (j = i; j < vol->inodeCount - 1; j++) {
+                vol->inodeColors[j] = vol->inodeColors[j + 1];
+            }
+            vol->inodeCount--;
+            return;
+        }
+    }
+}
+/* tfs_deleteFile:
+   - Deletes a file (failing if it is read-only).
+   - On a journaled volume, a file too large to free in one journal group
+     is first emptied in steps, so a crash part way may leave it shorter.
+*/
+static int deleteFileLocked(fileDescriptor FD) {
+    if (FD < 0 || FD >= MAX_OPEN_FILES) return TFS_ERR_DELETE;
+
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    char inodeBlock[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0)
+        return TFS_ERR_DELETE;
+
+    if (inodeBlock[32] == 1) return TFS_ERR_DELETE;
+
+    int blocks = fileBlocksFor(inodeBlock, bytesToInt(inodeBlock + 12));
+    if (vol->logCapacity > 0 && logCredits(blocks + 3, blocks + 1) > vol->logCapacity) {
+        if (truncateLogged(FD, inodeBlock, 0) < 0) return TFS_ERR_DELETE;
+        blocks = 0;
+    }
+    beginLog(logCredits(blocks + 3, blocks + 1));
+    lockMeta();
+    invalidateCursors(inodeBlockLocation);
+    if (freeFileBlocks(inodeBlock, NULL) < 0) {
+        unlockMeta();
+        endLog();
+        return TFS_ERR_DELETE;
+    }
+    removeInodeColorByIndex(inodeBlockLocation);
+    int dirSlot = dirFindSlot(inodeBlock+4, inodeBlockLocation);
+    if (dirSlot >= 0) dirRemoveEntry(dirSlot);
+    nameIndexRemove(inodeBlock+4, inodeBlockLocation);
+
+    vol->openFileTable[FD].pendingAtime = 0;
+    addFreeBlock(inodeBlockLocation);
+    syncSuperBlock();
+
+    vol->openFileTable[FD].used = 0;
+    vol->openFileTable[FD].inodeBlock = -1;
+    vol->openFileTable[FD].filePointer = -1;
+    unlockMeta();
+    endLog();
+    return TFS_SUCCESS;
+}
+
+/* tfs_readByte:
+   - Reads a single byte from a file and updates the access timestamp.
+*/
+static int readByteLocked(fileDescriptor FD, char *buffer) {
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used) return TFS_ERR_READ;
+    
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    char inodeBlock[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0) return TFS_ERR_READ;
+    
+    int fileSize = bytesToInt(inodeBlock+12);
+    int fpPosition = vol->openFileTable[FD].filePointer;
+    if (fpPosition >= fileSize) return TFS_ERR_READ;
+
+    int bytesPerBlock = payloadSize(inodeBlock);
+    int blockIndex = fpPosition / bytesPerBlock;
+    int offsetWithinBlock = fpPosition % bytesPerBlock;
+    const char *dataBlock = seekCursor(FD, inodeBlock, blockIndex);
+    if (!dataBlock) return TFS_ERR_READ;
+
+    *buffer = dataBlock[payloadOffset(inodeBlock) + offsetWithinBlock];
+    vol->openFileTable[FD].filePointer++;
+
+    touchAtime(FD, inodeBlock);
+    
+    return TFS_SUCCESS;
+}
+
+// Copies up to size bytes starting at offset of the file open as FD into
+// buffer. The data chain is walked once, from FD's cursor when possible
+// (an indexed file is looked up block by block through its map), and
+// stretches of it that are contiguous on the disk are read as one run
+// (see readChainRun). Each block's payload is copied whole, and the access
+// time is recorded once per call. Returns the number
+// of bytes copied (0 at or past the end of the file), or -1 on error.
+static int readFileAt(fileDescriptor FD, char *buffer, int size, int offset){
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used) return -1;
+    if (size < 0 || offset < 0 || (!buffer && size > 0)) return -1;
+
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    char inodeBlock[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0) return -1;
+
+    int fileSize = bytesToInt(inodeBlock+12);
+    if (offset >= fileSize || size == 0) return 0;
+    if (size > fileSize - offset) size = fileSize - offset;
+
+    int bytesPerBlock = payloadSize(inodeBlock);
+    int blockIndex = offset / bytesPerBlock;
+    int copied = 0;
+    int offsetWithinBlock = offset % bytesPerBlock;
+    char run[SCAN_CHUNK][BLOCKSIZE];
+    int runCount = 0, runNext = 0;
+    while (copied < size) {
+        const char *dataBlock;
+        if (runNext < runCount) {
+            dataBlock = run[runNext++];
+        } else {
+            int wanted = (offsetWithinBlock + size - copied + bytesPerBlock - 1) / bytesPerBlock;
+            runCount = runNext = 0;
+            if (!isIndexed(inodeBlock) && wanted > 1 && vol->openFileTable[FD].cursorIndex == blockIndex - 1)
+                runCount = readChainRun(FD, wanted, run);
+            dataBlock = (runCount > 0) ? run[runNext++] : seekCursor(FD, inodeBlock, blockIndex);
+        }
+        blockIndex++;
+        if (!dataBlock) return -1;
+        int count = bytesPerBlock - offsetWithinBlock;
+        if (count > size - copied) count = size - copied;
+        memcpy(buffer + copied, dataBlock + payloadOffset(inodeBlock) + offsetWithinBlock, count);
+        copied += count;
+        offsetWithinBlock = 0;
+    }
+
+    touchAtime(FD, inodeBlock);
+    return copied;
+}
+
+/* tfs_read:
+   - Reads up to size bytes from the file pointer into buffer and advances
+     the file pointer past them.
+   - Returns the number of bytes read (0 at the end of the file) or
+     TFS_ERR_READ.
+*/
+static int readLocked(fileDescriptor FD, char *buffer, int size) {
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used) return TFS_ERR_READ;
+
+    int count = readFileAt(FD, buffer, size, vol->openFileTable[FD].filePointer);
+    if (count < 0) return TFS_ERR_READ;
+    vol->openFileTable[FD].filePointer += count;
+    return count;
+}
+
+/* tfs_pread:
+   - Reads up to size bytes starting at offset into buffer without moving
+     the file pointer.
+   - Returns the number of bytes read (0 at or past the end of the file) or
+     TFS_ERR_READ.
+*/
+static int preadLocked(fileDescriptor FD, char *buffer, int size, int offset) {
+    int count = readFileAt(FD, buffer, size, offset);
+    return count < 0 ? TFS_ERR_READ : count;
+}
+
+static int seekLocked(fileDescriptor FD, int offset){
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used) return TFS_ERR_SEEK;
+
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    char inodeBlock[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0) return TFS_ERR_READ;
+    
+    int fileSize = bytesToInt(inodeBlock+12);
+    if (offset < 0 || offset > fileSize) return TFS_ERR_SEEK;
+
+    vol->openFileTable[FD].filePointer = offset;
+    return TFS_SUCCESS;
+}
+
+//-------------------------------------------------------------
+/*                Additional Features                      */
+//-------------------------------------------------------------
+
+/* tfs_readFileInfo:
+   - Prints file info (name, size, timestamps, read-only status).
+*/
+static int readFileInfoLocked(fileDescriptor FD) {
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used)
+        return TFS_ERR_READINFO;
+
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    char inodeBlock[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0)
+        return TFS_ERR_READINFO;
+
+    char filename[9];
+    memcpy(filename, inodeBlock+4, 8);
+    filename[8] = '\0';
+    int fileSize = bytesToInt(inodeBlock+12);
+    int creationTime = bytesToInt(inodeBlock+20);
+    int modificationTime = bytesToInt(inodeBlock+24);
+    int accessTime = bytesToInt(inodeBlock+28);
+    if (vol->openFileTable[FD].pendingAtime > accessTime) accessTime = vol->openFileTable[FD].pendingAtime;
+    int readOnly = inodeBlock[32];
+
+    time_t t_creation = (time_t) creationTime;
+    time_t t_mod = (time_t) modificationTime;
+    time_t t_access = (time_t) accessTime;
+
+    printf("File Info:\n");
+    printf("  Name: %s\n", filename);
+    printf("  Size: %d bytes\n", fileSize);
+    printf("  Created: %s", ctime(&t_creation));
+    printf("  Modified: %s", ctime(&t_mod));
+    printf("  Last Accessed: %s", ctime(&t_access));
+    printf("  Read-Only: %s\n", readOnly ? "Yes" : "No");
+    return TFS_SUCCESS;
+}
+
+// Looks up the inode named name (zero padded) and locks it for writing.
+// Returns its block, or -1 if there is no such file. The name is looked up
+// again once the lock is held, in case the file was renamed or deleted.
+static int lockInodeByName(const char *name){
+    while (1) {
+        lockMeta();
+        int inodeBlock = findInode(name);
+        unlockMeta();
+        if (inodeBlock < 0) return -1;
+        lockInode(inodeBlock, 1);
+        lockMeta();
+        int current = findInode(name);
+        unlockMeta();
+        if (current == inodeBlock) return inodeBlock;
+        unlockInode(inodeBlock);
+    }
+}
+
+/* tfs_makeRO:
+   - Sets a file's flag to read-only by name.
+*/
+static int makeROLocked(char *name) {
+    char inodeName[9];
+    memset(inodeName, 0, 9);
+    strncpy(inodeName, name, 8);
+
+    char block[BLOCKSIZE];
+    int inodeBlockLocation = lockInodeByName(inodeName);
+    if (inodeBlockLocation < 0) return TFS_ERR_MAKE_RO;
+    beginLog(logCredits(1, 0));
+    int result = TFS_SUCCESS;
+    if (readBlock(vol->mountedDisk, inodeBlockLocation, block) < 0) {
+        result = TFS_ERR_MAKE_RO;
+    } else {
+        block[32] = 1; // set read-only
+        if (writeBlock(vol->mountedDisk, inodeBlockLocation, block) < 0) result = TFS_ERR_MAKE_RO;
+    }
+    endLog();
+    unlockInode(inodeBlockLocation);
+    return result;
+}
+
+/* tfs_makeRW:
+   - Resets a file's flag to read-write by name.
+*/
+static int makeRWLocked(char *name) {
+    char inodeName[9];
+    memset(inodeName, 0, 9);
+    strncpy(inodeName, name, 8);
+
+    char block[BLOCKSIZE];
+    int inodeBlockLocation = lockInodeByName(inodeName);
+    if (inodeBlockLocation < 0) return TFS_ERR_MAKE_RW;
+    beginLog(logCredits(1, 0));
+    int result = TFS_SUCCESS;
+    if (readBlock(vol->mountedDisk, inodeBlockLocation, block) < 0) {
+        result = TFS_ERR_MAKE_RW;
+    } else {
+        block[32] = 0; // set to read-write
+        if (writeBlock(vol->mountedDisk, inodeBlockLocation, block) < 0) result = TFS_ERR_MAKE_RW;
+    }
+    endLog();
+    unlockInode(inodeBlockLocation);
+    return result;
+}
+
+/* tfs_writeByte:
+   - Writes a single byte at a given offset.
+   - Fails if the file is read-only or if the offset is invalid.
+*/
+static int writeByteLocked(fileDescriptor FD, int offset, unsigned int data) {
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used)
+        return TFS_ERR_WRITE;
+
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    char inodeBlock[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0)
+        return TFS_ERR_WRITE;
+
+    if (inodeBlock[32] == 1) return TFS_ERR_WRITE;
+
+    int fileSize = bytesToInt(inodeBlock+12);
+    if (offset < 0 || offset >= fileSize) return TFS_ERR_WRITE;
+
+    int bytesPerBlock = payloadSize(inodeBlock);
+    int blockIndex = offset / bytesPerBlock;
+    int offsetWithinBlock = offset % bytesPerBlock;
+
+    if (!seekCursor(FD, inodeBlock, blockIndex))
+        return TFS_ERR_WRITE;
+    OpenFile *file = &vol->openFileTable[FD];
+    file->cursorData[payloadOffset(inodeBlock) + offsetWithinBlock] = (char)data;
+    if (writeBlock(vol->mountedDisk, file->cursorBlock, file->cursorData) < 0) {
+        file->cursorIndex = -1;
+        return TFS_ERR_WRITE;
+    }
+    // other descriptors holding the same block see the new byte
+    int i;
+    lockMeta();
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (i != FD && vol->openFileTable[i].used && vol->openFileTable[i].inodeBlock == inodeBlockLocation &&
+            vol->openFileTable[i].cursorIndex >= 0 && vol->openFileTable[i].cursorBlock == file->cursorBlock)
+            memcpy(vol->openFileTable[i].cursorData, file->cursorData, BLOCKSIZE);
+    }
+    unlockMeta();
+
+    intToBytes((int)time(NULL), inodeBlock+24);
+    if (writeBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0)
+        return TFS_ERR_WRITE;
+    return TFS_SUCCESS;
+}
+
+/* tfs_rename:
+   - Renames an open file by updating its inode's filename field and modification timestamp.
+   - Fails if another file already has the new name.
+*/
+static int renameLocked(fileDescriptor FD, char *newName) {
+    if (FD < 0 || FD >= MAX_OPEN_FILES || !vol->openFileTable[FD].used)
+        return TFS_ERR_RENAME;
+
+    int nameLength = strlen(newName);
+    if (nameLength > 8) nameLength = 8;
+    char newNameBuffer[9];
+    memset(newNameBuffer, 0, 9);
+    strncpy(newNameBuffer, newName, nameLength);
+
+    int inodeBlockLocation = vol->openFileTable[FD].inodeBlock;
+    int existing = findInode(newNameBuffer);
+    if (existing >= 0 && existing != inodeBlockLocation) return TFS_ERR_RENAME;
+
+    char inodeBlock[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0)
+        return TFS_ERR_RENAME;
+
+    char oldName[8];
+    memcpy(oldName, inodeBlock+4, 8);
+    memset(inodeBlock+4, 0, 8);
+    memcpy(inodeBlock+4, newNameBuffer, 8);
+    intToBytes((int)time(NULL), inodeBlock+24);
+    if (writeBlock(vol->mountedDisk, inodeBlockLocation, inodeBlock) < 0)
+        return TFS_ERR_RENAME;
+    int dirSlot = dirFindSlot(oldName, inodeBlockLocation);
+    if (dirSlot >= 0) dirRenameEntry(dirSlot, newNameBuffer);
+    nameIndexRemove(oldName, inodeBlockLocation);
+    nameIndexInsert(newNameBuffer, inodeBlockLocation, dirSlot);
+    return TFS_SUCCESS;
+}
+
+/* tfs_readdir:
+   - Walks the directory and prints each file's info from its inode.
+*/
+static int readdirLocked(void) {
+    if (vol->mountedDisk < 0) return TFS_ERR_READDIR;
+
+    char scratch[BLOCKSIZE];
+    int slot, found = 0;
+    printf("Directory Listing:\n");
+    for (slot = 0; slot < vol->dirBlockCount * DIR_ENTRIES_PER_BLOCK; slot++){
+        int inodeBlockLocation = bytesToInt(dirEntry(slot) + 8);
+        if (inodeBlockLocation == 0)
+            continue;
+        // a copy: writers of the file may be changing it in place
+        const char *block = readBlock(vol->mountedDisk, inodeBlockLocation, scratch) == 0 ? scratch : NULL;
+        if (block && block[0] == 2 && block[1] == 0x44) {
+            found = 1;
+            char filename[9];
+            memcpy(filename, block+4, 8);
+            filename[8] = '\0';
+            int fileSize = bytesToInt(block+12);
+            int readOnly = block[32];
+            printf("  Name: %s, Size: %d bytes, Read-Only: %s\n",
+                   filename, fileSize, readOnly ? "Yes" : "No");
+        }
+    }
+    if (!found)
+        printf("  (No files found)\n");
+    return TFS_SUCCESS;
+}
+
+static void displayFragmentsLocked() {
+    if (vol->mountedDisk < 0) {
+        printf("No filesystem mounted.\n");
+        return;
+    }
+
+    char block[BLOCKSIZE];
+    int i;
+    printf("--- File Color Mapping ---\n");
+    for (i = 0; i < vol->inodeCount; i++) {
+        printf("  \033[1;38;2;%d;%d;%dm%s\033[0m\n", 
+               vol->inodeColors[i].r, vol->inodeColors[i].g, vol->inodeColors[i].b, vol->inodeColors[i].name);
+    }
+
+    printf("\n--- Disk Fragmentation Map ---\n");
+    for (i = 0; i < vol->totalBlocks; i++) {
+        if (readBlock(vol->mountedDisk, i, block) < 0) continue;
+        if (i == 0) {
+            printf("\033[1m[SUPERBLOCK]\033[0m ");
+        } else if (inJournal(i)) {
+            printf("\033[1;32m[JOURNAL]\033[0m ");
+        } else if (block[0] == 2) {  // Inode block
+            InodeColor *color = NULL;
+            int j;
+            for (j = 0; j < vol->inodeCount; j++) {
+                if (vol->inodeColors[j].inodeIndex == i) {
+                    color = &vol->inodeColors[j];
+                    break;
+                }
+            }
+            if (color) {
+                printf("\033[3;38;2;%d;%d;%dm[INODE]\033[0m ", 
+                       color->r, color->g, color->b);
+            } else {
+                printf("\033[3m[UNKNOWN INODE]\033[0m ");
+            }
+        } else if (block[0] == 3 || block[0] == 7 || block[0] == 8) {  // Data or index block
+            const char *label = (block[0] == 7) ? "[INDEX]" : "[DATA]";
+            InodeColor *owner = getOwnerForDataBlock(i);
+            if (owner) {
+                printf("\033[1;38;2;%d;%d;%dm%s\033[0m ", 
+                       owner->r, owner->g, owner->b, label);
+            } else {
+                printf("\033[1;36m%s\033[0m ", label);
+            }
+        } else if (block[0] == 4) {
+            printf("\033[1;31m[FREE]\033[0m ");
+        } else if (block[0] == 5) {
+            printf("\033[1;35m[BITMAP]\033[0m ");
+        } else if (block[0] == 6) {
+            printf("\033[1;34m[DIR]\033[0m ");
+        } else {
+            printf("\033[1;33m[UNKNOWN]\033[0m ");
+        }
+        if ((i + 1) % 10 == 0) printf("\n");
+    }
+    printf("\n");
+}
+
+// Copies block into moved with its pointers (chain, first data block,
+// block map, directory entries) changed to the blocks' new places.
+static void remapPointers(const char *block, char *moved, const int *mapping){
+    int j;
+    memcpy(moved, block, BLOCKSIZE);
+    if (block[0] == 2 && isIndexed(block)) { // indexed inode: its whole map
+        for (j = 40; j < BLOCKSIZE; j += 4) {
+            int oldPtr = bytesToInt(block+j);
+            if (oldPtr != 0) intToBytes(mapping[oldPtr], moved+j);
+        }
+    } else if (block[0] == 2) { // inode block
+        int oldFirstData = bytesToInt(block+16);
+        intToBytes(oldFirstData == 0 ? 0 : mapping[oldFirstData], moved+16);
+    } else if (block[0] == 7) { // index block
+        for (j = 4; j < BLOCKSIZE; j += 4) {
+            int oldPtr = bytesToInt(block+j);
+            if (oldPtr != 0) intToBytes(mapping[oldPtr], moved+j);
+        }
+    } else if (block[0] == 3) { // data block
+        int oldNext = bytesToInt(block+4);
+        intToBytes(oldNext == 0 ? 0 : mapping[oldNext], moved+4);
+    } else if (block[0] == 6) { // directory block
+        int oldNext = bytesToInt(block+4);
+        intToBytes(oldNext == 0 ? 0 : mapping[oldNext], moved+4);
+        for (j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+            char *entry = moved + 8 + j * DIR_ENTRY_SIZE;
+            int oldInode = bytesToInt(entry+8);
+            if (oldInode != 0) intToBytes(mapping[oldInode], entry+8);
+        }
+    }
+}
+
+// First block a defrag may move: the superblock, bitmap and journal come
+// first on the disk and stay where they are.
+static int firstMovableBlock(void){
+    int first = 1;
+    if (vol->useBitmap && vol->bitmapStart + vol->bitmapBlocks > first) first = vol->bitmapStart + vol->bitmapBlocks;
+    if (vol->journalBlocks > 0 && vol->journalStart + vol->journalBlocks > first) first = vol->journalStart + vol->journalBlocks;
+    return first;
+}
+
+// Compaction layout: every allocated block packed after the superblock in
+// its current order. Sets mapping[i] to the new home of block i, -1 for
+// free blocks, and returns the number of blocks in use, or -1.
+static int layoutCompact(int *mapping){
+    char chunk[SCAN_CHUNK * BLOCKSIZE];
+    const char *view = NULL;
+    int i;
+    mapping[0] = 0;
+    int nextFreeIndex = 1;
+    for (i = 1; i < vol->totalBlocks; i++) {
+        if ((i - 1) % SCAN_CHUNK == 0 && !(view = peekBlocks(i, vol->totalBlocks - i, chunk))) return -1;
+        mapping[i] = (view[((i - 1) % SCAN_CHUNK) * BLOCKSIZE] != 4 || inJournal(i)) ? nextFreeIndex++ : -1;
+    }
+    return nextFreeIndex;
+}
+
+// Moves the blocks to a compaction layout with their pointers already
+// updated, so each block is written once. Blocks only move towards the
+// front, so nothing is overwritten before it has been read, and the moved
+// blocks form consecutive runs that go out as vectored writes. Returns the
+// number of blocks moved.
+static int compactBlocks(const int *mapping, char (*out)[BLOCKSIZE]){
+    char chunk[SCAN_CHUNK * BLOCKSIZE];
+    const char *view = NULL;
+    int i, runStart = 0, runLen = 0, moves = 0, result = 0;
+    for (i = 1; i < vol->totalBlocks && result == 0; i++) {
+        if ((i - 1) % SCAN_CHUNK == 0 && !(view = peekBlocks(i, vol->totalBlocks - i, chunk))) {
+            result = -1;
+            break;
+        }
+        const char *block = view + ((i - 1) % SCAN_CHUNK) * BLOCKSIZE;
+        if (inJournal(i)) {
+            // the log stays where it is; nothing before it is ever free
+            if (runLen > 0 && writeBlocks(vol->mountedDisk, runStart, runLen, out) < 0) result = -1;
+            runLen = 0;
+            continue;
+        }
+        if (block[0] == 4) continue;  // free block, nothing to move
+
+        char *moved = out[runLen];
+        remapPointers(block, moved, mapping);
+        if (mapping[i] == i && memcmp(moved, block, BLOCKSIZE) == 0) {
+            // already in place and unchanged, end the current run here
+            if (runLen > 0 && writeBlocks(vol->mountedDisk, runStart, runLen, out) < 0) result = -1;
+            runLen = 0;
+            continue;
+        }
+        if (mapping[i] != i) moves++;
+        if (runLen == 0) runStart = mapping[i];
+        runLen++;
+        if (runLen == SCAN_CHUNK) {
+            if (writeBlocks(vol->mountedDisk, runStart, runLen, out) < 0) result = -1;
+            runLen = 0;
+        }
+    }
+    if (runLen > 0 && writeBlocks(vol->mountedDisk, runStart, runLen, out) < 0) result = -1;
+    return result < 0 ? -1 : moves;
+}
+
+// Blocks that move together in a file-order layout: a file (its inode,
+// then its data in logical order, then its index blocks), or one directory
+// or stray block. key is where the unit starts now.
+typedef struct {
+    int key;
+    int start;  // first of its blocks in the member list
+    int count;
+} LayoutUnit;
+
+typedef struct {
+    LayoutUnit *units;
+    int count;
+    int capacity;
+} UnitList;
+
+static int compareUnits(const void *a, const void *b){
+    return ((const LayoutUnit *)a)->key - ((const LayoutUnit *)b)->key;
+}
+
+// Appends a unit of the blocks added to members since start.
+static int addUnit(UnitList *list, int key, int start, const BlockList *members){
+    if (list->count == list->capacity) {
+        int grown = list->capacity ? list->capacity * 2 : 16;
+        LayoutUnit *units = realloc(list->units, grown * sizeof(LayoutUnit));
+        if (!units) return -1;
+        list->units = units;
+        list->capacity = grown;
+    }
+    LayoutUnit *unit = &list->units[list->count++];
+    unit->key = key;
+    unit->start = start;
+    unit->count = members->count - start;
+    return 0;
+}
+
+// File-order layout: the directory blocks, then each file's inode directly
+// followed by its data blocks in logical order and its index blocks, packed
+// after the superblock, bitmap and journal. Files, directory blocks and
+// stray blocks keep their current order relative to each other, so a volume
+// laid out this way already needs no moves. One scan reads each block's
+// type and chain pointer; only indexed inodes and index blocks are read
+// again, for the block maps. Sets mapping like layoutCompact.
+static int layoutByFile(int *mapping){
+    char chunk[SCAN_CHUNK * BLOCKSIZE];
+    const char *view = NULL;
+    int total = vol->totalBlocks, first = firstMovableBlock();
+    char *kind = malloc(total);
+    int *link = malloc(total * sizeof(int)); // next block, or a chained inode's first data block
+    BlockList members = {NULL, 0, 0};
+    UnitList units = {NULL, 0, 0};
+    int result = 0;
+    int i, j;
+    if (!kind || !link) result = -1;
+    for (i = 0; i < total && result == 0; i++) {
+        mapping[i] = i < first ? i : -1;
+        if (i % SCAN_CHUNK == 0 && !(view = peekBlocks(i, total - i, chunk))) result = -1;
+        if (result < 0) break;
+        const char *block = view + (i % SCAN_CHUNK) * BLOCKSIZE;
+        kind[i] = block[0];
+        link[i] = (block[0] == 2) ? bytesToInt(block+16) : bytesToInt(block+4);
+        if (link[i] < 0 || link[i] >= total) link[i] = 0;
+    }
+
+    // claim each block for the first unit that reaches it; mapping marks
+    // the claimed ones with -2 until they are placed
+    int cur = bytesToInt(vol->mountedSuper+24);
+    while (result == 0 && cur >= first && cur < total && kind[cur] == 6 && mapping[cur] == -1) {
+        int start = members.count;
+        mapping[cur] = -2;
+        result = appendBlock(&members, cur);
+        if (result == 0) result = addUnit(&units, cur, start, &members);
+        cur = link[cur];
+    }
+    for (j = 0; j < vol->dirBlockCount * DIR_ENTRIES_PER_BLOCK && result == 0; j++) {
+        int inodeBlock = bytesToInt(dirEntry(j) + 8);
+        if (inodeBlock < first || inodeBlock >= total || kind[inodeBlock] != 2 || mapping[inodeBlock] != -1) continue;
+        int start = members.count;
+        mapping[inodeBlock] = -2;
+        result = appendBlock(&members, inodeBlock);
+        char inode[BLOCKSIZE];
+        if (result == 0 && readBlock(vol->mountedDisk, inodeBlock, inode) == 0 && isIndexed(inode)) {
+            BlockList data = {NULL, 0, 0}, index = {NULL, 0, 0};
+            if (collectFileBlocks(inode, &data, &index) < 0) result = -1;
+            for (i = 0; i < data.count + index.count && result == 0; i++) {
+                int b = i < data.count ? data.blocks[i] : index.blocks[i - data.count];
+                if (b < first || b >= total || mapping[b] != -1) continue;
+                mapping[b] = -2;
+                result = appendBlock(&members, b);
+            }
+            free(data.blocks);
+            free(index.blocks);
+        } else {
+            for (cur = link[inodeBlock]; result == 0 && cur >= first && kind[cur] == 3 && mapping[cur] == -1; cur = link[cur]) {
+                mapping[cur] = -2;
+                result = appendBlock(&members, cur);
+            }
+        }
+        if (result == 0) result = addUnit(&units, inodeBlock, start, &members);
+    }
+    // whatever no file reached stays in use, in its place in the order
+    for (i = first; i < total && result == 0; i++) {
+        if (mapping[i] != -1 || kind[i] == 4) continue;
+        int start = members.count;
+        mapping[i] = -2;
+        result = appendBlock(&members, i);
+        if (result == 0) result = addUnit(&units, i, start, &members);
+    }
+
+    int place = first;
+    if (result == 0) {
+        qsort(units.units, units.count, sizeof(LayoutUnit), compareUnits);
+        for (i = 0; i < units.count; i++) {
+            LayoutUnit *unit = &units.units[i];
+            for (j = 0; j < unit->count; j++) mapping[members.blocks[unit->start + j]] = place++;
+        }
+    }
+    free(kind);
+    free(link);
+    free(members.blocks);
+    free(units.units);
+    return result < 0 ? -1 : place;
+}
+
+// Reads the count blocks src[i] (a negative src: in[i] already holds it),
+// then writes each to dst[i] with its pointers remapped, skipping blocks
+// that stay put unchanged. Returns -1 on an I/O error.
+static int moveBlocks(const int *src, const int *dst, int count, const int *mapping,
+                      char (*in)[BLOCKSIZE], char (*out)[BLOCKSIZE]){
+    BlockVec list[SCAN_CHUNK];
+    int i, n = 0;
+    for (i = 0; i < count; i++) {
+        if (src[i] < 0) continue;
+        list[n].bNum = src[i];
+        list[n].block = in[i];
+        n++;
+    }
+    if (n > 0 && readBlockList(vol->mountedDisk, list, n) < 0) return -1;
+    n = 0;
+    for (i = 0; i < count; i++) {
+        remapPointers(in[i], out[i], mapping);
+        if (src[i] == dst[i] && memcmp(in[i], out[i], BLOCKSIZE) == 0) continue;
+        list[n].bNum = dst[i];
+        list[n].block = out[i];
+        n++;
+    }
+    return n > 0 ? writeBlockList(vol->mountedDisk, list, n) : 0;
+}
+
+// Applies the layout in mapping as a permutation: each block that moves is
+// read and written once, with its pointers updated on the way, and blocks
+// already in place are only rewritten if their pointers change. Following
+// the moves backwards from a free block, each block is read before the
+// block moving into its place is written over it; a cycle keeps its first
+// block in memory until the end. Returns the number of blocks moved, or -1.
+static int permuteBlocks(const int *mapping, char (*out)[BLOCKSIZE]){
+    int total = vol->totalBlocks, first = firstMovableBlock();
+    int *inverse = malloc(total * sizeof(int));
+    char *moved = calloc(total, 1);
+    char (*in)[BLOCKSIZE] = malloc(SCAN_CHUNK * BLOCKSIZE);
+    char held[BLOCKSIZE];
+    int src[SCAN_CHUNK], dst[SCAN_CHUNK];
+    int i, pass, count = 0, moves = 0, result = 0;
+    if (!inverse || !moved || !in) result = -1;
+    for (i = 0; i < total && result == 0; i++) inverse[i] = -1;
+    for (i = 0; i < total && result == 0; i++) {
+        if (mapping[i] >= 0) inverse[mapping[i]] = i;
+    }
+
+    // blocks that stay put, for their pointers
+    for (i = first; i < total && result == 0; i++) {
+        if (mapping[i] != i) continue;
+        src[count] = dst[count] = i;
+        if (++count == SCAN_CHUNK) {
+            result = moveBlocks(src, dst, count, mapping, in, out);
+            count = 0;
+        }
+    }
+    if (count > 0 && result == 0) result = moveBlocks(src, dst, count, mapping, in, out);
+    count = 0;
+
+    // pass 0 follows the moves from each free block a block moves into,
+    // pass 1 the cycles left over
+    for (pass = 0; pass < 2; pass++) {
+        for (i = first; i < total && result == 0; i++) {
+            if (inverse[i] < 0 || inverse[i] == i || moved[inverse[i]]) continue;
+            if (pass == 0 && mapping[i] >= 0) continue;
+            if (pass == 1 && readBlock(vol->mountedDisk, i, held) < 0) {
+                result = -1;
+                break;
+            }
+            int cur = i;
+            while (result == 0) {
+                int from = inverse[cur];
+                if (from < 0 || moved[from]) break;
+                moved[from] = 1;
+                moves++;
+                src[count] = from;
+                dst[count] = cur;
+                if (from == i) { // back at the start of the cycle
+                    src[count] = -1;
+                    memcpy(in[count], held, BLOCKSIZE);
+                }
+                if (++count == SCAN_CHUNK) {
+                    result = moveBlocks(src, dst, count, mapping, in, out);
+                    count = 0;
+                }
+                cur = from;
+            }
+            if (count > 0 && result == 0) result = moveBlocks(src, dst, count, mapping, in, out);
+            count = 0;
+        }
+    }
+    free(inverse);
+    free(moved);
+    free(in);
+    return result < 0 ? -1 : moves;
+}
+
+// Ends a defrag that put the blocks where mapping says, with usedEnd blocks
+// in use: everything from usedEnd on becomes the free list, in ascending
+// order, or the free part of the bitmap, and the superblock, directory,
+// open files and inode colors follow the blocks. Returns -1 if the free
+// space or the directory could not be rewritten or reloaded.
+static int finishDefrag(const int *mapping, int usedEnd, char (*out)[BLOCKSIZE]){
+    int i, first, result = 0;
+    for (first = usedEnd; first < vol->totalBlocks; first += SCAN_CHUNK) {
+        int count = (vol->totalBlocks - first < SCAN_CHUNK) ? vol->totalBlocks - first : SCAN_CHUNK;
+        for (i = 0; i < count; i++) {
+            int blockNum = first + i;
+            memset(out[i], 0, BLOCKSIZE);
+            out[i][0] = 4;
+            out[i][1] = 0x44;
+            if (!vol->useBitmap) intToBytes(blockNum == vol->totalBlocks - 1 ? 0 : blockNum + 1, out[i]+4);
+        }
+        if (writeBlocks(vol->mountedDisk, first, count, out) < 0) result = -1;
+    }
+    if (vol->useBitmap) {
+        for (i = 1; i < vol->totalBlocks; i++) {
+            if (isBlockFree(i) != (i >= usedEnd)) setBlockFree(i, i >= usedEnd);
+        }
+        vol->allocHint = 0;
+    } else {
+        intToBytes(usedEnd < vol->totalBlocks ? usedEnd : 0, vol->mountedSuper+4);
+    }
+    vol->freeBlockCount = vol->totalBlocks - usedEnd;
+    int dirHead = bytesToInt(vol->mountedSuper+24);
+    intToBytes(dirHead == 0 ? 0 : mapping[dirHead], vol->mountedSuper+24);
+    intToBytes(0, vol->mountedSuper+36); // online defragmentation starts over
+    vol->defragPassWhole = 1;
+    vol->defragPassMoved = 0;
+    vol->superDirty = 1;
+    if (syncSuperBlock() < 0) result = -1;
+
+    // The directory moved too; reload it, which also rebuilds the name index.
+    if (loadDirectory() < 0) result = -1;
+
+    // Open files follow their inodes to the new locations.
+    invalidateCursors(-1);
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (vol->openFileTable[i].used)
+            vol->openFileTable[i].inodeBlock = mapping[vol->openFileTable[i].inodeBlock];
+    }
+    // Update global inodeColors table with new inode and first data block
+    // numbers; entries left over from deleted or rewritten files now point
+    // at free space and become 0.
+    for (i = 0; i < vol->inodeCount; i++) {
+        int oldInode = vol->inodeColors[i].inodeIndex;
+        vol->inodeColors[i].inodeIndex = mapping[oldInode] > 0 ? mapping[oldInode] : 0;
+        int oldData = vol->inodeColors[i].firstDataBlock;
+        if (oldData != 0)
+            vol->inodeColors[i].firstDataBlock = mapping[oldData] > 0 ? mapping[oldData] : 0;
+    }
+    return result;
+}
+
+/* tfs_defragEx:
+   - Defragments the volume with the volume held alone. With flags 0 it is
+     tfs_defrag: the allocated blocks are packed after the superblock in
+     their current order. With TFS_DEFRAG_FILE_ORDER each file's inode is
+     directly followed by its data blocks in logical order (then its index
+     blocks), so every file is one extent; the layout is worked out from
+     one scan and applied as a permutation that moves each misplaced block
+     once and leaves the rest where they are.
+   - Either way the free space ends up as one run at the end of the disk.
+   - A journal group could not hold the whole of it, so on a journaled
+     volume the journal is committed and closed for the length of it: like
+     on any other volume, a crash part way leaves the volume to be checked.
+     tfs_defragStep stays journaled.
+   - Returns the number of blocks moved, or TFS_ERR if nothing is mounted,
+     a flag is unknown, or a block or the directory could not be read or
+     written; the volume should then be checked.
+*/
+static int defragExLocked(int flags) {
+    if (vol->mountedDisk < 0) {
+        printf("No filesystem mounted.\n");
+        return TFS_ERR;
+    }
+    if (flags & ~TFS_DEFRAG_FILE_ORDER) return TFS_ERR;
+    if (drainMagazines() < 0) return TFS_ERR;
+    if (vol->journalBlocks > 0 && closeJournal(vol->mountedDisk) < 0) return TFS_ERR;
+
+    int *mapping = malloc(vol->totalBlocks * sizeof(int));
+    char (*out)[BLOCKSIZE] = malloc(SCAN_CHUNK * BLOCKSIZE);
+    int usedEnd = -1, moves = -1;
+    if (mapping && out) {
+        // Work out where every allocated block ends up, then move them.
+        usedEnd = (flags & TFS_DEFRAG_FILE_ORDER) ? layoutByFile(mapping) : layoutCompact(mapping);
+    }
+    if (usedEnd >= 0) {
+        moves = (flags & TFS_DEFRAG_FILE_ORDER) ? permuteBlocks(mapping, out) : compactBlocks(mapping, out);
+        // once blocks have moved the volume and memory follow the new
+        // layout even if a write failed; the error is still reported
+        if (finishDefrag(mapping, usedEnd, out) < 0) moves = -1;
+    }
+    free(out);
+    free(mapping);
+    if (vol->journalBlocks > 0 && openJournal(vol->mountedDisk, vol->journalStart, vol->journalBlocks) < 0)
+        moves = -1;
+    if (moves < 0) {
+        printf("Defragmentation failed.\n");
+        return TFS_ERR;
+    }
+    printf("Defragmentation complete.\n");
+    return moves;
+}
+
+// Whether the count blocks from start are all on the volume and free.
+static int runIsFree(int start, int count){
+    int i;
+    if (start + count > vol->totalBlocks) return 0;
+    for (i = 0; i < count; i++) {
+        if (!isBlockFree(start + i)) return 0;
+    }
+    return 1;
+}
+
+// Moves up to maxMove data blocks of the file whose inode is at inodeBlock
+// towards one run. When the file's leading blocks already are a run and
+// the blocks after it are free, the run grows into them; otherwise the
+// file starts over in the lowest free run that holds all of it. Copies are
+// written before the file points at them, and the old blocks freed last.
+// Adds the blocks read and written to *cost. Returns the blocks moved, 0
+// if the file is one run or has no room to become one, or -1.
+static int defragFile(int inodeBlock, int maxMove, int *cost){
+    char inode[BLOCKSIZE];
+    BlockList data = {NULL, 0, 0}, index = {NULL, 0, 0};
+    if (readBlock(vol->mountedDisk, inodeBlock, inode) < 0 || inode[0] != 2) return -1;
+    if (collectFileBlocks(inode, &data, &index) < 0) return -1;
+    int indexed = isIndexed(inode);
+    int n = data.count;
+    *cost += 1 + (indexed ? index.count : n);
+
+    int p = 1, from = -1, target = -1, count = 0;
+    while (p < n && data.blocks[p] == data.blocks[p - 1] + 1) p++;
+    if (p < n) {
+        count = (n - p < maxMove) ? n - p : maxMove;
+        if (runIsFree(data.blocks[p - 1] + 1, count)) {
+            from = p;
+            target = data.blocks[p - 1] + 1;
+        } else if ((target = bitmapFindRun(n)) >= 0) {
+            from = 0;
+            count = (n < maxMove) ? n : maxMove;
+        }
+    }
+    char (*buffer)[BLOCKSIZE] = (from >= 0) ? malloc(count * BLOCKSIZE) : NULL;
+    if (!buffer) {
+        free(data.blocks);
+        free(index.blocks);
+        return (from >= 0) ? -1 : 0;
+    }
+
+    BlockVec list[SCAN_CHUNK];
+    int old[SCAN_CHUNK];
+    int i;
+    for (i = 0; i < count; i++) {
+        old[i] = data.blocks[from + i];
+        list[i].bNum = old[i];
+        list[i].block = buffer[i];
+    }
+    int result = readBlockList(vol->mountedDisk, list, count);
+    for (i = 0; i + 1 < count && !indexed; i++) intToBytes(target + i + 1, buffer[i] + 4);
+    for (i = 0; i < count; i++) setBlockFree(target + i, 0);
+    vol->freeBlockCount -= count;
+    vol->superDirty = 1;
+    if (result == 0) result = writeBlocks(vol->mountedDisk, target, count, buffer);
+    free(buffer);
+    *cost += 2 * count;
+    if (result < 0) {
+        for (i = 0; i < count; i++) old[i] = target + i;
+        writeFreeBlocks(old, count, 1);
+        free(data.blocks);
+        free(index.blocks);
+        return -1;
+    }
+
+    // point the file at the copies, then free the originals
+    for (i = 0; i < count; i++) data.blocks[from + i] = target + i;
+    if (indexed) {
+        result = writeBlockMap(inode, data.blocks, n, index.blocks, from);
+        if (result == 0) result = writeBlock(vol->mountedDisk, inodeBlock, inode);
+        *cost += 1 + index.count;
+    } else if (from == 0) {
+        intToBytes(target, inode + 16);
+        result = writeBlock(vol->mountedDisk, inodeBlock, inode);
+        *cost += 1;
+    } else {
+        char previous[BLOCKSIZE];
+        result = readBlock(vol->mountedDisk, data.blocks[from - 1], previous);
+        intToBytes(target, previous + 4);
+        if (result == 0) result = writeBlock(vol->mountedDisk, data.blocks[from - 1], previous);
+        *cost += 2;
+    }
+    if (result == 0) {
+        writeFreeBlocks(old, count, 1);
+        *cost += count;
+    }
+    if (from == 0) {
+        for (i = 0; i < vol->inodeCount; i++) {
+            if (vol->inodeColors[i].inodeIndex == inodeBlock) vol->inodeColors[i].firstDataBlock = target;
+        }
+    }
+    invalidateCursors(inodeBlock);
+    free(data.blocks);
+    free(index.blocks);
+    return result < 0 ? -1 : count;
+}
+
+static long microsSince(const struct timespec *start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* tfs_defragStep:
+   - Does one bounded step of online defragmentation, with the volume held
+     for as long as the step takes: examines files in directory order and
+     moves the data blocks of fragmented ones so each file becomes one run
+     (see defragFile), until about budget blocks have been read or written.
+     The first file a step examines may always move some blocks, so every
+     step makes progress.
+   - Open files stay usable. The directory slot to resume at is kept in the
+     superblock, so a pass continues where it stopped after an unmount or
+     a crash.
+   - Needs a bitmap volume, the only kind that can allocate a chosen run.
+   - Returns 1 while there is more to do, 0 once a whole pass has found
+     every file in one run (the next step starts a new pass), or TFS_ERR if
+     nothing is mounted or the volume has a free list.
+*/
+// maxMicros, when positive, also ends the step once it has run that long.
+static int defragStepTimed(int budget, long maxMicros){
+    if (vol->mountedDisk < 0 || !vol->useBitmap || budget <= 0) return TFS_ERR;
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    int slot = bytesToInt(vol->mountedSuper+36);
+    int total = vol->dirBlockCount * DIR_ENTRIES_PER_BLOCK;
+    if (slot < 0 || slot > total) slot = 0;
+    int cost = 0, more = 1, first = 1;
+    while (first || (cost < budget && (maxMicros <= 0 || microsSince(&started) < maxMicros))) {
+        if (slot == total) {
+            // a pass ends the step
+            more = !vol->defragPassWhole || vol->defragPassMoved > 0;
+            vol->defragPasses++;
+            vol->defragPassWhole = 1;
+            vol->defragPassMoved = 0;
+            slot = 0;
+            break;
+        }
+        int inodeBlock = bytesToInt(dirEntry(slot) + 8);
+        if (inodeBlock == 0) {
+            slot++;
+            continue;
+        }
+        int maxMove = first ? SCAN_CHUNK : (budget - cost) / 3;
+        if (maxMove > SCAN_CHUNK) maxMove = SCAN_CHUNK;
+        if (maxMove <= 0) break;
+        // each file's move is a journal step: copies, map and freed originals
+        if (vol->logCapacity > 0 && maxMove > vol->stepBlocks / 2)
+            maxMove = vol->stepBlocks > 1 ? vol->stepBlocks / 2 : 1;
+        first = 0;
+        beginLog(logCredits(2 * maxMove + maxMove / POINTERS_PER_INDEX + 4, 2 * maxMove));
+        int moved = defragFile(inodeBlock, maxMove, &cost);
+        endLog();
+        if (moved > 0) {
+            vol->defragBlocksMoved += moved;
+            vol->defragPassMoved += moved;
+        } else {
+            slot++; // one run, no room for one, or unreadable
+        }
+    }
+    beginLog(logCredits(0, 0));
+    intToBytes(slot, vol->mountedSuper+36);
+    vol->superDirty = 1;
+    syncSuperBlock();
+    endLog();
+    long micros = microsSince(&started);
+    if (micros > vol->defragLongestMicros) vol->defragLongestMicros = micros;
+    return more;
+}
+
+static int defragStepLocked(int budget){
+    return defragStepTimed(budget, 0);
+}
+
+static void *defragMain(void *arg){
+    vol = arg; // for good: this thread serves only this volume
+    pthread_mutex_lock(&vol->defragLock);
+    while (!vol->defragStopping) {
+        pthread_mutex_unlock(&vol->defragLock);
+        enterVolume(vol, VOLUME_EXCLUSIVE);
+        int more = defragStepTimed(INT_MAX, vol->defragMicros);
+        leaveVolume(vol);
+
+        // as long a pause as the step may take, so foreground calls get
+        // at least half the time
+        struct timespec next;
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_nsec += (vol->defragMicros % 1000000L) * 1000;
+        next.tv_sec += vol->defragMicros / 1000000L + next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        pthread_mutex_lock(&vol->defragLock);
+        if (more <= 0) {
+            vol->defragFinished = 1;
+            break;
+        }
+        while (!vol->defragStopping && pthread_cond_timedwait(&vol->defragWake, &vol->defragLock, &next) == 0);
+    }
+    pthread_mutex_unlock(&vol->defragLock);
+    return arg;
+}
+
+// Joins the defrag thread after it was told to stop or ended on its own.
+// Called with defragLock held, which it drops while waiting.
+static void joinDefrag(tfs_volume *v){
+    v->defragStopping = 1;
+    pthread_cond_signal(&v->defragWake);
+    pthread_mutex_unlock(&v->defragLock);
+    pthread_join(v->defragThread, NULL);
+    pthread_mutex_lock(&v->defragLock);
+    v->defragRunning = 0;
+}
+
+/* tfs_defragStart:
+   - Starts a background thread that runs tfs_defragStep until a pass
+     finds every file in one run. Each step stops examining files once it
+     has held the volume for maxStepMicros, so it runs over by at most the
+     last file's block map walk and one chunk of moved blocks; the thread
+     then pauses as long, so foreground calls wait for one step at most
+     and get at least half the time.
+   - Progress is reported by tfs_defragStatus().
+   - Returns TFS_SUCCESS, or TFS_ERR if nothing is mounted, the volume has
+     a free list, it already runs, maxStepMicros is not positive or the
+     thread cannot be started.
+*/
+static int defragStartLocked(int maxStepMicros){
+    if (maxStepMicros <= 0 || vol->mountedDisk < 0 || !vol->useBitmap) return TFS_ERR;
+    pthread_mutex_lock(&vol->defragLock);
+    int result = TFS_ERR;
+    if (vol->defragRunning && vol->defragFinished) joinDefrag(vol);
+    if (!vol->defragRunning) {
+        vol->defragMicros = maxStepMicros;
+        vol->defragStopping = 0;
+        vol->defragFinished = 0;
+        if (pthread_create(&vol->defragThread, NULL, defragMain, vol) == 0) {
+            vol->defragRunning = 1;
+            result = TFS_SUCCESS;
+        }
+    }
+    pthread_mutex_unlock(&vol->defragLock);
+    return result;
+}
+
+/* tfs_defragStop:
+   - Stops the background defragmentation and waits for its step to end;
+     the position stays in the superblock for the next start. Unmounting
+     stops it too.
+   - Returns TFS_SUCCESS, or TFS_ERR if it was not started.
+   Called without the volume lock, which the thread needs to finish its
+   step.
+*/
+static int defragStopVolume(tfs_volume *v){
+    pthread_mutex_lock(&v->defragLock);
+    int result = v->defragRunning ? TFS_SUCCESS : TFS_ERR;
+    if (v->defragRunning) joinDefrag(v);
+    pthread_mutex_unlock(&v->defragLock);
+    return result;
+}
+
+/* tfs_defragStatus:
+   - Copies the progress of online defragmentation into status: whether
+     the background thread runs, its step limit, the directory slot the
+     next step examines, the passes completed and blocks moved since the
+     mount, and the longest a step has held the volume.
+   - Returns TFS_SUCCESS, or TFS_ERR if status is NULL or nothing is mounted.
+*/
+static int defragStatusLocked(TfsDefragStatus *status){
+    if (!status || vol->mountedDisk < 0) return TFS_ERR;
+    pthread_mutex_lock(&vol->defragLock);
+    status->running = vol->defragRunning && !vol->defragFinished;
+    status->maxStepMicros = vol->defragMicros;
+    pthread_mutex_unlock(&vol->defragLock);
+    lockMeta();
+    status->position = bytesToInt(vol->mountedSuper+36);
+    unlockMeta();
+    status->passes = vol->defragPasses;
+    status->blocksMoved = vol->defragBlocksMoved;
+    status->longestStepMicros = vol->defragLongestMicros;
+    return TFS_SUCCESS;
+}
+//-------------------------------------------------------------
+/*                   Consistency check                       */
+//-------------------------------------------------------------
+
+// The check reads the volume once. Worker threads each scan a slice of the
+// block range and boil every block down to a type byte and one link; the
+// few blocks that carry structure (inodes, index and directory blocks) are
+// summarized into per-slice lists. Free lists, file maps and the directory
+// are then validated against that summary in memory.
+
+#define CHECK_JOURNAL 0xFE     // summary type of a journal region block
+#define CHECK_BAD_MAGIC 0xFF   // summary type of a block with a bad magic number
+#define CHECK_MAX_THREADS 8
+#define CHECK_SLICE_MIN 4096   // fewest blocks worth a thread of their own
+#define CHECK_READ_BLOCKS 256  // blocks per read in a slice scan
+
+typedef struct {
+    int block;
+    char name[8];
+    int size;
+    int indexed;
+    int first;      // chained: first data block; indexed: its map in the pointer pool
+} InodeSummary;
+
+typedef struct {
+    int block;
+    char entries[DIR_ENTRIES_PER_BLOCK * DIR_ENTRY_SIZE];
+} DirSummary;
+
+typedef struct {
+    tfs_volume *volume;     // worker threads have no current volume of their own
+    int lo, hi;             // blocks [lo, hi) of the volume
+    unsigned char *type;    // shared, each slice writes its own range
+    int *link;              // next pointer of 3, 4 and 6 blocks, pool offset of 7 blocks
+    InodeSummary *inodes;
+    int inodeCount, inodeCapacity;
+    DirSummary *dirs;
+    int dirCount, dirCapacity;
+    int *pool;              // pointers of indexed inodes (54 each) and index blocks (63 each)
+    int poolCount, poolCapacity;
+    int failed;
+} CheckSlice;
+
+// Makes room for one more element of size bytes in a growing array
+static int reserveOne(void **array, int *capacity, int count, size_t size){
+    if (count < *capacity) return 0;
+    int grown = *capacity ? *capacity * 2 : 16;
+    void *bigger = realloc(*array, grown * size);
+    if (!bigger) return -1;
+    *array = bigger;
+    *capacity = grown;
+    return 0;
+}
+
+static int reservePool(CheckSlice *slice, int count){
+    while (slice->poolCount + count > slice->poolCapacity) {
+        if (reserveOne((void **)&slice->pool, &slice->poolCapacity, slice->poolCapacity, sizeof(int)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Copies count big-endian pointers from src into the slice's pool and
+// returns where they start
+static int poolPointers(CheckSlice *slice, const char *src, int count){
+    int start = slice->poolCount, i;
+    for (i = 0; i < count; i++) slice->pool[start + i] = bytesToInt(src + i * 4);
+    slice->poolCount += count;
+    return start;
+}
+
+// Summarizes one block of a slice
+static int summarizeBlock(CheckSlice *slice, int i, const char *block){
+    unsigned char type = (unsigned char)block[0];
+    if (inJournal(i)) {
+        slice->type[i] = CHECK_JOURNAL;
+        return 0;
+    }
+    if (block[1] != 0x44) {
+        slice->type[i] = CHECK_BAD_MAGIC;
+        return 0;
+    }
+    slice->type[i] = type;
+    if (type == 3 || type == 4 || type == 6) slice->link[i] = bytesToInt(block+4);
+    if (type == 2) {
+        if (reserveOne((void **)&slice->inodes, &slice->inodeCapacity, slice->inodeCount, sizeof(InodeSummary)) < 0)
+            return -1;
+        InodeSummary *inode = &slice->inodes[slice->inodeCount++];
+        inode->block = i;
+        memcpy(inode->name, block+4, 8);
+        inode->size = bytesToInt(block+12);
+        inode->indexed = isIndexed(block);
+        if (inode->indexed) {
+            if (reservePool(slice, DIRECT_POINTERS + 2) < 0) return -1;
+            inode->first = poolPointers(slice, block+40, DIRECT_POINTERS + 2);
+        } else {
+            inode->first = bytesToInt(block+16);
+        }
+    } else if (type == 7) {
+        if (reservePool(slice, POINTERS_PER_INDEX) < 0) return -1;
+        slice->link[i] = poolPointers(slice, block+4, POINTERS_PER_INDEX);
+    } else if (type == 6) {
+        if (reserveOne((void **)&slice->dirs, &slice->dirCapacity, slice->dirCount, sizeof(DirSummary)) < 0)
+            return -1;
+        DirSummary *dir = &slice->dirs[slice->dirCount++];
+        dir->block = i;
+        memcpy(dir->entries, block+8, sizeof(dir->entries));
+    }
+    return 0;
+}
+
+// Thread body: reads a slice in large runs, or straight from the mapping
+static void *scanSlice(void *arg){
+    CheckSlice *slice = arg;
+    char *buffer = NULL;
+    vol = slice->volume;
+    int first, i;
+    for (first = slice->lo; first < slice->hi && !slice->failed; first += CHECK_READ_BLOCKS) {
+        int count = (slice->hi - first < CHECK_READ_BLOCKS) ? slice->hi - first : CHECK_READ_BLOCKS;
+        const char *view = mapBlock(vol->mountedDisk, first);
+        if (!view) {
+            if (!buffer && !(buffer = malloc(CHECK_READ_BLOCKS * BLOCKSIZE))) {
+                slice->failed = 1;
+                break;
+            }
+            if (readBlocksShared(vol->mountedDisk, first, count, buffer) < 0) {
+                slice->failed = 1;
+                break;
+            }
+            view = buffer;
+        }
+        for (i = 0; i < count; i++) {
+            if (summarizeBlock(slice, first + i, view + i * BLOCKSIZE) < 0) {
+                slice->failed = 1;
+                break;
+            }
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void addProblem(TfsCheckReport *report, int code, int block, int detail){
+    if (report->problemCount < TFS_CHECK_MAX_PROBLEMS) {
+        TfsCheckProblem *p = &report->problems[report->problemCount];
+        p->code = code;
+        p->block = block;
+        p->detail = detail;
+    }
+    report->problemCount++;
+}
+
+static int testBit(const uint64_t *bits, int i){
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void setBit(uint64_t *bits, int i){
+    bits[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static int compareInodeSummary(const void *a, const void *b){
+    int x = ((const InodeSummary *)a)->block, y = ((const InodeSummary *)b)->block;
+    return (x > y) - (x < y);
+}
+
+static int compareDirSummary(const void *a, const void *b){
+    int x = ((const DirSummary *)a)->block, y = ((const DirSummary *)b)->block;
+    return (x > y) - (x < y);
+}
+
+// State of the in-memory validation
+typedef struct {
+    unsigned char *type;
+    int *link;
+    int *pool;
+    uint64_t *freeBits;
+    uint64_t *refBits;     // blocks claimed by a file
+    uint64_t *listedBits;  // inodes and directory blocks reached through the directory
+    TfsCheckReport *report;
+} CheckState;
+
+// Claims block ptr, reached from the inode at inodeNum, for that file: it
+// must be a block of the given type that no other file uses.
+static int claimFileBlock(CheckState *st, int inodeNum, int ptr, int type){
+    if (ptr < 1 || ptr >= vol->totalBlocks || st->type[ptr] != type) {
+        addProblem(st->report, TFS_CHECK_FILE_POINTER, inodeNum, ptr);
+        return -1;
+    }
+    if (testBit(st->refBits, ptr)) {
+        addProblem(st->report, TFS_CHECK_SHARED, ptr, inodeNum);
+        return -1;
+    }
+    setBit(st->refBits, ptr);
+    return 0;
+}
+
+// Claims the blocks of one indexed file and checks that it maps as many
+// data blocks as its size needs. A bad pointer only loses what is behind
+// it, so the rest of the map is still claimed and not reported as orphans.
+static void checkIndexedInode(CheckState *st, const InodeSummary *inode){
+    const int *map = st->pool + inode->first;
+    int expected = (inode->size + INDEXED_PAYLOAD - 1) / INDEXED_PAYLOAD;
+    int found = 0, bad = 0;
+    int i, j;
+    for (i = 0; i < DIRECT_POINTERS; i++) {
+        if (map[i] == 0) continue;
+        if (claimFileBlock(st, inode->block, map[i], 8) < 0) bad = 1;
+        else found++;
+    }
+    int single = map[DIRECT_POINTERS];
+    if (single != 0 && claimFileBlock(st, inode->block, single, 7) < 0) {
+        bad = 1;
+    } else if (single != 0) {
+        const int *index = st->pool + st->link[single];
+        for (i = 0; i < POINTERS_PER_INDEX; i++) {
+            if (index[i] == 0) continue;
+            if (claimFileBlock(st, inode->block, index[i], 8) < 0) bad = 1;
+            else found++;
+        }
+    }
+    int twoLevel = map[DIRECT_POINTERS + 1];
+    if (twoLevel != 0 && claimFileBlock(st, inode->block, twoLevel, 7) < 0) {
+        bad = 1;
+    } else if (twoLevel != 0) {
+        const int *index = st->pool + st->link[twoLevel];
+        for (i = 0; i < POINTERS_PER_INDEX; i++) {
+            if (index[i] == 0) continue;
+            if (claimFileBlock(st, inode->block, index[i], 7) < 0) {
+                bad = 1;
+                continue;
+            }
+            const int *child = st->pool + st->link[index[i]];
+            for (j = 0; j < POINTERS_PER_INDEX; j++) {
+                if (child[j] == 0) continue;
+                if (claimFileBlock(st, inode->block, child[j], 8) < 0) bad = 1;
+                else found++;
+            }
+        }
+    }
+    if (!bad && found != expected) addProblem(st->report, TFS_CHECK_SIZE, inode->block, found);
+}
+
+static void releaseSlices(CheckSlice *slices, int count){
+    int t;
+    for (t = 0; t < count; t++) {
+        free(slices[t].inodes);
+        free(slices[t].dirs);
+        free(slices[t].pool);
+    }
+}
+
+/* tfs_checkConsistency()
+ * Checks the mounted volume and records what it found in lastCheck.
+ * Free blocks left outside the free space are linked back into it.
+ * Returns 0 if the file system is consistent, or a negative error code otherwise.
+ * On success freeBlockCount holds the number of free blocks.
+ */
+static int tfs_checkConsistency(void) {
+    int i, t;
+    TfsCheckReport *report = &vol->lastCheck;
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    memset(report, 0, sizeof(*report));
+
+    // The workers read the disk file directly, so it must hold everything.
+    if ((vol->journalBlocks > 0 && commitJournal(vol->mountedDisk) < 0) || flushDisk(vol->mountedDisk) < 0) {
+        addProblem(report, TFS_CHECK_IO, 0, -1);
+        return -1;
+    }
+    char super[BLOCKSIZE];
+    if (readBlock(vol->mountedDisk, 0, super) < 0) {
+        addProblem(report, TFS_CHECK_IO, 0, -1);
+        return -1;
+    }
+    if (super[0] != 1 || super[1] != 0x44) {
+        addProblem(report, TFS_CHECK_SUPERBLOCK, 0, -1);
+        return -1;
+    }
+    int hasDirectory = (super[2] & FEATURE_DIRECTORY) != 0;
+
+    // --- Scan every block once, in parallel slices ---
+    int words = (vol->totalBlocks + 63) / 64;
+    unsigned char *type = calloc(vol->totalBlocks, 1);
+    int *link = calloc(vol->totalBlocks, sizeof(int));
+    uint64_t *bits = calloc(3 * words, sizeof(uint64_t));
+    if (!type || !link || !bits) {
+        free(type);
+        free(link);
+        free(bits);
+        addProblem(report, TFS_CHECK_IO, 0, -1);
+        return -1;
+    }
+    type[0] = 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = (vol->totalBlocks - 1) / CHECK_SLICE_MIN;
+    if (threads > cpus) threads = (int)cpus;
+    if (threads > CHECK_MAX_THREADS) threads = CHECK_MAX_THREADS;
+    if (threads < 1) threads = 1;
+    CheckSlice slices[CHECK_MAX_THREADS];
+    pthread_t workers[CHECK_MAX_THREADS];
+    memset(slices, 0, sizeof(slices));
+    for (t = 0; t < threads; t++) {
+        slices[t].volume = vol;
+        slices[t].lo = 1 + (int)((long)(vol->totalBlocks - 1) * t / threads);
+        slices[t].hi = 1 + (int)((long)(vol->totalBlocks - 1) * (t + 1) / threads);
+        slices[t].type = type;
+        slices[t].link = link;
+    }
+    int spawned = 0;
+    for (t = 1; t < threads; t++) {
+        if (pthread_create(&workers[t], NULL, scanSlice, &slices[t]) != 0) break;
+        spawned++;
+    }
+    for (t = spawned + 1; t < threads; t++) scanSlice(&slices[t]); // no thread for it
+    scanSlice(&slices[0]);
+    for (t = 1; t <= spawned; t++) pthread_join(workers[t], NULL);
+
+    // Merge the slice summaries; pool offsets become offsets into one pool.
+    int inodeTotal = 0, dirTotal = 0, poolTotal = 0, failed = 0;
+    for (t = 0; t < threads; t++) {
+        failed |= slices[t].failed;
+        inodeTotal += slices[t].inodeCount;
+        dirTotal += slices[t].dirCount;
+        poolTotal += slices[t].poolCount;
+    }
+    InodeSummary *inodes = malloc((inodeTotal + 1) * sizeof(InodeSummary));
+    DirSummary *dirs = malloc((dirTotal + 1) * sizeof(DirSummary));
+    int *pool = malloc((poolTotal + 1) * sizeof(int));
+    if (failed || !inodes || !dirs || !pool) {
+        releaseSlices(slices, threads);
+        free(inodes);
+        free(dirs);
+        free(pool);
+        free(type);
+        free(link);
+        free(bits);
+        addProblem(report, TFS_CHECK_IO, 0, -1);
+        return -1;
+    }
+    int inodeAt = 0, dirAt = 0, poolAt = 0;
+    for (t = 0; t < threads; t++) {
+        CheckSlice *slice = &slices[t];
+        for (i = 0; i < slice->inodeCount; i++) {
+            inodes[inodeAt] = slice->inodes[i];
+            if (inodes[inodeAt].indexed) inodes[inodeAt].first += poolAt;
+            inodeAt++;
+        }
+        memcpy(dirs + dirAt, slice->dirs, slice->dirCount * sizeof(DirSummary));
+        dirAt += slice->dirCount;
+        memcpy(pool + poolAt, slice->pool, slice->poolCount * sizeof(int));
+        for (i = slice->lo; i < slice->hi; i++) {
+            if (type[i] == 7) link[i] += poolAt;
+        }
+        poolAt += slice->poolCount;
+    }
+    releaseSlices(slices, threads);
+
+    CheckState st = {type, link, pool, bits, bits + words, bits + 2 * words, report};
+
+    // --- Free space ---
+    // Every block the bitmap or the free list calls free must be a free
+    // block outside the reserved regions, and be reached once.
+    int freePtr = bytesToInt(super + 4);
+    int freeCount = 0;
+    if (vol->useBitmap) {
+        if (freePtr != 0) addProblem(report, TFS_CHECK_FREE_LIST, freePtr, 0);
+        for (i = 0; i < vol->totalBlocks; i++) {
+            if (!isBlockFree(i)) continue;
+            if (i == 0 || type[i] == CHECK_JOURNAL || (i >= vol->bitmapStart && i < vol->bitmapStart + vol->bitmapBlocks)) {
+                addProblem(report, TFS_CHECK_RESERVED_FREE, i, -1);
+                continue;
+            }
+            setBit(st.freeBits, i);
+            freeCount++;
+        }
+    } else {
+        int previous = 0;
+        while (freePtr != 0) {
+            if (freePtr < 1 || freePtr >= vol->totalBlocks || testBit(st.freeBits, freePtr) ||
+                type[freePtr] != 4) {
+                addProblem(report, (freePtr > 0 && freePtr < vol->totalBlocks && type[freePtr] == CHECK_JOURNAL)
+                                   ? TFS_CHECK_RESERVED_FREE : TFS_CHECK_FREE_LIST, freePtr, previous);
+                break;
+            }
+            setBit(st.freeBits, freePtr);
+            freeCount++;
+            previous = freePtr;
+            freePtr = link[freePtr];
+        }
+    }
+
+    // --- Block types ---
+    // A free block outside the free space is one a crash caught in a
+    // magazine; it is not a problem, and goes back once the rest checks out.
+    int strays = 0;
+    for (i = 1; i < vol->totalBlocks; i++) {
+        int inBitmap = vol->useBitmap && i >= vol->bitmapStart && i < vol->bitmapStart + vol->bitmapBlocks;
+        if (type[i] == CHECK_JOURNAL) continue;
+        if (type[i] == CHECK_BAD_MAGIC) {
+            addProblem(report, TFS_CHECK_MAGIC, i, -1);
+        } else if ((type[i] == 5) != inBitmap) {
+            addProblem(report, TFS_CHECK_BITMAP_REGION, i, type[i]);
+        } else if (type[i] == 4) {
+            if (!testBit(st.freeBits, i)) strays++; // reclaimed below
+        } else if (type[i] == 5) {
+            // bitmap block, checked above
+        } else if (type[i] == 2 || type[i] == 3 || type[i] == 7 || type[i] == 8 ||
+                   (type[i] == 6 && hasDirectory)) {
+            if (testBit(st.freeBits, i)) addProblem(report, TFS_CHECK_ALLOCATED_FREE, i, -1);
+        } else {
+            addProblem(report, TFS_CHECK_TYPE, i, type[i]);
+        }
+    }
+
+    // --- Files ---
+    for (i = 0; i < inodeTotal; i++) {
+        if (inodes[i].indexed) {
+            checkIndexedInode(&st, &inodes[i]);
+            continue;
+        }
+        int dataPtr = inodes[i].first;
+        while (dataPtr != 0 && claimFileBlock(&st, inodes[i].block, dataPtr, 3) == 0)
+            dataPtr = link[dataPtr];
+    }
+    for (i = 1; i < vol->totalBlocks; i++) {
+        if ((type[i] == 3 || type[i] == 7 || type[i] == 8) && !testBit(st.refBits, i))
+            addProblem(report, TFS_CHECK_ORPHAN, i, type[i]);
+    }
+
+    // --- Directory ---
+    // Every directory block is on the chain from the superblock, and every
+    // inode is named by exactly one entry that carries the inode's name.
+    if (hasDirectory) {
+        int dirPtr = bytesToInt(super + 24), previous = 0;
+        while (dirPtr != 0) {
+            if (dirPtr < 1 || dirPtr >= vol->totalBlocks || type[dirPtr] != 6 || testBit(st.listedBits, dirPtr)) {
+                addProblem(report, TFS_CHECK_DIR_CHAIN, previous, dirPtr);
+                break;
+            }
+            setBit(st.listedBits, dirPtr);
+            DirSummary key = {dirPtr};
+            const DirSummary *dir = bsearch(&key, dirs, dirTotal, sizeof(DirSummary), compareDirSummary);
+            int j;
+            for (j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+                const char *entry = dir->entries + j * DIR_ENTRY_SIZE;
+                int inodePtr = bytesToInt(entry + 8);
+                if (inodePtr == 0) continue;
+                if (inodePtr < 1 || inodePtr >= vol->totalBlocks || type[inodePtr] != 2 ||
+                    testBit(st.listedBits, inodePtr)) {
+                    addProblem(report, TFS_CHECK_DIR_ENTRY, dirPtr, inodePtr);
+                    continue;
+                }
+                InodeSummary inodeKey = {inodePtr};
+                const InodeSummary *inode = bsearch(&inodeKey, inodes, inodeTotal, sizeof(InodeSummary),
+                                                    compareInodeSummary);
+                if (memcmp(inode->name, entry, 8) != 0)
+                    addProblem(report, TFS_CHECK_DIR_NAME, dirPtr, inodePtr);
+                setBit(st.listedBits, inodePtr); // listed
+            }
+            previous = dirPtr;
+            dirPtr = link[dirPtr];
+        }
+        for (i = 1; i < vol->totalBlocks; i++) {
+            if ((type[i] == 2 || type[i] == 6) && !testBit(st.listedBits, i))
+                addProblem(report, TFS_CHECK_UNLISTED, i, type[i]);
+        }
+    }
+
+    vol->freeBlockCount = freeCount;
+    if (strays > 0 && report->problemCount == 0) {
+        int *chain = malloc(strays * sizeof(int)), n = 0;
+        if (chain) {
+            for (i = 1; i < vol->totalBlocks; i++) {
+                if (type[i] == 4 && !testBit(st.freeBits, i)) chain[n++] = i;
+            }
+        }
+        if (!chain || writeFreeBlocks(chain, n, 1) < 0) {
+            addProblem(report, TFS_CHECK_IO, 0, -1);
+        } else {
+            report->reclaimed = n;
+        }
+        free(chain);
+    }
+
+    report->blocks = vol->totalBlocks;
+    report->freeBlocks = vol->freeBlockCount;
+    report->inodes = inodeTotal;
+    report->threads = threads;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    report->micros = (finished.tv_sec - started.tv_sec) * 1000000L +
+                     (finished.tv_nsec - started.tv_nsec) / 1000;
+    free(inodes);
+    free(dirs);
+    free(pool);
+    free(type);
+    free(link);
+    free(bits);
+    if (report->problemCount > 0) return -1;
     return 0;  // File system is consistent.
-}
\ No newline at end of file
+}
+
+/* tfs_getCheckReport:
+   - Copies the report of the last consistency check, run at mount or by
+     tfs_check(), into report: the problems it found (the first
+     TFS_CHECK_MAX_PROBLEMS of problemCount), what it scanned and how long
+     it took.
+   - Returns TFS_SUCCESS, or TFS_ERR if report is NULL.
+*/
+static int getCheckReportLocked(TfsCheckReport *report){
+    if (!report) return TFS_ERR;
+    *report = vol->lastCheck;
+    return TFS_SUCCESS;
+}
+
+/* tfs_checkProblemText:
+   - Returns a one-line description of a TFS_CHECK_* problem code.
+*/
+const char *tfs_checkProblemText(int code){
+    switch (code) {
+    case TFS_CHECK_IO:             return "the volume could not be read";
+    case TFS_CHECK_SUPERBLOCK:     return "superblock corrupted";
+    case TFS_CHECK_MAGIC:          return "block has an invalid magic number";
+    case TFS_CHECK_TYPE:           return "block has an unknown type";
+    case TFS_CHECK_BITMAP_REGION:  return "bitmap block outside the bitmap region, or other block inside it";
+    case TFS_CHECK_RESERVED_FREE:  return "reserved block is marked free";
+    case TFS_CHECK_FREE_LIST:      return "free list points outside the volume, loops, or at a block that is not free";
+    case TFS_CHECK_FREE_UNLISTED:  return "block is free on disk but not in the free space";
+    case TFS_CHECK_ALLOCATED_FREE: return "block is allocated but also in the free space";
+    case TFS_CHECK_FILE_POINTER:   return "file block points at an invalid or corrupted block";
+    case TFS_CHECK_SHARED:         return "block is referenced by multiple inodes";
+    case TFS_CHECK_SIZE:           return "indexed inode maps the wrong number of data blocks for its size";
+    case TFS_CHECK_ORPHAN:         return "block is allocated but not referenced by any inode";
+    case TFS_CHECK_DIR_CHAIN:      return "directory chain points at a block that is not a directory block";
+    case TFS_CHECK_DIR_ENTRY:      return "directory entry names a block that is not an unlisted inode";
+    case TFS_CHECK_DIR_NAME:       return "directory entry does not match the name of its inode";
+    case TFS_CHECK_UNLISTED:       return "inode or directory block is not in the directory";
+    default:                       return "unknown problem";
+    }
+}
+
+//-------------------------------------------------------------
+/*                   Background scrubber                     */
+//-------------------------------------------------------------
+
+// The scrub thread verifies the volume a batch of blocks at a time, each
+// batch under the volume lock, and sleeps between batches to stay within
+// its budget of blocks per second. Each block is checked on its own: magic
+// number and type, the blocks its pointers lead to, and its free-space
+// state. Findings are collected per pass over the volume.
+
+#define SCRUB_BATCH 16 // blocks read per hold of the volume lock, pointer targets included
+
+
+// Type of block ptr, read for the scrubber; -1 if ptr is outside the
+// volume, in the journal region or unreadable
+static int scrubTypeOf(int ptr, char *scratch){
+    if (ptr < 1 || ptr >= vol->totalBlocks || inJournal(ptr)) return -1;
+    const char *block = peekBlock(ptr, scratch);
+    vol->scrubBlocksRead++;
+    if (!block || block[1] != 0x44) return -1;
+    return block[0];
+}
+
+// Reports block i if the nonzero pointer ptr does not lead to a block of
+// type want (or of type alt, when alt is not 0)
+static void scrubPointer(int i, int ptr, int want, int alt, int code, char *scratch){
+    if (ptr == 0) return;
+    int type = scrubTypeOf(ptr, scratch);
+    if (type != want && (alt == 0 || type != alt)) addProblem(&vol->scrubPass, code, i, ptr);
+}
+
+// Whether block i is held by a magazine. The volume is held alone, so no
+// thread is using one.
+static int inMagazine(int i){
+    int j, k;
+    for (j = 0; j < MAGAZINES; j++) {
+        for (k = 0; k < vol->magazines[j].count; k++) {
+            if (vol->magazines[j].blocks[k] == i) return 1;
+        }
+    }
+    return 0;
+}
+
+// Verifies one block against its neighbours and the free space
+static void scrubBlock(int i){
+    char copy[BLOCKSIZE], scratch[BLOCKSIZE];
+    int j;
+    if (inJournal(i)) return;
+    const char *view = peekBlock(i, copy);
+    vol->scrubBlocksRead++;
+    if (!view) {
+        addProblem(&vol->scrubPass, TFS_CHECK_IO, i, -1);
+        return;
+    }
+    if (view != copy) memcpy(copy, view, BLOCKSIZE); // keep it while the pointer targets are read
+    if (i == 0) {
+        if (copy[0] != 1 || copy[1] != 0x44) addProblem(&vol->scrubPass, TFS_CHECK_SUPERBLOCK, 0, -1);
+        return;
+    }
+    int inBitmap = vol->useBitmap && i >= vol->bitmapStart && i < vol->bitmapStart + vol->bitmapBlocks;
+    int type = copy[0];
+    if (copy[1] != 0x44) {
+        addProblem(&vol->scrubPass, TFS_CHECK_MAGIC, i, -1);
+    } else if ((type == 5) != inBitmap) {
+        addProblem(&vol->scrubPass, TFS_CHECK_BITMAP_REGION, i, type);
+    } else if (type == 4) {
+        if (inMagazine(i)) return; // off the free space until drained
+        if (vol->useBitmap && !isBlockFree(i)) addProblem(&vol->scrubPass, TFS_CHECK_FREE_UNLISTED, i, -1);
+        if (!vol->useBitmap) {
+            int next = bytesToInt(copy+4);
+            if (next != 0 && scrubTypeOf(next, scratch) != 4) addProblem(&vol->scrubPass, TFS_CHECK_FREE_LIST, next, i);
+        }
+    } else if (type == 2 || type == 3 || type == 7 || type == 8 ||
+               (type == 6 && (vol->mountedSuper[2] & FEATURE_DIRECTORY))) {
+        if (vol->useBitmap && isBlockFree(i)) addProblem(&vol->scrubPass, TFS_CHECK_ALLOCATED_FREE, i, -1);
+        if (type == 2 && isIndexed(copy)) {
+            for (j = 0; j < DIRECT_POINTERS; j++)
+                scrubPointer(i, bytesToInt(copy + 40 + j * 4), 8, 0, TFS_CHECK_FILE_POINTER, scratch);
+            scrubPointer(i, bytesToInt(copy+248), 7, 0, TFS_CHECK_FILE_POINTER, scratch);
+            scrubPointer(i, bytesToInt(copy+252), 7, 0, TFS_CHECK_FILE_POINTER, scratch);
+        } else if (type == 2) {
+            scrubPointer(i, bytesToInt(copy+16), 3, 0, TFS_CHECK_FILE_POINTER, scratch);
+        } else if (type == 3) {
+            scrubPointer(i, bytesToInt(copy+4), 3, 0, TFS_CHECK_FILE_POINTER, scratch);
+        } else if (type == 7) {
+            for (j = 0; j < POINTERS_PER_INDEX; j++)
+                scrubPointer(i, bytesToInt(copy + 4 + j * 4), 8, 7, TFS_CHECK_FILE_POINTER, scratch);
+        } else if (type == 6) {
+            scrubPointer(i, bytesToInt(copy+4), 6, 0, TFS_CHECK_DIR_CHAIN, scratch);
+            for (j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+                const char *entry = copy + 8 + j * DIR_ENTRY_SIZE;
+                int inodePtr = bytesToInt(entry + 8);
+                if (inodePtr == 0) continue;
+                if (scrubTypeOf(inodePtr, scratch) != 2) {
+                    addProblem(&vol->scrubPass, TFS_CHECK_DIR_ENTRY, i, inodePtr);
+                } else {
+                    const char *inode = peekBlock(inodePtr, scratch);
+                    if (inode && memcmp(inode + 4, entry, 8) != 0)
+                        addProblem(&vol->scrubPass, TFS_CHECK_DIR_NAME, i, inodePtr);
+                }
+            }
+        }
+    } else if (type != 5) { // bitmap blocks were placed above
+        addProblem(&vol->scrubPass, TFS_CHECK_TYPE, i, type);
+    }
+}
+
+// Verifies blocks until a batch has been read; returns how many blocks it read
+static long scrubBatch(void){
+    long before = vol->scrubBlocksRead;
+    while (vol->scrubBlocksRead - before < SCRUB_BATCH && vol->mountedDisk >= 0) {
+        if (vol->scrubPosition >= vol->totalBlocks) {
+            vol->scrubLastPass = vol->scrubPass;
+            vol->scrubLastPass.blocks = vol->totalBlocks;
+            memset(&vol->scrubPass, 0, sizeof(vol->scrubPass));
+            vol->scrubPasses++;
+            vol->scrubPosition = 0;
+        }
+        scrubBlock(vol->scrubPosition++);
+    }
+    return vol->scrubBlocksRead - before;
+}
+
+static void *scrubMain(void *arg){
+    vol = arg; // for good: this thread serves only this volume
+    struct timespec next;
+    clock_gettime(CLOCK_REALTIME, &next);
+    pthread_mutex_lock(&vol->scrubLock);
+    while (!vol->scrubStopping) {
+        pthread_mutex_unlock(&vol->scrubLock);
+        enterVolume(vol, VOLUME_EXCLUSIVE);
+        long read = scrubBatch();
+        leaveVolume(vol);
+
+        // the next batch may start once this one's blocks fit the budget
+        long nanos = read * 1000000000L / vol->scrubRate;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (next.tv_sec < now.tv_sec - 1) next = now; // do not make up for a long stall
+        next.tv_sec += nanos / 1000000000L;
+        next.tv_nsec += nanos % 1000000000L;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&vol->scrubLock);
+        while (!vol->scrubStopping && pthread_cond_timedwait(&vol->scrubWake, &vol->scrubLock, &next) == 0);
+    }
+    pthread_mutex_unlock(&vol->scrubLock);
+    return arg;
+}
+
+/* tfs_scrubStart:
+   - Starts a background thread that verifies the mounted volume block by
+     block, over and over, reading at most blocksPerSecond blocks a second
+     (pointer targets included). Foreground operations wait for at most
+     one small batch of the scrubber.
+   - Progress and findings are reported by tfs_scrubStatus().
+   - Returns TFS_SUCCESS, or TFS_ERR if nothing is mounted, a scrub is
+     already running, blocksPerSecond is not positive or the thread cannot
+     be started.
+*/
+static int scrubStartLocked(int blocksPerSecond){
+    if (blocksPerSecond <= 0) return TFS_ERR;
+    pthread_mutex_lock(&vol->scrubLock);
+    int result = TFS_ERR;
+    if (vol->mountedDisk >= 0 && !vol->scrubRunning) {
+        vol->scrubRate = blocksPerSecond;
+        vol->scrubStopping = 0;
+        vol->scrubPosition = 0;
+        vol->scrubPasses = 0;
+        vol->scrubBlocksRead = 0;
+        memset(&vol->scrubPass, 0, sizeof(vol->scrubPass));
+        memset(&vol->scrubLastPass, 0, sizeof(vol->scrubLastPass));
+        if (pthread_create(&vol->scrubThread, NULL, scrubMain, vol) == 0) {
+            vol->scrubRunning = 1;
+            result = TFS_SUCCESS;
+        }
+    }
+    pthread_mutex_unlock(&vol->scrubLock);
+    return result;
+}
+
+/* tfs_scrubStop:
+   - Stops the scrub thread and waits for it; its status stays readable.
+     Unmounting stops it too.
+   - Returns TFS_SUCCESS, or TFS_ERR if no scrub is running.
+   Called without the volume lock, which the thread needs to finish its
+   batch.
+*/
+static int scrubStopVolume(tfs_volume *v){
+    pthread_mutex_lock(&v->scrubLock);
+    if (!v->scrubRunning) {
+        pthread_mutex_unlock(&v->scrubLock);
+        return TFS_ERR;
+    }
+    v->scrubStopping = 1;
+    pthread_cond_signal(&v->scrubWake);
+    pthread_mutex_unlock(&v->scrubLock);
+    pthread_join(v->scrubThread, NULL);
+    pthread_mutex_lock(&v->scrubLock);
+    v->scrubRunning = 0;
+    pthread_mutex_unlock(&v->scrubLock);
+    return TFS_SUCCESS;
+}
+
+/* tfs_scrubStatus:
+   - Copies the scrubber's progress into status: whether it runs, its
+     rate, the next block it verifies, the passes completed and blocks
+     read, the problems found so far in this pass, and the problems found
+     by the last complete pass.
+   - Returns TFS_SUCCESS, or TFS_ERR if status is NULL.
+*/
+static int scrubStatusLocked(TfsScrubStatus *status){
+    if (!status) return TFS_ERR;
+    pthread_mutex_lock(&vol->scrubLock);
+    status->running = vol->scrubRunning;
+    status->rate = vol->scrubRate;
+    pthread_mutex_unlock(&vol->scrubLock);
+    status->position = vol->scrubPosition;
+    status->passes = vol->scrubPasses;
+    status->blocksRead = vol->scrubBlocksRead;
+    status->pendingProblems = vol->scrubPass.problemCount;
+    status->problemCount = vol->scrubLastPass.problemCount;
+    memcpy(status->problems, vol->scrubLastPass.problems, sizeof(status->problems));
+    return TFS_SUCCESS;
+}
+
+//-------------------------------------------------------------
+/*                   Volume handles                          */
+//-------------------------------------------------------------
+
+// Each tfsv_* call runs the matching *Locked function on its volume with
+// the volume lock held shared or alone, the file's inode lock for calls on
+// a descriptor, and metaLock for calls that mostly change the directory or
+// the open file table; each tfs_* call is the tfsv_* call on the default
+// volume. Calls on different volumes, and reads of any files, run in
+// parallel.
+
+/* tfsv_mount:
+   - Mounts diskname like tfs_mountEx(diskname, flags), but on a volume of
+     its own: on success *volume is a new handle that every tfsv_* call
+     takes, independent of the default volume and of other handles.
+   - Returns TFS_SUCCESS, or TFS_ERR_MOUNT with *volume set to NULL.
+*/
+int tfsv_mount(tfs_volume **volume, char *diskname, int flags){
+    *volume = NULL;
+    tfs_volume *v = malloc(sizeof(tfs_volume));
+    if (!v) return TFS_ERR_MOUNT;
+    initVolume(v);
+    tfs_volume *previous = enterVolume(v, VOLUME_EXCLUSIVE);
+    int result = mountExLocked(diskname, flags);
+    leaveVolume(previous);
+    if (result != TFS_SUCCESS) {
+        destroyVolume(v);
+        free(v);
+        return result;
+    }
+    *volume = v;
+    return TFS_SUCCESS;
+}
+
+// Stops the volume's scrubber and defragmentation and unmounts it
+static int unmountVolume(tfs_volume *v){
+    scrubStopVolume(v);
+    defragStopVolume(v);
+    tfs_volume *previous = enterVolume(v, VOLUME_EXCLUSIVE);
+    int result = unmountLocked();
+    leaveVolume(previous);
+    return result;
+}
+
+/* tfsv_unmount:
+   - Unmounts the volume like tfs_unmount and frees the handle.
+   - Returns TFS_SUCCESS, or TFS_ERR_UNMOUNT if the volume could not be
+     written back; the handle then stays valid.
+*/
+int tfsv_unmount(tfs_volume *volume){
+    int result = unmountVolume(volume);
+    if (result == TFS_SUCCESS) {
+        destroyVolume(volume);
+        free(volume);
+    }
+    return result;
+}
+
+int tfsv_scrubStart(tfs_volume *volume, int blocksPerSecond){
+    tfs_volume *previous = enterVolume(volume, VOLUME_READ);
+    int result = scrubStartLocked(blocksPerSecond);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_scrubStop(tfs_volume *volume){
+    return scrubStopVolume(volume);
+}
+
+int tfsv_scrubStatus(tfs_volume *volume, TfsScrubStatus *status){
+    tfs_volume *previous = enterVolume(volume, VOLUME_READ);
+    int result = scrubStatusLocked(status);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_getMountStats(tfs_volume *volume, TfsMountStats *stats){
+    tfs_volume *previous = enterVolume(volume, VOLUME_READ);
+    int result = getMountStatsLocked(stats);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_check(tfs_volume *volume){
+    tfs_volume *previous = enterVolume(volume, VOLUME_EXCLUSIVE);
+    int result = checkLocked();
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_sync(tfs_volume *volume){
+    tfs_volume *previous = enterVolume(volume, VOLUME_EXCLUSIVE);
+    int result = syncLocked();
+    leaveVolume(previous);
+    return result;
+}
+
+fileDescriptor tfsv_openFile(tfs_volume *volume, char *name){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    beginLog(logCredits(3, 2)); // a new inode, its directory block and one more
+    lockMeta();
+    fileDescriptor result = openFileLocked(name);
+    unlockMeta();
+    endLog();
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_closeFile(tfs_volume *volume, fileDescriptor FD){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int inodeBlock = lockFile(FD, 0);
+    beginLog(logCredits(1, 0));
+    lockMeta();
+    int result = closeFileLocked(FD);
+    unlockMeta();
+    endLog();
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_writeFile(tfs_volume *volume, fileDescriptor FD, char *buffer, int size){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int inodeBlock = lockFile(FD, 1);
+    int result = writeFileLocked(FD, buffer, size);
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_writeAt(tfs_volume *volume, fileDescriptor FD, int offset, char *buffer, int size){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int inodeBlock = lockFile(FD, 1);
+    int result = writeAtLocked(FD, offset, buffer, size);
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_append(tfs_volume *volume, fileDescriptor FD, char *buffer, int size){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int inodeBlock = lockFile(FD, 1);
+    int result = appendLocked(FD, buffer, size);
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_deleteFile(tfs_volume *volume, fileDescriptor FD){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int inodeBlock = lockFile(FD, 1);
+    int result = deleteFileLocked(FD);
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_readByte(tfs_volume *volume, fileDescriptor FD, char *buffer){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int inodeBlock = lockFile(FD, 0);
+    int result = readByteLocked(FD, buffer);
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_read(tfs_volume *volume, fileDescriptor FD, char *buffer, int size){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int inodeBlock = lockFile(FD, 0);
+    int result = readLocked(FD, buffer, size);
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_pread(tfs_volume *volume, fileDescriptor FD, char *buffer, int size, int offset){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int inodeBlock = lockFile(FD, 0);
+    int result = preadLocked(FD, buffer, size, offset);
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_seek(tfs_volume *volume, fileDescriptor FD, int offset){
+    tfs_volume *previous = enterVolume(volume, VOLUME_READ);
+    int inodeBlock = lockFile(FD, 0);
+    int result = seekLocked(FD, offset);
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_readFileInfo(tfs_volume *volume, fileDescriptor FD){
+    tfs_volume *previous = enterVolume(volume, VOLUME_READ);
+    int inodeBlock = lockFile(FD, 0);
+    int result = readFileInfoLocked(FD);
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_makeRO(tfs_volume *volume, char *name){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int result = makeROLocked(name);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_makeRW(tfs_volume *volume, char *name){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int result = makeRWLocked(name);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_writeByte(tfs_volume *volume, fileDescriptor FD, int offset, unsigned int data){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int inodeBlock = lockFile(FD, 1);
+    beginLog(logCredits(2, 0));
+    int result = writeByteLocked(FD, offset, data);
+    endLog();
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_rename(tfs_volume *volume, fileDescriptor FD, char *newName){
+    tfs_volume *previous = enterVolume(volume, VOLUME_UPDATE);
+    int inodeBlock = lockFile(FD, 1);
+    beginLog(logCredits(2, 0));
+    lockMeta();
+    int result = renameLocked(FD, newName);
+    unlockMeta();
+    endLog();
+    unlockFile(FD, inodeBlock);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_readdir(tfs_volume *volume){
+    tfs_volume *previous = enterVolume(volume, VOLUME_READ);
+    lockMeta();
+    int result = readdirLocked();
+    unlockMeta();
+    leaveVolume(previous);
+    return result;
+}
+
+void tfsv_displayFragments(tfs_volume *volume){
+    tfs_volume *previous = enterVolume(volume, VOLUME_EXCLUSIVE);
+    displayFragmentsLocked();
+    leaveVolume(previous);
+}
+
+void tfsv_defrag(tfs_volume *volume){
+    tfs_volume *previous = enterVolume(volume, VOLUME_EXCLUSIVE);
+    defragExLocked(0);
+    leaveVolume(previous);
+}
+
+int tfsv_defragEx(tfs_volume *volume, int flags){
+    tfs_volume *previous = enterVolume(volume, VOLUME_EXCLUSIVE);
+    int result = defragExLocked(flags);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_defragStep(tfs_volume *volume, int budget){
+    tfs_volume *previous = enterVolume(volume, VOLUME_EXCLUSIVE);
+    int result = defragStepLocked(budget);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_defragStart(tfs_volume *volume, int maxStepMicros){
+    tfs_volume *previous = enterVolume(volume, VOLUME_READ);
+    int result = defragStartLocked(maxStepMicros);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_defragStop(tfs_volume *volume){
+    return defragStopVolume(volume);
+}
+
+int tfsv_defragStatus(tfs_volume *volume, TfsDefragStatus *status){
+    tfs_volume *previous = enterVolume(volume, VOLUME_READ);
+    int result = defragStatusLocked(status);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfsv_getCheckReport(tfs_volume *volume, TfsCheckReport *report){
+    tfs_volume *previous = enterVolume(volume, VOLUME_READ);
+    int result = getCheckReportLocked(report);
+    leaveVolume(previous);
+    return result;
+}
+
+//-------------------------------------------------------------
+/*                   Default volume                          */
+//-------------------------------------------------------------
+
+int tfs_mountEx(char *diskname, int flags){
+    tfs_volume *previous = enterVolume(getDefaultVolume(), VOLUME_EXCLUSIVE);
+    int result = mountExLocked(diskname, flags);
+    leaveVolume(previous);
+    return result;
+}
+
+int tfs_unmount(void){
+    return unmountVolume(getDefaultVolume());
+}
+
+int tfs_scrubStart(int blocksPerSecond){
+    return tfsv_scrubStart(getDefaultVolume(), blocksPerSecond);
+}
+
+int tfs_scrubStop(void){
+    return tfsv_scrubStop(getDefaultVolume());
+}
+
+int tfs_scrubStatus(TfsScrubStatus *status){
+    return tfsv_scrubStatus(getDefaultVolume(), status);
+}
+
+int tfs_getMountStats(TfsMountStats *stats){
+    return tfsv_getMountStats(getDefaultVolume(), stats);
+}
+
+int tfs_check(void){
+    return tfsv_check(getDefaultVolume());
+}
+
+int tfs_sync(void){
+    return tfsv_sync(getDefaultVolume());
+}
+
+fileDescriptor tfs_openFile(char *name){
+    return tfsv_openFile(getDefaultVolume(), name);
+}
+
+int tfs_closeFile(fileDescriptor FD){
+    return tfsv_closeFile(getDefaultVolume(), FD);
+}
+
+int tfs_writeFile(fileDescriptor FD, char *buffer, int size){
+    return tfsv_writeFile(getDefaultVolume(), FD, buffer, size);
+}
+
+int tfs_writeAt(fileDescriptor FD, int offset, char *buffer, int size){
+    return tfsv_writeAt(getDefaultVolume(), FD, offset, buffer, size);
+}
+
+int tfs_append(fileDescriptor FD, char *buffer, int size){
+    return tfsv_append(getDefaultVolume(), FD, buffer, size);
+}
+
+int tfs_deleteFile(fileDescriptor FD){
+    return tfsv_deleteFile(getDefaultVolume(), FD);
+}
+
+int tfs_readByte(fileDescriptor FD, char *buffer){
+    return tfsv_readByte(getDefaultVolume(), FD, buffer);
+}
+
+int tfs_read(fileDescriptor FD, char *buffer, int size){
+    return tfsv_read(getDefaultVolume(), FD, buffer, size);
+}
+
+int tfs_pread(fileDescriptor FD, char *buffer, int size, int offset){
+    return tfsv_pread(getDefaultVolume(), FD, buffer, size, offset);
+}
+
+int tfs_seek(fileDescriptor FD, int offset){
+    return tfsv_seek(getDefaultVolume(), FD, offset);
+}
+
+int tfs_readFileInfo(fileDescriptor FD){
+    return tfsv_readFileInfo(getDefaultVolume(), FD);
+}
+
+int tfs_makeRO(char *name){
+    return tfsv_makeRO(getDefaultVolume(), name);
+}
+
+int tfs_makeRW(char *name){
+    return tfsv_makeRW(getDefaultVolume(), name);
+}
+
+int tfs_writeByte(fileDescriptor FD, int offset, unsigned int data){
+    return tfsv_writeByte(getDefaultVolume(), FD, offset, data);
+}
+
+int tfs_rename(fileDescriptor FD, char *newName){
+    return tfsv_rename(getDefaultVolume(), FD, newName);
+}
+
+int tfs_readdir(void){
+    return tfsv_readdir(getDefaultVolume());
+}
+
+void tfs_displayFragments(void){
+    tfsv_displayFragments(getDefaultVolume());
+}
+
+void tfs_defrag(void){
+    tfsv_defrag(getDefaultVolume());
+}
+
+int tfs_defragEx(int flags){
+    return tfsv_defragEx(getDefaultVolume(), flags);
+}
+
+int tfs_defragStep(int budget){
+    return tfsv_defragStep(getDefaultVolume(), budget);
+}
+
+int tfs_defragStart(int maxStepMicros){
+    return tfsv_defragStart(getDefaultVolume(), maxStepMicros);
+}
+
+int tfs_defragStop(void){
+    return tfsv_defragStop(getDefaultVolume());
+}
+
+int tfs_defragStatus(TfsDefragStatus *status){
+    return tfsv_defragStatus(getDefaultVolume(), status);
+}
+
+int tfs_getCheckReport(TfsCheckReport *report){
+    return tfsv_getCheckReport(getDefaultVolume(), report);
+}
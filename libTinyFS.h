@@ -3,15 +3,99 @@
 
 #include "tinyFS.h"
 
+/* tfs_mkfsEx flags */
+#define TFS_MKFS_BITMAP 0x01 // track free space in a bitmap instead of a free list
+#define TFS_MKFS_INDEXED 0x04 // new files map their data through direct and indirect pointers
+#define TFS_MKFS_JOURNAL 0x08 // block writes go through a write-ahead log region
+
 int tfs_mkfs(char *filename, int nBytes);
+int tfs_mkfsEx(char *filename, int nBytes, int flags);
+/* tfs_mountEx flags */
+#define TFS_MOUNT_NOATIME  0x01 // reads never update access times
+#define TFS_MOUNT_RELATIME 0x02 // access times only refreshed when stale, written at close/unmount
+#define TFS_MOUNT_CHECK    0x04 // run the consistency check even on a cleanly unmounted volume
+#define TFS_MOUNT_NOCHECK  0x08 // mount a dirty volume without the check, see tfs_check
+
+typedef struct TfsMountStats {
+    long micros;    // time the last tfs_mount took
+    int wasClean;   // the volume had been unmounted cleanly
+    int checked;    // the consistency check ran
+    int replayed;   // blocks the journal replayed
+} TfsMountStats;
+
 int tfs_mount(char *diskname);
+int tfs_mountEx(char *diskname, int flags);
 int tfs_unmount(void);
+int tfs_sync(void);
+int tfs_check(void);
+int tfs_getMountStats(TfsMountStats *stats);
+
+/* Problems reported by the consistency check (TfsCheckProblem.code) */
+#define TFS_CHECK_IO              1  // the volume could not be read
+#define TFS_CHECK_SUPERBLOCK      2  // superblock type or magic is wrong
+#define TFS_CHECK_MAGIC           3  // block has an invalid magic number
+#define TFS_CHECK_TYPE            4  // block has an unknown type (detail: the type)
+#define TFS_CHECK_BITMAP_REGION   5  // bitmap block outside the bitmap region or other block inside it
+#define TFS_CHECK_RESERVED_FREE   6  // superblock, bitmap or journal block marked free
+#define TFS_CHECK_FREE_LIST       7  // free list leaves the volume, loops or reaches a non-free block (detail: the block pointing there)
+#define TFS_CHECK_FREE_UNLISTED   8  // free block not in the free list or bitmap (scrub only; the check reclaims it)
+#define TFS_CHECK_ALLOCATED_FREE  9  // allocated block also in the free list or bitmap
+#define TFS_CHECK_FILE_POINTER   10  // inode, data or index block points outside the volume or at the wrong type (detail: the pointer)
+#define TFS_CHECK_SHARED         11  // block referenced twice (detail: the second inode)
+#define TFS_CHECK_SIZE           12  // indexed inode maps the wrong number of blocks (detail: blocks mapped)
+#define TFS_CHECK_ORPHAN         13  // data or index block no inode references
+#define TFS_CHECK_DIR_CHAIN      14  // directory chain reaches a non-directory or repeated block (detail: the pointer)
+#define TFS_CHECK_DIR_ENTRY      15  // directory entry names a non-inode or an inode listed twice (detail: the entry's inode)
+#define TFS_CHECK_DIR_NAME       16  // directory entry and inode names differ (detail: the inode)
+#define TFS_CHECK_UNLISTED       17  // inode or directory block not reached through the directory
+
+#define TFS_CHECK_MAX_PROBLEMS 16
+
+typedef struct TfsCheckProblem {
+    int code;       // TFS_CHECK_*
+    int block;      // block the problem was found at
+    int detail;     // see the code, -1 if unused
+} TfsCheckProblem;
+
+typedef struct TfsCheckReport {
+    int problemCount;   // problems found, the first TFS_CHECK_MAX_PROBLEMS listed below
+    TfsCheckProblem problems[TFS_CHECK_MAX_PROBLEMS];
+    int blocks;         // blocks scanned
+    int freeBlocks;     // blocks in the free list or bitmap
+    int reclaimed;      // free blocks found outside them and put back
+    int inodes;         // inodes found
+    int threads;        // threads the scan was split across
+    long micros;        // time the check took
+} TfsCheckReport;
+
+int tfs_getCheckReport(TfsCheckReport *report);
+const char *tfs_checkProblemText(int code);
+
+typedef struct TfsScrubStatus {
+    int running;         // the scrub thread is active
+    int rate;            // blocks per second it may read
+    int position;        // next block it verifies
+    long passes;         // complete passes over the volume
+    long blocksRead;     // blocks read, pointer targets included
+    int pendingProblems; // problems found so far in the current pass
+    int problemCount;    // problems found by the last complete pass, the first TFS_CHECK_MAX_PROBLEMS listed
+    TfsCheckProblem problems[TFS_CHECK_MAX_PROBLEMS];
+} TfsScrubStatus;
+
+int tfs_scrubStart(int blocksPerSecond);
+int tfs_scrubStop(void);
+int tfs_scrubStatus(TfsScrubStatus *status);
+
 fileDescriptor tfs_openFile(char *name);
 int tfs_closeFile(fileDescriptor FD);
 int tfs_writeFile(fileDescriptor FD, char *buffer, int size);
+int tfs_writeAt(fileDescriptor FD, int offset, char *buffer, int size);
+int tfs_append(fileDescriptor FD, char *buffer, int size);
 int tfs_deleteFile(fileDescriptor FD);
 int tfs_readByte(fileDescriptor FD, char *buffer);
 int tfs_seek(fileDescriptor FD, int offset);
+int tfs_read(fileDescriptor FD, char *buffer, int size);
+int tfs_pread(fileDescriptor FD, char *buffer, int size, int offset);
 //new ones
 int tfs_readFileInfo(fileDescriptor FD);
 int tfs_writeByte(fileDescriptor FD, int offset, unsigned int newByte);
@@ -21,27 +105,101 @@ int tfs_makeRO(char *filename);
 int tfs_makeRW(char *filename);
 void tfs_displayFragments();
 void tfs_defrag();
+/* tfs_defragEx flags */
+#define TFS_DEFRAG_FILE_ORDER 0x01 // each inode followed by its data in logical order
+int tfs_defragEx(int flags);
+
+typedef struct TfsDefragStatus {
+    int running;            // the background thread is active
+    int maxStepMicros;      // the longest it means to hold the volume per step
+    int position;           // directory slot the next step examines
+    long passes;            // complete passes over the directory
+    long blocksMoved;       // data blocks moved by steps since the mount
+    long longestStepMicros; // the longest a step has held the volume
+} TfsDefragStatus;
+
+int tfs_defragStep(int budget);
+int tfs_defragStart(int maxStepMicros);
+int tfs_defragStop(void);
+int tfs_defragStatus(TfsDefragStatus *status);
 // static int checkConsistency(void);
+
+/* Volume handles: the calls above work on one default volume per process.
+   tfsv_mount mounts a volume of its own and returns a handle for the
+   tfsv_* calls, which behave like their tfs_* counterparts. Any call may
+   be made from any thread: reads of a file run concurrently, writes to it
+   exclusively, and different files and volumes do not wait on each other.
+   tfsv_unmount frees the handle. */
+typedef struct TfsVolume tfs_volume;
+
+int tfsv_mount(tfs_volume **volume, char *diskname, int flags);
+int tfsv_unmount(tfs_volume *volume);
+int tfsv_sync(tfs_volume *volume);
+int tfsv_check(tfs_volume *volume);
+int tfsv_getMountStats(tfs_volume *volume, TfsMountStats *stats);
+int tfsv_getCheckReport(tfs_volume *volume, TfsCheckReport *report);
+int tfsv_scrubStart(tfs_volume *volume, int blocksPerSecond);
+int tfsv_scrubStop(tfs_volume *volume);
+int tfsv_scrubStatus(tfs_volume *volume, TfsScrubStatus *status);
+fileDescriptor tfsv_openFile(tfs_volume *volume, char *name);
+int tfsv_closeFile(tfs_volume *volume, fileDescriptor FD);
+int tfsv_writeFile(tfs_volume *volume, fileDescriptor FD, char *buffer, int size);
+int tfsv_writeAt(tfs_volume *volume, fileDescriptor FD, int offset, char *buffer, int size);
+int tfsv_append(tfs_volume *volume, fileDescriptor FD, char *buffer, int size);
+int tfsv_deleteFile(tfs_volume *volume, fileDescriptor FD);
+int tfsv_readByte(tfs_volume *volume, fileDescriptor FD, char *buffer);
+int tfsv_seek(tfs_volume *volume, fileDescriptor FD, int offset);
+int tfsv_read(tfs_volume *volume, fileDescriptor FD, char *buffer, int size);
+int tfsv_pread(tfs_volume *volume, fileDescriptor FD, char *buffer, int size, int offset);
+int tfsv_readFileInfo(tfs_volume *volume, fileDescriptor FD);
+int tfsv_writeByte(tfs_volume *volume, fileDescriptor FD, int offset, unsigned int newByte);
+int tfsv_rename(tfs_volume *volume, fileDescriptor FD, char *newname);
+int tfsv_readdir(tfs_volume *volume);
+int tfsv_makeRO(tfs_volume *volume, char *filename);
+int tfsv_makeRW(tfs_volume *volume, char *filename);
+void tfsv_displayFragments(tfs_volume *volume);
+void tfsv_defrag(tfs_volume *volume);
+int tfsv_defragEx(tfs_volume *volume, int flags);
+int tfsv_defragStep(tfs_volume *volume, int budget);
+int tfsv_defragStart(tfs_volume *volume, int maxStepMicros);
+int tfsv_defragStop(tfs_volume *volume);
+int tfsv_defragStatus(tfs_volume *volume, TfsDefragStatus *status);
 /*
 Block Structures:
 
 Superblock (block 0):
 – Bytes 0: block type (1)
 – Byte 1: magic number (0x44)
-– Bytes 4–7: pointer to the first free block
+- Byte 2: feature flags (TFS_MKFS_BITMAP, 0x02 = has a directory,
+  TFS_MKFS_INDEXED, TFS_MKFS_JOURNAL)
+- Byte 3: state flags (0x01 = unmounted cleanly; cleared while mounted)
+– Bytes 4–7: pointer to the first free block (0 on bitmap volumes)
 - Bytes 8-11: total number of blocks on disk
+- Bytes 12-15: number of free blocks (kept in memory while mounted,
+  written back with the superblock)
+- Bytes 16-19: first bitmap block (bitmap volumes only)
+- Bytes 20-23: number of bitmap blocks (bitmap volumes only)
+- Bytes 24-27: pointer to the first directory block (0 if none yet)
+- Bytes 28-31: first block of the journal region (journaled volumes only)
+- Bytes 32-35: number of journal blocks (journaled volumes only)
+- Bytes 36-39: directory slot the next tfs_defragStep examines
 
 Inode block:
 – Byte 0: type (2)
 – Byte 1: magic (0x44)
 – Bytes 4–11: file name (up to 8 characters)
 – Bytes 12–15: file size (stored as 4 bytes)
-– Bytes 16-19: pointer to the first data block (0 if none)
+– Bytes 16-19: pointer to the first data block (0 if none, or if indexed)
 - Bytes 20–23: creation timestamp (4 bytes)
 - Bytes 24–27: modification timestamp (4 bytes)
 - Bytes 28–31: access timestamp (4 bytes)
 - Byte 32: read-only flag (0 = read-write, 1 = read-only)
 - Byte 33-35: r,g,b values
+- Byte 36: data layout (0 = chain of type 3 blocks, 1 = indexed)
+- Bytes 40-247: indexed only, 52 direct pointers to type 8 data blocks
+- Bytes 248-251: indexed only, single indirect block (type 7)
+- Bytes 252-255: indexed only, double indirect block (type 7 pointing at
+  type 7 blocks)
 
 Data (file extent) block:
 – Byte 0: type (3)
@@ -52,7 +210,35 @@ Data (file extent) block:
 Free block (type 4):
 – Byte 0: type (4)
 – Byte 1: magic (0x44)
-- Bytes 4-7: pointer to next free block
+- Bytes 4-7: pointer to next free block (0 on bitmap volumes)
+
+Bitmap block (type 5, bitmap volumes only, right after the superblock):
+– Byte 0: type (5)
+– Byte 1: magic (0x44)
+- Bytes 8-255: one bit per block, set while the block is free; byte j of
+  bitmap block k covers blocks (k*248 + j)*8 to +7, lowest block in bit 0
+
+Directory block (type 6):
+– Byte 0: type (6)
+– Byte 1: magic (0x44)
+- Bytes 4-7: pointer to the next directory block (0 if last)
+- Bytes 8-247: 20 entries of 12 bytes: file name (8 bytes, zero padded)
+  followed by its inode block (4 bytes, 0 for an empty entry)
+
+Index block (type 7, indexed files only):
+– Byte 0: type (7)
+– Byte 1: magic (0x44)
+- Bytes 4-255: 63 block pointers (0 when unused)
+
+Indexed data block (type 8, indexed files only):
+– Byte 0: type (8)
+– Byte 1: magic (0x44)
+- Bytes 4-255: file data (252 bytes)
+
+Journal region (journaled volumes only, right after the bitmap blocks or
+the superblock): owned by the disk layer, see openJournal in libDisk.h.
+Its blocks are type 9 until the first commit and hold the log after that;
+they are never free and never move.
 
 */
 
@@ -0,0 +1,310 @@
+/*
+ * tfsBench.c
+ *
+ * Read throughput of TinyFS with 1 to 8 threads sharing one volume: every
+ * thread reads whole files with tfs_pread, either each its own file or all
+ * the same one. Readers only share the volume and inode locks, so the
+ * throughput can grow with the number of cores, but not past it: the cores
+ * column is the most any run can gain, and with fewer CPUs than threads
+ * the extra threads only take turns on the same cores. Then each thread
+ * rewrites a small file of its own with tfs_writeFile, taking and freeing
+ * its blocks through its own magazine. Last, the slowest small read while
+ * a background defrag untangles interleaved files, for a few step limits,
+ * and single-threaded sequential reads of interleaved files before and after
+ * each kind of tfs_defragEx, mapped and through pread. tfs_defrag only closes
+ * the gaps, so the files stay interleaved; a file-order defrag lays each one
+ * out as a single run. That only pays where a run of blocks is one read call
+ * rather than a copy out of the mapping, so the pread column shows it.
+ *
+ * Usage: tfsBench [backend] [seconds]
+ *   backend: a DISK_BACKEND_* number (default DISK_BACKEND_MMAP)
+ *   seconds: how long each run reads (default 1)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libDisk.h"
+#include "libTinyFS.h"
+#include "TinyFS_errno.h"
+
+#define BENCH_DISK "tfsBench.dsk"
+#define BENCH_BLOCKS 16384
+#define BENCH_FILES 8
+#define FILE_BYTES (256 * 1024)
+#define MAX_THREADS 8
+
+static tfs_volume *volume;
+static double seconds = 1.0;
+
+typedef struct {
+    int file;       // file the thread reads
+    long bytes;     // bytes it read, or files it wrote
+    int failed;
+} Reader;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *readFiles(void *arg){
+    Reader *reader = arg;
+    char name[9];
+    char *buffer = malloc(FILE_BYTES);
+    sprintf(name, "f%d", reader->file);
+    fileDescriptor fd = tfsv_openFile(volume, name);
+    if (!buffer || fd < 0) {
+        reader->failed = 1;
+        free(buffer);
+        return NULL;
+    }
+    double end = now() + seconds;
+    while (now() < end) {
+        if (tfsv_pread(volume, fd, buffer, FILE_BYTES, 0) != FILE_BYTES) {
+            reader->failed = 1;
+            break;
+        }
+        reader->bytes += FILE_BYTES;
+    }
+    tfsv_closeFile(volume, fd);
+    free(buffer);
+    return NULL;
+}
+
+// Thread body for the write runs: rewrites its own file, alternating
+// between two sizes so its blocks are freed and allocated every time
+static void *writeFiles(void *arg){
+    Reader *writer = arg;
+    char name[9], buffer[3000];
+    int round = 0;
+    sprintf(name, "w%d", writer->file);
+    memset(buffer, 'w', sizeof(buffer));
+    fileDescriptor fd = tfsv_openFile(volume, name);
+    if (fd < 0) {
+        writer->failed = 1;
+        return NULL;
+    }
+    double end = now() + seconds;
+    while (now() < end) {
+        if (tfsv_writeFile(volume, fd, buffer, (round++ & 1) ? 3000 : 2000) != TFS_SUCCESS) {
+            writer->failed = 1;
+            break;
+        }
+        writer->bytes++;
+    }
+    tfsv_deleteFile(volume, fd);
+    return NULL;
+}
+
+// Files written per second by threads writers
+static double runWriters(int threads){
+    pthread_t workers[MAX_THREADS];
+    Reader writers[MAX_THREADS];
+    long total = 0;
+    int t;
+    memset(writers, 0, sizeof(writers));
+    double start = now();
+    for (t = 0; t < threads; t++) {
+        writers[t].file = t;
+        pthread_create(&workers[t], NULL, writeFiles, &writers[t]);
+    }
+    for (t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+        if (writers[t].failed) return -1;
+        total += writers[t].bytes;
+    }
+    return total / (now() - start);
+}
+
+// Most speedup threads can get over one thread: one per core they can run on
+static long usableCores(int threads, long cpus){
+    return cpus > 0 && cpus < threads ? cpus : threads;
+}
+
+// Megabytes per second read by threads readers, on their own files or all
+// on file 0
+static double run(int threads, int sameFile){
+    pthread_t workers[MAX_THREADS];
+    Reader readers[MAX_THREADS];
+    long total = 0;
+    int t;
+    memset(readers, 0, sizeof(readers));
+    double start = now();
+    for (t = 0; t < threads; t++) {
+        readers[t].file = sameFile ? 0 : t % BENCH_FILES;
+        pthread_create(&workers[t], NULL, readFiles, &readers[t]);
+    }
+    for (t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+        if (readers[t].failed) return -1;
+        total += readers[t].bytes;
+    }
+    return total / (now() - start) / (1024 * 1024);
+}
+
+// Grows files g0 to g7 a block at a time in turns, then reads one block of
+// g0 over and over while a background defrag with steps of at most
+// stepMicros runs. Returns the slowest read in microseconds, -1 on failure,
+// and sets *longestStep to the longest step.
+static long readDuringDefrag(int stepMicros, long *longestStep){
+    char name[9], buffer[BLOCKSIZE];
+    fileDescriptor fds[BENCH_FILES];
+    TfsDefragStatus status;
+    int f, round;
+    memset(buffer, 'g', sizeof(buffer));
+    for (f = 0; f < BENCH_FILES; f++) {
+        sprintf(name, "g%d", f);
+        fds[f] = tfsv_openFile(volume, name);
+        tfsv_writeFile(volume, fds[f], buffer, 200);
+    }
+    for (round = 0; round < 64; round++)
+        for (f = 0; f < BENCH_FILES; f++) tfsv_append(volume, fds[f], buffer, 200);
+    if (tfsv_defragStart(volume, stepMicros) != TFS_SUCCESS) return -1;
+    long slowest = 0;
+    do {
+        double start = now();
+        if (tfsv_pread(volume, fds[0], buffer, 100, 0) != 100) slowest = -1;
+        long micros = (now() - start) * 1e6;
+        if (slowest >= 0 && micros > slowest) slowest = micros;
+    } while (tfsv_defragStatus(volume, &status) == TFS_SUCCESS && status.running && slowest >= 0);
+    tfsv_defragStop(volume);
+    *longestStep = status.longestStepMicros;
+    for (f = 0; f < BENCH_FILES; f++) tfsv_deleteFile(volume, fds[f]);
+    return slowest;
+}
+
+// Remounts the bench volume on a DISK_BACKEND_* backend. 0 on success.
+static int remount(int backend){
+    tfsv_unmount(volume);
+    setDefaultDiskBackend(backend);
+    return tfsv_mount(&volume, BENCH_DISK, TFS_MOUNT_NOATIME) == TFS_SUCCESS ? 0 : -1;
+}
+
+// Megabytes per second one thread reads whole files s0 to s7, grown a
+// block at a time in turns and then defragmented with flags (-1: left
+// interleaved). -1 on failure.
+static double readAfterDefrag(int flags){
+    char name[9];
+    char *buffer = malloc(FILE_BYTES / 2);
+    fileDescriptor fds[BENCH_FILES];
+    int f, round, rounds = FILE_BYTES / 2 / (BLOCKSIZE - 8);
+    long bytes = 0;
+    if (!buffer) return -1;
+    memset(buffer, 's', FILE_BYTES / 2);
+    for (f = 0; f < BENCH_FILES; f++) {
+        sprintf(name, "s%d", f);
+        fds[f] = tfsv_openFile(volume, name);
+    }
+    for (round = 0; round < rounds; round++)
+        for (f = 0; f < BENCH_FILES; f++) tfsv_append(volume, fds[f], buffer, BLOCKSIZE - 8);
+    if (flags >= 0 && tfsv_defragEx(volume, flags) < 0) bytes = -1;
+    double start = now(), end = start + seconds;
+    while (bytes >= 0 && now() < end) {
+        for (f = 0; f < BENCH_FILES && bytes >= 0; f++) {
+            int read = tfsv_pread(volume, fds[f], buffer, FILE_BYTES / 2, 0);
+            bytes = (read == rounds * (BLOCKSIZE - 8)) ? bytes + read : -1;
+        }
+    }
+    double rate = bytes < 0 ? -1 : bytes / (now() - start) / (1024 * 1024);
+    for (f = 0; f < BENCH_FILES; f++) tfsv_deleteFile(volume, fds[f]);
+    free(buffer);
+    return rate;
+}
+
+int main(int argc, char **argv){
+    int backend = argc > 1 ? atoi(argv[1]) : DISK_BACKEND_MMAP;
+    if (argc > 2) seconds = atof(argv[2]);
+    char *contents = malloc(FILE_BYTES);
+    char name[9];
+    int f, threads;
+
+    setDefaultDiskBackend(backend);
+    if (!contents || tfs_mkfsEx(BENCH_DISK, BENCH_BLOCKS * BLOCKSIZE, TFS_MKFS_BITMAP) != TFS_SUCCESS ||
+        tfsv_mount(&volume, BENCH_DISK, TFS_MOUNT_NOATIME) != TFS_SUCCESS) {
+        printf("Could not set up %s.\n", BENCH_DISK);
+        return 1;
+    }
+    for (f = 0; f < BENCH_FILES; f++) {
+        sprintf(name, "f%d", f);
+        memset(contents, 'a' + f, FILE_BYTES);
+        fileDescriptor fd = tfsv_openFile(volume, name);
+        tfsv_writeFile(volume, fd, contents, FILE_BYTES);
+        tfsv_closeFile(volume, fd);
+    }
+    free(contents);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%ld CPU%s, backend %d, %.1f s per run\n", cpus, cpus == 1 ? "" : "s", backend, seconds);
+    printf("threads  cores  own files MB/s  same file MB/s\n");
+    double base[2] = {0, 0};
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double own = run(threads, 0), same = run(threads, 1);
+        if (own < 0 || same < 0) {
+            printf("Read failed.\n");
+            return 1;
+        }
+        if (threads == 1) {
+            base[0] = own;
+            base[1] = same;
+        }
+        printf("%7d  %5ld  %9.1f (%.2fx)  %9.1f (%.2fx)\n", threads, usableCores(threads, cpus),
+               own, own / base[0], same, same / base[1]);
+    }
+
+    printf("threads  cores  writeFile/s\n");
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double writes = runWriters(threads);
+        if (writes < 0) {
+            printf("Write failed.\n");
+            return 1;
+        }
+        if (threads == 1) base[0] = writes;
+        printf("%7d  %5ld  %9.0f (%.2fx)\n", threads, usableCores(threads, cpus), writes, writes / base[0]);
+    }
+    if (cpus < MAX_THREADS)
+        printf("Only %ld CPU%s: threads past %ld share %s, so no run can beat %ldx here;\n"
+               "rates that stay flat show what the locks cost, not how far they scale.\n",
+               cpus, cpus == 1 ? "" : "s", cpus, cpus == 1 ? "it" : "them", cpus);
+
+    int limits[] = {200, 1000, 5000};
+    printf("defrag step limit us  longest step us  slowest read us\n");
+    for (f = 0; f < 3; f++) {
+        long longest;
+        long slowest = readDuringDefrag(limits[f], &longest);
+        if (slowest < 0) {
+            printf("Defrag failed.\n");
+            return 1;
+        }
+        printf("%20d  %15ld  %15ld\n", limits[f], longest, slowest);
+    }
+
+    int layouts[] = {-1, 0, TFS_DEFRAG_FILE_ORDER};
+    const char *layoutNames[] = {"interleaved", "tfs_defrag", "file order"};
+    int backends[] = {DISK_BACKEND_MMAP, DISK_BACKEND_PIO}, b;
+    double rates[2][3];
+    for (b = 0; b < 2; b++) {
+        if (remount(backends[b]) < 0) {
+            printf("Could not remount %s.\n", BENCH_DISK);
+            return 1;
+        }
+        for (f = 0; f < 3; f++) {
+            if ((rates[b][f] = readAfterDefrag(layouts[f])) < 0) {
+                printf("Sequential read failed.\n");
+                return 1;
+            }
+        }
+    }
+    printf("sequential read  mapped MB/s        pread MB/s\n");
+    for (f = 0; f < 3; f++)
+        printf("%-15s  %9.1f (%.2fx)  %9.1f (%.2fx)\n", layoutNames[f],
+               rates[0][f], rates[0][f] / rates[0][0], rates[1][f], rates[1][f] / rates[1][0]);
+    tfsv_unmount(volume);
+    remove(BENCH_DISK);
+    return 0;
+}
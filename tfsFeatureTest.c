@@ -0,0 +1,1345 @@
+/*
+ * tfsFeatureTest.c
+ *
+ * Exercises TinyFS on each on-disk format (free list or free-space
+ * bitmap, chained or indexed files, with or without a journal): files written, rewritten, deleted and defragmented must read
+ * back unchanged, survive a remount or a crash, and leave the volume consistent.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "libDisk.h"
+#include "libTinyFS.h"
+#include "TinyFS_errno.h"
+
+#define TEST_DISK "tfsFeature.dsk"
+#define NUM_BLOCKS 300
+#define NUM_FILES 4
+
+static int failures = 0;
+
+static void check(int cond, const char *what){
+    if (cond) {
+        printf("] PASS %s\n", what);
+    } else {
+        printf("] FAIL %s\n", what);
+        failures++;
+    }
+}
+
+/* Fills buffer with a pattern derived from the file number and a round */
+static void fillPattern(char *buffer, int size, int file, int round){
+    int i;
+    for (i = 0; i < size; i++) buffer[i] = (char)(file * 31 + round * 7 + i);
+}
+
+/* Reads the whole file from offset 0 and compares it with expected */
+static int readsBack(fileDescriptor fd, const char *expected, int size){
+    char c;
+    int i;
+    if (tfs_seek(fd, 0) < 0) return 0;
+    for (i = 0; i < size; i++) {
+        if (tfs_readByte(fd, &c) < 0 || c != expected[i]) return 0;
+    }
+    return tfs_readByte(fd, &c) < 0; // nothing past the end
+}
+
+/* Counts the free blocks and checks the stored free count, on the closed
+ * image; the journal region may hold copies of free blocks and is skipped */
+static int freeCountMatches(void){
+    char block[BLOCKSIZE];
+    int disk = openDisk(TEST_DISK, 0);
+    int b, freeBlocks = 0, stored, logStart = 0, logBlocks = 0;
+    if (disk < 0 || readBlock(disk, 0, block) < 0) return 0;
+    stored = ((unsigned char)block[12] << 24) | ((unsigned char)block[13] << 16) |
+             ((unsigned char)block[14] << 8) | (unsigned char)block[15];
+    if (block[2] & TFS_MKFS_JOURNAL) {
+        logStart = ((unsigned char)block[30] << 8) | (unsigned char)block[31];
+        logBlocks = ((unsigned char)block[34] << 8) | (unsigned char)block[35];
+    }
+    for (b = 1; b < NUM_BLOCKS; b++) {
+        if (b >= logStart && b < logStart + logBlocks) continue;
+        if (readBlock(disk, b, block) < 0) return 0;
+        if (block[0] == 4) freeBlocks++;
+    }
+    closeDisk(disk);
+    return stored == freeBlocks;
+}
+
+/* Number of contiguous extents in the data chain of the named file, read
+ * from the closed image; -1 if the file is not found */
+static int countExtents(const char *name){
+    char block[BLOCKSIZE];
+    int disk = openDisk(TEST_DISK, 0);
+    int b, current = 0, previous = -1, extents = 0;
+    if (disk < 0) return -1;
+    for (b = 1; b < NUM_BLOCKS && current == 0; b++) {
+        if (readBlock(disk, b, block) < 0) break;
+        if (block[0] == 2 && strncmp(block + 4, name, 8) == 0)
+            current = ((unsigned char)block[18] << 8) | (unsigned char)block[19];
+    }
+    if (current == 0) {
+        closeDisk(disk);
+        return -1;
+    }
+    while (current != 0 && readBlock(disk, current, block) == 0) {
+        if (current != previous + 1) extents++;
+        previous = current;
+        current = ((unsigned char)block[6] << 8) | (unsigned char)block[7];
+    }
+    closeDisk(disk);
+    return extents;
+}
+
+/* On bitmap volumes a file written into a hole left by a deleted file of
+ * the same size, or past every hole, comes out as one extent. Free-list
+ * volumes only reach the head of the list, so there the files just have
+ * to read back. */
+static void testExtents(int flags){
+    static char buffer[30 * BLOCKSIZE];
+    fileDescriptor a, b, c, d, e;
+
+    printf("] Extents, format flags %d\n", flags);
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, flags);
+    tfs_mount(TEST_DISK);
+    fillPattern(buffer, sizeof(buffer), 9, 0);
+    a = tfs_openFile("a");
+    b = tfs_openFile("b");
+    c = tfs_openFile("c");
+    d = tfs_openFile("d");
+    e = tfs_openFile("e");
+    tfs_writeFile(a, buffer, 2480);
+    tfs_writeFile(b, buffer, 2480);
+    tfs_writeFile(c, buffer, 2480);
+    tfs_deleteFile(b);
+    tfs_writeFile(d, buffer, 2480);
+    check(tfs_writeFile(e, buffer, 4000) == TFS_SUCCESS, "write larger file");
+    check(tfs_writeFile(a, buffer, NUM_BLOCKS * BLOCKSIZE) == TFS_ERR_WRITE, "write larger than the volume fails");
+    check(readsBack(a, buffer, 2480), "failed write leaves the file unchanged");
+    check(readsBack(d, buffer, 2480) && readsBack(e, buffer, 4000), "files read back");
+    tfs_unmount();
+    if (flags & TFS_MKFS_BITMAP) {
+        check(countExtents("d") == 1, "file written into a hole is one extent");
+        check(countExtents("e") == 1, "file larger than the hole is one extent");
+    }
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount after extent allocation");
+    tfs_unmount();
+}
+
+/* Name lookups go through the in-memory index: files created, renamed and
+ * deleted in bulk must open by their current names only, before and after
+ * defrag and remount */
+static void testNames(void){
+    char name[9], data[8];
+    fileDescriptor fd;
+    int i, ok = 1;
+
+    printf("] Name index\n");
+    tfs_mkfs(TEST_DISK, NUM_BLOCKS * BLOCKSIZE);
+    tfs_mount(TEST_DISK);
+    for (i = 0; i < 200; i++) {
+        sprintf(name, "n%d", i);
+        fd = tfs_openFile(name);
+        sprintf(data, "%d", i);
+        tfs_writeFile(fd, data, strlen(data));
+        if (i % 3 == 0) {
+            tfs_deleteFile(fd);
+        } else {
+            if (i % 3 == 2) {
+                sprintf(name, "r%d", i);
+                tfs_rename(fd, name);
+            }
+            tfs_closeFile(fd);
+        }
+    }
+    fd = tfs_openFile("n1");
+    check(tfs_rename(fd, "r2") == TFS_ERR_RENAME, "rename onto an existing name fails");
+    check(tfs_rename(fd, "n1") == TFS_SUCCESS, "rename to its own name succeeds");
+    tfs_closeFile(fd);
+
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < 200 && ok; i++) {
+            sprintf(name, "%c%d", i % 3 == 2 ? 'r' : 'n', i);
+            sprintf(data, "%d", i);
+            fd = tfs_openFile(name);
+            if (i % 3 == 0) {
+                // deleted: opening creates a new, empty file
+                char c;
+                ok = fd >= 0 && tfs_readByte(fd, &c) < 0;
+                tfs_deleteFile(fd);
+            } else {
+                ok = fd >= 0 && readsBack(fd, data, strlen(data));
+                tfs_closeFile(fd);
+            }
+        }
+        if (pass == 0) {
+            check(ok, "files open by their current names");
+            tfs_defrag();
+        }
+    }
+    check(ok, "files open by their current names after defrag");
+
+    tfs_unmount();
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount");
+    fd = tfs_openFile("r5");
+    check(fd >= 0 && readsBack(fd, "5", 1), "renamed file found after remount");
+    tfs_unmount();
+}
+
+/* Bulk reads return the same bytes as tfs_readByte, from any offset and in
+ * any piece size, and stop at the end of the file */
+static void testBulkRead(void){
+    static char contents[3000], buffer[3100];
+    fileDescriptor fd;
+    int offset, size, ok = 1;
+
+    printf("] Bulk reads\n");
+    tfs_mkfs(TEST_DISK, NUM_BLOCKS * BLOCKSIZE);
+    tfs_mount(TEST_DISK);
+    fd = tfs_openFile("bulk");
+    fillPattern(contents, sizeof(contents), 5, 0);
+    tfs_writeFile(fd, contents, sizeof(contents));
+
+    check(tfs_read(fd, buffer, sizeof(buffer)) == sizeof(contents) &&
+          memcmp(buffer, contents, sizeof(contents)) == 0, "whole file in one tfs_read");
+    check(tfs_read(fd, buffer, 10) == 0, "tfs_read at the end returns 0");
+
+    for (offset = 0; offset < 3000 && ok; offset += 97) {
+        for (size = 1; size < 600 && ok; size += 131) {
+            int expected = (offset + size > 3000) ? 3000 - offset : size;
+            ok = tfs_pread(fd, buffer, size, offset) == expected &&
+                 memcmp(buffer, contents + offset, expected) == 0;
+        }
+    }
+    check(ok, "tfs_pread across block boundaries");
+    check(tfs_pread(fd, buffer, 10, 5000) == 0, "tfs_pread past the end returns 0");
+
+    tfs_seek(fd, 0);
+    ok = 1;
+    for (offset = 0; offset < 3000 && ok; offset += 248)
+        ok = tfs_read(fd, buffer + offset, 248) == (offset + 248 > 3000 ? 3000 - offset : 248);
+    check(ok && memcmp(buffer, contents, sizeof(contents)) == 0, "sequential tfs_read advances the file pointer");
+    check(tfs_read(fd, buffer, -1) == TFS_ERR_READ, "negative size rejected");
+    check(tfs_read(-1, buffer, 1) == TFS_ERR_READ, "bad descriptor rejected");
+    tfs_unmount();
+}
+
+/* Descriptors cache their position in the data chain; the cache must
+ * follow writes made through other descriptors and backward seeks */
+static void testCursor(void){
+    static char contents[3000], other[1000];
+    fileDescriptor a, b;
+    char c;
+    int ok = 1, i;
+
+    printf("] Cursor\n");
+    tfs_mkfs(TEST_DISK, NUM_BLOCKS * BLOCKSIZE);
+    tfs_mount(TEST_DISK);
+    a = tfs_openFile("cursor");
+    b = tfs_openFile("cursor");
+    fillPattern(contents, sizeof(contents), 6, 0);
+    tfs_writeFile(a, contents, sizeof(contents));
+
+    tfs_seek(a, 1000);
+    for (i = 1000; i < 1300 && ok; i++) ok = tfs_readByte(a, &c) == 0 && c == contents[i];
+    check(ok, "sequential readByte from a seek");
+    check(tfs_seek(a, 10) == 0 && tfs_readByte(a, &c) == 0 && c == contents[10], "backward seek");
+
+    tfs_seek(a, 1290);
+    tfs_readByte(a, &c); // a's cursor now holds the block with offset 1290
+    check(tfs_writeByte(b, 1291, 'Q') == 0, "writeByte through a second descriptor");
+    check(tfs_readByte(a, &c) == 0 && c == 'Q', "first descriptor sees the new byte");
+
+    fillPattern(other, sizeof(other), 7, 1);
+    tfs_writeFile(b, other, sizeof(other));
+    check(tfs_pread(a, &c, 1, 700) == 1 && c == other[700], "rewrite through a second descriptor is visible");
+    tfs_unmount();
+}
+
+static void putInt(char *dest, int value){
+    dest[0] = (value >> 24) & 0xFF;
+    dest[1] = (value >> 16) & 0xFF;
+    dest[2] = (value >> 8) & 0xFF;
+    dest[3] = value & 0xFF;
+}
+
+static int getInt(const char *src){
+    return ((unsigned char)src[0] << 24) | ((unsigned char)src[1] << 16) |
+           ((unsigned char)src[2] << 8) | (unsigned char)src[3];
+}
+
+/* Reads the inode of the named file from the closed image, optionally
+ * replacing its modification and access times first (when mtime != 0).
+ * Returns the stored access time, or -1. */
+static int inodeTimes(const char *name, int mtime, int atime){
+    char block[BLOCKSIZE];
+    int disk = openDisk(TEST_DISK, 0);
+    int b, result = -1;
+    for (b = 1; b < NUM_BLOCKS && disk >= 0; b++) {
+        if (readBlock(disk, b, block) < 0) break;
+        if (block[0] == 2 && strncmp(block + 4, name, 8) == 0) {
+            if (mtime != 0) {
+                putInt(block + 24, mtime);
+                putInt(block + 28, atime);
+                writeBlock(disk, b, block);
+            }
+            result = getInt(block + 28);
+            break;
+        }
+    }
+    if (disk >= 0) closeDisk(disk);
+    return result;
+}
+
+/* Reads the named file once under the given mount flags and returns the
+ * access time stored afterwards */
+static int atimeAfterRead(const char *name, int flags){
+    char buffer[16];
+    fileDescriptor fd;
+    tfs_mountEx(TEST_DISK, flags);
+    fd = tfs_openFile((char *)name);
+    tfs_read(fd, buffer, sizeof(buffer));
+    tfs_unmount();
+    return inodeTimes(name, 0, 0);
+}
+
+/* Reads leave the access time alone under noatime; under relatime they only
+ * refresh one that is older than the modification time or a day, and the
+ * write happens when the file is closed or the volume unmounted */
+static void testAtime(void){
+    int now = (int)time(NULL);
+    fileDescriptor fd;
+    char c;
+
+    printf("] Access times\n");
+    tfs_mkfs(TEST_DISK, NUM_BLOCKS * BLOCKSIZE);
+    tfs_mount(TEST_DISK);
+    fd = tfs_openFile("atime");
+    tfs_writeFile(fd, "contents", 8);
+    tfs_unmount();
+
+    check(tfs_mountEx(TEST_DISK, 0x80) == TFS_ERR_MOUNT, "unknown mount flag rejected");
+
+    inodeTimes("atime", 1000, 500);
+    check(atimeAfterRead("atime", TFS_MOUNT_NOATIME) == 500, "noatime leaves the access time");
+    check(atimeAfterRead("atime", TFS_MOUNT_RELATIME) >= now, "relatime refreshes an atime older than mtime");
+
+    inodeTimes("atime", now - 20, now - 10);
+    check(atimeAfterRead("atime", TFS_MOUNT_RELATIME) == now - 10, "relatime keeps a recent atime");
+    inodeTimes("atime", now - 3 * 86400, now - 2 * 86400);
+    check(atimeAfterRead("atime", TFS_MOUNT_RELATIME) >= now, "relatime refreshes an atime older than a day");
+
+    inodeTimes("atime", 1000, 500);
+    check(atimeAfterRead("atime", 0) >= now, "default mount writes the access time");
+
+    // relatime defers the write until the descriptor is closed
+    inodeTimes("atime", 1000, 500);
+    tfs_mountEx(TEST_DISK, TFS_MOUNT_RELATIME);
+    fd = tfs_openFile("atime");
+    tfs_read(fd, &c, 1);
+    tfs_closeFile(fd);
+    tfs_unmount();
+    check(inodeTimes("atime", 0, 0) >= now, "deferred access time written back after close");
+}
+
+/* Writes an image in the layout used before directories existed: the
+ * superblock, an inode "old" holding "xy" in block 2, free list from 3 */
+static void makeOldImage(void){
+    char block[BLOCKSIZE];
+    int disk = openDisk(TEST_DISK, NUM_BLOCKS * BLOCKSIZE);
+    int b;
+    memset(block, 0, BLOCKSIZE);
+    block[0] = 1;
+    block[1] = 0x44;
+    putInt(block + 4, 3);
+    putInt(block + 8, NUM_BLOCKS);
+    writeBlock(disk, 0, block);
+    memset(block, 0, BLOCKSIZE);
+    block[0] = 2;
+    block[1] = 0x44;
+    memcpy(block + 4, "old", 3);
+    putInt(block + 12, 2);
+    putInt(block + 16, 2);
+    writeBlock(disk, 1, block);
+    memset(block, 0, BLOCKSIZE);
+    block[0] = 3;
+    block[1] = 0x44;
+    memcpy(block + 8, "xy", 2);
+    writeBlock(disk, 2, block);
+    for (b = 3; b < NUM_BLOCKS; b++) {
+        memset(block, 0, BLOCKSIZE);
+        block[0] = 4;
+        block[1] = 0x44;
+        putInt(block + 4, b + 1 < NUM_BLOCKS ? b + 1 : 0);
+        writeBlock(disk, b, block);
+    }
+    closeDisk(disk);
+}
+
+/* Returns the block number of the first directory block, from the closed image */
+static int directoryHead(void){
+    char block[BLOCKSIZE];
+    int disk = openDisk(TEST_DISK, 0);
+    if (disk < 0 || readBlock(disk, 0, block) < 0) return -1;
+    closeDisk(disk);
+    return ((unsigned char)block[26] << 8) | (unsigned char)block[27];
+}
+
+/* Whether the first problem the last consistency check reported has the
+ * given code and block */
+static int reportsProblem(int code, int block){
+    TfsCheckReport report;
+    if (tfs_getCheckReport(&report) != TFS_SUCCESS) return 0;
+    return report.problemCount >= 1 && report.problems[0].code == code && report.problems[0].block == block;
+}
+
+/* Old images get a directory at mount; a directory entry that disagrees
+ * with its inode makes the volume fail the consistency check */
+
+static void testDirectory(void){
+    char block[BLOCKSIZE];
+    fileDescriptor fd;
+    int i, head;
+
+    printf("] Directory\n");
+    makeOldImage();
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "mount image without a directory");
+    fd = tfs_openFile("old");
+    check(readsBack(fd, "xy", 2), "existing file found after upgrade");
+    for (i = 0; i < 50; i++) {
+        char name[9];
+        sprintf(name, "d%d", i);
+        tfs_closeFile(tfs_openFile(name)); // more entries than one directory block holds
+    }
+    check(tfs_readdir() == TFS_SUCCESS, "readdir");
+    tfs_unmount();
+    head = directoryHead();
+    check(head > 0, "superblock points at the directory");
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount with the directory");
+    fd = tfs_openFile("d49");
+    tfs_deleteFile(fd);
+    tfs_defrag();
+    fd = tfs_openFile("old");
+    check(readsBack(fd, "xy", 2), "file found after defrag moved the directory");
+    tfs_unmount();
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount after defrag");
+    tfs_unmount();
+
+    // rename the first entry behind the filesystem's back
+    head = directoryHead();
+    int disk = openDisk(TEST_DISK, 0);
+    readBlock(disk, head, block);
+    block[8] = 'X';
+    writeBlock(disk, head, block);
+    closeDisk(disk);
+    check(tfs_mountEx(TEST_DISK, TFS_MOUNT_CHECK) == TFS_ERR_MOUNT, "mismatched directory entry fails the check");
+    check(reportsProblem(TFS_CHECK_DIR_NAME, head), "check reports the mismatched entry");
+}
+
+/* Indexed files reach data through direct, single and double indirect
+ * pointers: a file spilling into the double indirect block reads back at
+ * any offset, takes byte writes, survives defrag and remount, and a block
+ * map pointing at a free block fails the consistency check */
+static void testIndexed(void){
+    static char contents[150 * 252], buffer[600];
+    char block[BLOCKSIZE];
+    fileDescriptor small, big;
+    int offset, ok = 1, inode = 0, indirect, b;
+
+    printf("] Indexed files\n");
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, TFS_MKFS_INDEXED);
+    tfs_mount(TEST_DISK);
+    small = tfs_openFile("small");
+    big = tfs_openFile("big");
+    fillPattern(contents, sizeof(contents), 6, 0);
+    tfs_writeFile(small, contents, 3 * 252);
+    check(tfs_writeFile(big, contents, sizeof(contents)) == TFS_SUCCESS, "write file past the single indirect block");
+    check(tfs_writeFile(small, contents, (NUM_BLOCKS - 150) * 252) == TFS_ERR_WRITE, "write without room for data and index blocks fails");
+    for (offset = 0; offset < (int)sizeof(contents) && ok; offset += 1001) {
+        int expected = (offset + 500 > (int)sizeof(contents)) ? (int)sizeof(contents) - offset : 500;
+        ok = tfs_pread(big, buffer, 500, offset) == expected &&
+             memcmp(buffer, contents + offset, expected) == 0;
+    }
+    check(ok, "tfs_pread through direct and indirect blocks");
+    offset = sizeof(contents) - 1;
+    contents[offset] = 'Z';
+    contents[52 * 252] = 'Y';
+    check(tfs_writeByte(big, offset, 'Z') == TFS_SUCCESS &&
+          tfs_writeByte(big, 52 * 252, 'Y') == TFS_SUCCESS, "writeByte in indirect blocks");
+    check(readsBack(big, contents, sizeof(contents)), "file reads back");
+    tfs_deleteFile(small);
+    tfs_defrag();
+    check(readsBack(big, contents, sizeof(contents)), "file reads back after defrag");
+    tfs_unmount();
+    check(freeCountMatches(), "stored free count matches the free blocks");
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount passes the consistency check");
+    big = tfs_openFile("big");
+    check(readsBack(big, contents, sizeof(contents)), "file reads back after remount");
+    tfs_unmount();
+
+    // point the single indirect block at a free block
+    int disk = openDisk(TEST_DISK, 0);
+    for (b = 1; b < NUM_BLOCKS && inode == 0; b++) {
+        readBlock(disk, b, block);
+        if (block[0] == 2 && strncmp(block + 4, "big", 8) == 0) inode = b;
+    }
+    check(block[36] == 1 && getInt(block + 16) == 0, "inode uses the block map");
+    indirect = getInt(block + 248);
+    readBlock(disk, indirect, block);
+    check(block[0] == 7, "single indirect pointer names an index block");
+    putInt(block + 4, NUM_BLOCKS - 1);
+    writeBlock(disk, indirect, block);
+    closeDisk(disk);
+    check(tfs_mountEx(TEST_DISK, TFS_MOUNT_CHECK) == TFS_ERR_MOUNT, "index pointer to a free block fails the check");
+    check(reportsProblem(TFS_CHECK_FILE_POINTER, inode), "check reports the bad pointer");
+}
+
+/* Returns the first data block of the named file, chained or indexed,
+ * from the closed image */
+static int firstDataBlock(const char *name){
+    char block[BLOCKSIZE];
+    int disk = openDisk(TEST_DISK, 0);
+    int b, result = -1;
+    for (b = 1; b < NUM_BLOCKS && disk >= 0 && result < 0; b++) {
+        if (readBlock(disk, b, block) < 0) break;
+        if (block[0] == 2 && strncmp(block + 4, name, 8) == 0)
+            result = getInt(block + (block[36] == 1 ? 40 : 16));
+    }
+    if (disk >= 0) closeDisk(disk);
+    return result;
+}
+
+/* tfs_writeAt and tfs_append change a file in place: overwrites inside the
+ * file, writes running past its end and appends read back like the same
+ * edits made to a buffer, and a rewrite of the same size keeps the blocks */
+static void testWriteAt(int flags){
+    static char contents[5000], piece[3000];
+    fileDescriptor fd, other;
+    int before, size = 1000;
+
+    printf("] In-place writes, format flags %d\n", flags);
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, flags);
+    tfs_mount(TEST_DISK);
+    fd = tfs_openFile("inplace");
+    other = tfs_openFile("other");
+    fillPattern(contents, size, 3, 0);
+    tfs_writeFile(fd, contents, size);
+    tfs_writeFile(other, contents, 100);
+    tfs_unmount();
+    before = firstDataBlock("inplace");
+
+    tfs_mount(TEST_DISK);
+    fd = tfs_openFile("inplace");
+    fillPattern(contents, size, 3, 1);
+    check(tfs_writeFile(fd, contents, size) == TFS_SUCCESS, "rewrite with the same size");
+    tfs_unmount();
+    check(firstDataBlock("inplace") == before, "same-size rewrite keeps its blocks");
+
+    tfs_mount(TEST_DISK);
+    fd = tfs_openFile("inplace");
+    fillPattern(piece, sizeof(piece), 4, 0);
+    check(tfs_writeAt(fd, 300, piece, 10) == TFS_SUCCESS, "overwrite inside a block");
+    memcpy(contents + 300, piece, 10);
+    check(tfs_writeAt(fd, 200, piece, 1500) == TFS_SUCCESS, "write past the end");
+    memcpy(contents + 200, piece, 1500);
+    size = 1700;
+    check(tfs_append(fd, piece, 3000) == TFS_SUCCESS, "append");
+    memcpy(contents + size, piece, 3000);
+    size += 3000;
+    check(tfs_writeAt(fd, size + 1, piece, 1) == TFS_ERR_WRITE, "write past the end of the file rejected");
+    check(readsBack(fd, contents, size), "file reads back after in-place writes");
+    check(tfs_append(fd, contents, NUM_BLOCKS * BLOCKSIZE) == TFS_ERR_WRITE, "append without room fails");
+    check(readsBack(fd, contents, size), "file unchanged by the failed append");
+    tfs_unmount();
+    check(freeCountMatches(), "stored free count matches the free blocks");
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount passes the consistency check");
+    fd = tfs_openFile("inplace");
+    check(readsBack(fd, contents, size), "file reads back after remount");
+    tfs_unmount();
+}
+
+/* A file longer than one write batch is written in several scatter-list
+ * writes; its chain must still link up across the batches */
+static void testLargeWrite(int flags){
+    static char contents[240 * 248], patch[120 * 248];
+    fileDescriptor fd;
+
+    printf("] Large write, format flags %d\n", flags);
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, flags);
+    tfs_mount(TEST_DISK);
+    fd = tfs_openFile("large");
+    fillPattern(contents, 200 * 248, 8, 0);
+    check(tfs_writeFile(fd, contents, 200 * 248) == TFS_SUCCESS, "write a 200 block file");
+    check(readsBack(fd, contents, 200 * 248), "file reads back");
+    tfs_unmount();
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount passes the consistency check");
+    fd = tfs_openFile("large");
+    check(readsBack(fd, contents, 200 * 248), "file reads back after remount");
+
+    fillPattern(patch, sizeof(patch), 9, 0);
+    memcpy(contents + 10 * 248 + 5, patch, sizeof(patch));
+    check(tfs_writeAt(fd, 10 * 248 + 5, patch, sizeof(patch)) == TFS_SUCCESS &&
+          readsBack(fd, contents, 200 * 248), "120 blocks rewritten in place");
+    fillPattern(contents + 200 * 248, 40 * 248, 10, 0);
+    check(tfs_append(fd, contents + 200 * 248, 40 * 248) == TFS_SUCCESS &&
+          readsBack(fd, contents, 240 * 248), "40 blocks appended");
+    check(tfs_writeFile(fd, patch, 30 * 248 + 1) == TFS_SUCCESS && readsBack(fd, patch, 30 * 248 + 1),
+          "file rewritten 210 blocks shorter");
+    check(tfs_writeFile(fd, contents, 240 * 248) == TFS_SUCCESS && readsBack(fd, contents, 240 * 248),
+          "file grown back to 240 blocks");
+    check(tfs_deleteFile(fd) == TFS_SUCCESS, "240 block file deleted");
+    tfs_unmount();
+    check(freeCountMatches(), "every block of it freed");
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "volume consistent after the large writes");
+    tfs_unmount();
+}
+
+/* Writes and deletes larger than the journal's log are made in steps, and
+ * a group only ends between steps: a crash after a run of them leaves a
+ * consistent volume */
+static void testJournalSteps(int flags){
+    static char contents[200 * 248];
+    fileDescriptor fd;
+    int status = -1, r;
+
+    printf("] Journal steps, format flags %d\n", flags);
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, flags);
+    fillPattern(contents, sizeof(contents), 11, 0);
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        if (tfs_mount(TEST_DISK) < 0) _exit(1);
+        fd = tfs_openFile("big");
+        fileDescriptor small = tfs_openFile("small");
+        for (r = 0; r < 6; r++) {
+            if (tfs_writeFile(fd, contents, (200 - 17 * r) * 248) < 0) _exit(1);
+            if (tfs_writeFile(small, contents, 300 + r) < 0) _exit(1);
+            if (tfs_append(fd, contents, (10 + 13 * r) * 248) < 0) _exit(1);
+            if (tfs_writeAt(fd, 248 * r + 3, contents, 100 * 248) < 0) _exit(1);
+        }
+        if (tfs_deleteFile(fd) < 0) _exit(1);
+        fd = tfs_openFile("big2");
+        if (tfs_writeFile(fd, contents, sizeof(contents)) < 0) _exit(1);
+        _exit(0); // crash while mounted, mid-group
+    }
+    waitpid(child, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "large writes and deletes before the crash");
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "volume consistent after the crash");
+    tfs_unmount();
+    check(freeCountMatches(), "free count after recovery");
+}
+
+/* A crash right after tfs_sync must keep everything synced, even when the
+ * home copies of the last group were torn, and lose the operations after
+ * it without leaving the volume inconsistent */
+static void testJournal(void){
+    static char contents[3000];
+    char block[BLOCKSIZE];
+    fileDescriptor fd;
+    int status = -1;
+
+    printf("] Journal crash recovery\n");
+    check(tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, TFS_MKFS_JOURNAL) == TFS_SUCCESS, "mkfs journaled volume");
+    check(tfs_mkfsEx(TEST_DISK, 20 * BLOCKSIZE, TFS_MKFS_JOURNAL) == TFS_ERR_MKFS, "volume too small for a journal rejected");
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, TFS_MKFS_JOURNAL);
+    fillPattern(contents, sizeof(contents), 9, 0);
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        int b;
+        if (tfs_mount(TEST_DISK) < 0) _exit(1);
+        fd = tfs_openFile("kept");
+        if (tfs_writeFile(fd, contents, sizeof(contents)) < 0 || tfs_sync() < 0) _exit(1);
+        fd = tfs_openFile("lost");
+        tfs_writeFile(fd, contents, 100);
+        // tear the home copy of every data block, then die without unmounting
+        FILE *raw = fopen(TEST_DISK, "r+b");
+        if (fread(block, 1, BLOCKSIZE, raw) != BLOCKSIZE) _exit(1);
+        int logEnd = ((unsigned char)block[30] << 8) + (unsigned char)block[31] +
+                     ((unsigned char)block[34] << 8) + (unsigned char)block[35];
+        for (b = logEnd; b < NUM_BLOCKS; b++) {
+            fseek(raw, (long)b * BLOCKSIZE, SEEK_SET);
+            if (fread(block, 1, BLOCKSIZE, raw) != BLOCKSIZE || block[0] != 3) continue;
+            memset(block + 8, 0, BLOCKSIZE - 8);
+            fseek(raw, (long)b * BLOCKSIZE, SEEK_SET);
+            fwrite(block, 1, BLOCKSIZE, raw);
+        }
+        fclose(raw);
+        _exit(0);
+    }
+    waitpid(child, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "writes and sync before the crash");
+
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "mount replays the journal and passes the consistency check");
+    fd = tfs_openFile("kept");
+    check(readsBack(fd, contents, sizeof(contents)), "synced file restored by replay");
+    fd = tfs_openFile("lost");
+    check(readsBack(fd, contents, 0), "unsynced file never reached the disk");
+    check(tfs_unmount() == TFS_SUCCESS, "unmount");
+    check(freeCountMatches(), "stored free count matches the free blocks");
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount after recovery");
+    tfs_unmount();
+}
+
+/* A cleanly unmounted volume mounts without the check; one left mounted by
+ * a crash is checked at the next mount, or on demand with TFS_MOUNT_NOCHECK */
+static void testCleanMount(void){
+    TfsMountStats stats;
+    fileDescriptor fd;
+    int status = -1;
+
+    printf("] Clean and dirty mounts\n");
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, 0);
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "mount new volume");
+    check(tfs_getMountStats(&stats) == TFS_SUCCESS && stats.wasClean && !stats.checked && stats.micros > 0,
+          "new volume mounts clean without the check");
+    fd = tfs_openFile("a");
+    tfs_writeFile(fd, "abc", 3);
+    tfs_unmount();
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount");
+    tfs_getMountStats(&stats);
+    check(stats.wasClean && !stats.checked, "unmount leaves the volume clean");
+    tfs_unmount();
+    check(tfs_mountEx(TEST_DISK, TFS_MOUNT_CHECK) == TFS_SUCCESS, "mount with a forced check");
+    tfs_getMountStats(&stats);
+    check(stats.wasClean && stats.checked, "forced check runs on a clean volume");
+    TfsCheckReport report;
+    check(tfs_getCheckReport(&report) == TFS_SUCCESS && report.problemCount == 0 &&
+          report.blocks == NUM_BLOCKS && report.inodes == 1 && report.threads >= 1, "check report of a clean volume");
+    tfs_unmount();
+    check(tfs_mountEx(TEST_DISK, TFS_MOUNT_CHECK | TFS_MOUNT_NOCHECK) == TFS_ERR_MOUNT, "conflicting check flags rejected");
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        if (tfs_mount(TEST_DISK) < 0) _exit(1);
+        fd = tfs_openFile("b");
+        tfs_writeFile(fd, "defg", 4);
+        tfs_sync();
+        _exit(0); // crash while mounted
+    }
+    waitpid(child, &status, 0);
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "mount after a crash");
+    tfs_getMountStats(&stats);
+    check(!stats.wasClean && stats.checked, "crashed volume is checked");
+    fd = tfs_openFile("b");
+    check(readsBack(fd, "defg", 4), "synced file survives the crash");
+    tfs_unmount();
+
+    fflush(stdout);
+    child = fork();
+    if (child == 0) {
+        if (tfs_mount(TEST_DISK) < 0) _exit(1);
+        _exit(0);
+    }
+    waitpid(child, &status, 0);
+    check(tfs_mountEx(TEST_DISK, TFS_MOUNT_NOCHECK) == TFS_SUCCESS, "dirty mount without the check");
+    tfs_getMountStats(&stats);
+    check(!stats.wasClean && !stats.checked, "check deferred");
+    tfs_unmount();
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount");
+    tfs_getMountStats(&stats);
+    check(!stats.wasClean && stats.checked, "unchecked volume stays dirty");
+    tfs_unmount();
+    check(tfs_mountEx(TEST_DISK, TFS_MOUNT_NOCHECK) == TFS_SUCCESS, "dirty mount without the check");
+    check(tfs_check() == TFS_SUCCESS, "check on demand");
+    tfs_unmount();
+    tfs_mount(TEST_DISK);
+    tfs_getMountStats(&stats);
+    check(stats.wasClean && !stats.checked, "volume clean after a passed check");
+    tfs_unmount();
+}
+
+/* A free block outside the free list, as a crash leaves the blocks a
+ * thread's magazine held, is put back by the check instead of failing it */
+static void testStrayFreeBlock(void){
+    char super[BLOCKSIZE], block[BLOCKSIZE];
+    TfsCheckReport report;
+
+    printf("] Free blocks lost by a crash\n");
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, 0);
+    tfs_mount(TEST_DISK);
+    tfs_writeFile(tfs_openFile("a"), "abc", 3);
+    tfs_unmount();
+    // unlink the head of the free list, leaving it a free block
+    int disk = openDisk(TEST_DISK, 0);
+    readBlock(disk, 0, super);
+    readBlock(disk, getInt(super + 4), block);
+    putInt(super + 4, getInt(block + 4));
+    writeBlock(disk, 0, super);
+    closeDisk(disk);
+
+    check(tfs_mountEx(TEST_DISK, TFS_MOUNT_CHECK) == TFS_SUCCESS, "mount with a free block outside the free list");
+    check(tfs_getCheckReport(&report) == TFS_SUCCESS && report.problemCount == 0 && report.reclaimed == 1,
+          "check puts the block back");
+    tfs_unmount();
+    check(freeCountMatches(), "stored free count matches the free blocks");
+    tfs_mountEx(TEST_DISK, TFS_MOUNT_CHECK);
+    check(tfs_getCheckReport(&report) == TFS_SUCCESS && report.reclaimed == 0, "block stays in the free list");
+    tfs_unmount();
+}
+
+/* Waits up to five seconds for the scrubber to finish a pass */
+static int scrubPassed(TfsScrubStatus *status){
+    int i;
+    for (i = 0; i < 500; i++) {
+        if (tfs_scrubStatus(status) == TFS_SUCCESS && status->passes >= 1) return 1;
+        usleep(10000);
+    }
+    return 0;
+}
+
+/* The background scrubber finds a corrupted block on a volume mounted
+ * without the check, keeps to its rate and leaves the volume usable */
+static void testScrub(void){
+    char block[BLOCKSIZE];
+    char data[1000];
+    TfsScrubStatus status;
+    fileDescriptor fd;
+    int i, bad, found;
+
+    printf("] Background scrub\n");
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, 0);
+    tfs_mount(TEST_DISK);
+    check(tfs_scrubStart(0) == TFS_ERR, "scrub rate must be positive");
+    check(tfs_scrubStart(1000000) == TFS_SUCCESS, "start scrub");
+    check(tfs_scrubStart(1000000) == TFS_ERR, "only one scrub at a time");
+    check(scrubPassed(&status) && status.problemCount == 0 && status.running, "new volume scrubs clean");
+    fillPattern(data, sizeof(data), 5, 0);
+    fd = tfs_openFile("scrub");
+    tfs_writeFile(fd, data, sizeof(data));
+    check(readsBack(fd, data, sizeof(data)), "file usable while scrubbing");
+    check(tfs_scrubStop() == TFS_SUCCESS, "stop scrub");
+    check(tfs_scrubStop() == TFS_ERR, "stop without a scrub");
+    tfs_unmount();
+
+    bad = firstDataBlock("scrub");
+    int disk = openDisk(TEST_DISK, 0);
+    readBlock(disk, bad, block);
+    block[1] = 0;
+    writeBlock(disk, bad, block);
+    closeDisk(disk);
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "clean volume mounts without the check");
+    tfs_scrubStart(1000000);
+    found = 0;
+    if (scrubPassed(&status))
+        for (i = 0; i < status.problemCount && i < TFS_CHECK_MAX_PROBLEMS; i++)
+            found |= status.problems[i].code == TFS_CHECK_MAGIC && status.problems[i].block == bad;
+    check(found, "scrub finds the corrupted block");
+    tfs_scrubStop();
+
+    tfs_scrubStart(200);
+    usleep(500000);
+    tfs_scrubStatus(&status);
+    check(status.blocksRead > 0 && status.blocksRead <= 150, "scrub keeps to its rate");
+    tfs_unmount();
+    tfs_scrubStatus(&status);
+    check(!status.running, "unmount stops the scrub");
+    check(tfs_scrubStart(1000) == TFS_ERR, "no scrub without a volume");
+}
+
+#define VOLUME_THREADS 4
+
+// Thread body for testVolumes: rewrites and reads back files on its own volume
+static void *volumeWorker(void *arg){
+    tfs_volume *volume = arg;
+    char data[3000], name[9];
+    int round, f;
+    long ok = 1;
+    for (round = 0; round < 20; round++) {
+        for (f = 0; f < 3; f++) {
+            sprintf(name, "v%d", f);
+            fileDescriptor fd = tfsv_openFile(volume, name);
+            int size = 200 + (round * 7 + f * 500) % 2800;
+            fillPattern(data, size, f, round);
+            char back[3000];
+            ok &= tfsv_writeFile(volume, fd, data, size) == TFS_SUCCESS &&
+                  tfsv_pread(volume, fd, back, size, 0) == size && memcmp(back, data, size) == 0;
+            tfsv_closeFile(volume, fd);
+        }
+    }
+    return (void *)ok;
+}
+
+/* Volume handles are independent of each other and of the default volume,
+ * and can be used from several threads at once */
+static void testVolumes(void){
+    tfs_volume *volumes[VOLUME_THREADS];
+    pthread_t threads[VOLUME_THREADS];
+    char name[32], back[4];
+    fileDescriptor fd;
+    int i, ok;
+
+    printf("] Volume handles\n");
+    check(tfsv_mount(&volumes[0], "missing.dsk", 0) == TFS_ERR_MOUNT && volumes[0] == NULL, "mount of a missing disk fails");
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, 0);
+    tfs_mount(TEST_DISK);
+    fd = tfs_openFile("dflt");
+    tfs_writeFile(fd, "abc", 3);
+    ok = 1;
+    for (i = 0; i < VOLUME_THREADS; i++) {
+        sprintf(name, "volume%d.dsk", i);
+        tfs_mkfsEx(name, NUM_BLOCKS * BLOCKSIZE, (i & 1) ? TFS_MKFS_BITMAP : TFS_MKFS_JOURNAL);
+        ok &= tfsv_mount(&volumes[i], name, 0) == TFS_SUCCESS;
+    }
+    check(ok, "mount one handle per volume");
+    check(tfsv_openFile(volumes[0], "a") >= 0 && tfsv_makeRO(volumes[1], "a") < 0, "files belong to their volume");
+    ok = 1;
+    for (i = 0; i < VOLUME_THREADS; i++)
+        ok &= pthread_create(&threads[i], NULL, volumeWorker, volumes[i]) == 0;
+    for (i = 0; i < VOLUME_THREADS; i++) {
+        void *result = NULL;
+        pthread_join(threads[i], &result);
+        ok &= result != NULL;
+    }
+    check(ok, "volumes used from parallel threads");
+    check(readsBack(fd, "abc", 3), "default volume unaffected");
+    ok = 1;
+    for (i = 0; i < VOLUME_THREADS; i++) {
+        TfsCheckReport report;
+        ok &= tfsv_check(volumes[i]) == TFS_SUCCESS && tfsv_getCheckReport(volumes[i], &report) == TFS_SUCCESS &&
+              report.inodes == (i == 0 ? 4 : 3);
+        ok &= tfsv_unmount(volumes[i]) == TFS_SUCCESS;
+    }
+    check(ok, "volumes consistent after parallel use");
+    tfs_unmount();
+    sprintf(name, "volume%d.dsk", 0);
+    check(tfsv_mount(&volumes[0], name, TFS_MOUNT_CHECK) == TFS_SUCCESS, "remount a volume");
+    fd = tfsv_openFile(volumes[0], "v1");
+    check(tfsv_read(volumes[0], fd, back, 4) == 4, "its files survive");
+    tfsv_unmount(volumes[0]);
+    for (i = 0; i < VOLUME_THREADS; i++) {
+        sprintf(name, "volume%d.dsk", i);
+        remove(name);
+    }
+}
+
+typedef struct {
+    tfs_volume *volume;
+    int thread;
+} SharedWriter;
+
+// Thread body for testSharedVolume: rewrites its own files on a volume the
+// other threads write too, then deletes them
+static void *sharedWriter(void *arg){
+    SharedWriter *writer = arg;
+    char data[3500], back[3500], name[9];
+    fileDescriptor fds[2];
+    int round, f;
+    long ok = 1;
+    for (f = 0; f < 2; f++) {
+        sprintf(name, "t%df%d", writer->thread, f);
+        fds[f] = tfsv_openFile(writer->volume, name);
+        ok &= fds[f] >= 0;
+    }
+    for (round = 0; round < 30 && ok; round++) {
+        for (f = 0; f < 2; f++) {
+            int size = 100 + (round * 1300 + f * 2900 + writer->thread * 700) % 3400;
+            fillPattern(data, size, writer->thread * 2 + f, round);
+            ok &= tfsv_writeFile(writer->volume, fds[f], data, size) == TFS_SUCCESS &&
+                  tfsv_pread(writer->volume, fds[f], back, size, 0) == size && memcmp(back, data, size) == 0;
+        }
+    }
+    for (f = 0; f < 2; f++) ok &= tfsv_deleteFile(writer->volume, fds[f]) == TFS_SUCCESS;
+    return (void *)ok;
+}
+
+/* Threads writing files on one volume take their blocks from per-thread
+ * magazines; the blocks they still hold must count as free and be usable
+ * by any writer */
+static void testSharedVolume(int flags){
+    tfs_volume *volume;
+    pthread_t threads[VOLUME_THREADS];
+    SharedWriter writers[VOLUME_THREADS];
+    TfsCheckReport before, after;
+    static char big[NUM_BLOCKS * BLOCKSIZE];
+    int i, ok = 1;
+
+    printf("] Writers sharing a volume, format flags %d\n", flags);
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, flags);
+    tfsv_mount(&volume, TEST_DISK, 0);
+    fileDescriptor fd = tfsv_openFile(volume, "big");
+    tfsv_check(volume);
+    tfsv_getCheckReport(volume, &before);
+    for (i = 0; i < VOLUME_THREADS; i++) {
+        writers[i].volume = volume;
+        writers[i].thread = i;
+        ok &= pthread_create(&threads[i], NULL, sharedWriter, &writers[i]) == 0;
+    }
+    for (i = 0; i < VOLUME_THREADS; i++) {
+        void *result = NULL;
+        pthread_join(threads[i], &result);
+        ok &= result != NULL;
+    }
+    check(ok, "files written by parallel threads read back");
+
+    // only fits with the blocks the threads' magazines still hold
+    int bytes = before.freeBlocks * (BLOCKSIZE - 8);
+    fillPattern(big, bytes, 9, 9);
+    check(tfsv_writeFile(volume, fd, big, bytes) == TFS_SUCCESS, "free blocks held by threads are usable");
+    tfsv_writeFile(volume, fd, big, 0);
+    check(tfsv_check(volume) == TFS_SUCCESS && tfsv_getCheckReport(volume, &after) == TFS_SUCCESS &&
+          after.freeBlocks == before.freeBlocks, "every block free again");
+    tfsv_unmount(volume);
+    check(freeCountMatches(), "stored free count matches the free blocks");
+}
+
+#define SHARED_FD_BYTES 6000
+
+typedef struct {
+    tfs_volume *volume;
+    fileDescriptor fd;
+    int thread;
+    long bytes; // bytes read, or descriptors opened and closed
+    int failed;
+} DescriptorUser;
+
+// Thread body for testSharedDescriptor: reads the shared descriptor in
+// small pieces until its end, checking each piece against the pattern
+static void *descriptorReader(void *arg){
+    DescriptorUser *user = arg;
+    char expected[SHARED_FD_BYTES], piece[97];
+    int count;
+    fillPattern(expected, SHARED_FD_BYTES, 7, 0);
+    while ((count = tfsv_read(user->volume, user->fd, piece, sizeof(piece))) > 0) {
+        // the piece is the file from some offset on
+        int offset, found = 0;
+        for (offset = 0; offset + count <= SHARED_FD_BYTES && !found; offset++)
+            found = memcmp(piece, expected + offset, count) == 0;
+        user->failed |= !found;
+        user->bytes += count;
+    }
+    user->failed |= count < 0;
+    return NULL;
+}
+
+// Thread body for testSharedDescriptor: opens and closes descriptors, so
+// the slots of the table are reused while the readers run
+static void *descriptorChurner(void *arg){
+    DescriptorUser *user = arg;
+    char name[9];
+    int round;
+    for (round = 0; round < 200; round++) {
+        sprintf(name, "c%d", round % 3);
+        fileDescriptor fd = tfsv_openFile(user->volume, name);
+        if (fd < 0 || tfsv_closeFile(user->volume, fd) != TFS_SUCCESS) user->failed = 1;
+        user->bytes++;
+    }
+    return NULL;
+}
+
+/* Threads reading through one descriptor each get their own part of the
+ * file, the parts adding up to the whole file once, while descriptors are
+ * opened and closed around them */
+static void testSharedDescriptor(void){
+    static char contents[SHARED_FD_BYTES];
+    tfs_volume *volume;
+    pthread_t threads[VOLUME_THREADS + 1];
+    DescriptorUser users[VOLUME_THREADS + 1];
+    int i, ok = 1;
+    long total = 0;
+
+    printf("] Threads sharing a descriptor\n");
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, 0);
+    tfsv_mount(&volume, TEST_DISK, 0);
+    fileDescriptor fd = tfsv_openFile(volume, "shared");
+    fillPattern(contents, SHARED_FD_BYTES, 7, 0);
+    tfsv_writeFile(volume, fd, contents, SHARED_FD_BYTES);
+    memset(users, 0, sizeof(users));
+    for (i = 0; i <= VOLUME_THREADS; i++) {
+        users[i].volume = volume;
+        users[i].fd = fd;
+        users[i].thread = i;
+        ok &= pthread_create(&threads[i], NULL, i < VOLUME_THREADS ? descriptorReader : descriptorChurner, &users[i]) == 0;
+    }
+    for (i = 0; i <= VOLUME_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        ok &= !users[i].failed;
+        if (i < VOLUME_THREADS) total += users[i].bytes;
+    }
+    check(ok, "reads through a shared descriptor return the file's data");
+    check(total == SHARED_FD_BYTES, "every byte read exactly once");
+    check(users[VOLUME_THREADS].bytes == 200, "descriptors opened and closed meanwhile");
+    tfsv_unmount(volume);
+}
+
+#define DEFRAG_FILES 6
+#define DEFRAG_ROUNDS 8
+
+/* Opens the files d0 to d5 */
+static void openDefragFiles(fileDescriptor *fds){
+    int f;
+    char name[9];
+    for (f = 0; f < DEFRAG_FILES; f++) {
+        sprintf(name, "d%d", f);
+        fds[f] = tfs_openFile(name);
+    }
+}
+
+/* Grows the files a block at a time in turns, so each is split into one
+ * extent per round */
+static void fragmentFiles(fileDescriptor *fds, char (*contents)[DEFRAG_ROUNDS * 200], int round){
+    int f, r;
+    openDefragFiles(fds);
+    for (f = 0; f < DEFRAG_FILES; f++) {
+        fillPattern(contents[f], DEFRAG_ROUNDS * 200, f, round);
+        tfs_writeFile(fds[f], contents[f], 200);
+    }
+    for (r = 1; r < DEFRAG_ROUNDS; r++)
+        for (f = 0; f < DEFRAG_FILES; f++) tfs_append(fds[f], contents[f] + r * 200, 200);
+}
+
+/* Checks every file reads back through its descriptor */
+static int defragFilesRead(fileDescriptor *fds, char (*contents)[DEFRAG_ROUNDS * 200]){
+    int f, ok = 1;
+    for (f = 0; f < DEFRAG_FILES; f++) ok &= readsBack(fds[f], contents[f], DEFRAG_ROUNDS * 200);
+    return ok;
+}
+
+/* Checks every file is one extent on the closed image (chained files only) */
+static int defragFilesContiguous(void){
+    int f, ok = 1;
+    char name[9];
+    for (f = 0; f < DEFRAG_FILES; f++) {
+        sprintf(name, "d%d", f);
+        ok &= countExtents(name) == 1;
+    }
+    return ok;
+}
+
+/* Online defragmentation: small steps make fragmented files contiguous
+ * while they stay open, a pass resumes where an unmount left it, and the
+ * background thread finishes on its own. Free-list volumes are refused. */
+static void testOnlineDefrag(int flags){
+    static char contents[DEFRAG_FILES][DEFRAG_ROUNDS * 200];
+    fileDescriptor fds[DEFRAG_FILES];
+    TfsDefragStatus status;
+    int i, result = 1, steps = 0, usable = 1;
+    int chained = !(flags & TFS_MKFS_INDEXED);
+
+    printf("] Online defragmentation, format flags %d\n", flags);
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, flags);
+    tfs_mount(TEST_DISK);
+    fragmentFiles(fds, contents, 0);
+    if (chained) {
+        tfs_unmount();
+        check(!defragFilesContiguous(), "files are fragmented");
+        tfs_mount(TEST_DISK);
+        openDefragFiles(fds);
+    }
+    check(tfs_defragStep(0) == TFS_ERR, "step budget must be positive");
+    while (result > 0 && steps++ < 1000) result = tfs_defragStep(20);
+    check(result == 0 && steps > 2, "small steps finish a pass");
+    check(defragFilesRead(fds, contents), "open files read back during defrag");
+    tfs_defragStatus(&status);
+    check(status.blocksMoved > 0 && status.passes >= 1 && status.longestStepMicros > 0, "defrag status");
+    tfs_unmount();
+    if (chained) check(defragFilesContiguous(), "defragmented files are one extent");
+    check(freeCountMatches(), "free count after online defrag");
+    check(tfs_mountEx(TEST_DISK, TFS_MOUNT_CHECK) == TFS_SUCCESS, "volume consistent after online defrag");
+
+    // an unmount in the middle of a pass
+    fragmentFiles(fds, contents, 1);
+    tfs_defragStep(20);
+    tfs_defragStep(20);
+    tfs_defragStatus(&status);
+    int position = status.position;
+    tfs_unmount();
+    tfs_mount(TEST_DISK);
+    tfs_defragStatus(&status);
+    check(position > 0 && status.position == position, "defrag resumes after a remount");
+
+    // in the background, with the files in use
+    openDefragFiles(fds);
+    check(tfs_defragStart(0) == TFS_ERR, "step time must be positive");
+    check(tfs_defragStart(1000) == TFS_SUCCESS, "start background defrag");
+    check(tfs_defragStart(1000) == TFS_ERR, "only one defrag thread at a time");
+    for (i = 0; i < 500 && tfs_defragStatus(&status) == TFS_SUCCESS && status.running; i++) {
+        usable &= readsBack(fds[i % DEFRAG_FILES], contents[i % DEFRAG_FILES], DEFRAG_ROUNDS * 200);
+        usleep(10000);
+    }
+    check(usable, "files usable during background defrag");
+    check(!status.running && status.passes >= 1, "background defrag ends after a clean pass");
+    check(tfs_defragStop() == TFS_SUCCESS, "join finished defrag");
+    check(tfs_defragStop() == TFS_ERR, "stop without a defrag");
+    check(defragFilesRead(fds, contents), "files read back after background defrag");
+    tfs_unmount();
+    if (chained) check(defragFilesContiguous(), "background defrag leaves files one extent");
+    check(tfs_mountEx(TEST_DISK, TFS_MOUNT_CHECK) == TFS_SUCCESS, "volume consistent after background defrag");
+    tfs_unmount();
+
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, flags & ~TFS_MKFS_BITMAP);
+    tfs_mount(TEST_DISK);
+    check(tfs_defragStep(100) == TFS_ERR && tfs_defragStart(1000) == TFS_ERR, "free-list volumes use tfs_defrag");
+    tfs_unmount();
+}
+
+/* Whether the named file's inode is directly followed by all its data
+ * blocks in logical order, on the closed image; copies of the inode in the
+ * journal region are skipped */
+static int fileInOrder(const char *name){
+    char block[BLOCKSIZE];
+    int disk = openDisk(TEST_DISK, 0);
+    int b, inode = -1, ok = 1, logEnd = 0;
+    if (disk >= 0 && readBlock(disk, 0, block) == 0 && (block[2] & TFS_MKFS_JOURNAL))
+        logEnd = getInt(block + 28) + getInt(block + 32);
+    for (b = 1; b < NUM_BLOCKS && disk >= 0 && inode < 0; b++) {
+        if (b < logEnd) continue;
+        if (readBlock(disk, b, block) < 0) break;
+        if (block[0] == 2 && strncmp(block + 4, name, 8) == 0) inode = b;
+    }
+    if (inode < 0) ok = 0;
+    if (ok && block[36] == 1) {
+        for (b = 0; b < 52 && getInt(block + 40 + b * 4) != 0; b++) ok &= getInt(block + 40 + b * 4) == inode + 1 + b;
+    } else if (ok) {
+        int expected = inode + 1, current = getInt(block + 16);
+        while (current != 0 && ok) {
+            ok = current == expected++ && readBlock(disk, current, block) == 0;
+            current = getInt(block + 4);
+        }
+    }
+    if (disk >= 0) closeDisk(disk);
+    return ok;
+}
+
+/* File-order defrag puts each interleaved file right after its inode, in
+ * order, while the files stay open, and a second run has nothing to move */
+static void testFileOrderDefrag(int flags){
+    static char contents[DEFRAG_FILES][DEFRAG_ROUNDS * 200];
+    fileDescriptor fds[DEFRAG_FILES];
+    char name[9];
+    int f, ordered = 1;
+
+    printf("] File-order defrag, format flags %d\n", flags);
+    tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, flags);
+    tfs_mount(TEST_DISK);
+    fileDescriptor gap = tfs_openFile("gap");
+    tfs_writeFile(gap, contents[0], 1000);
+    fragmentFiles(fds, contents, 0);
+    tfs_deleteFile(gap); // a hole before the files
+    tfs_unmount();
+    check(!fileInOrder("d0") && !fileInOrder("d1"), "files are interleaved");
+    tfs_mount(TEST_DISK);
+    openDefragFiles(fds);
+    check(tfs_defragEx(0x80) == TFS_ERR, "unknown defrag flag rejected");
+    check(tfs_defragEx(TFS_DEFRAG_FILE_ORDER) > 0, "file-order defrag moves blocks");
+    check(defragFilesRead(fds, contents), "open files read back after file-order defrag");
+    check(tfs_defragEx(TFS_DEFRAG_FILE_ORDER) == 0, "ordered volume needs no moves");
+    tfs_unmount();
+    for (f = 0; f < DEFRAG_FILES; f++) {
+        sprintf(name, "d%d", f);
+        ordered &= fileInOrder(name);
+    }
+    check(ordered, "each inode followed by its data in order");
+    check(freeCountMatches(), "free count after file-order defrag");
+    check(tfs_mountEx(TEST_DISK, TFS_MOUNT_CHECK) == TFS_SUCCESS, "volume consistent after file-order defrag");
+    openDefragFiles(fds);
+    check(defragFilesRead(fds, contents), "files read back after a remount");
+    tfs_unmount();
+}
+
+static void testFormat(int flags){
+    static char contents[NUM_FILES][4000];
+    int sizes[NUM_FILES] = {0};
+    fileDescriptor fds[NUM_FILES];
+    char name[9];
+    int f, ok;
+
+    printf("] Format flags %d\n", flags);
+    check(tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, flags) == TFS_SUCCESS, "mkfs");
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "mount new volume");
+
+    for (f = 0; f < NUM_FILES; f++) {
+        sprintf(name, "file%d", f);
+        fds[f] = tfs_openFile(name);
+        sizes[f] = 500 + f * 900;
+        fillPattern(contents[f], sizes[f], f, 0);
+        tfs_writeFile(fds[f], contents[f], sizes[f]);
+    }
+    // rewrite one file smaller and one larger so freed blocks get reused
+    sizes[1] = 100;
+    fillPattern(contents[1], sizes[1], 1, 1);
+    tfs_writeFile(fds[1], contents[1], sizes[1]);
+    sizes[2] = 3500;
+    fillPattern(contents[2], sizes[2], 2, 1);
+    tfs_writeFile(fds[2], contents[2], sizes[2]);
+
+    ok = 1;
+    for (f = 0; f < NUM_FILES; f++) ok &= readsBack(fds[f], contents[f], sizes[f]);
+    check(ok, "files read back after rewrites");
+
+    check(tfs_deleteFile(fds[0]) == TFS_SUCCESS, "delete file");
+    tfs_defrag();
+    ok = 1;
+    for (f = 1; f < NUM_FILES; f++) ok &= readsBack(fds[f], contents[f], sizes[f]);
+    check(ok, "open files read back after defrag");
+
+    check(tfs_unmount() == TFS_SUCCESS, "unmount");
+    check(freeCountMatches(), "stored free count matches the free blocks");
+    check(tfs_mount(TEST_DISK) == TFS_SUCCESS, "remount passes the consistency check");
+    ok = 1;
+    for (f = 1; f < NUM_FILES; f++) {
+        sprintf(name, "file%d", f);
+        fds[f] = tfs_openFile(name);
+        ok &= readsBack(fds[f], contents[f], sizes[f]);
+    }
+    check(ok, "files read back after remount");
+    tfs_unmount();
+}
+
+int main(){
+    testFormat(0);
+    testFormat(TFS_MKFS_BITMAP);
+    testFormat(TFS_MKFS_INDEXED);
+    testFormat(TFS_MKFS_BITMAP | TFS_MKFS_INDEXED);
+    testFormat(TFS_MKFS_JOURNAL);
+    testFormat(TFS_MKFS_BITMAP | TFS_MKFS_INDEXED | TFS_MKFS_JOURNAL);
+    testExtents(0);
+    testExtents(TFS_MKFS_BITMAP);
+    testNames();
+    testDirectory();
+    testBulkRead();
+    testCursor();
+    testAtime();
+    testIndexed();
+    testWriteAt(TFS_MKFS_BITMAP);
+    testWriteAt(TFS_MKFS_BITMAP | TFS_MKFS_INDEXED);
+    testLargeWrite(0);
+    testLargeWrite(TFS_MKFS_INDEXED);
+    testLargeWrite(TFS_MKFS_JOURNAL);
+    testLargeWrite(TFS_MKFS_BITMAP | TFS_MKFS_INDEXED | TFS_MKFS_JOURNAL);
+    testJournal();
+    testJournalSteps(TFS_MKFS_JOURNAL);
+    testJournalSteps(TFS_MKFS_BITMAP | TFS_MKFS_INDEXED | TFS_MKFS_JOURNAL);
+    testCleanMount();
+    testStrayFreeBlock();
+    testScrub();
+    testVolumes();
+    testSharedVolume(0);
+    testSharedVolume(TFS_MKFS_BITMAP);
+    testSharedVolume(TFS_MKFS_BITMAP | TFS_MKFS_JOURNAL);
+    testSharedDescriptor();
+    testOnlineDefrag(TFS_MKFS_BITMAP);
+    testOnlineDefrag(TFS_MKFS_BITMAP | TFS_MKFS_INDEXED | TFS_MKFS_JOURNAL);
+    testFileOrderDefrag(0);
+    testFileOrderDefrag(TFS_MKFS_BITMAP);
+    testFileOrderDefrag(TFS_MKFS_INDEXED);
+    testFileOrderDefrag(TFS_MKFS_BITMAP | TFS_MKFS_INDEXED | TFS_MKFS_JOURNAL);
+    check(tfs_mkfsEx(TEST_DISK, NUM_BLOCKS * BLOCKSIZE, 0x80) == TFS_ERR_MKFS, "unknown mkfs flag rejected");
+    remove(TEST_DISK);
+
+    if (failures) {
+        printf("] %d check(s) failed.\n", failures);
+        return 1;
+    }
+    printf("] All TinyFS feature checks passed.\n");
+    return 0;
+}
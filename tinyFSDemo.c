@@ -363,6 +363,8 @@ int main() {
     * To simulate inconsistency, we open the disk directly using libDisk functions and 
     * modify a free block’s type. For example, we change the type from FREE (4) to INODE (2)
     * so that a block appears in both the free list and allocated.
+    * The superblock's clean flag is cleared too, as a crash would leave it, so that
+    * mount runs the consistency check.
     */
     {
     int disk;
@@ -376,6 +378,9 @@ int main() {
             printf(RED "Failed to read superblock for corruption simulation.\n" RESET);
         } else {
             int freePtr = demoBytesToInt(block + 4);
+            block[3] = 0;  // no longer unmounted cleanly
+            if (writeBlock(disk, 0, block) < 0)
+                printf(RED "Failed to mark the volume dirty.\n" RESET);
             if (freePtr > 0 && freePtr < diskSize / BLOCKSIZE) {
                 if (readBlock(disk, freePtr, block) < 0) {
                     printf(RED "Failed to read free block for corruption simulation.\n" RESET);